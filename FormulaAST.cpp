@@ -4,15 +4,19 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <utility>
 
 namespace ASTImpl {
 
 enum ExprPrecedence {
+  EP_COMPARE,
   EP_ADD,
   EP_SUB,
   EP_MUL,
@@ -58,13 +62,17 @@ enum PrecedenceRule {
 //     (currently in the table we're always putting in the parentheses)
 // +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
 // +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+// A < (B < C) - never okay, comparisons are left-associative
+// A + (B < C) - never okay (the same for every arithmetic parent)
+// Function arguments are printed as atoms' children and never need parens
 constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-    /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_COMPARE */ {PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ADD */ {PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_SUB */ {PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
 class Expr {
@@ -74,6 +82,35 @@ class Expr {
   virtual void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const = 0;
   virtual double Evaluate(CellValueResolver &resolver) const = 0;
 
+  // Узел формулы-массива даёт область чисел
+  virtual bool IsArray() const {
+    return false;
+  }
+
+  // Размер значения узла; nullopt - размеры операндов не согласованы
+  virtual std::optional<Size> GetShape() const {
+    return Size{1, 1};
+  }
+
+  // Значение в формуле-массиве; число - матрица 1 x 1
+  virtual Matrix EvaluateArray(CellValueResolver &resolver) const {
+    return Matrix({1, 1}, Evaluate(resolver));
+  }
+
+  // Возвращает упрощённую копию выражения для вычисления. Упрощения не меняют
+  // результат, включая знак нуля и ошибки вычисления.
+  virtual std::unique_ptr<Expr> Optimize() const = 0;
+
+  virtual std::optional<double> GetConstant() const {
+    return std::nullopt;
+  }
+
+  // Дописывает в программу команды, вычисляющие выражение
+  virtual void Compile(std::vector<Instruction> &program) const = 0;
+
+  // Глубокая копия; ссылки переводятся на узлы списка ячеек копии
+  virtual std::unique_ptr<Expr> Clone(const CellMapping &cells) const = 0;
+
   // higher is tighter
   virtual ExprPrecedence GetPrecedence() const = 0;
 
@@ -95,6 +132,93 @@ class Expr {
 };
 
 namespace {
+
+bool ParseNumber(const std::string &text, double &value) {
+  std::istringstream in(text);
+  in >> value;
+  return !in.fail();
+}
+
+enum class Function {
+  If,
+  And,
+  Or,
+  Match,
+  VLookup,
+  MMult,
+  Transpose,
+};
+
+std::optional<Function> FindFunction(std::string_view name) {
+  if (name == "IF"sv) {
+    return Function::If;
+  }
+  if (name == "AND"sv) {
+    return Function::And;
+  }
+  if (name == "OR"sv) {
+    return Function::Or;
+  }
+  if (name == "MATCH"sv) {
+    return Function::Match;
+  }
+  if (name == "VLOOKUP"sv) {
+    return Function::VLookup;
+  }
+  if (name == "MMULT"sv) {
+    return Function::MMult;
+  }
+  if (name == "TRANSPOSE"sv) {
+    return Function::Transpose;
+  }
+  return std::nullopt;
+}
+
+class NumberExpr final : public Expr {
+ public:
+  explicit NumberExpr(double value)
+      : value_(value) {
+  }
+
+  // Поток печатал бы 6 значащих цифр, и формулы =0.1234567 и =0.1234568
+  // получили бы одно каноническое выражение
+  void Print(std::ostream &out) const override {
+    out << FormatNumber(value_);
+  }
+
+  void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */) const override {
+    out << FormatNumber(value_);
+  }
+
+  ExprPrecedence GetPrecedence() const override {
+    return EP_ATOM;
+  }
+
+  std::unique_ptr<Expr> Optimize() const override {
+    return std::make_unique<NumberExpr>(value_);
+  }
+
+  std::optional<double> GetConstant() const override {
+    return value_;
+  }
+
+  void Compile(std::vector<Instruction> &program) const override {
+    program.push_back({Instruction::Op::Number, value_});
+  }
+
+  std::unique_ptr<Expr> Clone(const CellMapping & /* cells */) const override {
+    return std::make_unique<NumberExpr>(value_);
+  }
+
+  // Для чисел метод возвращает значение числа.
+  double Evaluate(CellValueResolver &resolver) const override {
+    return value_;
+  }
+
+ private:
+  double value_;
+};
+
 class BinaryOpExpr final : public Expr {
  public:
   enum Type : char {
@@ -136,6 +260,100 @@ class BinaryOpExpr final : public Expr {
     }
   }
 
+  std::unique_ptr<Expr> Optimize() const override {
+    auto lhs = lhs_->Optimize();
+    auto rhs = rhs_->Optimize();
+    auto lhs_const = lhs->GetConstant();
+    auto rhs_const = rhs->GetConstant();
+
+    if (lhs_const && rhs_const) {
+      auto folded = std::make_unique<BinaryOpExpr>(type_, std::move(lhs), std::move(rhs));
+      try {
+        CellValueResolver no_cells;
+        return std::make_unique<NumberExpr>(folded->Evaluate(no_cells));
+      } catch (const FormulaError &) {
+        // Ошибка должна возникать при каждом вычислении, как и без упрощения
+        return folded;
+      }
+    }
+
+    // x+0 не упрощается: для x = -0 результат равен +0
+    switch (type_) {
+      case Add:
+        if (IsNegativeZero(rhs_const)) {
+          return lhs;
+        }
+        if (IsNegativeZero(lhs_const)) {
+          return rhs;
+        }
+        break;
+      case Subtract:
+        if (rhs_const && *rhs_const == 0 && !std::signbit(*rhs_const)) {
+          return lhs;
+        }
+        break;
+      case Multiply:
+        if (rhs_const == 1.0) {
+          return lhs;
+        }
+        if (lhs_const == 1.0) {
+          return rhs;
+        }
+        break;
+      case Divide:
+        // x/1 не упрощается: бесконечное x превращается в #DIV/0!
+        break;
+    }
+
+    return std::make_unique<BinaryOpExpr>(type_, std::move(lhs), std::move(rhs));
+  }
+
+  void Compile(std::vector<Instruction> &program) const override {
+    lhs_->Compile(program);
+    rhs_->Compile(program);
+    switch (type_) {
+      case Add:program.push_back({Instruction::Op::Add});
+        break;
+      case Subtract:program.push_back({Instruction::Op::Subtract});
+        break;
+      case Multiply:program.push_back({Instruction::Op::Multiply});
+        break;
+      case Divide:program.push_back({Instruction::Op::Divide});
+        break;
+    }
+  }
+
+  std::unique_ptr<Expr> Clone(const CellMapping &cells) const override {
+    return std::make_unique<BinaryOpExpr>(type_, lhs_->Clone(cells), rhs_->Clone(cells));
+  }
+
+  bool IsArray() const override {
+    return lhs_->IsArray() || rhs_->IsArray();
+  }
+
+  std::optional<Size> GetShape() const override {
+    auto lhs = lhs_->GetShape();
+    auto rhs = rhs_->GetShape();
+    if (!lhs || !rhs) {
+      return std::nullopt;
+    }
+    return Matrix::Broadcast(*lhs, *rhs);
+  }
+
+  Matrix EvaluateArray(CellValueResolver &resolver) const override {
+    if (!IsArray()) {
+      return Expr::EvaluateArray(resolver);
+    }
+    auto lhs = lhs_->EvaluateArray(resolver);
+    auto rhs = rhs_->EvaluateArray(resolver);
+    switch (type_) {
+      case Add:return Matrix::Apply(Matrix::Op::Add, lhs, rhs);
+      case Subtract:return Matrix::Apply(Matrix::Op::Subtract, lhs, rhs);
+      case Multiply:return Matrix::Apply(Matrix::Op::Multiply, lhs, rhs);
+      default:return Matrix::Apply(Matrix::Op::Divide, lhs, rhs);
+    }
+  }
+
   // Реализуйте метод Evaluate() для бинарных операций.
   // При делении на 0 выбрасывайте ошибку вычисления FormulaError
   double Evaluate(CellValueResolver &resolver) const override {
@@ -156,107 +374,699 @@ class BinaryOpExpr final : public Expr {
   }
 
  private:
-  Type type_;
-  std::unique_ptr<Expr> lhs_;
-  std::unique_ptr<Expr> rhs_;
+  Type type_;
+  std::unique_ptr<Expr> lhs_;
+  std::unique_ptr<Expr> rhs_;
+
+  static bool IsNegativeZero(std::optional<double> value) {
+    return value && *value == 0 && std::signbit(*value);
+  }
+};
+
+class UnaryOpExpr final : public Expr {
+ public:
+  enum Type : char {
+    UnaryPlus = '+',
+    UnaryMinus = '-',
+  };
+
+ public:
+  explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+      : type_(type), operand_(std::move(operand)) {
+  }
+
+  void Print(std::ostream &out) const override {
+    out << '(' << static_cast<char>(type_) << ' ';
+    operand_->Print(out);
+    out << ')';
+  }
+
+  void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const override {
+    out << static_cast<char>(type_);
+    operand_->PrintFormula(out, precedence);
+  }
+
+  ExprPrecedence GetPrecedence() const override {
+    return EP_UNARY;
+  }
+
+  std::unique_ptr<Expr> Optimize() const override {
+    auto operand = operand_->Optimize();
+    if (type_ == UnaryPlus) {
+      return operand;
+    }
+
+    if (auto value = operand->GetConstant()) {
+      return std::make_unique<NumberExpr>(*value * -1);
+    }
+    // Унарный плюс уже убран, остаётся только минус: -(-x) = x
+    if (auto nested = dynamic_cast<UnaryOpExpr *>(operand.get())) {
+      return std::move(nested->operand_);
+    }
+    return std::make_unique<UnaryOpExpr>(type_, std::move(operand));
+  }
+
+  void Compile(std::vector<Instruction> &program) const override {
+    operand_->Compile(program);
+    if (type_ == UnaryMinus) {
+      program.push_back({Instruction::Op::Negate});
+    }
+  }
+
+  std::unique_ptr<Expr> Clone(const CellMapping &cells) const override {
+    return std::make_unique<UnaryOpExpr>(type_, operand_->Clone(cells));
+  }
+
+  bool IsArray() const override {
+    return operand_->IsArray();
+  }
+
+  std::optional<Size> GetShape() const override {
+    return operand_->GetShape();
+  }
+
+  Matrix EvaluateArray(CellValueResolver &resolver) const override {
+    auto result = operand_->EvaluateArray(resolver);
+    if (type_ == UnaryMinus) {
+      result.Negate();
+    }
+    return result;
+  }
+
+  // Реализуйте метод Evaluate() для унарных операций.
+  double Evaluate(CellValueResolver &resolver) const override {
+    if (type_ == UnaryMinus) {
+      return operand_->Evaluate(resolver) * -1;
+    } else {
+      return operand_->Evaluate(resolver);
+    }
+  }
+
+ private:
+  Type type_;
+  std::unique_ptr<Expr> operand_;
+};
+
+class ComparisonExpr final : public Expr {
+ public:
+  enum Type : char {
+    Equal,
+    NotEqual,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
+  };
+
+ public:
+  explicit ComparisonExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+      : type_(type), lhs_(std::move(lhs)), rhs_(std::move(rhs)) {
+  }
+
+  void Print(std::ostream &out) const override {
+    out << '(' << GetOperator() << ' ';
+    lhs_->Print(out);
+    out << ' ';
+    rhs_->Print(out);
+    out << ')';
+  }
+
+  void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const override {
+    lhs_->PrintFormula(out, precedence);
+    out << GetOperator();
+    rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+  }
+
+  ExprPrecedence GetPrecedence() const override {
+    return EP_COMPARE;
+  }
+
+  std::unique_ptr<Expr> Optimize() const override {
+    auto lhs = lhs_->Optimize();
+    auto rhs = rhs_->Optimize();
+    if (lhs->GetConstant() && rhs->GetConstant()) {
+      return std::make_unique<NumberExpr>(Compare(*lhs->GetConstant(), *rhs->GetConstant()));
+    }
+    return std::make_unique<ComparisonExpr>(type_, std::move(lhs), std::move(rhs));
+  }
+
+  void Compile(std::vector<Instruction> &program) const override {
+    lhs_->Compile(program);
+    rhs_->Compile(program);
+    switch (type_) {
+      case Equal:program.push_back({Instruction::Op::Equal});
+        break;
+      case NotEqual:program.push_back({Instruction::Op::NotEqual});
+        break;
+      case Less:program.push_back({Instruction::Op::Less});
+        break;
+      case LessEqual:program.push_back({Instruction::Op::LessEqual});
+        break;
+      case Greater:program.push_back({Instruction::Op::Greater});
+        break;
+      case GreaterEqual:program.push_back({Instruction::Op::GreaterEqual});
+        break;
+    }
+  }
+
+  std::unique_ptr<Expr> Clone(const CellMapping &cells) const override {
+    return std::make_unique<ComparisonExpr>(type_, lhs_->Clone(cells), rhs_->Clone(cells));
+  }
+
+  double Evaluate(CellValueResolver &resolver) const override {
+    auto lhs = lhs_->Evaluate(resolver);
+    return Compare(lhs, rhs_->Evaluate(resolver));
+  }
+
+ private:
+  Type type_;
+  std::unique_ptr<Expr> lhs_;
+  std::unique_ptr<Expr> rhs_;
+
+  std::string_view GetOperator() const {
+    switch (type_) {
+      case Equal:return "="sv;
+      case NotEqual:return "<>"sv;
+      case Less:return "<"sv;
+      case LessEqual:return "<="sv;
+      case Greater:return ">"sv;
+      case GreaterEqual:return ">="sv;
+    }
+    return {};
+  }
+
+  double Compare(double lhs, double rhs) const {
+    switch (type_) {
+      case Equal:return lhs == rhs ? 1 : 0;
+      case NotEqual:return lhs != rhs ? 1 : 0;
+      case Less:return lhs < rhs ? 1 : 0;
+      case LessEqual:return lhs <= rhs ? 1 : 0;
+      case Greater:return lhs > rhs ? 1 : 0;
+      case GreaterEqual:return lhs >= rhs ? 1 : 0;
+    }
+    return 0;
+  }
+};
+
+// Переход вперёд, адрес которого станет известен после компиляции ветви
+size_t EmitJump(std::vector<Instruction> &program, Instruction::Op op) {
+  program.push_back({op});
+  return program.size() - 1;
+}
+
+void PatchJump(std::vector<Instruction> &program, size_t jump) {
+  program[jump].jump = program.size();
+}
+
+// IF(условие, значение, иначе): вычисляется только выбранная ветвь.
+// Без третьего аргумента ложное условие даёт 0
+class IfExpr final : public Expr {
+ public:
+  IfExpr(std::unique_ptr<Expr> condition, std::unique_ptr<Expr> if_true,
+         std::unique_ptr<Expr> if_false)
+      : condition_(std::move(condition)),
+        if_true_(std::move(if_true)),
+        if_false_(std::move(if_false)) {
+  }
+
+  void Print(std::ostream &out) const override {
+    out << "(IF ";
+    condition_->Print(out);
+    out << ' ';
+    if_true_->Print(out);
+    if (if_false_) {
+      out << ' ';
+      if_false_->Print(out);
+    }
+    out << ')';
+  }
+
+  void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */) const override {
+    out << "IF(";
+    condition_->PrintFormula(out, EP_ATOM);
+    out << ',';
+    if_true_->PrintFormula(out, EP_ATOM);
+    if (if_false_) {
+      out << ',';
+      if_false_->PrintFormula(out, EP_ATOM);
+    }
+    out << ')';
+  }
+
+  ExprPrecedence GetPrecedence() const override {
+    return EP_ATOM;
+  }
+
+  std::unique_ptr<Expr> Optimize() const override {
+    auto condition = condition_->Optimize();
+    if (auto value = condition->GetConstant()) {
+      if (*value != 0) {
+        return if_true_->Optimize();
+      }
+      return if_false_ ? if_false_->Optimize() : std::make_unique<NumberExpr>(0);
+    }
+    return std::make_unique<IfExpr>(std::move(condition), if_true_->Optimize(),
+                                    if_false_ ? if_false_->Optimize() : nullptr);
+  }
+
+  void Compile(std::vector<Instruction> &program) const override {
+    condition_->Compile(program);
+    auto to_false = EmitJump(program, Instruction::Op::JumpIfZero);
+    if_true_->Compile(program);
+    auto to_end = EmitJump(program, Instruction::Op::Jump);
+    PatchJump(program, to_false);
+    if (if_false_) {
+      if_false_->Compile(program);
+    } else {
+      program.push_back({Instruction::Op::Number, 0});
+    }
+    PatchJump(program, to_end);
+  }
+
+  std::unique_ptr<Expr> Clone(const CellMapping &cells) const override {
+    return std::make_unique<IfExpr>(condition_->Clone(cells), if_true_->Clone(cells),
+                                    if_false_ ? if_false_->Clone(cells) : nullptr);
+  }
+
+  double Evaluate(CellValueResolver &resolver) const override {
+    if (condition_->Evaluate(resolver) != 0) {
+      return if_true_->Evaluate(resolver);
+    }
+    return if_false_ ? if_false_->Evaluate(resolver) : 0;
+  }
+
+ private:
+  std::unique_ptr<Expr> condition_;
+  std::unique_ptr<Expr> if_true_;
+  // nullptr, если третьего аргумента нет
+  std::unique_ptr<Expr> if_false_;
+};
+
+// AND и OR дают 1 или 0. Аргументы вычисляются слева направо до первого,
+// определяющего результат
+class LogicalExpr final : public Expr {
+ public:
+  enum Type : char {
+    And,
+    Or,
+  };
+
+ public:
+  LogicalExpr(Type type, std::vector<std::unique_ptr<Expr>> args)
+      : type_(type), args_(std::move(args)) {
+  }
+
+  void Print(std::ostream &out) const override {
+    out << '(' << GetName();
+    for (const auto &arg : args_) {
+      out << ' ';
+      arg->Print(out);
+    }
+    out << ')';
+  }
+
+  void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */) const override {
+    out << GetName() << '(';
+    for (size_t i = 0; i < args_.size(); ++i) {
+      if (i > 0) {
+        out << ',';
+      }
+      args_[i]->PrintFormula(out, EP_ATOM);
+    }
+    out << ')';
+  }
+
+  ExprPrecedence GetPrecedence() const override {
+    return EP_ATOM;
+  }
+
+  std::unique_ptr<Expr> Optimize() const override {
+    // Константа, не определяющая результат, отбрасывается; определяющая
+    // отбрасывает следующие аргументы: они никогда не вычисляются
+    std::vector<std::unique_ptr<Expr>> args;
+    for (const auto &arg : args_) {
+      auto optimized = arg->Optimize();
+      auto value = optimized->GetConstant();
+      if (!value) {
+        args.push_back(std::move(optimized));
+      } else if (IsDecisive(*value)) {
+        if (args.empty()) {
+          return std::make_unique<NumberExpr>(type_ == And ? 0 : 1);
+        }
+        args.push_back(std::move(optimized));
+        break;
+      }
+    }
+    if (args.empty()) {
+      return std::make_unique<NumberExpr>(type_ == And ? 1 : 0);
+    }
+    return std::make_unique<LogicalExpr>(type_, std::move(args));
+  }
+
+  void Compile(std::vector<Instruction> &program) const override {
+    // Все аргументы, кроме последнего, переходят к готовому результату, если
+    // определяют его; последний приводится к 1 или 0
+    const auto op = type_ == And ? Instruction::Op::JumpIfZero : Instruction::Op::JumpIfNonZero;
+    std::vector<size_t> to_decided;
+    for (size_t i = 0; i + 1 < args_.size(); ++i) {
+      args_[i]->Compile(program);
+      to_decided.push_back(EmitJump(program, op));
+    }
+    args_.back()->Compile(program);
+    program.push_back({Instruction::Op::Test});
+    if (to_decided.empty()) {
+      return;
+    }
+    auto to_end = EmitJump(program, Instruction::Op::Jump);
+    for (auto jump : to_decided) {
+      PatchJump(program, jump);
+    }
+    program.push_back({Instruction::Op::Number, type_ == And ? 0.0 : 1.0});
+    PatchJump(program, to_end);
+  }
+
+  std::unique_ptr<Expr> Clone(const CellMapping &cells) const override {
+    std::vector<std::unique_ptr<Expr>> args;
+    for (const auto &arg : args_) {
+      args.push_back(arg->Clone(cells));
+    }
+    return std::make_unique<LogicalExpr>(type_, std::move(args));
+  }
+
+  double Evaluate(CellValueResolver &resolver) const override {
+    for (const auto &arg : args_) {
+      if (IsDecisive(arg->Evaluate(resolver))) {
+        return type_ == And ? 0 : 1;
+      }
+    }
+    return type_ == And ? 1 : 0;
+  }
+
+ private:
+  Type type_;
+  std::vector<std::unique_ptr<Expr>> args_;
+
+  std::string_view GetName() const {
+    return type_ == And ? "AND"sv : "OR"sv;
+  }
+
+  bool IsDecisive(double value) const {
+    return (type_ == And) == (value == 0);
+  }
+};
+
+class CellExpr final : public Expr {
+ public:
+  explicit CellExpr(const Position* cell)
+      : cell_(cell) {
+  }
+
+  void Print(std::ostream& out) const override {
+    if (!cell_->IsValid()) {
+      out << FormulaError::Category::Ref;
+    } else {
+      out << cell_->ToString();
+    }
+  }
+
+  void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+    Print(out);
+  }
+
+  ExprPrecedence GetPrecedence() const override {
+    return EP_ATOM;
+  }
+
+  double Evaluate(CellValueResolver &resolver) const override {
+    return resolver(cell_);
+  }
+
+  std::unique_ptr<Expr> Optimize() const override {
+    return std::make_unique<CellExpr>(cell_);
+  }
+
+  void Compile(std::vector<Instruction> &program) const override {
+    program.push_back({Instruction::Op::Cell, 0, cell_});
+  }
+
+  std::unique_ptr<Expr> Clone(const CellMapping &cells) const override {
+    return std::make_unique<CellExpr>(cells.cells.at(cell_));
+  }
+
+ private:
+  const Position* cell_;
+};
+
+// Область - аргумент MATCH или VLOOKUP или значение формулы-массива
+class RangeExpr final : public Expr {
+ public:
+  explicit RangeExpr(const Range *range)
+      : range_(range) {
+  }
+
+  const Range *GetRange() const {
+    return range_;
+  }
+
+  void Print(std::ostream &out) const override {
+    if (!range_->IsValid()) {
+      out << FormulaError::Category::Ref;
+    } else {
+      out << range_->ToString();
+    }
+  }
+
+  void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */) const override {
+    Print(out);
+  }
+
+  ExprPrecedence GetPrecedence() const override {
+    return EP_ATOM;
+  }
+
+  double Evaluate(CellValueResolver & /* resolver */) const override {
+    throw std::logic_error("Range is not a value"s);
+  }
+
+  std::unique_ptr<Expr> Optimize() const override {
+    return std::make_unique<RangeExpr>(range_);
+  }
+
+  void Compile(std::vector<Instruction> & /* program */) const override {
+    throw std::logic_error("Range is not a value"s);
+  }
+
+  std::unique_ptr<Expr> Clone(const CellMapping &cells) const override {
+    return std::make_unique<RangeExpr>(cells.ranges.at(range_));
+  }
+
+  bool IsArray() const override {
+    return true;
+  }
+
+  std::optional<Size> GetShape() const override {
+    return range_->IsValid() ? range_->GetSize() : Size{1, 1};
+  }
+
+  Matrix EvaluateArray(CellValueResolver &resolver) const override {
+    if (!range_->IsValid()) {
+      throw FormulaError(FormulaError::Category::Ref);
+    }
+    Matrix result(range_->GetSize());
+    for (int row = range_->first.row; row <= range_->last.row; ++row) {
+      for (int col = range_->first.col; col <= range_->last.col; ++col) {
+        Position pos{row, col};
+        result(row - range_->first.row, col - range_->first.col) = resolver(&pos);
+      }
+    }
+    return result;
+  }
+
+ private:
+  const Range *range_;
 };
 
-class UnaryOpExpr final : public Expr {
+// MATCH(ключ, строка или столбец, вид поиска) и
+// VLOOKUP(ключ, область, номер столбца, приближённый поиск). Необязательный
+// последний аргумент по умолчанию 1, как в Excel. Поиск ведёт резолвер по
+// индексу области
+class LookupExpr final : public Expr {
  public:
   enum Type : char {
-    UnaryPlus = '+',
-    UnaryMinus = '-',
+    Match,
+    VLookup,
   };
 
  public:
-  explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-      : type_(type), operand_(std::move(operand)) {
+  // Второй аргумент - RangeExpr
+  LookupExpr(Type type, std::vector<std::unique_ptr<Expr>> args)
+      : type_(type), args_(std::move(args)) {
   }
 
   void Print(std::ostream &out) const override {
-    out << '(' << static_cast<char>(type_) << ' ';
-    operand_->Print(out);
+    out << '(' << GetName();
+    for (const auto &arg : args_) {
+      out << ' ';
+      arg->Print(out);
+    }
     out << ')';
   }
 
-  void DoPrintFormula(std::ostream &out, ExprPrecedence precedence) const override {
-    out << static_cast<char>(type_);
-    operand_->PrintFormula(out, precedence);
+  void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */) const override {
+    out << GetName() << '(';
+    for (size_t i = 0; i < args_.size(); ++i) {
+      if (i > 0) {
+        out << ',';
+      }
+      args_[i]->PrintFormula(out, EP_ATOM);
+    }
+    out << ')';
   }
 
   ExprPrecedence GetPrecedence() const override {
-    return EP_UNARY;
+    return EP_ATOM;
   }
 
-  // Реализуйте метод Evaluate() для унарных операций.
-  double Evaluate(CellValueResolver &resolver) const override {
-    if (type_ == UnaryMinus) {
-      return operand_->Evaluate(resolver) * -1;
-    } else {
-      return operand_->Evaluate(resolver);
+  double Evaluate(CellValueResolver & /* resolver */) const override {
+    throw std::logic_error("Lookup is evaluated only by FormulaAST::Execute"s);
+  }
+
+  std::unique_ptr<Expr> Optimize() const override {
+    std::vector<std::unique_ptr<Expr>> args;
+    for (const auto &arg : args_) {
+      args.push_back(arg->Optimize());
+    }
+    return std::make_unique<LookupExpr>(type_, std::move(args));
+  }
+
+  void Compile(std::vector<Instruction> &program) const override {
+    const size_t count = type_ == Match ? 3 : 4;
+    for (size_t i = 0; i < count; ++i) {
+      if (i == 1) {
+        continue;
+      }
+      if (i < args_.size()) {
+        args_[i]->Compile(program);
+      } else {
+        program.push_back({Instruction::Op::Number, 1});
+      }
+    }
+    Instruction lookup{type_ == Match ? Instruction::Op::Match : Instruction::Op::VLookup};
+    lookup.range = static_cast<const RangeExpr &>(*args_[1]).GetRange();
+    program.push_back(lookup);
+  }
+
+  std::unique_ptr<Expr> Clone(const CellMapping &cells) const override {
+    std::vector<std::unique_ptr<Expr>> args;
+    for (const auto &arg : args_) {
+      args.push_back(arg->Clone(cells));
     }
+    return std::make_unique<LookupExpr>(type_, std::move(args));
   }
 
  private:
   Type type_;
-  std::unique_ptr<Expr> operand_;
+  std::vector<std::unique_ptr<Expr>> args_;
+
+  std::string_view GetName() const {
+    return type_ == Match ? "MATCH"sv : "VLOOKUP"sv;
+  }
 };
 
-class NumberExpr final : public Expr {
+// MMULT(a, b) и TRANSPOSE(a): аргументы - массивы или числа
+class ArrayFunctionExpr final : public Expr {
  public:
-  explicit NumberExpr(double value)
-      : value_(value) {
+  enum Type : char {
+    MMult,
+    Transpose,
+  };
+
+ public:
+  ArrayFunctionExpr(Type type, std::vector<std::unique_ptr<Expr>> args)
+      : type_(type), args_(std::move(args)) {
   }
 
   void Print(std::ostream &out) const override {
-    out << value_;
+    out << '(' << GetName();
+    for (const auto &arg : args_) {
+      out << ' ';
+      arg->Print(out);
+    }
+    out << ')';
   }
 
   void DoPrintFormula(std::ostream &out, ExprPrecedence /* precedence */) const override {
-    out << value_;
+    out << GetName() << '(';
+    for (size_t i = 0; i < args_.size(); ++i) {
+      if (i > 0) {
+        out << ',';
+      }
+      args_[i]->PrintFormula(out, EP_ATOM);
+    }
+    out << ')';
   }
 
   ExprPrecedence GetPrecedence() const override {
     return EP_ATOM;
   }
 
-  // Для чисел метод возвращает значение числа.
-  double Evaluate(CellValueResolver &resolver) const override {
-    return value_;
+  double Evaluate(CellValueResolver & /* resolver */) const override {
+    throw std::logic_error("Array is evaluated only by FormulaAST::ExecuteArray"s);
   }
 
- private:
-  double value_;
-};
+  std::unique_ptr<Expr> Optimize() const override {
+    std::vector<std::unique_ptr<Expr>> args;
+    for (const auto &arg : args_) {
+      args.push_back(arg->Optimize());
+    }
+    return std::make_unique<ArrayFunctionExpr>(type_, std::move(args));
+  }
 
-class CellExpr final : public Expr {
- public:
-  explicit CellExpr(const Position* cell)
-      : cell_(cell) {
+  void Compile(std::vector<Instruction> & /* program */) const override {
+    throw std::logic_error("Array is evaluated only by FormulaAST::ExecuteArray"s);
   }
 
-  void Print(std::ostream& out) const override {
-    if (!cell_->IsValid()) {
-      out << FormulaError::Category::Ref;
-    } else {
-      out << cell_->ToString();
+  std::unique_ptr<Expr> Clone(const CellMapping &cells) const override {
+    std::vector<std::unique_ptr<Expr>> args;
+    for (const auto &arg : args_) {
+      args.push_back(arg->Clone(cells));
     }
+    return std::make_unique<ArrayFunctionExpr>(type_, std::move(args));
   }
 
-  void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-    Print(out);
+  bool IsArray() const override {
+    return true;
   }
 
-  ExprPrecedence GetPrecedence() const override {
-    return EP_ATOM;
+  std::optional<Size> GetShape() const override {
+    auto lhs = args_[0]->GetShape();
+    if (!lhs) {
+      return std::nullopt;
+    }
+    if (type_ == Transpose) {
+      return Size{lhs->cols, lhs->rows};
+    }
+    auto rhs = args_[1]->GetShape();
+    if (!rhs || lhs->cols != rhs->rows) {
+      return std::nullopt;
+    }
+    return Size{lhs->rows, rhs->cols};
   }
 
-  double Evaluate(CellValueResolver &resolver) const override {
-    return resolver(cell_);
+  Matrix EvaluateArray(CellValueResolver &resolver) const override {
+    if (type_ == Transpose) {
+      return args_[0]->EvaluateArray(resolver).Transpose();
+    }
+    return Matrix::Multiply(args_[0]->EvaluateArray(resolver), args_[1]->EvaluateArray(resolver));
   }
 
  private:
-  const Position* cell_;
+  Type type_;
+  std::vector<std::unique_ptr<Expr>> args_;
+
+  std::string_view GetName() const {
+    return type_ == MMult ? "MMULT"sv : "TRANSPOSE"sv;
+  }
 };
 
 class ParseASTListener final : public FormulaBaseListener {
@@ -273,8 +1083,20 @@ class ParseASTListener final : public FormulaBaseListener {
     return std::move(cells_);
   }
 
+  std::forward_list<Range> MoveRanges() {
+    return std::move(ranges_);
+  }
+
+  // Первая ошибка построения дерева; после неё узлы не создаются
+  const std::optional<FormulaParseError> &GetError() const {
+    return error_;
+  }
+
  public:
   void exitUnaryOp(FormulaParser::UnaryOpContext *ctx) override {
+    if (error_) {
+      return;
+    }
     assert(args_.size() >= 1);
 
     auto operand = std::move(args_.back());
@@ -292,12 +1114,14 @@ class ParseASTListener final : public FormulaBaseListener {
   }
 
   void exitLiteral(FormulaParser::LiteralContext *ctx) override {
+    if (error_) {
+      return;
+    }
     double value = 0;
     auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-    std::istringstream in(valueStr);
-    in >> value;
-    if (!in) {
-      throw ParsingError("Invalid number: " + valueStr);
+    if (!ParseNumber(valueStr, value)) {
+      Fail(ctx->NUMBER()->getSymbol(), "Invalid number: " + valueStr);
+      return;
     }
 
     auto node = std::make_unique<NumberExpr>(value);
@@ -305,6 +1129,9 @@ class ParseASTListener final : public FormulaBaseListener {
   }
 
   void exitBinaryOp(FormulaParser::BinaryOpContext *ctx) override {
+    if (error_) {
+      return;
+    }
     assert(args_.size() >= 2);
 
     auto rhs = std::move(args_.back());
@@ -329,11 +1156,160 @@ class ParseASTListener final : public FormulaBaseListener {
   }
 
 
+  void exitComparison(FormulaParser::ComparisonContext *ctx) override {
+    if (error_) {
+      return;
+    }
+    assert(args_.size() >= 2);
+    if (RejectArray(ctx, {args_.end()[-2].get(), args_.back().get()})) {
+      return;
+    }
+
+    auto rhs = std::move(args_.back());
+    args_.pop_back();
+
+    auto lhs = std::move(args_.back());
+
+    ComparisonExpr::Type type;
+    if (ctx->EQ()) {
+      type = ComparisonExpr::Equal;
+    } else if (ctx->NE()) {
+      type = ComparisonExpr::NotEqual;
+    } else if (ctx->LT()) {
+      type = ComparisonExpr::Less;
+    } else if (ctx->LE()) {
+      type = ComparisonExpr::LessEqual;
+    } else if (ctx->GT()) {
+      type = ComparisonExpr::Greater;
+    } else {
+      assert(ctx->GE() != nullptr);
+      type = ComparisonExpr::GreaterEqual;
+    }
+
+    auto node = std::make_unique<ComparisonExpr>(type, std::move(lhs), std::move(rhs));
+    args_.back() = std::move(node);
+  }
+
+  void exitFunction(FormulaParser::FunctionContext *ctx) override {
+    if (error_) {
+      return;
+    }
+    auto name = ctx->NAME()->getSymbol()->getText();
+    auto count = ctx->expr().size();
+    assert(args_.size() >= count);
+
+    std::vector<std::unique_ptr<Expr>> args;
+    for (auto it = args_.end() - count; it != args_.end(); ++it) {
+      args.push_back(std::move(*it));
+    }
+    args_.resize(args_.size() - count);
+
+    auto function = FindFunction(name);
+    if (!function) {
+      Fail(ctx->NAME()->getSymbol(), "Unknown function: " + name);
+      return;
+    }
+    // Вторым аргументом MATCH и VLOOKUP может быть только область, массивы
+    // принимают только MMULT и TRANSPOSE
+    const bool lookup = *function == Function::Match || *function == Function::VLookup;
+    const bool array = *function == Function::MMult || *function == Function::Transpose;
+    for (size_t i = 0; i < count; ++i) {
+      if (lookup && i == 1) {
+        if (!IsRange(*args[i])) {
+          Fail(ctx->expr(i)->getStart(), "Range expected: " + name);
+          return;
+        }
+      } else if (!array && args[i]->IsArray()) {
+        Fail(ctx->expr(i)->getStart(), "Array is not allowed here"s);
+        return;
+      }
+    }
+    switch (*function) {
+      case Function::If:
+        if (count < 2 || count > 3) {
+          Fail(ctx->NAME()->getSymbol(), "Wrong number of arguments: " + name);
+          return;
+        }
+        args_.push_back(std::make_unique<IfExpr>(std::move(args[0]), std::move(args[1]),
+                                                 count == 3 ? std::move(args[2]) : nullptr));
+        break;
+      case Function::And:
+      case Function::Or:
+        args_.push_back(std::make_unique<LogicalExpr>(
+            *function == Function::And ? LogicalExpr::And : LogicalExpr::Or, std::move(args)));
+        break;
+      case Function::Match:
+      case Function::VLookup: {
+        const size_t min_count = *function == Function::Match ? 2 : 3;
+        if (count < min_count || count > min_count + 1) {
+          Fail(ctx->NAME()->getSymbol(), "Wrong number of arguments: " + name);
+          return;
+        }
+        auto range = static_cast<const RangeExpr &>(*args[1]).GetRange();
+        if (*function == Function::Match && range->first.row != range->last.row
+            && range->first.col != range->last.col) {
+          Fail(ctx->expr(1)->getStart(), "MATCH range must be a single row or column"s);
+          return;
+        }
+        args_.push_back(std::make_unique<LookupExpr>(
+            *function == Function::Match ? LookupExpr::Match : LookupExpr::VLookup, std::move(args)));
+        has_lookup_ = true;
+        break;
+      }
+      case Function::MMult:
+      case Function::Transpose:
+        if (count != (*function == Function::MMult ? 2u : 1u)) {
+          Fail(ctx->NAME()->getSymbol(), "Wrong number of arguments: " + name);
+          return;
+        }
+        args_.push_back(std::make_unique<ArrayFunctionExpr>(
+            *function == Function::MMult ? ArrayFunctionExpr::MMult : ArrayFunctionExpr::Transpose,
+            std::move(args)));
+        break;
+    }
+  }
+
+  void exitRange(FormulaParser::RangeContext *ctx) override {
+    if (error_) {
+      return;
+    }
+    Position corners[2];
+    for (size_t i = 0; i < 2; ++i) {
+      auto value_str = ctx->CELL(i)->getSymbol()->getText();
+      corners[i] = Position::FromString(value_str);
+      if (!corners[i].IsValid()) {
+        Fail(ctx->CELL(i)->getSymbol(), "Invalid position: " + value_str);
+        return;
+      }
+    }
+    // B10:A1 - то же, что A1:B10
+    ranges_.push_front({{std::min(corners[0].row, corners[1].row), std::min(corners[0].col, corners[1].col)},
+                        {std::max(corners[0].row, corners[1].row), std::max(corners[0].col, corners[1].col)}});
+    args_.push_back(std::make_unique<RangeExpr>(&ranges_.front()));
+  }
+
+  void exitMain(FormulaParser::MainContext *ctx) override {
+    if (error_ || args_.empty() || !args_.back()->IsArray()) {
+      return;
+    }
+    // Поиск вычисляет только программа Execute, массив - обход дерева
+    if (has_lookup_) {
+      Fail(ctx->getStart(), "MATCH and VLOOKUP are not supported in array formulas"s);
+    } else if (!args_.back()->GetShape()) {
+      Fail(ctx->getStart(), "Array sizes do not match"s);
+    }
+  }
+
+
   void exitCell(FormulaParser::CellContext *ctx) override {
+    if (error_) {
+      return;
+    }
     auto value_str = ctx->CELL()->getSymbol()->getText();
     auto value = Position::FromString(value_str);
     if (!value.IsValid()) {
-      throw FormulaException("Invalid position: " + value_str);
+      Fail(ctx->CELL()->getSymbol(), "Invalid position: " + value_str);
+      return;
     }
     cells_.push_front(value);
     auto node = std::make_unique<CellExpr>(&cells_.front());
@@ -341,12 +1317,36 @@ class ParseASTListener final : public FormulaBaseListener {
   }
 
   void visitErrorNode(antlr4::tree::ErrorNode *node) override {
-    throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
+    if (!error_) {
+      Fail(node->getSymbol(), "Error when parsing: " + node->getSymbol()->getText());
+    }
   }
 
  private:
   std::vector<std::unique_ptr<Expr>> args_;
   std::forward_list<Position> cells_;
+  std::forward_list<Range> ranges_;
+  std::optional<FormulaParseError> error_;
+  bool has_lookup_ = false;
+
+  void Fail(antlr4::Token *token, std::string message) {
+    error_ = FormulaParseError{token->getStartIndex(), std::move(message)};
+  }
+
+  static bool IsRange(const Expr &expr) {
+    return dynamic_cast<const RangeExpr *>(&expr) != nullptr;
+  }
+
+  // Массив там, где ожидается число
+  bool RejectArray(antlr4::ParserRuleContext *ctx, std::initializer_list<const Expr *> operands) {
+    for (auto operand : operands) {
+      if (operand->IsArray()) {
+        Fail(ctx->getStart(), "Array is not allowed here"s);
+        return true;
+      }
+    }
+    return false;
+  }
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -359,6 +1359,101 @@ class BailErrorListener : public antlr4::BaseErrorListener {
   }
 };
 
+// Запоминает первую ошибку вместо исключения
+class CollectingErrorListener : public antlr4::BaseErrorListener {
+ public:
+  explicit CollectingErrorListener(std::string prefix) : prefix_(std::move(prefix)) {
+  }
+
+  void syntaxError(antlr4::Recognizer * /* recognizer */, antlr4::Token *offendingSymbol,
+                   size_t line, size_t charPositionInLine, const std::string &msg,
+                   std::exception_ptr /* e */
+  ) override {
+    if (error_) {
+      return;
+    }
+    size_t offset = offendingSymbol != nullptr
+                    ? offendingSymbol->getStartIndex()
+                    : OffsetOf(line, charPositionInLine);
+    error_ = FormulaParseError{offset, prefix_ + msg};
+  }
+
+  void Reset(std::string_view expression) {
+    expression_ = expression;
+    error_.reset();
+  }
+
+  const std::optional<FormulaParseError> &GetError() const {
+    return error_;
+  }
+
+ private:
+  std::string prefix_;
+  std::string_view expression_;
+  std::optional<FormulaParseError> error_;
+
+  // Лексер сообщает строку (с 1) и позицию в ней
+  size_t OffsetOf(size_t line, size_t column) const {
+    size_t offset = 0;
+    for (; line > 1 && offset < expression_.size(); ++offset) {
+      if (expression_[offset] == '\n') {
+        --line;
+      }
+    }
+    return offset + column;
+  }
+};
+
+// Лексер и парсер, переиспользуемые между разборами в одном потоке
+class FormulaParserSession {
+ public:
+  FormulaParserSession()
+      : lexer_errors_("Error when lexing: "),
+        parser_errors_("Error when parsing: "),
+        lexer_(&empty_input_),
+        tokens_(&lexer_),
+        parser_(&tokens_) {
+    lexer_.removeErrorListeners();
+    lexer_.addErrorListener(&lexer_errors_);
+    parser_.removeErrorListeners();
+    parser_.addErrorListener(&parser_errors_);
+  }
+
+  std::variant<FormulaAST, FormulaParseError> Parse(std::string_view expression) {
+    using namespace antlr4;
+
+    lexer_errors_.Reset(expression);
+    parser_errors_.Reset(expression);
+
+    ANTLRInputStream input(expression);
+    lexer_.setInputStream(&input);
+    tokens_.setTokenSource(&lexer_);
+    parser_.setTokenStream(&tokens_);
+
+    tree::ParseTree *tree = parser_.main();
+    for (const auto *errors : {&lexer_errors_, &parser_errors_}) {
+      if (errors->GetError()) {
+        return *errors->GetError();
+      }
+    }
+
+    ParseASTListener listener;
+    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+    if (listener.GetError()) {
+      return *listener.GetError();
+    }
+    return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveRanges());
+  }
+
+ private:
+  antlr4::ANTLRInputStream empty_input_;
+  CollectingErrorListener lexer_errors_;
+  CollectingErrorListener parser_errors_;
+  FormulaLexer lexer_;
+  antlr4::CommonTokenStream tokens_;
+  FormulaParser parser_;
+};
+
 }  // namespace
 }  // namespace ASTImpl
 
@@ -382,16 +1477,63 @@ FormulaAST ParseFormulaAST(std::istream& in) {
   tree::ParseTree* tree = parser.main();
   ASTImpl::ParseASTListener listener;
   tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+  if (listener.GetError()) {
+    throw ParsingError(listener.GetError()->message);
+  }
 
-  return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+  return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveRanges());
 }
 
 FormulaAST ParseFormulaAST(const std::string &in_str) {
-  std::istringstream in(in_str);
-  try {
-    return ParseFormulaAST(in);
-  } catch (const std::exception &exc) {
-    std::throw_with_nested(FormulaException(exc.what()));
+  auto result = TryParseFormulaAST(in_str);
+  if (auto error = std::get_if<FormulaParseError>(&result)) {
+    throw FormulaException(error->message);
+  }
+  return std::get<FormulaAST>(std::move(result));
+}
+
+std::variant<FormulaAST, FormulaParseError> TryParseFormulaAST(std::string_view expression) {
+  thread_local ASTImpl::FormulaParserSession session;
+  return session.Parse(expression);
+}
+
+namespace {
+
+const std::vector<std::string> &DefaultWarmUpCorpus() {
+  static const std::vector<std::string> corpus = {
+      "1", "42", "3.14", ".5", "1e10", "2.5E-3", "7e+2",
+      "A1", "Z99", "AB12", "XFD16384",
+      "A1+B2", "A1-B2", "A1*B2", "A1/B2",
+      "-A1", "+A1", "--1", "-(+A1)",
+      "(1)", "((A1))", "(1+2)*3", "1+2*3", "1*2+3", "1-2-3", "1/2/3",
+      "A1+B2*C3-D4/E5", "(A1+B2)*(C3-D4)/(E5+1)", "-(A1*2)+(-B2/3)",
+      "1 + 2", "\t A1\n*\r2 ",
+      "SUM1*(2+(3-(4*(5/(6+7)))))",
+      "A1+A2+A3+A4+A5+A6+A7+A8+A9+A10",
+      "A1=B2", "A1<>B2", "A1<B2", "A1<=B2", "A1>B2", "A1>=B2", "1+2<3*4",
+      "IF(A1>0,B1,C1)", "IF(A1,1)", "AND(A1,B1>2)", "OR(A1,B1,C1)",
+      "IF(AND(A1>0,A1<10),-A1,IF(OR(B1,C1),1,2))",
+      "MATCH(A1,B1:B10)", "MATCH(A1,B1:Z1,0)", "VLOOKUP(A1,B1:D100,3,0)",
+      "A1:A10*B1:B10+1", "-A1:C1/2", "MMULT(A1:B2,C1:D2)", "TRANSPOSE(A1:C1)",
+  };
+  return corpus;
+}
+
+}  // namespace
+
+void WarmUpFormulaParser() {
+  WarmUpFormulaParser(DefaultWarmUpCorpus());
+}
+
+void WarmUpFormulaParser(const std::vector<std::string> &corpus) {
+  FormulaLexer::initialize();
+  FormulaParser::initialize();
+  for (const auto &expression : corpus) {
+    try {
+      ParseFormulaAST(expression);
+    } catch (const FormulaException &) {
+      // Ошибочные формулы тоже прогревают путь разбора
+    }
   }
 }
 
@@ -403,26 +1545,55 @@ void FormulaAST::PrintFormula(std::ostream &out) const {
   root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
-double FormulaAST::Execute(const SheetInterface &sheet) const {
-  CellValueResolver resolver = [&sheet](const Position* pos) -> double {
-//    auto pos = Position::FromString(address);
-//    if (pos == Position::NONE) {
-//      throw FormulaError(FormulaError::Category::Ref);
-//    }
+void FormulaAST::PrintOptimized(std::ostream &out) const {
+  optimized_expr_->Print(out);
+}
+
+bool ParseCellNumber(std::string_view text, double &value) {
+  // Поток пропускает пробелы и читает число со знаком; текст, который не может
+  // начинаться с числа, отбрасывается без создания потока
+  auto first = text.find_first_not_of(" \t\n\v\f\r"sv);
+  if (first == std::string_view::npos) {
+    return false;
+  }
+  char ch = text[first];
+  if (!(ch >= '0' && ch <= '9') && ch != '+' && ch != '-' && ch != '.') {
+    return false;
+  }
+
+  std::istringstream in{std::string(text)};
+  in >> value;
+  return !in.fail();
+}
+
+std::string FormatNumber(double value) {
+  char buffer[32];
+  auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+  return {buffer, result.ptr};
+}
+
+namespace {
+
+// Резолвер для произвольной таблицы: область MATCH и VLOOKUP просматривается
+// целиком при каждом поиске
+class SheetResolver {
+ public:
+  explicit SheetResolver(const SheetInterface &sheet) : sheet_(sheet) {
+  }
 
-    auto cell = sheet.GetCell(*pos);
+  double operator()(const Position *pos) const {
+    if (!pos->IsValid()) {
+      throw FormulaError(FormulaError::Category::Ref);
+    }
+    auto cell = sheet_.GetCell(*pos);
     if (cell == nullptr) {
       return 0;
     }
 
     auto value = cell->GetValue();
-    // FIXME
     if (std::holds_alternative<std::string>(value)) {
       double result = 0;
-      auto strValue = std::get<std::string>(value);
-      std::istringstream in(strValue);
-      in >> result;
-      if (!in) {
+      if (!ParseCellNumber(std::get<std::string>(value), result)) {
         throw FormulaError(FormulaError::Category::Value);
       }
       return result;
@@ -433,14 +1604,137 @@ double FormulaAST::Execute(const SheetInterface &sheet) const {
     }
 
     return std::get<double>(value);
-  };
-  return root_expr_->Evaluate(resolver);
+  }
+
+  std::optional<int> Match(const Range &line, double key, LookupIndex::Match match) const {
+    LookupIndex index;
+    const auto size = line.GetSize();
+    for (int offset = 0; offset < size.rows * size.cols; ++offset) {
+      Position pos{line.first.row + (size.cols == 1 ? offset : 0),
+                   line.first.col + (size.cols == 1 ? 0 : offset)};
+      if (sheet_.GetCell(pos) == nullptr) {
+        continue;
+      }
+      try {
+        index.Set(offset, (*this)(&pos));
+      } catch (const FormulaError &) {
+      }
+    }
+    return index.Find(key, match);
+  }
+
+ private:
+  const SheetInterface &sheet_;
+};
+
+}  // namespace
+
+double FormulaAST::Execute(const SheetInterface &sheet) const {
+  return Execute(SheetResolver(sheet));
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+                       std::forward_list<Range> ranges)
     : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
+    , optimized_expr_(root_expr_->Optimize())
+    , cells_(std::move(cells))
+    , ranges_(std::move(ranges))
+    , is_array_(root_expr_->IsArray()) {
   cells_.sort();  // to avoid sorting in GetReferencedCells
+  Compile();
+}
+
+FormulaAST::FormulaAST(const FormulaAST &other)
+    : cells_(other.cells_), ranges_(other.ranges_), is_array_(other.is_array_) {
+  ASTImpl::CellMapping cells;
+  auto copy = cells_.begin();
+  for (const auto &cell : other.cells_) {
+    cells.cells.emplace(&cell, &*copy++);
+  }
+  auto range_copy = ranges_.begin();
+  for (const auto &range : other.ranges_) {
+    cells.ranges.emplace(&range, &*range_copy++);
+  }
+  root_expr_ = other.root_expr_->Clone(cells);
+  optimized_expr_ = other.optimized_expr_->Clone(cells);
+  Compile();
+}
+
+void FormulaAST::Compile() {
+  using Op = ASTImpl::Instruction::Op;
+  if (is_array_) {
+    return;
+  }
+  optimized_expr_->Compile(program_);
+  // Jump завершает ветвь, за ним идёт другая ветвь с тем же начальным стеком
+  size_t depth = 0;
+  unconditional_size_ = program_.size();
+  for (size_t i = 0; i < program_.size(); ++i) {
+    switch (program_[i].op) {
+      case Op::Number:
+      case Op::Cell:++depth;
+        stack_depth_ = std::max(stack_depth_, depth);
+        break;
+      case Op::Negate:
+      case Op::Test:break;
+      case Op::JumpIfZero:
+      case Op::JumpIfNonZero:
+      case Op::Jump:unconditional_size_ = std::min(unconditional_size_, i);
+        --depth;
+        break;
+      case Op::VLookup:depth -= 2;
+        break;
+      default:--depth;
+    }
+  }
+}
+
+std::vector<Position> FormulaAST::GetUnconditionalCells() const {
+  // Программа строится по упрощённому выражению: ссылки, отброшенные
+  // упрощением, в неё не попадают
+  std::vector<Position> result;
+  if (is_array_) {
+    result.assign(cells_.begin(), cells_.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+  }
+  for (size_t i = 0; i < unconditional_size_; ++i) {
+    if (program_[i].op == ASTImpl::Instruction::Op::Cell) {
+      result.push_back(*program_[i].cell);
+    }
+  }
+  std::sort(result.begin(), result.end());
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+  return result;
+}
+
+Size FormulaAST::GetArraySize() const {
+  return optimized_expr_->GetShape().value_or(Size{1, 1});
+}
+
+Matrix FormulaAST::ExecuteArray(const CellValueResolver &resolver) const {
+  auto cells = resolver;
+  return optimized_expr_->EvaluateArray(cells);
+}
+
+void FormulaAST::ShiftCells(const PositionShift &shift) {
+  for (auto &cell : cells_) {
+    cell = shift.Apply(cell);
+  }
+  for (auto &range : ranges_) {
+    range = shift.Apply(range);
+  }
+  // Сортировка списка переставляет узлы, не перемещая значения
+  cells_.sort();
+}
+
+void FormulaAST::PermuteCells(const RowPermutation &permutation) {
+  for (auto &cell : cells_) {
+    cell = permutation.Apply(cell);
+  }
+  cells_.sort();
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
@@ -2,30 +2,124 @@
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "lookup_index.h"
+#include "matrix.h"
 
+#include <cmath>
 #include <forward_list>
 #include <functional>
+#include <optional>
 #include <stdexcept>
+#include <unordered_map>
+#include <variant>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
+
+// Команда стековой машины. Оптимизированное выражение компилируется в
+// обратную польскую запись, чтобы вычислять его без виртуальных вызовов.
+// Ветви IF, AND и OR компилируются переходами: невыбранная ветвь и её ссылки
+// не вычисляются.
+struct Instruction {
+  enum class Op : char {
+    Number,
+    Cell,
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Negate,
+    // Сравнения дают 1 или 0
+    Equal,
+    NotEqual,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
+    // Заменяет вершину на 1, если она не 0, иначе на 0
+    Test,
+    // Снимают вершину и переходят к команде jump, если она 0 (не 0)
+    JumpIfZero,
+    JumpIfNonZero,
+    // Переход в конец условного выражения: значение на вершине - результат
+    // выбранной ветви
+    Jump,
+    // MATCH: снимает ключ и вид поиска, кладёт номер найденной ячейки range
+    Match,
+    // VLOOKUP: снимает ключ, номер столбца range и признак приближённого
+    // поиска, кладёт значение ячейки из строки, найденной в первом столбце
+    VLookup,
+  };
+
+  Op op;
+  double value = 0;
+  const Position *cell = nullptr;
+  size_t jump = 0;
+  const Range *range = nullptr;
+};
+
+// Соответствие узлов списков ячеек и областей оригинала и копии выражения
+struct CellMapping {
+  std::unordered_map<const Position *, const Position *> cells;
+  std::unordered_map<const Range *, const Range *> ranges;
+};
 }
 
+using CellValueResolver = std::function<double(const Position* pos)>;
+
 class ParsingError : public std::runtime_error {
   using std::runtime_error::runtime_error;
 };
 
+// Ошибка разбора формулы без исключения
+struct FormulaParseError {
+  // Позиция символа в выражении, на котором обнаружена ошибка
+  size_t offset = 0;
+  std::string message;
+};
+
 class FormulaAST {
  public:
   explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                      std::forward_list<Position> cells);
-  FormulaAST(FormulaAST&&) = default;
-  FormulaAST& operator=(FormulaAST&&) = default;
+                      std::forward_list<Position> cells,
+                      std::forward_list<Range> ranges = {});
+  // Копия не разделяет узлов с оригиналом: их можно сдвигать независимо
+  FormulaAST(const FormulaAST &other);
+  FormulaAST(FormulaAST&&);
+  FormulaAST& operator=(FormulaAST&&);
   ~FormulaAST();
 
   double Execute(const SheetInterface &sheet) const;
+
+  // Вычисление со статически известным резолвером ссылок: он вызывается как
+  // double(const Position*) и сообщает об ошибке ячейки исключением
+  // FormulaError. Формулам с MATCH и VLOOKUP резолвер ищет значение методом
+  // std::optional<int> Match(const Range &line, double key, LookupIndex::Match)
+  // - смещение найденной ячейки в строке или столбце line. Формула-массив
+  // даёт свой левый верхний элемент
+  template <typename Resolver>
+  double Execute(Resolver &&resolver) const;
+
+  // Формула-массив (область в выражении, MMULT, TRANSPOSE): результат -
+  // область чисел, которую ячейка формулы выводит в соседние ячейки.
+  // Вычисляется обходом дерева ядрами Matrix, а не программой
+  bool IsArray() const {
+    return is_array_;
+  }
+
+  // Размер результата по текущим областям формулы, без вычисления. {1, 1},
+  // если после сдвига строк размеры перестали согласовываться: вычисление
+  // тогда даёт #VALUE!
+  Size GetArraySize() const;
+
+  // Вычисляет формулу-массив; ошибки передаются исключением FormulaError
+  Matrix ExecuteArray(const CellValueResolver &resolver) const;
+
   void Print(std::ostream &out) const;
   void PrintFormula(std::ostream &out) const;
+  // Выражение после свёртки констант, по которому идёт вычисление
+  void PrintOptimized(std::ostream &out) const;
 
   std::forward_list<Position>& GetCells() {
     return cells_;
@@ -35,12 +129,190 @@ class FormulaAST {
     return cells_;
   }
 
+  // Области формулы в порядке записи, возможно с повторами
+  const std::forward_list<Range> &GetRanges() const {
+    return ranges_;
+  }
+
+  // Программа, которую выполняет Execute; ссылки команд Cell указывают на
+  // узлы GetCells()
+  const std::vector<ASTImpl::Instruction> &GetProgram() const {
+    return program_;
+  }
+
+  size_t GetStackDepth() const {
+    return stack_depth_;
+  }
+
+  // В программе есть переходы: часть ссылок может не читаться
+  bool HasBranches() const {
+    return unconditional_size_ < program_.size();
+  }
+
+  // Ссылки, которые читает каждое вычисление, по возрастанию без повторов
+  std::vector<Position> GetUnconditionalCells() const;
+
+  // Переносит ссылки и области на месте: деревья и программа указывают на
+  // узлы cells_ и ranges_, поэтому повторный разбор не нужен. Ссылки на
+  // удалённые ячейки становятся Position::NONE и печатаются как #REF!
+  void ShiftCells(const PositionShift &shift);
+  // То же для перестановки строк; области остаются прежними
+  void PermuteCells(const RowPermutation &permutation);
+
  private:
+  // Исходное выражение используется для печати формулы
   std::unique_ptr<ASTImpl::Expr> root_expr_;
+  std::unique_ptr<ASTImpl::Expr> optimized_expr_;
+  std::vector<ASTImpl::Instruction> program_;
+  size_t stack_depth_ = 0;
+  // Число команд до первого перехода
+  size_t unconditional_size_ = 0;
   std::forward_list<Position> cells_;
+  std::forward_list<Range> ranges_;
+  bool is_array_ = false;
+
+  void Compile();
+
+  // Смещение ячейки с ключом в строке или столбце line. Бросает #REF! для
+  // удалённой области и #N/A, если ключ не найден
+  template <typename Resolver>
+  static int Find(Resolver &resolver, const Range &line, double key, LookupIndex::Match match);
 };
 
+template <typename Resolver>
+double FormulaAST::Execute(Resolver &&resolver) const {
+  using Op = ASTImpl::Instruction::Op;
+
+  if (is_array_) {
+    return ExecuteArray([&resolver](const Position *pos) {
+      return resolver(pos);
+    })(0, 0);
+  }
+
+  // Выражения редко бывают глубже, стек в куче нужен только для длинных формул
+  constexpr size_t INLINE_STACK_SIZE = 16;
+  double inline_stack[INLINE_STACK_SIZE] = {};
+  std::vector<double> heap_stack;
+  double *stack = inline_stack;
+  if (stack_depth_ > INLINE_STACK_SIZE) {
+    heap_stack.resize(stack_depth_);
+    stack = heap_stack.data();
+  }
+
+  size_t top = 0;
+  const auto *begin = program_.data();
+  const auto *end = begin + program_.size();
+  for (const auto *next = begin; next != end;) {
+    const auto &instruction = *next++;
+    switch (instruction.op) {
+      case Op::Number:stack[top++] = instruction.value;
+        break;
+      case Op::Cell:stack[top++] = resolver(instruction.cell);
+        break;
+      case Op::Add:--top;
+        stack[top - 1] = stack[top - 1] + stack[top];
+        break;
+      case Op::Subtract:--top;
+        stack[top - 1] = stack[top - 1] - stack[top];
+        break;
+      case Op::Multiply:--top;
+        stack[top - 1] = stack[top - 1] * stack[top];
+        break;
+      case Op::Divide:--top;
+        stack[top - 1] = stack[top - 1] / stack[top];
+        if (!std::isfinite(stack[top - 1])) {
+          throw FormulaError(FormulaError::Category::Div0);
+        }
+        break;
+      case Op::Negate:stack[top - 1] = stack[top - 1] * -1;
+        break;
+      case Op::Equal:--top;
+        stack[top - 1] = stack[top - 1] == stack[top] ? 1 : 0;
+        break;
+      case Op::NotEqual:--top;
+        stack[top - 1] = stack[top - 1] != stack[top] ? 1 : 0;
+        break;
+      case Op::Less:--top;
+        stack[top - 1] = stack[top - 1] < stack[top] ? 1 : 0;
+        break;
+      case Op::LessEqual:--top;
+        stack[top - 1] = stack[top - 1] <= stack[top] ? 1 : 0;
+        break;
+      case Op::Greater:--top;
+        stack[top - 1] = stack[top - 1] > stack[top] ? 1 : 0;
+        break;
+      case Op::GreaterEqual:--top;
+        stack[top - 1] = stack[top - 1] >= stack[top] ? 1 : 0;
+        break;
+      case Op::Test:stack[top - 1] = stack[top - 1] != 0 ? 1 : 0;
+        break;
+      case Op::JumpIfZero:
+        if (stack[--top] == 0) {
+          next = begin + instruction.jump;
+        }
+        break;
+      case Op::JumpIfNonZero:
+        if (stack[--top] != 0) {
+          next = begin + instruction.jump;
+        }
+        break;
+      case Op::Jump:next = begin + instruction.jump;
+        break;
+      case Op::Match:--top;
+        stack[top - 1] = 1 + Find(resolver, *instruction.range, stack[top - 1],
+                                  LookupIndex::ToMatch(stack[top]));
+        break;
+      case Op::VLookup: {
+        top -= 2;
+        const auto &range = *instruction.range;
+        const double column = std::trunc(stack[top]);
+        if (column < 1) {
+          throw FormulaError(FormulaError::Category::Value);
+        }
+        if (column > range.last.col - range.first.col + 1) {
+          throw FormulaError(FormulaError::Category::Ref);
+        }
+        const Range keys{range.first, {range.last.row, range.first.col}};
+        auto match = stack[top + 1] != 0 ? LookupIndex::Match::Ascending : LookupIndex::Match::Exact;
+        const Position found{range.first.row + Find(resolver, keys, stack[top - 1], match),
+                             range.first.col + static_cast<int>(column) - 1};
+        stack[top - 1] = resolver(&found);
+        break;
+      }
+    }
+  }
+  return stack[0];
+}
+
+template <typename Resolver>
+int FormulaAST::Find(Resolver &resolver, const Range &line, double key, LookupIndex::Match match) {
+  if (!line.IsValid()) {
+    throw FormulaError(FormulaError::Category::Ref);
+  }
+  auto offset = resolver.Match(line, key, match);
+  if (!offset) {
+    throw FormulaError(FormulaError::Category::NA);
+  }
+  return *offset;
+}
+
 FormulaAST ParseFormulaAST(std::istream &in);
 FormulaAST ParseFormulaAST(const std::string &in_str);
 
-using CellValueResolver = std::function<double(const Position* pos)>;
+// Не бросает исключений для некорректных формул. Лексер и парсер
+// переиспользуются между вызовами в пределах потока.
+std::variant<FormulaAST, FormulaParseError> TryParseFormulaAST(std::string_view expression);
+
+// ANTLR строит DFA лексера и парсера лениво, поэтому первые разборы после
+// запуска заметно медленнее. Прогрев заранее разбирает корпус формул, покрывающий
+// все конструкции грамматики. DFA общие для всех экземпляров парсера, так что
+// достаточно вызвать один раз при старте.
+void WarmUpFormulaParser();
+void WarmUpFormulaParser(const std::vector<std::string> &corpus);
+
+// Числовое значение текста ячейки, на которую ссылается формула
+bool ParseCellNumber(std::string_view text, double &value);
+// Кратчайшая запись числа, которую ParseCellNumber и разбор формул читают
+// обратно тем же числом
+std::string FormatNumber(double value);
+
@@ -0,0 +1,91 @@
+#include "async_recalc.h"
+
+AsyncRecalculator::AsyncRecalculator(Sheet &sheet)
+    : sheet_(sheet),
+      computed_(Compute()),
+      requested_(computed_->GetVersion()),
+      worker_([this] {
+        Run();
+      }) {
+  sheet_.DeferInvalidation(true);
+}
+
+AsyncRecalculator::~AsyncRecalculator() {
+  {
+    std::lock_guard guard(mutex_);
+    stop_ = true;
+  }
+  requested_cv_.notify_one();
+  worker_.join();
+  sheet_.DeferInvalidation(false);
+  sheet_.InvalidatePending();
+}
+
+size_t AsyncRecalculator::SetCell(Position pos, std::string text) {
+  sheet_.SetCell(pos, std::move(text));
+  auto version = sheet_.GetVersion();
+  Request(version);
+  return version;
+}
+
+size_t AsyncRecalculator::ClearCell(Position pos) {
+  sheet_.ClearCell(pos);
+  auto version = sheet_.GetVersion();
+  Request(version);
+  return version;
+}
+
+std::shared_ptr<const SheetSnapshot> AsyncRecalculator::GetComputed() const {
+  std::lock_guard guard(mutex_);
+  return computed_;
+}
+
+std::shared_ptr<const SheetSnapshot> AsyncRecalculator::WaitForVersion(size_t version) const {
+  std::unique_lock lock(mutex_);
+  computed_cv_.wait(lock, [this, version] {
+    return computed_->GetVersion() >= version;
+  });
+  return computed_;
+}
+
+std::shared_ptr<const SheetSnapshot> AsyncRecalculator::Compute() {
+  std::vector<Position> published;
+  auto snapshot = sheet_.Snapshot(&published);
+  // Ячейка вычисляется после своих ссылок, поэтому рекурсия неглубокая
+  for (auto pos : published) {
+    if (auto cell = snapshot->GetCell(pos)) {
+      cell->GetValue();
+    }
+  }
+  return snapshot;
+}
+
+void AsyncRecalculator::Request(size_t version) {
+  {
+    std::lock_guard guard(mutex_);
+    if (version <= requested_) {
+      return;
+    }
+    requested_ = version;
+  }
+  requested_cv_.notify_one();
+}
+
+void AsyncRecalculator::Run() {
+  std::unique_lock lock(mutex_);
+  for (;;) {
+    requested_cv_.wait(lock, [this] {
+      return stop_ || requested_ > computed_->GetVersion();
+    });
+    if (stop_) {
+      return;
+    }
+
+    lock.unlock();
+    sheet_.InvalidatePending();
+    auto snapshot = Compute();
+    lock.lock();
+    computed_ = std::move(snapshot);
+    computed_cv_.notify_all();
+  }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "sheet.h"
+#include "snapshot.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Фоновый пересчёт листа.
+// Изменения применяются к листу сразу: вызов ждёт только разбора формулы и
+// проверки циклов. Кэши зависимых формул листа сбрасывает фоновый поток
+// (Sheet::DeferInvalidation), затем он берёт снимок листа и вычисляет в нём
+// изменённые ячейки и зависящие от них формулы. Несколько изменений,
+// пришедших за время одного пересчёта, пересчитываются вместе. Значения
+// читаются из снимков: формулы самого листа до сброса дают прежние значения.
+// После отключения лист снова согласован.
+//
+//   AsyncRecalculator recalc(sheet);
+//   auto version = recalc.SetCell("A1"_pos, "=B1+1");
+//   recalc.GetComputed();            // последние вычисленные значения, без ожидания
+//   recalc.WaitForVersion(version);  // значения с учётом изменения A1
+//
+// Снимки листа, пока он подключён, должен брать только этот объект: иначе
+// часть формул вычисляется лениво при чтении.
+class AsyncRecalculator {
+ public:
+  // Вычисляет лист целиком до возврата
+  explicit AsyncRecalculator(Sheet &sheet);
+  AsyncRecalculator(const AsyncRecalculator &) = delete;
+  AsyncRecalculator &operator=(const AsyncRecalculator &) = delete;
+  ~AsyncRecalculator();
+
+  // Изменяют лист и возвращают его версию, включающую изменение. Исключения
+  // те же, что у Sheet::SetCell и Sheet::ClearCell
+  size_t SetCell(Position pos, std::string text);
+  size_t ClearCell(Position pos);
+
+  // Снимок, все значения которого уже вычислены
+  std::shared_ptr<const SheetSnapshot> GetComputed() const;
+  // Ждёт снимок версии не меньше version
+  std::shared_ptr<const SheetSnapshot> WaitForVersion(size_t version) const;
+
+ private:
+  Sheet &sheet_;
+
+  mutable std::mutex mutex_;
+  // Новое изменение или остановка
+  std::condition_variable requested_cv_;
+  // Вычислен новый снимок
+  mutable std::condition_variable computed_cv_;
+  std::shared_ptr<const SheetSnapshot> computed_;
+  size_t requested_;
+  bool stop_ = false;
+
+  std::thread worker_;
+
+  std::shared_ptr<const SheetSnapshot> Compute();
+  void Request(size_t version);
+  void Run();
+};
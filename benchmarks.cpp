@@ -0,0 +1,973 @@
+#include "benchmarks.h"
+
+#include "FormulaAST.h"
+#include "cell.h"
+#include "formula.h"
+#include "group_by.h"
+#include "matrix.h"
+#include "scenario.h"
+#include "sheet.h"
+#include "spreadsheet_ml.h"
+#include "workload.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace std::literals;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+template <typename Func>
+double MeasureSeconds(Func func) {
+  auto start = Clock::now();
+  func();
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void Report(std::ostream &out, std::string_view benchmark, std::string_view metric, double value,
+            std::string_view unit) {
+  out << benchmark << '\t' << metric << '\t' << std::fixed << std::setprecision(3) << value
+      << std::defaultfloat << '\t' << unit << '\n';
+}
+
+// Случайные формулы разной формы: числа, ячейки, скобки, унарные и бинарные
+// операции
+class FormulaGenerator {
+ public:
+  explicit FormulaGenerator(unsigned seed) : generator_(seed) {
+  }
+
+  std::string Next() {
+    return Expression(4);
+  }
+
+ private:
+  std::mt19937 generator_;
+
+  int Uniform(int from, int to) {
+    return std::uniform_int_distribution<int>(from, to)(generator_);
+  }
+
+  std::string Expression(int depth) {
+    int kind = Uniform(0, depth > 0 ? 5 : 1);
+    switch (kind) {
+      case 0:
+        return Position{Uniform(0, 999), Uniform(0, 60)}.ToString();
+      case 1:
+        return std::to_string(Uniform(0, 1000)) + (Uniform(0, 3) == 0 ? ".25"s : ""s);
+      case 2:
+        return "("s + Expression(depth - 1) + ")"s;
+      case 3:
+        return (Uniform(0, 1) == 0 ? "-"s : "+"s) + Expression(depth - 1);
+      default:
+        return Expression(depth - 1) + "+-*/"[Uniform(0, 3)] + Expression(depth - 1);
+    }
+  }
+};
+
+std::vector<std::string> MakeFormulaCorpus(size_t count, unsigned seed) {
+  FormulaGenerator generator(seed);
+  std::vector<std::string> corpus;
+  corpus.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    corpus.push_back(generator.Next());
+  }
+  return corpus;
+}
+
+double ParseAll(const std::vector<std::string> &corpus) {
+  return MeasureSeconds([&corpus] {
+    for (const auto &expression : corpus) {
+      ParseFormulaAST(expression);
+    }
+  });
+}
+
+// Выполняет measure в дочернем процессе и возвращает его замеры. Ребёнок
+// получает состояние разборщика родителя: пока родитель не разбирал формул,
+// каждый ребёнок начинает с холодного разборщика и не греет его другому.
+// Без fork (Windows) measure выполняется в этом процессе, и следующий замер
+// застаёт разборщик, прогретый предыдущим
+std::vector<double> MeasureInChild(const std::function<std::vector<double>()> &measure) {
+#ifdef _WIN32
+  return measure();
+#else
+  int fds[2];
+  if (::pipe(fds) != 0) {
+    throw std::system_error(errno, std::generic_category(), "pipe"s);
+  }
+  auto child = ::fork();
+  if (child < 0) {
+    ::close(fds[0]);
+    ::close(fds[1]);
+    throw std::system_error(errno, std::generic_category(), "fork"s);
+  }
+  if (child == 0) {
+    ::close(fds[0]);
+    auto values = measure();
+    auto size = values.size() * sizeof(double);
+    bool written = ::write(fds[1], values.data(), size) == static_cast<ssize_t>(size);
+    ::_exit(written ? 0 : 1);
+  }
+  ::close(fds[1]);
+  std::vector<double> values;
+  double buffer[16];
+  ssize_t read_bytes = 0;
+  while ((read_bytes = ::read(fds[0], buffer, sizeof(buffer))) > 0) {
+    values.insert(values.end(), buffer, buffer + read_bytes / sizeof(double));
+  }
+  ::close(fds[0]);
+  int status = 0;
+  ::waitpid(child, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    throw std::runtime_error("benchmark child process failed"s);
+  }
+  return values;
+#endif
+}
+
+// Пропускная способность разбора до прогрева и после него. Холодный разбор и
+// прогрев замеряются каждый в своём процессе до любых разборов: прогрев после
+// холодного прохода застал бы уже построенные DFA. Корпуса разные, чтобы
+// тёплый замер не пользовался DFA, построенными на тех же формулах.
+void BenchParseColdWarm(std::ostream &out) {
+  const size_t count = 2000;
+  auto first = MakeFormulaCorpus(1, 1);
+  auto cold = MakeFormulaCorpus(count, 2);
+  auto warm = MakeFormulaCorpus(count, 3);
+
+  auto cold_values = MeasureInChild([&] {
+    return std::vector<double>{ParseAll(first), ParseAll(cold)};
+  });
+  auto warm_values = MeasureInChild([&] {
+    auto warm_up_seconds = MeasureSeconds([] { WarmUpFormulaParser(); });
+    return std::vector<double>{warm_up_seconds, ParseAll(first), ParseAll(warm)};
+  });
+
+  Report(out, "parse_cold_warm"sv, "first_parse"sv, cold_values.at(0) * 1e6, "us"sv);
+  Report(out, "parse_cold_warm"sv, "cold"sv, count / cold_values.at(1), "formulas/s"sv);
+  Report(out, "parse_cold_warm"sv, "warm_up"sv, warm_values.at(0) * 1e3, "ms"sv);
+  Report(out, "parse_cold_warm"sv, "warm_first_parse"sv, warm_values.at(1) * 1e6, "us"sv);
+  Report(out, "parse_cold_warm"sv, "warm"sv, count / warm_values.at(2), "formulas/s"sv);
+}
+
+// Проверка импорта, где половина формул некорректна: исключения против
+// ValidateFormulas
+void BenchValidateMalformed(std::ostream &out) {
+  auto corpus = MakeFormulaCorpus(20000, 4);
+  for (size_t i = 0; i < corpus.size(); i += 2) {
+    corpus[i] += i % 4 == 0 ? "+"s : ")"s;
+  }
+
+  size_t throwing_errors = 0;
+  auto throwing_seconds = MeasureSeconds([&] {
+    for (const auto &expression : corpus) {
+      try {
+        ParseFormula(expression);
+      } catch (const FormulaException &) {
+        ++throwing_errors;
+      }
+    }
+  });
+
+  size_t errors = 0;
+  auto validate_seconds = MeasureSeconds([&] {
+    for (const auto &error : ValidateFormulas(corpus)) {
+      errors += error.has_value();
+    }
+  });
+  size_t parallel_errors = 0;
+  auto parallel_seconds = MeasureSeconds([&] {
+    for (const auto &error : ValidateFormulas(corpus, 0)) {
+      parallel_errors += error.has_value();
+    }
+  });
+
+  if (errors != throwing_errors || parallel_errors != throwing_errors) {
+    throw std::logic_error("Validation results differ"s);
+  }
+  Report(out, "validate_malformed"sv, "throwing"sv, corpus.size() / throwing_seconds, "formulas/s"sv);
+  Report(out, "validate_malformed"sv, "batch"sv, corpus.size() / validate_seconds, "formulas/s"sv);
+  Report(out, "validate_malformed"sv, "batch_parallel"sv, corpus.size() / parallel_seconds, "formulas/s"sv);
+}
+
+// Стоимость одной ссылки в формуле: через SheetInterface и CellInterface
+// против статического резолвера Sheet::ValueResolver
+void BenchReferenceResolution(std::ostream &out) {
+  const int refs = 1000;
+  const int rounds = 2000;
+
+  for (bool text_cells : {false, true}) {
+    Sheet sheet;
+    std::string expression;
+    for (int i = 0; i < refs; ++i) {
+      Position pos{i, 1};
+      sheet.SetCell(pos, text_cells ? std::to_string(i) : "="s + std::to_string(i));
+      sheet.GetCell(pos)->GetValue();
+      expression += (i > 0 ? "+"s : ""s) + pos.ToString();
+    }
+    auto formula = ParseFormula(expression);
+
+    double interface_sum = 0;
+    auto interface_seconds = MeasureSeconds([&] {
+      for (int round = 0; round < rounds; ++round) {
+        interface_sum += std::get<double>(formula->Evaluate(sheet));
+      }
+    });
+    double static_sum = 0;
+    auto static_seconds = MeasureSeconds([&] {
+      for (int round = 0; round < rounds; ++round) {
+        static_sum += formula->GetAST().Execute(Sheet::ValueResolver(sheet));
+      }
+    });
+    if (interface_sum != static_sum) {
+      throw std::logic_error("Resolvers disagree"s);
+    }
+
+    auto per_reference = [&](double seconds) {
+      return seconds * 1e9 / (static_cast<double>(refs) * rounds);
+    };
+    auto prefix = text_cells ? "text_"s : "formula_"s;
+    Report(out, "reference_resolution"sv, prefix + "interface"s, per_reference(interface_seconds), "ns/ref"sv);
+    Report(out, "reference_resolution"sv, prefix + "static"s, per_reference(static_seconds), "ns/ref"sv);
+  }
+}
+
+// Вставка и удаление строки в начале большого листа против его пересборки
+// через SetCell
+// Чтение вычисленной области по ячейкам через GetValue и одним GetValues
+void BenchRangeRead(std::ostream &out) {
+  const int rows = 1000;
+  const int cols = 20;
+  const int rounds = 50;
+
+  Sheet sheet;
+  for (int row = 0; row < rows; ++row) {
+    for (int col = 0; col < cols; ++col) {
+      Position pos{row, col};
+      if (col % 2 == 0) {
+        // Подписи длиннее буфера короткой строки: GetValue их копирует
+        sheet.SetCell(pos, col % 4 == 0 ? std::to_string(row)
+                                        : "description of row "s + std::to_string(row));
+      } else {
+        // Ссылка на ближайший слева числовой столбец
+        sheet.SetCell(pos, "="s + Position{row, col - col % 4}.ToString() + "*2"s);
+      }
+    }
+  }
+
+  size_t per_cell_count = 0;
+  auto per_cell_seconds = MeasureSeconds([&] {
+    for (int round = 0; round < rounds; ++round) {
+      for (int col = 0; col < cols; ++col) {
+        for (int row = 0; row < rows; ++row) {
+          auto value = sheet.GetCell({row, col})->GetValue();
+          per_cell_count += std::holds_alternative<double>(value) ? 1 : 0;
+        }
+      }
+    }
+  });
+
+  std::vector<double> numbers(rows * cols);
+  std::vector<ValueTag> tags(rows * cols);
+  std::vector<std::string_view> texts(rows * cols);
+  size_t bulk_count = 0;
+  auto bulk_seconds = MeasureSeconds([&] {
+    for (int round = 0; round < rounds; ++round) {
+      sheet.GetValues({0, 0}, {rows, cols}, {numbers.data(), tags.data(), texts.data()});
+      bulk_count += std::count(tags.begin(), tags.end(), ValueTag::NUMBER);
+    }
+  });
+  if (per_cell_count != bulk_count) {
+    throw std::logic_error("Range reads disagree"s);
+  }
+
+  auto per_cell = [&](double seconds) {
+    return seconds * 1e9 / (static_cast<double>(rows) * cols * rounds);
+  };
+  Report(out, "range_read"sv, "get_value"sv, per_cell(per_cell_seconds), "ns/cell"sv);
+  Report(out, "range_read"sv, "get_values"sv, per_cell(bulk_seconds), "ns/cell"sv);
+}
+
+void BenchInsertRows(std::ostream &out) {
+  WorkloadOptions options;
+  options.shape = WorkloadShape::RandomDag;
+  // Генератор заполняет столбцы целиком, вставке нужна свободная строка
+  options.size = Position::MAX_ROWS - 1;
+  Sheet sheet;
+  GenerateWorkload(sheet, options);
+
+  auto insert_seconds = MeasureSeconds([&sheet] { sheet.InsertRows(1); });
+  auto delete_seconds = MeasureSeconds([&sheet] { sheet.DeleteRows(1); });
+
+  auto size = sheet.GetPrintableSize();
+  auto rebuild_seconds = MeasureSeconds([&] {
+    Sheet rebuilt;
+    for (int row = 0; row < size.rows; ++row) {
+      for (int col = 0; col < size.cols; ++col) {
+        if (auto cell = sheet.GetCell({row, col})) {
+          rebuilt.SetCell({row + (row >= 1 ? 1 : 0), col}, cell->GetText());
+        }
+      }
+    }
+  });
+
+  Report(out, "insert_rows"sv, "cells"sv, options.size, "cells"sv);
+  Report(out, "insert_rows"sv, "insert"sv, insert_seconds * 1e3, "ms"sv);
+  Report(out, "insert_rows"sv, "delete"sv, delete_seconds * 1e3, "ms"sv);
+  Report(out, "insert_rows"sv, "rebuild"sv, rebuild_seconds * 1e3, "ms"sv);
+}
+
+struct Benchmark {
+  std::string_view name;
+  void (*run)(std::ostream &out);
+};
+
+// Потоки заполняют непересекающиеся полосы строк. Для сравнения те же записи
+// выполняются под одной общей блокировкой
+void BenchConcurrentWriters(std::ostream &out) {
+  constexpr int rows = 16000;
+
+  auto fill = [](int threads, std::mutex *serialize) {
+    Sheet sheet;
+    auto seconds = MeasureSeconds([&] {
+      std::vector<std::thread> writers;
+      for (int t = 0; t < threads; ++t) {
+        writers.emplace_back([&, t] {
+          int first = rows / threads * t;
+          int last = t + 1 == threads ? rows : rows / threads * (t + 1);
+          for (int row = first; row < last; ++row) {
+            auto name = std::to_string(row + 1);
+            auto above = std::to_string(row == first ? row + 1 : row);
+            std::string texts[] = {name, "=A"s + name + "*2"s, "=B"s + above + "+B"s + name};
+            for (int col = 0; col < 3; ++col) {
+              std::unique_lock<std::mutex> guard;
+              if (serialize != nullptr) {
+                guard = std::unique_lock(*serialize);
+              }
+              sheet.SetCell({row, col}, std::move(texts[col]));
+            }
+          }
+        });
+      }
+      for (auto &writer : writers) {
+        writer.join();
+      }
+    });
+    return rows * 3 / seconds;
+  };
+
+  for (int threads : {1, 2, 4, 8}) {
+    std::mutex serialize;
+    auto metric = std::to_string(threads) + "_threads"s;
+    Report(out, "concurrent_writers"sv, metric + "_sharded"s, fill(threads, nullptr), "cells/s"sv);
+    Report(out, "concurrent_writers"sv, metric + "_one_mutex"s, fill(threads, &serialize),
+           "cells/s"sv);
+  }
+}
+
+// Сценарии "что, если": четыре входа, выход зависит от 1000 формул, ещё 2000
+// формул зависят от входов, но не от выхода
+void BenchScenarios(std::ostream &out) {
+  const int rows = 500;
+  Sheet sheet;
+  const std::vector<Position> inputs = {{0, 0}, {1, 0}, {2, 0}, {3, 0}};
+  const Position output{0, 3};
+  const std::string initial[] = {"5"s, "100"s, "3"s, "2"s};
+  for (size_t k = 0; k < inputs.size(); ++k) {
+    sheet.SetCell(inputs[k], initial[k]);
+  }
+  for (int row = 0; row < rows; ++row) {
+    auto name = std::to_string(row + 1);
+    sheet.SetCell({row, 1}, row == 0 ? "=A2*A3"s : "=B"s + std::to_string(row) + "*(1+A1/100)-A4"s);
+    sheet.SetCell({row, 2}, "=B"s + name + "*A3/(A2+1)"s);
+  }
+  sheet.SetCell(output, "=B"s + std::to_string(rows) + "+C"s + std::to_string(rows));
+  for (int row = 0; row < 2000; ++row) {
+    sheet.SetCell({row, 4}, "=A1*"s + std::to_string(row));
+  }
+
+  auto scenario_inputs = [&inputs](size_t count) {
+    std::mt19937 generator(7);
+    std::uniform_real_distribution<double> distribution(1, 10);
+    std::vector<double> values(count * inputs.size());
+    for (auto &value : values) {
+      value = distribution(generator);
+    }
+    return values;
+  };
+
+  const size_t edited_count = 20;
+  auto edited_inputs = scenario_inputs(edited_count);
+  auto edited_seconds = MeasureSeconds([&] {
+    for (size_t i = 0; i < edited_count; ++i) {
+      for (size_t k = 0; k < inputs.size(); ++k) {
+        sheet.SetCell(inputs[k], std::to_string(edited_inputs[i * inputs.size() + k]));
+      }
+      sheet.GetCell(output)->GetValue();
+    }
+  });
+
+  std::optional<ScenarioProgram> program;
+  auto compile_seconds = MeasureSeconds([&] {
+    program.emplace(sheet, inputs, output);
+  });
+  const size_t program_count = 100000;
+  auto program_inputs = scenario_inputs(program_count);
+  auto one_thread_seconds = MeasureSeconds([&] {
+    program->Evaluate(program_inputs, 1);
+  });
+  auto all_threads_seconds = MeasureSeconds([&] {
+    program->Evaluate(program_inputs, 0);
+  });
+
+  Report(out, "scenarios"sv, "set_cell"sv, edited_count / edited_seconds, "scenarios/s"sv);
+  Report(out, "scenarios"sv, "compile"sv, compile_seconds * 1e3, "ms"sv);
+  Report(out, "scenarios"sv, "program_1_thread"sv, program_count / one_thread_seconds,
+         "scenarios/s"sv);
+  Report(out, "scenarios"sv, "program_all_threads"sv, program_count / all_threads_seconds,
+         "scenarios/s"sv);
+}
+
+// VLOOKUP по столбцу на всю высоту листа: каждая строка ищет свой ключ.
+// Индексированный поиск сравнивается с просмотром столбца без индекса
+void BenchLookups(std::ostream &out) {
+  const int rows = Position::MAX_ROWS;
+  const std::string range = "A1:B"s + std::to_string(rows);
+  Sheet sheet;
+  for (int row = 0; row < rows; ++row) {
+    sheet.SetCell({row, 0}, std::to_string(rows - row));
+    sheet.SetCell({row, 1}, std::to_string(row));
+  }
+  for (int row = 0; row < rows; ++row) {
+    sheet.SetCell({row, 3}, "=VLOOKUP("s + std::to_string(row + 1) + ","s + range + ",2,0)"s);
+  }
+
+  auto evaluate_all = [&sheet] {
+    for (int row = 0; row < rows; ++row) {
+      sheet.GetCell({row, 3})->GetValue();
+    }
+  };
+  auto first_seconds = MeasureSeconds(evaluate_all);
+  // Изменение ключа сбрасывает все формулы, но индекс перечитывает одну ячейку
+  sheet.SetCell({0, 0}, std::to_string(rows + 1));
+  auto changed_seconds = MeasureSeconds(evaluate_all);
+
+  const int scanned = 50;
+  auto scan_seconds = MeasureSeconds([&sheet] {
+    for (int row = 0; row < scanned; ++row) {
+      static_cast<const Cell *>(sheet.GetCell({row, 3}))->GetFormula()->Evaluate(sheet);
+    }
+  });
+
+  Report(out, "lookups"sv, "indexed_first"sv, rows / first_seconds, "lookups/s"sv);
+  Report(out, "lookups"sv, "indexed_after_change"sv, rows / changed_seconds, "lookups/s"sv);
+  Report(out, "lookups"sv, "column_scan"sv, scanned / scan_seconds, "lookups/s"sv);
+}
+
+// Формулы-массивы против той же модели из отдельных формул: MMULT матриц
+// side x side и поэлементное выражение над столбцами из rows строк. Для каждой
+// модели - заполнение формул, первое чтение всех результатов и чтение после
+// изменения одного входа
+void BenchArrays(std::ostream &out) {
+  const int side = 64;
+  const int rows = 10000;
+  const int column = 2 * side + 2;
+  auto fill_inputs = [](Sheet &sheet) {
+    for (int row = 0; row < side; ++row) {
+      for (int col = 0; col < side; ++col) {
+        sheet.SetCell({row, col}, std::to_string((row + col) % 7));
+        sheet.SetCell({side + row, col}, std::to_string(row * col % 5));
+      }
+    }
+    for (int row = 0; row < rows; ++row) {
+      sheet.SetCell({row, column}, std::to_string(row % 100));
+      sheet.SetCell({row, column + 1}, std::to_string(row % 7));
+    }
+  };
+  auto read = [](const Sheet &sheet, Position top_left, Size size) {
+    for (int row = top_left.row; row < top_left.row + size.rows; ++row) {
+      for (int col = top_left.col; col < top_left.col + size.cols; ++col) {
+        sheet.GetCell({row, col})->GetValue();
+      }
+    }
+  };
+  auto measure = [&out, &read](std::string_view model, Sheet &sheet, Position top_left, Size size,
+                               const std::function<void()> &set_formulas, Position input) {
+    auto setup_seconds = MeasureSeconds(set_formulas);
+    auto first_seconds = MeasureSeconds([&] {
+      read(sheet, top_left, size);
+    });
+    sheet.SetCell(input, "3"s);
+    auto changed_seconds = MeasureSeconds([&] {
+      read(sheet, top_left, size);
+    });
+    const std::string name(model);
+    Report(out, "arrays"sv, name + "_setup"s, setup_seconds * 1e3, "ms"sv);
+    Report(out, "arrays"sv, name + "_first"s, first_seconds * 1e3, "ms"sv);
+    Report(out, "arrays"sv, name + "_after_change"s, changed_seconds * 1e3, "ms"sv);
+  };
+
+  const std::string product = "MMULT(A1:"s + Position{side - 1, side - 1}.ToString() + ","s
+      + Position{side, 0}.ToString() + ":"s + Position{2 * side - 1, side - 1}.ToString() + ")"s;
+  const std::string elementwise = Position{0, column}.ToString() + ":"s
+      + Position{rows - 1, column}.ToString() + "*"s + Position{0, column + 1}.ToString() + ":"s
+      + Position{rows - 1, column + 1}.ToString() + "+1"s;
+  {
+    Sheet sheet;
+    fill_inputs(sheet);
+    measure("mmult_array"sv, sheet, {0, side}, {side, side}, [&sheet, &product] {
+      sheet.SetCell({0, side}, "="s + product);
+    }, {0, 0});
+    measure("elementwise_array"sv, sheet, {0, column + 2}, {rows, 1}, [&sheet, &elementwise] {
+      sheet.SetCell({0, column + 2}, "="s + elementwise);
+    }, {0, column});
+  }
+  {
+    Sheet sheet;
+    fill_inputs(sheet);
+    measure("mmult_cells"sv, sheet, {0, side}, {side, side}, [&sheet] {
+      for (int row = 0; row < side; ++row) {
+        for (int col = 0; col < side; ++col) {
+          std::string text = "="s;
+          for (int k = 0; k < side; ++k) {
+            text += (k > 0 ? "+"s : ""s) + Position{row, k}.ToString() + "*"s
+                + Position{side + k, col}.ToString();
+          }
+          sheet.SetCell({row, side + col}, text);
+        }
+      }
+    }, {0, 0});
+    measure("elementwise_cells"sv, sheet, {0, column + 2}, {rows, 1}, [&sheet] {
+      for (int row = 0; row < rows; ++row) {
+        sheet.SetCell({row, column + 2}, "="s + Position{row, column}.ToString() + "*"s
+            + Position{row, column + 1}.ToString() + "+1"s);
+      }
+    }, {0, column});
+  }
+
+  // Ядро умножения без листа: блочное против наивного скалярного произведения
+  // строки на столбец
+  const int n = 256;
+  Matrix lhs({n, n});
+  Matrix rhs({n, n});
+  for (int row = 0; row < n; ++row) {
+    for (int col = 0; col < n; ++col) {
+      lhs(row, col) = (row + col) % 7;
+      rhs(row, col) = row * col % 5;
+    }
+  }
+  Matrix result;
+  auto blocked_seconds = MeasureSeconds([&] {
+    result = Matrix::Multiply(lhs, rhs);
+  });
+  Matrix naive({n, n});
+  auto naive_seconds = MeasureSeconds([&] {
+    for (int row = 0; row < n; ++row) {
+      for (int col = 0; col < n; ++col) {
+        double sum = 0;
+        for (int k = 0; k < n; ++k) {
+          sum += lhs(row, k) * rhs(k, col);
+        }
+        naive(row, col) = sum;
+      }
+    }
+  });
+  if (result(n - 1, n - 1) != naive(n - 1, n - 1)) {
+    throw std::logic_error("Matrix kernels disagree"s);
+  }
+  const double flops = 2.0 * n * n * n;
+  Report(out, "arrays"sv, "kernel_blocked_256"sv, flops / blocked_seconds / 1e9, "GFLOP/s"sv);
+  Report(out, "arrays"sv, "kernel_naive_256"sv, flops / naive_seconds / 1e9, "GFLOP/s"sv);
+}
+
+#ifndef _WIN32
+// Лист в несколько раз больше предела памяти: проходы по всем ячейкам и
+// случайные чтения в памяти, с вытеснением без предела и с пределом в
+// четверть листа. Счётчики подкачки - для листа с пределом
+void BenchOutOfCore(std::ostream &out) {
+  const int rows = 2000;
+  const int cols = 50;
+  const int random_reads = 2000;
+  auto fill = [](Sheet &sheet) {
+    for (int row = 0; row < rows; ++row) {
+      sheet.SetCell({row, 0}, std::to_string(row));
+      for (int col = 1; col < cols; ++col) {
+        sheet.SetCell({row, col}, "="s + Position{row, col - 1}.ToString() + "+1"s);
+      }
+    }
+  };
+  auto path = [](std::string_view name) {
+    return (std::filesystem::temp_directory_path() / ("spreadsheet_bench_"s + std::string(name) + ".bin"s))
+        .string();
+  };
+
+  auto measure = [&](std::string_view name, std::optional<size_t> limit) {
+    Sheet sheet;
+    fill(sheet);
+    if (limit) {
+      sheet.EnableOutOfCore(path(name), *limit);
+    }
+    auto scan = [&sheet] {
+      for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+          sheet.GetCell({row, col})->GetValue();
+        }
+      }
+    };
+    auto first_seconds = MeasureSeconds(scan);
+    auto again_seconds = MeasureSeconds(scan);
+    std::mt19937 generator(7);
+    auto random_seconds = MeasureSeconds([&] {
+      for (int i = 0; i < random_reads; ++i) {
+        Position pos{std::uniform_int_distribution<int>(0, rows - 1)(generator),
+                     std::uniform_int_distribution<int>(0, cols - 1)(generator)};
+        sheet.GetCell(pos)->GetValue();
+      }
+    });
+    Report(out, "out_of_core"sv, std::string(name) + "_scan_first"s, rows * cols / first_seconds, "cells/s"sv);
+    Report(out, "out_of_core"sv, std::string(name) + "_scan_again"s, rows * cols / again_seconds, "cells/s"sv);
+    Report(out, "out_of_core"sv, std::string(name) + "_random"s, random_reads / random_seconds, "reads/s"sv);
+    return sheet.GetPagingStats();
+  };
+
+  measure("memory"sv, std::nullopt);
+  const size_t total_bytes = measure("paged_unlimited"sv, std::numeric_limits<size_t>::max()).resident_bytes;
+  auto stats = measure("paged_quarter"sv, total_bytes / 4);
+  Report(out, "out_of_core"sv, "sheet_estimate"sv, total_bytes / 1048576.0, "MiB"sv);
+  Report(out, "out_of_core"sv, "resident_limit"sv, total_bytes / 4 / 1048576.0, "MiB"sv);
+  Report(out, "out_of_core"sv, "resident_after"sv, stats.resident_bytes / 1048576.0, "MiB"sv);
+  Report(out, "out_of_core"sv, "file_size"sv, stats.file_bytes / 1048576.0, "MiB"sv);
+  Report(out, "out_of_core"sv, "loads"sv, stats.loads, "tiles"sv);
+  Report(out, "out_of_core"sv, "evictions"sv, stats.evictions, "tiles"sv);
+}
+#endif
+
+// Два листа по миллиону ячеек, различающиеся в changed ячейках: сравнение по
+// хешам блоков против сравнения текстов PrintTexts
+void BenchDiff(std::ostream &out) {
+  const int rows = 1000;
+  const int cols = 1000;
+  const int changed = 10;
+  Sheet lhs;
+  Sheet rhs;
+  auto fill_seconds = MeasureSeconds([&] {
+    for (auto sheet : {&lhs, &rhs}) {
+      for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+          sheet->SetCell({row, col}, col % 10 == 0 ? "="s + Position{row, col + 1}.ToString() + "*2"s
+                                                   : std::to_string(row * cols + col));
+        }
+      }
+    }
+  });
+  std::mt19937 generator(11);
+  for (int i = 0; i < changed; ++i) {
+    Position pos{std::uniform_int_distribution<int>(0, rows - 1)(generator),
+                 std::uniform_int_distribution<int>(0, cols - 1)(generator)};
+    rhs.SetCell(pos, "changed"s);
+  }
+
+  std::vector<Position> diff;
+  auto diff_seconds = MeasureSeconds([&] {
+    diff = Sheet::Diff(lhs, rhs);
+  });
+  bool same_texts = true;
+  auto print_seconds = MeasureSeconds([&] {
+    std::ostringstream lhs_texts;
+    std::ostringstream rhs_texts;
+    lhs.PrintTexts(lhs_texts);
+    rhs.PrintTexts(rhs_texts);
+    same_texts = lhs_texts.str() == rhs_texts.str();
+  });
+  if (diff.empty() || same_texts) {
+    out << "diff: sheets are expected to differ\n";
+  }
+
+  Report(out, "diff"sv, "fill_with_hashes"sv, 2.0 * rows * cols / fill_seconds, "cells/s"sv);
+  Report(out, "diff"sv, "changed_cells"sv, diff.size(), "cells"sv);
+  Report(out, "diff"sv, "tile_hashes"sv, diff_seconds * 1e3, "ms"sv);
+  Report(out, "diff"sv, "print_texts"sv, print_seconds * 1e3, "ms"sv);
+}
+
+// Сортировка таблицы rows x 3 по числовому столбцу: SortRange против записи
+// тех же текстов в новом порядке через SetCell, которая разбирает формулы и
+// перестраивает обратные ссылки заново
+void BenchSortRange(std::ostream &out) {
+  const int rows = Position::MAX_ROWS;
+  std::mt19937 generator(5);
+  std::vector<int> keys(rows);
+  for (auto &key : keys) {
+    key = std::uniform_int_distribution<int>(0, 1000000)(generator);
+  }
+  auto fill = [&keys](Sheet &sheet) {
+    for (int row = 0; row < rows; ++row) {
+      sheet.SetCell({row, 0}, "="s + std::to_string(keys[row]));
+      sheet.SetCell({row, 1}, "="s + Position{row, 0}.ToString() + "*2"s);
+      sheet.SetCell({row, 2}, "item"s + std::to_string(row));
+      // Формула вне области ссылается на ячейку области
+      sheet.SetCell({row, 4}, "="s + Position{row, 1}.ToString() + "+1"s);
+      // Остальной лист сортировка не просматривает
+      for (int col = 10; col < 20; ++col) {
+        sheet.SetCell({row, col}, col % 2 == 0 ? "other"s : "="s + Position{row, col - 1}.ToString() + "+1"s);
+      }
+    }
+  };
+  const Range range{{0, 0}, {rows - 1, 2}};
+
+  Sheet sorted;
+  fill(sorted);
+  auto sort_seconds = MeasureSeconds([&] {
+    sorted.SortRange(range, {0});
+  });
+
+  Sheet rewritten;
+  fill(rewritten);
+  auto rewrite_seconds = MeasureSeconds([&] {
+    std::vector<int> order(rows);
+    for (int row = 0; row < rows; ++row) {
+      order[row] = row;
+    }
+    std::stable_sort(order.begin(), order.end(), [&keys](int lhs, int rhs) {
+      return keys[lhs] < keys[rhs];
+    });
+    std::vector<std::string> texts;
+    std::vector<int> moved_to(rows);
+    for (int row : order) {
+      const int to = static_cast<int>(texts.size() / 3);
+      moved_to[row] = to;
+      texts.push_back(rewritten.GetCell({row, 0})->GetText());
+      texts.push_back("="s + Position{to, 0}.ToString() + "*2"s);
+      texts.push_back(rewritten.GetCell({row, 2})->GetText());
+    }
+    for (int row = 0; row < rows; ++row) {
+      for (int col = 0; col < 3; ++col) {
+        rewritten.SetCell({row, col}, texts[row * 3 + col]);
+      }
+    }
+    // Ссылки извне на ячейки области тоже переписываются вручную
+    for (int row = 0; row < rows; ++row) {
+      rewritten.SetCell({row, 4}, "="s + Position{moved_to[row], 1}.ToString() + "+1"s);
+    }
+  });
+  bool same = true;
+  for (int row = 0; row < rows && same; ++row) {
+    for (int col : {0, 1, 2, 4}) {
+      same = same && sorted.GetCell({row, col})->GetText() == rewritten.GetCell({row, col})->GetText();
+    }
+  }
+  if (!same) {
+    out << "sort_range: results differ\n";
+  }
+
+  Report(out, "sort_range"sv, "sort_range"sv, sort_seconds * 1e3, "ms"sv);
+  Report(out, "sort_range"sv, "set_cells"sv, rewrite_seconds * 1e3, "ms"sv);
+}
+
+void BenchGroupBy(std::ostream &out) {
+  const int rows = Position::MAX_ROWS;
+  const int keys = 1000;
+  const int repeats = 20;
+  Sheet sheet;
+  for (int row = 0; row < rows; ++row) {
+    sheet.SetCell({row, 0}, "region"s + std::to_string(row * 7 % keys));
+    sheet.SetCell({row, 1}, std::to_string(row % 101));
+    sheet.SetCell({row, 2}, "="s + Position{row, 1}.ToString() + "*2"s);
+  }
+  const Range range{{0, 0}, {rows - 1, 2}};
+  const std::vector<Aggregation> aggregations = {
+      {1, Aggregate::Sum}, {2, Aggregate::Average}, {2, Aggregate::Max},
+  };
+  // Первый вызов вычисляет формулы
+  GroupBy(sheet, range, 0, aggregations);
+
+  auto measure = [&](size_t threads) {
+    GroupedValues groups;
+    auto seconds = MeasureSeconds([&] {
+      for (int i = 0; i < repeats; ++i) {
+        groups = GroupBy(sheet, range, 0, aggregations, threads);
+      }
+    });
+    if (groups.GetGroupCount() != keys) {
+      out << "group_by: wrong group count\n";
+    }
+    return seconds / repeats;
+  };
+  auto single_seconds = measure(1);
+  auto parallel_seconds = measure(0);
+
+  // Выгрузка значений и свёртка вне листа, как раньше
+  auto print_seconds = MeasureSeconds([&] {
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    std::istringstream in(values.str());
+    std::unordered_map<std::string, double> sums;
+    std::string line;
+    while (std::getline(in, line)) {
+      auto tab = line.find('\t');
+      auto next = line.find('\t', tab + 1);
+      sums[line.substr(0, tab)] += std::stod(line.substr(tab + 1, next - tab - 1));
+    }
+    if (sums.size() != keys) {
+      out << "group_by: wrong group count\n";
+    }
+  });
+
+  Report(out, "group_by"sv, "single_thread"sv, rows / single_seconds, "rows/s"sv);
+  Report(out, "group_by"sv, "parallel"sv, rows / parallel_seconds, "rows/s"sv);
+  Report(out, "group_by"sv, "print_values"sv, rows / print_seconds, "rows/s"sv);
+}
+
+// 0 без getrusage (Windows): рост пика памяти не замеряется
+size_t PeakResidentBytes() {
+#ifdef _WIN32
+  return 0;
+#else
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+void BenchSpreadsheetML(std::ostream &out) {
+  const int rows = Position::MAX_ROWS;
+  const int cols = 60;
+  // Длинный текст в последнем столбце доводит файл до сотен мегабайт
+  const std::string note(12000, 'n');
+  const auto path = (std::filesystem::temp_directory_path() / "spreadsheet_bench.xml").string();
+
+  Sheet sheet;
+  for (int row = 0; row < rows; ++row) {
+    for (int col = 0; col < cols; ++col) {
+      if (col % 10 == 9) {
+        sheet.SetCell({row, col}, "="s + Position{row, col - 1}.ToString() + "*2+"s + Position{row, 0}.ToString());
+      } else if (col % 3 == 0) {
+        sheet.SetCell({row, col}, "item "s + std::to_string(row * cols + col));
+      } else {
+        sheet.SetCell({row, col}, std::to_string((row * 31 + col) % 1000) + ".25"s);
+      }
+    }
+    sheet.SetCell({row, cols}, note);
+  }
+  const double cells = static_cast<double>(rows) * (cols + 1);
+
+  const size_t peak_before_write = PeakResidentBytes();
+  auto write_seconds = MeasureSeconds([&] {
+    std::ofstream file(path, std::ios::binary);
+    WriteSpreadsheetML(sheet, file);
+  });
+  const size_t write_growth = PeakResidentBytes() - peak_before_write;
+  const double megabytes = std::filesystem::file_size(path) / 1048576.0;
+
+  Sheet imported;
+  size_t read_cells = 0;
+  auto read_seconds = MeasureSeconds([&] {
+    std::ifstream file(path, std::ios::binary);
+    read_cells = ReadSpreadsheetML(file, imported);
+  });
+  std::filesystem::remove(path);
+  if (read_cells != static_cast<size_t>(cells) || !Sheet::Diff(sheet, imported).empty()) {
+    out << "spreadsheet_ml: imported sheet differs\n";
+  }
+
+  // Пачки против отдельных SetCell на тех же ячейках
+  const int batch_rows = 2000;
+  std::vector<std::pair<Position, std::string>> texts;
+  for (int row = 0; row < batch_rows; ++row) {
+    for (int col = 0; col < cols; ++col) {
+      texts.emplace_back(Position{row, col}, sheet.GetCell({row, col})->GetText());
+    }
+  }
+  Sheet single;
+  auto single_seconds = MeasureSeconds([&] {
+    for (const auto &[pos, text] : texts) {
+      single.SetCell(pos, text);
+    }
+  });
+  Sheet batched;
+  auto batched_seconds = MeasureSeconds([&] {
+    for (size_t first = 0; first < texts.size(); first += 4096) {
+      batched.SetCells({texts.begin() + first, texts.begin() + std::min(texts.size(), first + 4096)});
+    }
+  });
+
+  Report(out, "spreadsheet_ml"sv, "file_size"sv, megabytes, "MiB"sv);
+  Report(out, "spreadsheet_ml"sv, "write"sv, megabytes / write_seconds, "MiB/s"sv);
+  Report(out, "spreadsheet_ml"sv, "write_cells"sv, cells / write_seconds, "cells/s"sv);
+  Report(out, "spreadsheet_ml"sv, "write_peak_growth"sv, write_growth / 1048576.0, "MiB"sv);
+  Report(out, "spreadsheet_ml"sv, "read"sv, megabytes / read_seconds, "MiB/s"sv);
+  Report(out, "spreadsheet_ml"sv, "read_cells"sv, cells / read_seconds, "cells/s"sv);
+  Report(out, "spreadsheet_ml"sv, "set_cell"sv, texts.size() / single_seconds, "cells/s"sv);
+  Report(out, "spreadsheet_ml"sv, "set_cells"sv, texts.size() / batched_seconds, "cells/s"sv);
+}
+
+const std::vector<Benchmark> &GetBenchmarks() {
+  static const std::vector<Benchmark> benchmarks = {
+      {"parse_cold_warm"sv, BenchParseColdWarm},
+      {"validate_malformed"sv, BenchValidateMalformed},
+      {"reference_resolution"sv, BenchReferenceResolution},
+      {"range_read"sv, BenchRangeRead},
+      {"insert_rows"sv, BenchInsertRows},
+      {"concurrent_writers"sv, BenchConcurrentWriters},
+      {"scenarios"sv, BenchScenarios},
+      {"lookups"sv, BenchLookups},
+      {"arrays"sv, BenchArrays},
+#ifndef _WIN32
+      {"out_of_core"sv, BenchOutOfCore},
+#endif
+      {"diff"sv, BenchDiff},
+      {"sort_range"sv, BenchSortRange},
+      {"group_by"sv, BenchGroupBy},
+      {"spreadsheet_ml"sv, BenchSpreadsheetML},
+  };
+  return benchmarks;
+}
+
+}  // namespace
+
+int RunBenchmarks(const std::vector<std::string> &names, std::ostream &out) {
+  for (const auto &name : names) {
+    bool known = false;
+    for (const auto &benchmark : GetBenchmarks()) {
+      known = known || benchmark.name == name;
+    }
+    if (!known) {
+      out << "Unknown benchmark: "s << name << '\n';
+      return 2;
+    }
+  }
+
+  out << "benchmark\tmetric\tvalue\tunit\n";
+  for (const auto &benchmark : GetBenchmarks()) {
+    bool selected = names.empty();
+    for (const auto &name : names) {
+      selected = selected || benchmark.name == name;
+    }
+    if (selected) {
+      benchmark.run(out);
+    }
+  }
+  return 0;
+}
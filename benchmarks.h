@@ -0,0 +1,12 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Замеры производительности, команда
+//   spreadsheet bench [имя...]
+// Без имён выполняются все замеры в порядке регистрации. Замер холодного
+// разбора зарегистрирован первым: он выполняется в дочерних процессах,
+// которые должны начинать без разобранных формул.
+int RunBenchmarks(const std::vector<std::string> &names, std::ostream &out);
@@ -1,23 +1,194 @@
 #include "cell.h"
 
+#include "profiler.h"
+#include "sheet.h"
+
 #include <iostream>
 #include <string>
-#include <optional>
 
-Cell::Cell(SheetInterface &sheet) :
+Cell::Cell(SheetInterface &sheet, Position pos, FormulaCache *formula_cache) :
     sheet_(sheet),
+    pos_(pos),
+    formula_cache_(formula_cache),
     value_holder_(std::make_unique<CellValueEmpty>()) {}
 
 Cell::~Cell() {}
 
 void Cell::Set(std::string text) {
   if (text.size() > 1 && text[0] == FORMULA_SIGN) {
-    value_holder_ = std::make_unique<CellValueFormula>(sheet_, text);
+    value_holder_ = std::make_unique<CellValueFormula>(sheet_, pos_, text, formula_cache_);
   } else {
     value_holder_ = std::make_unique<CellValueText>(text);
   }
 }
 
+const Sheet *Cell::CellValueFormula::AsSheet(const SheetInterface &sheet) {
+  return dynamic_cast<const Sheet *>(&sheet);
+}
+
+namespace {
+
+// Запоминает ячейки, которые прочитало вычисление. Области MATCH и VLOOKUP
+// не запоминаются: их изменения сбрасывают кэш всегда
+struct RecordingResolver {
+  const Sheet::ValueResolver &resolver;
+  std::vector<Position> &read;
+
+  double operator()(const Position *pos) const {
+    read.push_back(*pos);
+    return resolver(pos);
+  }
+
+  std::optional<int> Match(const Range &line, double key, LookupIndex::Match match) const {
+    return resolver.Match(line, key, match);
+  }
+};
+
+}  // namespace
+
+FormulaInterface::Value Cell::CellValueFormula::Compute(std::shared_ptr<const Matrix> *array) {
+  if (!IsValid()) {
+    return FormulaError(FormulaError::Category::Ref);
+  }
+  if (spill_blocked_) {
+    return FormulaError(FormulaError::Category::Spill);
+  }
+
+  RecalcProfiler::CellScope profile(pos_);
+  if (state_.load(std::memory_order_acquire) == READY) {
+    ++CellCacheStat::hit;
+    if (array != nullptr) {
+      *array = array_;
+    }
+    if (array_error_) {
+      return *array_error_;
+    }
+    return cached_;
+  }
+
+  ++CellCacheStat::missed;
+  profile.MarkEvaluated();
+
+  FormulaInterface::Value result;
+  const auto &ast = formula_->GetAST();
+  if (ast.IsArray() && sheet_fast_ != nullptr) {
+    // Элементы результата читают его из кэша, поэтому и ошибка кэшируется
+    std::shared_ptr<const Matrix> matrix;
+    Sheet::ValueResolver resolver(*sheet_fast_);
+    try {
+      matrix = std::make_shared<const Matrix>(ast.ExecuteArray([&resolver](const Position *pos) {
+        return resolver(pos);
+      }));
+      result = (*matrix)(0, 0);
+    } catch (const FormulaError &e) {
+      result = e;
+    }
+    auto expected = EMPTY;
+    if (state_.compare_exchange_strong(expected, COMPUTING, std::memory_order_acquire)) {
+      array_ = matrix;
+      if (matrix != nullptr) {
+        cached_ = std::get<double>(result);
+        array_error_.reset();
+      } else {
+        array_error_ = std::get<FormulaError>(result);
+      }
+      read_known_ = false;
+      state_.store(READY, std::memory_order_release);
+    }
+    if (array != nullptr) {
+      *array = std::move(matrix);
+    }
+    return result;
+  }
+  // Ссылки из невыбранных ветвей не читаются: их изменение не сбрасывает кэш
+  const bool track_reads = sheet_fast_ != nullptr && ast.HasBranches();
+  std::vector<Position> read;
+  if (sheet_fast_ != nullptr) {
+    Sheet::ValueResolver resolver(*sheet_fast_);
+    try {
+      if (track_reads) {
+        result = ast.Execute(RecordingResolver{resolver, read});
+      } else {
+        result = ast.Execute(resolver);
+      }
+    } catch (const FormulaError &e) {
+      result = e;
+    }
+  } else {
+    result = formula_->Evaluate(sheet_);
+  }
+
+  // Ошибки не кэшируем
+  auto expected = EMPTY;
+  if (std::holds_alternative<double>(result)
+      && state_.compare_exchange_strong(expected, COMPUTING, std::memory_order_acquire)) {
+    cached_ = std::get<double>(result);
+    if (track_reads) {
+      std::sort(read.begin(), read.end());
+      read.erase(std::unique(read.begin(), read.end()), read.end());
+      read_ = std::move(read);
+    }
+    read_known_ = track_reads;
+    state_.store(READY, std::memory_order_release);
+  }
+  return result;
+}
+
+ValueTag Cell::CellValueFormula::ReadValue(double &number, std::string_view & /* text */) {
+  return ToValueTag(Compute(), number);
+}
+
+FormulaInterface::Value Cell::CellValueFormula::GetArrayValue(int row, int col) {
+  std::shared_ptr<const Matrix> array;
+  auto result = Compute(&array);
+  if (std::holds_alternative<FormulaError>(result)) {
+    return result;
+  }
+  if (array == nullptr || row >= array->GetSize().rows || col >= array->GetSize().cols) {
+    throw std::logic_error("Array element is out of the result"s);
+  }
+  return (*array)(row, col);
+}
+
+ValueTag Cell::CellValueSpill::ReadValue(double &number, std::string_view & /* text */) {
+  return ToValueTag(anchor_.GetArrayValue(row_, col_), number);
+}
+
+ValueTag Cell::ToValueTag(const FormulaInterface::Value &value, double &number) {
+  if (auto result = std::get_if<double>(&value)) {
+    number = *result;
+    return ValueTag::NUMBER;
+  }
+  switch (std::get<FormulaError>(value).GetCategory()) {
+    case FormulaError::Category::Ref:
+      return ValueTag::REF_ERROR;
+    case FormulaError::Category::Value:
+      return ValueTag::VALUE_ERROR;
+    case FormulaError::Category::Div0:
+      return ValueTag::DIV0_ERROR;
+    case FormulaError::Category::NA:
+      return ValueTag::NA_ERROR;
+    case FormulaError::Category::Spill:
+      return ValueTag::SPILL_ERROR;
+  }
+  return ValueTag::VALUE_ERROR;
+}
+
+FormulaError ToFormulaError(ValueTag tag) {
+  switch (tag) {
+    case ValueTag::REF_ERROR:
+      return FormulaError::Category::Ref;
+    case ValueTag::DIV0_ERROR:
+      return FormulaError::Category::Div0;
+    case ValueTag::NA_ERROR:
+      return FormulaError::Category::NA;
+    case ValueTag::SPILL_ERROR:
+      return FormulaError::Category::Spill;
+    default:
+      return FormulaError::Category::Value;
+  }
+}
+
 //void Cell::Clear() {
 //}
 
@@ -25,6 +196,10 @@ Cell::Value Cell::GetValue() const {
   return value_holder_->GetValue();
 }
 
+double Cell::GetNumber() const {
+  return value_holder_->GetNumber();
+}
+
 std::string Cell::GetText() const {
   return value_holder_->GetText();
 }
@@ -36,23 +211,81 @@ std::vector<Position> Cell::GetReferencedCells() const {
   return value_holder_->GetReferencedCells();
 }
 
+std::vector<Range> Cell::GetReferencedRanges() const {
+  return value_holder_->GetReferencedRanges();
+}
+
 bool Cell::IsFormula() const {
   return value_holder_->GetType() == FORMULA;
 }
 
 bool Cell::IsValid() const {
-  for (auto const &pos: Cell::GetReferencedCells()) {
-    if (pos == Position::NONE) {
-      return false;
-    }
-  }
-  return true;
+  return value_holder_->IsValid();
+}
+
+bool Cell::IsArray() const {
+  auto formula = GetFormula();
+  return formula != nullptr && formula->GetAST().IsArray();
+}
+
+Size Cell::GetArraySize() const {
+  return GetFormula()->GetAST().GetArraySize();
+}
+
+FormulaInterface::Value Cell::GetArrayValue(int row, int col) const {
+  return value_holder_->GetArrayValue(row, col);
+}
+
+void Cell::SetSpillBlocked(bool blocked) {
+  value_holder_->SetSpillBlocked(blocked);
+}
+
+bool Cell::IsSpillBlocked() const {
+  return value_holder_->IsSpillBlocked();
+}
+
+void Cell::SetSpill(const Cell &anchor, Position anchor_pos) {
+  value_holder_ = std::make_unique<CellValueSpill>(anchor, anchor_pos, pos_.row - anchor_pos.row,
+                                                   pos_.col - anchor_pos.col);
+}
+
+bool Cell::IsSpill() const {
+  return value_holder_->GetType() == SPILL;
+}
+
+Position Cell::GetSpillAnchor() const {
+  return value_holder_->GetSpillAnchor();
 }
 
 void Cell::InvalidateCache() const {
   value_holder_->InvalidateCache();
 }
 
+bool Cell::IsCached() const {
+  return value_holder_->IsCached();
+}
+
+bool Cell::IsIndependentOf(Position pos) const {
+  return value_holder_->IsIndependentOf(pos);
+}
+
+ValueTag Cell::ReadValue(double &number, std::string_view &text) const {
+  return value_holder_->ReadValue(number, text);
+}
+
+std::shared_ptr<FormulaInterface> Cell::GetFormula() const {
+  return value_holder_->GetFormula();
+}
+
+void Cell::Relocate(Position pos) {
+  pos_ = pos;
+  value_holder_->Relocate(pos);
+}
+
+void Cell::ReplaceFormula(std::shared_ptr<FormulaInterface> formula) {
+  value_holder_->ReplaceFormula(std::move(formula));
+}
+
 std::ostream &operator<<(std::ostream &output, const CellInterface::Value &value) {
   std::visit(
       [&](const auto &x) {
@@ -2,27 +2,89 @@
 
 #include "common.h"
 #include "formula.h"
-#include <optional>
+#include "formula_cache.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <utility>
 
+class Sheet;
+
 enum CellType {
   EMPTY,
   STRING,
-  FORMULA
+  FORMULA,
+  // Элемент результата формулы-массива вне её ячейки
+  SPILL
 };
 
 using namespace std::literals;
 
+// Тип значения ячейки при чтении диапазона (Sheet::GetValues)
+enum class ValueTag : unsigned char {
+  EMPTY,
+  NUMBER,
+  TEXT,
+  REF_ERROR,
+  VALUE_ERROR,
+  DIV0_ERROR,
+  NA_ERROR,
+  SPILL_ERROR,
+};
+
+// Ошибка формулы, которой соответствует тег ошибки
+FormulaError ToFormulaError(ValueTag tag);
+
+// Счётчик, который увеличивают многие потоки одновременно. Каждый поток пишет
+// в свою кэш-линию, чтобы читатели не конкурировали за одну; значение - сумма
+// всех полос
+class StripedCounter {
+ public:
+  StripedCounter &operator++() {
+    stripes_[StripeIndex()].value.fetch_add(1, std::memory_order_relaxed);
+    return *this;
+  }
+
+  operator size_t() const {
+    size_t sum = 0;
+    for (const auto &stripe : stripes_) {
+      sum += stripe.value.load(std::memory_order_relaxed);
+    }
+    return sum;
+  }
+
+  void Reset() {
+    for (auto &stripe : stripes_) {
+      stripe.value.store(0, std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  static constexpr size_t STRIPES = 16;
+
+  struct alignas(64) Stripe {
+    std::atomic<size_t> value{0};
+  };
+
+  std::array<Stripe, STRIPES> stripes_;
+
+  static size_t StripeIndex() {
+    static std::atomic<size_t> next{0};
+    thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed) % STRIPES;
+    return index;
+  }
+};
+
 struct CellCacheStat {
  public:
-  inline static size_t hit = 0;
-  inline static size_t missed = 0;
-  inline static size_t invalidate = 0;
+  inline static StripedCounter hit;
+  inline static StripedCounter missed;
+  inline static StripedCounter invalidate;
 
   static void Reset() {
-    hit = 0;
-    missed = 0;
-    invalidate = 0;
+    hit.Reset();
+    missed.Reset();
+    invalidate.Reset();
   }
 };
 
@@ -30,17 +92,52 @@ class Cell : public CellInterface {
  private:
   class CellValue {
    public:
+    virtual ~CellValue() = default;
     virtual Value GetValue() = 0;
+    // Значение для ссылающейся формулы: ошибка передаётся исключением
+    // FormulaError
+    virtual double GetNumber() = 0;
     virtual std::string GetText() = 0;
     virtual CellType GetType() = 0;
+    // Значение без копирования текста: text указывает в ячейку
+    virtual ValueTag ReadValue(double &number, std::string_view &text) = 0;
     virtual void InvalidateCache() {
     }
+    virtual bool IsCached() {
+      return true;
+    }
+    virtual bool IsIndependentOf(Position /* pos */) {
+      return false;
+    }
     virtual bool IsValid() {
       return true;
     }
     virtual std::vector<Position> GetReferencedCells() {
       throw std::logic_error("Not implemented"s);
     }
+    virtual std::vector<Range> GetReferencedRanges() {
+      return {};
+    }
+    virtual std::shared_ptr<FormulaInterface> GetFormula() {
+      return nullptr;
+    }
+    virtual void Relocate(Position /* pos */) {
+    }
+    virtual void ReplaceFormula(std::shared_ptr<FormulaInterface> /* formula */) {
+      throw std::logic_error("Not a formula"s);
+    }
+    virtual FormulaInterface::Value GetArrayValue(int /* row */, int /* col */) {
+      throw std::logic_error("Not an array formula"s);
+    }
+    virtual void SetSpillBlocked(bool /* blocked */) {
+      throw std::logic_error("Not an array formula"s);
+    }
+    virtual bool IsSpillBlocked() {
+      return false;
+    }
+    virtual Position GetSpillAnchor() {
+      return Position::NONE;
+    }
   };
 
   class CellValueEmpty : public CellValue {
@@ -48,6 +145,10 @@ class Cell : public CellInterface {
       throw std::logic_error("Access to empty cell"s);
     }
 
+    double GetNumber() override {
+      return 0;
+    }
+
     std::string GetText() override {
       throw std::logic_error("Access to empty cell"s);
     }
@@ -56,18 +157,27 @@ class Cell : public CellInterface {
       return CellType::EMPTY;
     }
 
+    ValueTag ReadValue(double & /* number */, std::string_view & /* text */) override {
+      return ValueTag::EMPTY;
+    }
+
   };
 
   class CellValueText : public CellValue {
    public:
-    explicit CellValueText(std::string raw_value) : raw_value_(std::move(raw_value)) {}
+    explicit CellValueText(std::string raw_value)
+        : raw_value_(std::move(raw_value)),
+          is_number_(ParseCellNumber(GetVisibleText(), number_)) {}
 
     Value GetValue() override {
-      if (raw_value_[0] == ESCAPE_SIGN) {
-        return raw_value_.substr(1);
-      } else {
-        return raw_value_;
+      return std::string(GetVisibleText());
+    }
+
+    double GetNumber() override {
+      if (!is_number_) {
+        throw FormulaError(FormulaError::Category::Value);
       }
+      return number_;
     }
 
     std::string GetText() override {
@@ -78,104 +188,290 @@ class Cell : public CellInterface {
       return CellType::STRING;
     }
 
+    ValueTag ReadValue(double & /* number */, std::string_view &text) override {
+      text = GetVisibleText();
+      return ValueTag::TEXT;
+    }
+
    protected:
     std::string raw_value_;
+
+   private:
+    // Число разбирается один раз, а не при каждом чтении ссылающейся формулой
+    double number_ = 0;
+    bool is_number_;
+
+    std::string_view GetVisibleText() const {
+      std::string_view text = raw_value_;
+      if (!text.empty() && text[0] == ESCAPE_SIGN) {
+        text.remove_prefix(1);
+      }
+      return text;
+    }
   };
 
-  class CellValueFormula : public CellValueText {
+  class CellValueFormula : public CellValue {
    public:
-    explicit CellValueFormula(SheetInterface &sheet, const std::string &raw_value)
-        : CellValueText(raw_value),
-          sheet_(sheet),
-          referenced_cells_(ValidateExpressionAndInitForwardList(raw_value)) {
-    }
-
-    std::vector<Position> ValidateExpressionAndInitForwardList(std::string expr) {
-      // Попытка разобрать формулу
-      try {
-        std::unique_ptr<FormulaInterface> formula = ParseFormula(expr.substr(1));
-        // Already sorted
-        return formula->GetReferencedCells();
-      } catch (...) {
-        throw FormulaException("Unable to parse formula");
-      }
+    explicit CellValueFormula(SheetInterface &sheet, Position pos, const std::string &raw_value,
+                              FormulaCache *formula_cache)
+        : sheet_(sheet),
+          pos_(pos),
+          sheet_fast_(AsSheet(sheet)),
+          formula_(Compile(raw_value, formula_cache)),
+          valid_(CheckReferences(*formula_)) {
     }
 
-    Value GetValue() override {
-      if (!IsValid()) {
-        return FormulaError(FormulaError::Category::Ref);
+    // Таблица, из хранилища которой ссылки читаются напрямую, или nullptr
+    static const Sheet *AsSheet(const SheetInterface &sheet);
+
+    static std::shared_ptr<FormulaInterface> Compile(const std::string &raw_value,
+                                                           FormulaCache *formula_cache) {
+      auto expression = std::string_view(raw_value).substr(1);
+      if (formula_cache != nullptr) {
+        return formula_cache->Get(std::string(expression));
+      }
+      // Разбор без исключений: на импорте некорректных формул много
+      auto result = TryParseFormula(expression);
+      if (auto error = std::get_if<FormulaParseError>(&result)) {
+        throw FormulaException(error->message);
       }
+      return std::get<std::unique_ptr<FormulaInterface>>(std::move(result));
+    }
 
-      if (cached_.has_value()) {
-        ++CellCacheStat::hit;
-      } else {
-        ++CellCacheStat::missed;
-
-        auto result = ParseFormula(raw_value_.substr(1))->Evaluate(sheet_);
-        // Ошибки не кэшируем
-        if (std::holds_alternative<FormulaError>(result)) {
-          return std::get<FormulaError>(result);
-        } else {
-          cached_ = std::get<double>(result);
+    static bool CheckReferences(const FormulaInterface &formula) {
+      for (auto const &pos : formula.GetReferencedCells()) {
+        if (pos == Position::NONE) {
+          return false;
         }
       }
+      for (auto const &range : formula.GetAST().GetRanges()) {
+        if (!range.IsValid()) {
+          return false;
+        }
+      }
+      return true;
+    }
 
-      return cached_.value();
+    Value GetValue() override {
+      auto result = Compute();
+      if (auto error = std::get_if<FormulaError>(&result)) {
+        return *error;
+      }
+      return std::get<double>(result);
+    }
+
+    double GetNumber() override {
+      auto result = Compute();
+      if (auto error = std::get_if<FormulaError>(&result)) {
+        throw *error;
+      }
+      return std::get<double>(result);
     }
 
     std::string GetText() override {
       // Очищенная формула
-      std::stringstream ss;
-      ss << '=' << ParseFormula(raw_value_.substr(1))->GetExpression();
-      return ss.str();
+      return '=' + formula_->GetExpression();
     }
 
     CellType GetType() override {
       return CellType::FORMULA;
     }
 
+    ValueTag ReadValue(double &number, std::string_view & /* text */) override;
+
+    FormulaInterface::Value GetArrayValue(int row, int col) override;
+
+    void SetSpillBlocked(bool blocked) override {
+      spill_blocked_ = blocked;
+    }
+
+    bool IsSpillBlocked() override {
+      return spill_blocked_;
+    }
+
     bool IsValid() override {
-      for (auto const &pos : referenced_cells_) {
-        if (pos == Position::NONE) {
-          return false;
-        }
-      }
-      return true;
+      return valid_;
     }
 
     std::vector<Position> GetReferencedCells() override {
-      return referenced_cells_;
+      // Already sorted
+      return formula_->GetReferencedCells();
+    }
+
+    std::vector<Range> GetReferencedRanges() override {
+      return formula_->GetReferencedRanges();
     }
 
     void InvalidateCache() override {
       ++CellCacheStat::invalidate;
-      cached_.reset();
+      state_.store(EMPTY, std::memory_order_relaxed);
+    }
+
+    bool IsCached() override {
+      return state_.load(std::memory_order_acquire) == READY;
+    }
+
+    bool IsIndependentOf(Position pos) override {
+      return state_.load(std::memory_order_acquire) == READY && read_known_
+          && !std::binary_search(read_.begin(), read_.end(), pos);
+    }
+
+    std::shared_ptr<FormulaInterface> GetFormula() override {
+      return formula_;
+    }
+
+    void Relocate(Position pos) override {
+      pos_ = pos;
+      valid_ = CheckReferences(*formula_);
+      read_known_ = false;
+    }
+
+    void ReplaceFormula(std::shared_ptr<FormulaInterface> formula) override {
+      formula_ = std::move(formula);
+      valid_ = CheckReferences(*formula_);
+      read_known_ = false;
     }
 
    private:
     SheetInterface &sheet_;
-    std::vector<Position> referenced_cells_;
-    std::optional<double> cached_;
+    Position pos_;
+    const Sheet *sheet_fast_;
+    // Может разделяться несколькими ячейками через FormulaCache
+    std::shared_ptr<FormulaInterface> formula_;
+    bool valid_;
+
+    // Значение читают многие потоки без блокировок: первый вычисливший его
+    // поток публикует результат, остальные вычисляют то же самое и отбрасывают.
+    // Сбрасывается только писателем, когда читателей нет
+    enum State : char {
+      EMPTY,
+      COMPUTING,
+      READY,
+    };
+    std::atomic<State> state_{EMPTY};
+    double cached_ = 0;
+    // Ссылки, прочитанные вычислением cached_, по возрастанию. Запоминаются
+    // только для формул с ветвлениями; иначе считается, что прочитаны все
+    std::vector<Position> read_;
+    bool read_known_ = false;
+    // Результат формулы-массива. Ошибка массива тоже кэшируется: иначе её
+    // заново вычислял бы каждый элемент области
+    std::shared_ptr<const Matrix> array_;
+    std::optional<FormulaError> array_error_;
+    // Область результата занята: значение #SPILL!. Меняет только лист
+    bool spill_blocked_ = false;
+
+    // array - результат формулы-массива, если нужен
+    FormulaInterface::Value Compute(std::shared_ptr<const Matrix> *array = nullptr);
   };
 
+  // Ячейка области, в которую выводится результат формулы-массива. Значение
+  // читается из кэша формулы; формула связана с ячейкой обратной ссылкой, как
+  // с зависимой
+  class CellValueSpill : public CellValue {
+   public:
+    CellValueSpill(const Cell &anchor, Position anchor_pos, int row, int col)
+        : anchor_(anchor), anchor_pos_(anchor_pos), row_(row), col_(col) {
+    }
+
+    Value GetValue() override {
+      auto result = anchor_.GetArrayValue(row_, col_);
+      if (auto error = std::get_if<FormulaError>(&result)) {
+        return *error;
+      }
+      return std::get<double>(result);
+    }
+
+    double GetNumber() override {
+      auto result = anchor_.GetArrayValue(row_, col_);
+      if (auto error = std::get_if<FormulaError>(&result)) {
+        throw *error;
+      }
+      return std::get<double>(result);
+    }
+
+    std::string GetText() override {
+      return {};
+    }
+
+    CellType GetType() override {
+      return CellType::SPILL;
+    }
+
+    ValueTag ReadValue(double &number, std::string_view & /* text */) override;
+
+    bool IsCached() override {
+      return anchor_.IsCached();
+    }
+
+    Position GetSpillAnchor() override {
+      return anchor_pos_;
+    }
+
+   private:
+    const Cell &anchor_;
+    Position anchor_pos_;
+    int row_;
+    int col_;
+  };
+
+  static ValueTag ToValueTag(const FormulaInterface::Value &value, double &number);
+
  public:
-  Cell(SheetInterface &sheet);
+  // Без formula_cache каждая формула разбирается и хранится отдельно
+  explicit Cell(SheetInterface &sheet, Position pos = Position::NONE,
+                FormulaCache *formula_cache = nullptr);
   ~Cell();
 
   void Set(std::string text);
   // void Clear();
 
   Value GetValue() const override;
+  // Значение для вычисления ссылающейся формулы без копирования текста
+  double GetNumber() const;
   std::string GetText() const override;
   std::vector<Position> GetReferencedCells() const override;
+  // Области формулы
+  std::vector<Range> GetReferencedRanges() const;
 
   void InvalidateCache() const;
+  // Значение формулы уже вычислено; ошибки кэшируются только у формул-массивов
+  bool IsCached() const;
+  // Значение формулы вычислено без чтения ячейки pos: её изменение его не
+  // меняет. Для формул без ветвлений всегда false
+  bool IsIndependentOf(Position pos) const;
+  // Значение без копирования текста. Текст действителен до изменения ячейки
+  ValueTag ReadValue(double &number, std::string_view &text) const;
+
+  // Формула ячейки или nullptr
+  std::shared_ptr<FormulaInterface> GetFormula() const;
+  // Вызывается после переноса ячейки или сдвига ссылок её формулы
+  void Relocate(Position pos);
+  // Формула заменена сдвинутой копией с тем же значением
+  void ReplaceFormula(std::shared_ptr<FormulaInterface> formula);
 
   bool IsFormula() const;
   bool IsValid() const;
 
+  // Формула-массив и размер её результата
+  bool IsArray() const;
+  Size GetArraySize() const;
+  // Элемент результата формулы-массива
+  FormulaInterface::Value GetArrayValue(int row, int col) const;
+  // Область результата занята: формула-массив даёт #SPILL!
+  void SetSpillBlocked(bool blocked);
+  bool IsSpillBlocked() const;
+
+  // Делает ячейку элементом результата формулы-массива anchor в anchor_pos
+  void SetSpill(const Cell &anchor, Position anchor_pos);
+  bool IsSpill() const;
+  // Позиция формулы-массива для ячейки её результата, иначе Position::NONE
+  Position GetSpillAnchor() const;
+
  private:
   SheetInterface &sheet_;
+  Position pos_;
+  FormulaCache *formula_cache_;
   std::unique_ptr<CellValue> value_holder_;
 };
 
@@ -0,0 +1,127 @@
+#include "cold_storage.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std::literals;
+
+#ifndef _WIN32
+
+namespace {
+
+[[noreturn]] void ThrowSystemError(const std::string &what) {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+
+}  // namespace
+
+ColdStorage::ColdStorage(std::string path) : path_(std::move(path)) {
+  fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd_ < 0) {
+    ThrowSystemError("open "s + path_);
+  }
+  try {
+    Map(MIN_CAPACITY);
+  } catch (...) {
+    ::close(fd_);
+    ::unlink(path_.c_str());
+    throw;
+  }
+}
+
+ColdStorage::~ColdStorage() {
+  if (data_ != nullptr) {
+    ::munmap(data_, capacity_);
+  }
+  ::close(fd_);
+  ::unlink(path_.c_str());
+}
+
+size_t ColdStorage::RoundUp(size_t size) {
+  size_t result = 64;
+  while (result < size) {
+    result *= 2;
+  }
+  return result;
+}
+
+void ColdStorage::Map(size_t capacity) {
+  if (::ftruncate(fd_, static_cast<off_t>(capacity)) != 0) {
+    ThrowSystemError("ftruncate "s + path_);
+  }
+  // Отображение заново: участки файла остаются на своих смещениях
+  if (data_ != nullptr) {
+    ::munmap(data_, capacity_);
+    data_ = nullptr;
+  }
+  void *data = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (data == MAP_FAILED) {
+    ThrowSystemError("mmap "s + path_);
+  }
+  data_ = static_cast<char *>(data);
+  capacity_ = capacity;
+}
+
+ColdStorage::Block ColdStorage::Write(std::string_view data) {
+  const size_t size = RoundUp(data.size());
+  size_t offset;
+  auto it = free_.find(size);
+  if (it != free_.end() && !it->second.empty()) {
+    offset = it->second.back();
+    it->second.pop_back();
+  } else {
+    if (end_ + size > capacity_) {
+      Map(std::max(capacity_ * 2, end_ + size));
+    }
+    offset = end_;
+    end_ += size;
+  }
+  std::memcpy(data_ + offset, data.data(), data.size());
+  return {offset, data.size()};
+}
+
+std::string_view ColdStorage::Read(const Block &block) const {
+  return {data_ + block.offset, block.size};
+}
+
+void ColdStorage::Free(const Block &block) {
+  free_[RoundUp(block.size)].push_back(block.offset);
+}
+
+#else
+
+// Отображения файлов POSIX нет: режим вытеснения недоступен
+ColdStorage::ColdStorage(std::string path) : path_(std::move(path)) {
+  throw std::system_error(std::make_error_code(std::errc::function_not_supported),
+                          "Out-of-core storage "s + path_);
+}
+
+ColdStorage::~ColdStorage() = default;
+
+size_t ColdStorage::RoundUp(size_t size) {
+  return size;
+}
+
+void ColdStorage::Map(size_t /* capacity */) {
+}
+
+ColdStorage::Block ColdStorage::Write(std::string_view data) {
+  return {0, data.size()};
+}
+
+std::string_view ColdStorage::Read(const Block & /* block */) const {
+  return {};
+}
+
+void ColdStorage::Free(const Block & /* block */) {
+}
+
+#endif
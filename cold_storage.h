@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Файл, отображённый в память, для блоков вытесненных ячеек листа. Блок
+// занимает участок размера степени двойки: освобождённые участки
+// переиспользуются блоками того же класса, поэтому файл не растёт при
+// повторном вытеснении тех же данных. Файл удаляется вместе с объектом.
+// Ошибки системных вызовов - исключение std::system_error. Только POSIX: в
+// сборке для Windows конструктор бросает std::system_error.
+class ColdStorage {
+ public:
+  struct Block {
+    size_t offset = 0;
+    size_t size = 0;
+  };
+
+  explicit ColdStorage(std::string path);
+  ColdStorage(const ColdStorage &) = delete;
+  ColdStorage &operator=(const ColdStorage &) = delete;
+  ~ColdStorage();
+
+  Block Write(std::string_view data);
+  // Действителен до следующего Write
+  std::string_view Read(const Block &block) const;
+  void Free(const Block &block);
+
+  // Размер файла
+  size_t GetCapacity() const {
+    return capacity_;
+  }
+
+ private:
+  static constexpr size_t MIN_CAPACITY = size_t{1} << 20;
+
+  std::string path_;
+  int fd_ = -1;
+  char *data_ = nullptr;
+  size_t capacity_ = 0;
+  // Конец занятой части файла
+  size_t end_ = 0;
+  // Свободные участки по размеру
+  std::map<size_t, std::vector<size_t>> free_;
+
+  static size_t RoundUp(size_t size);
+  void Map(size_t capacity);
+};
@@ -39,6 +39,54 @@ struct Size {
   bool operator==(Size rhs) const;
 };
 
+// Прямоугольная область ячеек от first до last включительно: A1:B10
+struct Range {
+  Position first;
+  Position last;
+
+  bool operator==(const Range &rhs) const;
+  bool operator<(const Range &rhs) const;
+
+  bool IsValid() const;
+  bool Contains(Position pos) const;
+  bool Intersects(const Range &rhs) const;
+  Size GetSize() const;
+  std::string ToString() const;
+};
+
+// Перенос позиций при вставке (count > 0) или удалении (count < 0) строк или
+// столбцов начиная с first
+struct PositionShift {
+  enum class Axis {
+    Rows,
+    Cols,
+  };
+
+  Axis axis = Axis::Rows;
+  int first = 0;
+  int count = 0;
+
+  // Затрагивает ли сдвиг позицию
+  bool Affects(Position pos) const;
+  // Новая позиция; Position::NONE, если ячейка удалена или вышла за пределы
+  // таблицы
+  Position Apply(Position pos) const;
+  // Область сдвигается вместе с ячейками: вставка внутри неё расширяет её,
+  // удаление части строк или столбцов сужает. {NONE, NONE}, если область
+  // удалена целиком
+  Range Apply(Range range) const;
+};
+
+// Перестановка строк области при сортировке: ячейка строки range.first.row + i
+// переходит в строку range.first.row + rows[i] того же столбца
+struct RowPermutation {
+  Range range;
+  std::vector<int> rows;
+
+  bool Affects(Position pos) const;
+  Position Apply(Position pos) const;
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
  public:
@@ -46,6 +94,8 @@ class FormulaError {
     Ref,    // ссылка на ячейку с некорректной позицией
     Value,  // ячейка не может быть трактована как число
     Div0,  // в результате вычисления возникло деление на ноль
+    NA,    // MATCH или VLOOKUP не нашли значение
+    Spill,  // область результата формулы-массива занята или вне таблицы
   };
 
   FormulaError(Category category);
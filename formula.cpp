@@ -5,6 +5,7 @@
 #include <algorithm>
 #include <sstream>
 #include <memory>
+#include <thread>
 
 using namespace std::literals;
 
@@ -21,7 +22,10 @@ class Formula : public FormulaInterface {
  public:
   // Реализуйте следующие методы:
   explicit Formula(std::string expression)
-      : ast_(ParseFormulaAST(expression)) {}
+      : ast_(ParseFormulaAST(expression)), expression_(Print(ast_)) {}
+
+  explicit Formula(FormulaAST ast)
+      : ast_(std::move(ast)), expression_(Print(ast_)) {}
 
   Value Evaluate(const SheetInterface &sheet) const override {
     try {
@@ -32,22 +36,56 @@ class Formula : public FormulaInterface {
   }
 
   std::string GetExpression() const override {
-    std::stringstream ss;
-    ast_.PrintFormula(ss);
-    return ss.str();
+    return expression_;
   }
 
   std::vector<Position> GetReferencedCells() const override {
     std::vector<Position> result;
-    // Already sorted
+    // Already sorted; ячейка может встречаться в выражении несколько раз:
+    // =C3 + B2 / C3
     for (auto const &pos : ast_.GetCells()) {
-      result.push_back(pos);
+      if (result.empty() || !(result.back() == pos)) {
+        result.push_back(pos);
+      }
     }
     return result;
   };
 
+  std::vector<Range> GetReferencedRanges() const override {
+    std::vector<Range> result(ast_.GetRanges().begin(), ast_.GetRanges().end());
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+  }
+
+  const FormulaAST &GetAST() const override {
+    return ast_;
+  }
+
+  void ShiftReferences(const PositionShift &shift) override {
+    ast_.ShiftCells(shift);
+    expression_ = Print(ast_);
+  }
+
+  void PermuteReferences(const RowPermutation &permutation) override {
+    ast_.PermuteCells(permutation);
+    expression_ = Print(ast_);
+  }
+
+  std::unique_ptr<FormulaInterface> Clone() const override {
+    return std::make_unique<Formula>(FormulaAST(ast_));
+  }
+
  private:
   FormulaAST ast_;
+  // Текст печатается один раз: его читают GetText, хеши и кэш формул
+  std::string expression_;
+
+  static std::string Print(const FormulaAST &ast) {
+    std::stringstream ss;
+    ast.PrintFormula(ss);
+    return ss.str();
+  }
 };
 
 }  // namespace
@@ -56,3 +94,45 @@ class Formula : public FormulaInterface {
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
   return std::make_unique<Formula>(std::move(expression));
 }
+
+FormulaParseResult TryParseFormula(std::string_view expression) {
+  auto result = TryParseFormulaAST(expression);
+  if (auto error = std::get_if<FormulaParseError>(&result)) {
+    return std::move(*error);
+  }
+  return std::make_unique<Formula>(std::get<FormulaAST>(std::move(result)));
+}
+
+std::vector<std::optional<FormulaParseError>> ValidateFormulas(
+    const std::vector<std::string> &expressions, size_t threads) {
+  std::vector<std::optional<FormulaParseError>> result(expressions.size());
+
+  auto validate = [&expressions, &result](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      auto parsed = TryParseFormulaAST(expressions[i]);
+      if (auto error = std::get_if<FormulaParseError>(&parsed)) {
+        result[i] = std::move(*error);
+      }
+    }
+  };
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = std::min(threads, std::max<size_t>(1, expressions.size()));
+  if (threads == 1) {
+    validate(0, expressions.size());
+    return result;
+  }
+
+  // Каждый поток переиспользует свой лексер и парсер
+  std::vector<std::thread> workers;
+  size_t chunk = (expressions.size() + threads - 1) / threads;
+  for (size_t begin = 0; begin < expressions.size(); begin += chunk) {
+    workers.emplace_back(validate, begin, std::min(begin + chunk, expressions.size()));
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  return result;
+}
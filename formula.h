@@ -5,6 +5,8 @@
 #include "FormulaAST.h"
 
 #include <memory>
+#include <optional>
+#include <string_view>
 #include <vector>
 #include <variant>
 
@@ -13,6 +15,10 @@
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Сравнения и функции IF, AND, OR, MATCH, VLOOKUP: IF(A1>0,B1,0),
+//   VLOOKUP(A1,C1:E100,2,0)
+// * Формулы-массивы из областей, MMULT и TRANSPOSE: A1:A10*B1:B10+1,
+//   MMULT(A1:B2,C1:D2); результат выводится в область листа
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -38,8 +44,34 @@ class FormulaInterface {
   // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
   // ячеек.
   virtual std::vector<Position> GetReferencedCells() const = 0;
+
+  // Области, которые читают MATCH, VLOOKUP и формулы-массивы, по возрастанию
+  // без повторов. Их ячейки в GetReferencedCells() не входят
+  virtual std::vector<Range> GetReferencedRanges() const = 0;
+
+  // Скомпилированное выражение для вычисления со статическим резолвером
+  virtual const FormulaAST &GetAST() const = 0;
+
+  // Переносит ссылки при вставке или удалении строк и столбцов без повторного
+  // разбора. Ссылки на удалённые ячейки становятся Position::NONE (#REF!).
+  virtual void ShiftReferences(const PositionShift &shift) = 0;
+  // Переносит ссылки на ячейки вслед за строками при сортировке. Области не
+  // меняются
+  virtual void PermuteReferences(const RowPermutation &permutation) = 0;
+
+  // Независимая копия формулы без повторного разбора
+  virtual std::unique_ptr<FormulaInterface> Clone() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// То же без исключений: либо формула, либо описание ошибки с позицией.
+using FormulaParseResult = std::variant<std::unique_ptr<FormulaInterface>, FormulaParseError>;
+FormulaParseResult TryParseFormula(std::string_view expression);
+
+// Проверяет набор выражений, не бросая исключений. Для корректной формулы
+// результат пуст. threads - число потоков, 0 - по числу ядер.
+std::vector<std::optional<FormulaParseError>> ValidateFormulas(
+    const std::vector<std::string> &expressions, size_t threads = 1);
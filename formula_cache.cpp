@@ -0,0 +1,198 @@
+#include "formula_cache.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace {
+
+// Меньшие списки формул переписываются в одном потоке
+constexpr size_t MIN_CHUNK_FORMULAS = 4096;
+
+}  // namespace
+
+FormulaCache::FormulaCache() : state_(std::make_shared<State>()) {}
+
+std::shared_ptr<FormulaInterface> FormulaCache::Get(const std::string &expression) {
+  auto &state = *state_;
+  {
+    std::lock_guard guard(state.mutex);
+    EvictReleased();
+
+    auto alias = state.aliases.find(expression);
+    if (alias != state.aliases.end()) {
+      if (auto formula = state.formulas.at(alias->second).formula.lock()) {
+        ++state.stats.hits;
+        return formula;
+      }
+    }
+    ++state.stats.misses;
+  }
+
+  // Разбор без блокировки: другие потоки тем временем могут добавить ту же
+  // формулу, тогда разобранная копия отбрасывается
+  auto result = TryParseFormula(expression);
+  if (auto error = std::get_if<FormulaParseError>(&result)) {
+    throw FormulaException(error->message);
+  }
+  std::unique_ptr<FormulaInterface> parsed = std::get<0>(std::move(result));
+  auto canonical = parsed->GetExpression();
+
+  std::lock_guard guard(state.mutex);
+  auto &entry = state.formulas[canonical];
+  auto formula = entry.formula.lock();
+  if (formula == nullptr) {
+    formula = std::shared_ptr<FormulaInterface>(parsed.release(), Deleter(state_, canonical));
+    entry.formula = formula;
+  }
+  if (state.aliases.emplace(expression, canonical).second) {
+    entry.aliases.push_back(expression);
+  }
+  return formula;
+}
+
+std::vector<std::shared_ptr<FormulaInterface>> FormulaCache::ShiftReferences(
+    const std::vector<std::shared_ptr<FormulaInterface>> &formulas, const PositionShift &shift,
+    bool copy) {
+  return Rewrite(formulas, copy, [&shift](FormulaInterface &formula) {
+    formula.ShiftReferences(shift);
+  });
+}
+
+std::vector<std::shared_ptr<FormulaInterface>> FormulaCache::PermuteReferences(
+    const std::vector<std::shared_ptr<FormulaInterface>> &formulas, const RowPermutation &permutation,
+    bool copy) {
+  return Rewrite(formulas, copy, [&permutation](FormulaInterface &formula) {
+    formula.PermuteReferences(permutation);
+  });
+}
+
+std::vector<std::shared_ptr<FormulaInterface>> FormulaCache::Rewrite(
+    const std::vector<std::shared_ptr<FormulaInterface>> &formulas, bool copy,
+    const std::function<void(FormulaInterface &)> &rewrite) {
+  auto &state = *state_;
+  std::lock_guard guard(state.mutex);
+  EvictReleased();
+
+  // Сначала все старые записи удаляются: иначе новое выражение одной формулы
+  // может временно совпасть со старым выражением другой. Узлы записей
+  // сохраняются и вставляются под новыми выражениями без выделения памяти
+  std::vector<bool> cached(formulas.size(), false);
+  std::vector<decltype(state.formulas)::node_type> nodes(formulas.size());
+  for (size_t i = 0; i < formulas.size(); ++i) {
+    // Выражение формулы из кэша хранится в её удалителе
+    auto deleter = std::get_deleter<Deleter>(formulas[i]);
+    if (deleter == nullptr) {
+      continue;
+    }
+    auto it = state.formulas.find(deleter->GetCanonical());
+    if (it == state.formulas.end() || it->second.formula.lock() != formulas[i]) {
+      continue;
+    }
+    for (const auto &alias : it->second.aliases) {
+      state.aliases.erase(alias);
+    }
+    nodes[i] = state.formulas.extract(it);
+    nodes[i].mapped() = {};
+    cached[i] = true;
+  }
+
+  // Формулы различны и переписываются независимо: большой список делится
+  // между потоками вместе с печатью новых выражений, а записи кэша
+  // переносятся после этого под блокировкой
+  std::vector<std::shared_ptr<FormulaInterface>> result(formulas.size());
+  std::vector<std::string> canonicals(formulas.size());
+  auto rewrite_part = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      if (!copy) {
+        rewrite(*formulas[i]);
+        result[i] = formulas[i];
+      } else {
+        auto clone = formulas[i]->Clone();
+        rewrite(*clone);
+        if (cached[i]) {
+          result[i] = std::shared_ptr<FormulaInterface>(clone.release(), Deleter(state_, {}));
+        } else {
+          result[i] = std::move(clone);
+        }
+      }
+      if (cached[i]) {
+        canonicals[i] = result[i]->GetExpression();
+      }
+    }
+  };
+  const size_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                          std::max<size_t>(1, formulas.size() / MIN_CHUNK_FORMULAS));
+  if (threads == 1) {
+    rewrite_part(0, formulas.size());
+  } else {
+    std::vector<std::thread> workers;
+    const size_t chunk = (formulas.size() + threads - 1) / threads;
+    for (size_t begin = 0; begin < formulas.size(); begin += chunk) {
+      workers.emplace_back(rewrite_part, begin, std::min(begin + chunk, formulas.size()));
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  for (size_t i = 0; i < formulas.size(); ++i) {
+    if (!cached[i]) {
+      continue;
+    }
+    auto canonical = std::move(canonicals[i]);
+    auto found = state.formulas.find(canonical);
+    if (found == state.formulas.end()) {
+      nodes[i].key() = canonical;
+      found = state.formulas.insert(std::move(nodes[i])).position;
+    }
+    auto &entry = found->second;
+    if (entry.formula.expired()) {
+      entry.formula = result[i];
+      if (state.aliases.emplace(canonical, canonical).second) {
+        entry.aliases.push_back(canonical);
+      }
+    }
+    std::get_deleter<Deleter>(result[i])->Retarget(std::move(canonical));
+  }
+  return result;
+}
+
+FormulaCache::Stats FormulaCache::GetStats() const {
+  std::lock_guard guard(state_->mutex);
+  EvictReleased();
+  auto stats = state_->stats;
+  stats.size = state_->formulas.size();
+  return stats;
+}
+
+void FormulaCache::EvictReleased() const {
+  auto &state = *state_;
+  std::vector<std::string> released;
+  {
+    std::lock_guard guard(state.released_mutex);
+    released.swap(state.released);
+  }
+
+  for (const auto &canonical : released) {
+    auto it = state.formulas.find(canonical);
+    if (it == state.formulas.end() || !it->second.formula.expired()) {
+      continue;
+    }
+    for (const auto &alias : it->second.aliases) {
+      state.aliases.erase(alias);
+    }
+    state.formulas.erase(it);
+    ++state.stats.evictions;
+  }
+}
+
+void FormulaCache::Deleter::operator()(const FormulaInterface *formula) const {
+  delete formula;
+
+  auto state = state_.lock();
+  if (state == nullptr) {
+    return;
+  }
+  std::lock_guard guard(state->released_mutex);
+  state->released.push_back(canonical_);
+}
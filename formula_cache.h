@@ -0,0 +1,103 @@
+#pragma once
+
+#include "formula.h"
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Кэш скомпилированных формул листа.
+// Одинаковые формулы разделяют один объект. Ключ - каноническое выражение
+// (GetExpression()), поэтому "=B1*C1" и "=(B1 * C1)" тоже разделяются;
+// числа в нём печатаются без потери точности, и формулы, различающиеся только
+// далёким знаком числа, не разделяются. Повторный текст формулы находится без
+// разбора. Запись удаляется, когда формулу перестаёт использовать последняя
+// ячейка. Формулы меняются только через ShiftReferences и PermuteReferences,
+// одинаково для всех разделяющих их ячеек.
+// Get можно вызывать из нескольких потоков: текст разбирается без блокировки.
+class FormulaCache {
+ public:
+  struct Stats {
+    // Формула выдана без разбора текста
+    size_t hits = 0;
+    // Текст пришлось разобрать
+    size_t misses = 0;
+    // Записи, удалённые после освобождения формулы
+    size_t evictions = 0;
+    // Число различных формул в кэше
+    size_t size = 0;
+  };
+
+  FormulaCache();
+
+  // Бросает FormulaException, если формула синтаксически некорректна
+  std::shared_ptr<FormulaInterface> Get(const std::string &expression);
+
+  // Сдвигает ссылки в формулах и переносит их записи под новые выражения.
+  // Формулы, не выданные кэшем, просто сдвигаются. Если после удаления
+  // строк выражения двух формул совпали, в кэше остаётся одна из них.
+  // С copy исходные формулы не меняются (их читают снимки листа), сдвигаются
+  // их копии. Возвращает сдвинутые формулы в порядке formulas. Формулы в
+  // formulas различны: большие списки переписываются в нескольких потоках.
+  std::vector<std::shared_ptr<FormulaInterface>> ShiftReferences(
+      const std::vector<std::shared_ptr<FormulaInterface>> &formulas, const PositionShift &shift,
+      bool copy = false);
+  // То же для перестановки строк при сортировке
+  std::vector<std::shared_ptr<FormulaInterface>> PermuteReferences(
+      const std::vector<std::shared_ptr<FormulaInterface>> &formulas, const RowPermutation &permutation,
+      bool copy = false);
+
+  Stats GetStats() const;
+
+ private:
+  struct Entry {
+    std::weak_ptr<FormulaInterface> formula;
+    // Тексты, по которым запрашивалась формула
+    std::vector<std::string> aliases;
+  };
+
+  struct State {
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> formulas;
+    std::unordered_map<std::string, std::string> aliases;
+    Stats stats;
+    // Формулы освобождаются и в потоках, читающих снимки листа. Удалитель
+    // только откладывает выражение, а запись удаляет сам кэш.
+    std::mutex released_mutex;
+    std::vector<std::string> released;
+  };
+
+  // Удаляет запись при освобождении формулы, если кэш ещё существует
+  class Deleter {
+   public:
+    Deleter(std::weak_ptr<State> state, std::string canonical)
+        : state_(std::move(state)), canonical_(std::move(canonical)) {
+    }
+
+    void operator()(const FormulaInterface *formula) const;
+
+    const std::string &GetCanonical() const {
+      return canonical_;
+    }
+
+    void Retarget(std::string canonical) {
+      canonical_ = std::move(canonical);
+    }
+
+   private:
+    std::weak_ptr<State> state_;
+    std::string canonical_;
+  };
+
+  std::shared_ptr<State> state_;
+
+  // Вызывается под state_->mutex
+  void EvictReleased() const;
+  // Применяет rewrite к формулам или их копиям и переносит записи кэша
+  std::vector<std::shared_ptr<FormulaInterface>> Rewrite(
+      const std::vector<std::shared_ptr<FormulaInterface>> &formulas, bool copy,
+      const std::function<void(FormulaInterface &)> &rewrite);
+};
@@ -0,0 +1,334 @@
+#include "group_by.h"
+
+#include "FormulaAST.h"
+
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <unordered_map>
+
+using namespace std::literals;
+
+namespace {
+
+// Меньшие части не окупают запуск потока
+constexpr size_t MIN_CHUNK_ROWS = 1024;
+constexpr uint32_t NO_GROUP = std::numeric_limits<uint32_t>::max();
+
+bool IsError(ValueTag tag) {
+  return tag != ValueTag::EMPTY && tag != ValueTag::NUMBER && tag != ValueTag::TEXT;
+}
+
+// Ключ группы; текст указывает в ячейку листа
+struct Key {
+  ValueTag tag;
+  double number;
+  std::string_view text;
+
+  bool operator==(const Key &rhs) const {
+    return tag == rhs.tag && number == rhs.number && text == rhs.text;
+  }
+};
+
+struct KeyHasher {
+  size_t operator()(const Key &key) const {
+    switch (key.tag) {
+      case ValueTag::NUMBER:return std::hash<double>{}(key.number);
+      case ValueTag::TEXT:return std::hash<std::string_view>{}(key.text);
+      default:return static_cast<size_t>(key.tag);
+    }
+  }
+};
+
+using GroupIndex = std::unordered_map<Key, uint32_t, KeyHasher>;
+
+// Столбец области, прочитанный GetValues
+struct Column {
+  std::vector<double> numbers;
+  std::vector<ValueTag> tags;
+};
+
+// Накопители одного агрегата по группам
+struct Accumulator {
+  std::vector<double> values;
+  std::vector<size_t> counts;
+  // Первая ошибка значения группы; EMPTY - ошибок нет
+  std::vector<ValueTag> errors;
+
+  void Resize(size_t groups, Aggregate function) {
+    double initial = 0;
+    if (function == Aggregate::Min) {
+      initial = std::numeric_limits<double>::infinity();
+    } else if (function == Aggregate::Max) {
+      initial = -std::numeric_limits<double>::infinity();
+    }
+    values.resize(groups, initial);
+    counts.resize(groups, 0);
+    errors.resize(groups, ValueTag::EMPTY);
+  }
+};
+
+double Combine(Aggregate function, double lhs, double rhs) {
+  switch (function) {
+    case Aggregate::Min:return std::min(lhs, rhs);
+    case Aggregate::Max:return std::max(lhs, rhs);
+    default:return lhs + rhs;
+  }
+}
+
+// Сводка части строк: ключи её групп в порядке появления и накопители
+struct Partial {
+  std::vector<Key> keys;
+  std::vector<Accumulator> accumulators;
+};
+
+// Проход по столбцу значений с постоянной операцией: цикл без ветвления по
+// виду агрегата читает столбец подряд
+template <typename Op>
+void Accumulate(const Column &column, const uint32_t *group_of, size_t begin, size_t end,
+                Accumulator &accumulator, Op op) {
+  for (size_t row = begin; row < end; ++row) {
+    const auto group = group_of[row];
+    if (group == NO_GROUP) {
+      continue;
+    }
+    const auto tag = column.tags[row];
+    if (tag == ValueTag::NUMBER) {
+      accumulator.values[group] = op(accumulator.values[group], column.numbers[row]);
+      ++accumulator.counts[group];
+    } else if (IsError(tag) && accumulator.errors[group] == ValueTag::EMPTY) {
+      accumulator.errors[group] = tag;
+    }
+  }
+}
+
+Partial Summarize(const Column &keys, const std::vector<std::string_view> &key_texts,
+                  const std::vector<const Column *> &values, const std::vector<Aggregation> &aggregations,
+                  size_t begin, size_t end, std::vector<uint32_t> &group_of) {
+  Partial result;
+  GroupIndex index;
+  for (size_t row = begin; row < end; ++row) {
+    Key key{keys.tags[row], 0, {}};
+    if (key.tag == ValueTag::EMPTY) {
+      group_of[row] = NO_GROUP;
+      continue;
+    }
+    if (key.tag == ValueTag::NUMBER) {
+      key.number = keys.numbers[row];
+    } else if (key.tag == ValueTag::TEXT) {
+      if (ParseCellNumber(key_texts[row], key.number)) {
+        key.tag = ValueTag::NUMBER;
+      } else {
+        key.text = key_texts[row];
+      }
+    }
+    // -0 и 0 - один ключ
+    if (key.number == 0) {
+      key.number = 0;
+    }
+    auto [it, inserted] = index.emplace(key, static_cast<uint32_t>(result.keys.size()));
+    if (inserted) {
+      result.keys.push_back(key);
+    }
+    group_of[row] = it->second;
+  }
+
+  result.accumulators.resize(aggregations.size());
+  for (size_t i = 0; i < aggregations.size(); ++i) {
+    const auto function = aggregations[i].function;
+    auto &accumulator = result.accumulators[i];
+    accumulator.Resize(result.keys.size(), function);
+    switch (function) {
+      case Aggregate::Min:
+        Accumulate(*values[i], group_of.data(), begin, end, accumulator, [](double lhs, double rhs) {
+          return std::min(lhs, rhs);
+        });
+        break;
+      case Aggregate::Max:
+        Accumulate(*values[i], group_of.data(), begin, end, accumulator, [](double lhs, double rhs) {
+          return std::max(lhs, rhs);
+        });
+        break;
+      default:
+        Accumulate(*values[i], group_of.data(), begin, end, accumulator, [](double lhs, double rhs) {
+          return lhs + rhs;
+        });
+        break;
+    }
+  }
+  return result;
+}
+
+}  // namespace
+
+GroupedValues GroupBy(const Sheet &sheet, const Range &range, int key_col,
+                      const std::vector<Aggregation> &aggregations, size_t threads) {
+  if (!range.IsValid()) {
+    throw InvalidPositionException("range "s + range.ToString());
+  }
+  auto validate_col = [&range](int col) {
+    if (col < range.first.col || col > range.last.col) {
+      throw InvalidPositionException("group by column "s + std::to_string(col));
+    }
+  };
+  validate_col(key_col);
+  for (const auto &aggregation : aggregations) {
+    validate_col(aggregation.col);
+  }
+
+  const auto size = range.GetSize();
+  const auto rows = static_cast<size_t>(size.rows);
+  std::vector<std::string_view> texts(rows);
+  auto read = [&sheet, &range, &size, &texts](int col, Column &column) {
+    column.numbers.resize(texts.size());
+    column.tags.resize(texts.size());
+    sheet.GetValues({range.first.row, col}, {size.rows, 1}, {column.numbers.data(), column.tags.data(), texts.data()});
+  };
+
+  // Каждый столбец значений читается один раз. Тексты действительны до
+  // следующего GetValues: текст-число сразу становится числом, а столбец
+  // ключей читается последним
+  std::unordered_map<int, Column> columns;
+  for (const auto &aggregation : aggregations) {
+    if (columns.count(aggregation.col) != 0) {
+      continue;
+    }
+    auto &column = columns[aggregation.col];
+    read(aggregation.col, column);
+    for (size_t row = 0; row < rows; ++row) {
+      if (column.tags[row] == ValueTag::TEXT && ParseCellNumber(texts[row], column.numbers[row])) {
+        column.tags[row] = ValueTag::NUMBER;
+      }
+    }
+  }
+  std::vector<const Column *> values;
+  for (const auto &aggregation : aggregations) {
+    values.push_back(&columns.at(aggregation.col));
+  }
+  Column keys;
+  read(key_col, keys);
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = std::min(threads, std::max<size_t>(1, (rows + MIN_CHUNK_ROWS - 1) / MIN_CHUNK_ROWS));
+  const size_t chunk = (rows + threads - 1) / threads;
+  std::vector<Partial> partials(threads);
+  std::vector<uint32_t> group_of(rows);
+  auto summarize = [&](size_t part) {
+    const size_t begin = std::min(rows, part * chunk);
+    partials[part] = Summarize(keys, texts, values, aggregations, begin, std::min(rows, begin + chunk), group_of);
+  };
+  if (threads == 1) {
+    summarize(0);
+  } else {
+    std::vector<std::thread> workers;
+    for (size_t part = 0; part < threads; ++part) {
+      workers.emplace_back(summarize, part);
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  // Части сливаются по порядку строк: группы идут в порядке первого
+  // появления, первая ошибка группы - ошибка её первой строки с ошибкой
+  Partial total;
+  total.accumulators.resize(aggregations.size());
+  GroupIndex index;
+  for (const auto &partial : partials) {
+    std::vector<uint32_t> to_total(partial.keys.size());
+    for (size_t group = 0; group < partial.keys.size(); ++group) {
+      auto [it, inserted] = index.emplace(partial.keys[group], static_cast<uint32_t>(total.keys.size()));
+      if (inserted) {
+        total.keys.push_back(partial.keys[group]);
+      }
+      to_total[group] = it->second;
+    }
+    for (size_t i = 0; i < aggregations.size(); ++i) {
+      const auto function = aggregations[i].function;
+      auto &accumulator = total.accumulators[i];
+      accumulator.Resize(total.keys.size(), function);
+      const auto &part = partial.accumulators[i];
+      for (size_t group = 0; group < partial.keys.size(); ++group) {
+        const auto to = to_total[group];
+        accumulator.values[to] = Combine(function, accumulator.values[to], part.values[group]);
+        accumulator.counts[to] += part.counts[group];
+        if (accumulator.errors[to] == ValueTag::EMPTY) {
+          accumulator.errors[to] = part.errors[group];
+        }
+      }
+    }
+  }
+
+  GroupedValues result;
+  const size_t groups = total.keys.size();
+  for (const auto &key : total.keys) {
+    result.key_numbers.push_back(key.number);
+    result.key_tags.push_back(key.tag);
+    result.key_texts.emplace_back(key.text);
+  }
+  result.numbers.resize(aggregations.size() * groups, 0);
+  result.tags.resize(aggregations.size() * groups, ValueTag::NUMBER);
+  for (size_t i = 0; i < aggregations.size(); ++i) {
+    const auto function = aggregations[i].function;
+    const auto &accumulator = total.accumulators[i];
+    for (size_t group = 0; group < groups; ++group) {
+      auto &number = result.numbers[i * groups + group];
+      auto &tag = result.tags[i * groups + group];
+      const auto count = accumulator.counts[group];
+      if (function == Aggregate::Count) {
+        number = static_cast<double>(count);
+      } else if (accumulator.errors[group] != ValueTag::EMPTY) {
+        tag = accumulator.errors[group];
+      } else if (function == Aggregate::Average) {
+        if (count == 0) {
+          tag = ValueTag::DIV0_ERROR;
+        } else {
+          number = accumulator.values[group] / static_cast<double>(count);
+        }
+      } else if (count > 0) {
+        number = accumulator.values[group];
+      }
+    }
+  }
+  return result;
+}
+
+void WriteGroupBy(Sheet &sheet, Position target, const GroupedValues &groups) {
+  const size_t count = groups.GetGroupCount();
+  if (count == 0) {
+    return;
+  }
+  const size_t aggregations = groups.numbers.size() / count;
+  const Position last{target.row + static_cast<int>(count) - 1, target.col + static_cast<int>(aggregations)};
+  if (!target.IsValid() || !last.IsValid()) {
+    throw TableTooBigException("Grouped values do not fit into the sheet"s);
+  }
+
+  auto write = [&sheet](Position pos, ValueTag tag, double number, std::string_view text) {
+    switch (tag) {
+      case ValueTag::NUMBER:
+        sheet.SetCell(pos, FormatNumber(number));
+        break;
+      case ValueTag::TEXT:
+        if (!text.empty() && (text.front() == FORMULA_SIGN || text.front() == ESCAPE_SIGN)) {
+          sheet.SetCell(pos, ESCAPE_SIGN + std::string(text));
+        } else {
+          sheet.SetCell(pos, std::string(text));
+        }
+        break;
+      default:
+        sheet.SetCell(pos, std::string(ToFormulaError(tag).ToString()));
+        break;
+    }
+  };
+  for (size_t group = 0; group < count; ++group) {
+    const int row = target.row + static_cast<int>(group);
+    write({row, target.col}, groups.key_tags[group], groups.key_numbers[group], groups.key_texts[group]);
+    for (size_t i = 0; i < aggregations; ++i) {
+      const size_t index = i * count + group;
+      write({row, target.col + 1 + static_cast<int>(i)}, groups.tags[index], groups.numbers[index], {});
+    }
+  }
+}
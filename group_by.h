@@ -0,0 +1,63 @@
+#pragma once
+
+#include "cell.h"
+#include "sheet.h"
+
+#include <string>
+#include <vector>
+
+// Группировка строк области листа по значению столбца-ключа с агрегатами
+// столбцов значений, как в сводной таблице:
+//
+//   // сумма и число значений столбца C по значениям столбца A
+//   auto groups = GroupBy(sheet, {{0, 0}, {9999, 2}}, 0,
+//                         {{2, Aggregate::Sum}, {2, Aggregate::Count}});
+//   WriteGroupBy(sheet, {0, 5}, groups);  // ключи в F, агрегаты в G и H
+//
+// Строки с пустым ключом пропускаются. Число и текст, который формула прочла
+// бы как число, - один ключ; остальной текст сравнивается побайтно, каждая
+// ошибка - свой ключ. В агрегаты идут числа и такой же текст, прочий текст и
+// пустые ячейки пропускаются. Ошибка значения делает агрегат группы этой
+// ошибкой, кроме Count: он, как COUNT, считает только числа.
+enum class Aggregate : unsigned char {
+  Sum,
+  Count,
+  Min,
+  Max,
+  // #DIV/0!, если в группе нет чисел
+  Average,
+};
+
+struct Aggregation {
+  // Столбец значений листа внутри области
+  int col;
+  Aggregate function;
+};
+
+struct GroupedValues {
+  // Ключи групп в порядке первого появления в области
+  std::vector<double> key_numbers;
+  std::vector<ValueTag> key_tags;
+  std::vector<std::string> key_texts;
+  // Агрегат a группы g - элемент a * GetGroupCount() + g; 0, если не число
+  std::vector<double> numbers;
+  std::vector<ValueTag> tags;
+
+  size_t GetGroupCount() const {
+    return key_tags.size();
+  }
+};
+
+// Столбцы читаются Sheet::GetValues целиком, строки делятся на части по
+// потокам: каждый поток сводит свою часть в собственную хеш-таблицу групп, и
+// таблицы частей сливаются по порядку. threads - число потоков, 0 - по числу
+// ядер. Бросает InvalidPositionException, если область вне таблицы или
+// столбец вне области. Лист не должен меняться во время вызова
+GroupedValues GroupBy(const Sheet &sheet, const Range &range, int key_col,
+                      const std::vector<Aggregation> &aggregations, size_t threads = 1);
+
+// Записывает ключи в столбец target и агрегаты в следующие столбцы, по строке
+// на группу, текстом ячеек: числа - кратчайшей записью, которая читается
+// обратно тем же числом, ошибки - своим обозначением. Бросает
+// TableTooBigException, если результат не помещается в таблицу
+void WriteGroupBy(Sheet &sheet, Position target, const GroupedValues &groups);
@@ -0,0 +1,89 @@
+#include "lookup_index.h"
+
+#include <climits>
+#include <cmath>
+#include <iterator>
+
+LookupIndex::Match LookupIndex::ToMatch(double value) {
+  if (value > 0) {
+    return Match::Ascending;
+  }
+  return value < 0 ? Match::Descending : Match::Exact;
+}
+
+void LookupIndex::Set(int offset, std::optional<double> key) {
+  // NaN не равен сам себе и не упорядочен: такое число не найти
+  if (key && std::isnan(*key)) {
+    key.reset();
+  }
+
+  auto it = keys_.find(offset);
+  if (it != keys_.end()) {
+    if (key == it->second) {
+      return;
+    }
+    if (exact_) {
+      auto rows = exact_->find(it->second);
+      rows->second.erase(offset);
+      if (rows->second.empty()) {
+        exact_->erase(rows);
+      }
+    }
+    if (sorted_) {
+      sorted_->erase({it->second, offset});
+    }
+    keys_.erase(it);
+  }
+
+  if (!key) {
+    return;
+  }
+  keys_.emplace(offset, *key);
+  if (exact_) {
+    (*exact_)[*key].insert(offset);
+  }
+  if (sorted_) {
+    sorted_->emplace(*key, offset);
+  }
+}
+
+std::optional<int> LookupIndex::Find(double key, Match match) {
+  if (std::isnan(key)) {
+    return std::nullopt;
+  }
+
+  if (match == Match::Exact) {
+    if (!exact_) {
+      exact_.emplace();
+      for (const auto &[offset, value] : keys_) {
+        (*exact_)[value].insert(offset);
+      }
+    }
+    auto it = exact_->find(key);
+    if (it == exact_->end()) {
+      return std::nullopt;
+    }
+    return *it->second.begin();
+  }
+
+  if (!sorted_) {
+    sorted_.emplace();
+    for (const auto &[offset, value] : keys_) {
+      sorted_->emplace(value, offset);
+    }
+  }
+  if (match == Match::Ascending) {
+    auto it = sorted_->upper_bound({key, INT_MAX});
+    if (it == sorted_->begin()) {
+      return std::nullopt;
+    }
+    return std::prev(it)->second;
+  }
+
+  auto it = sorted_->lower_bound({key, INT_MIN});
+  if (it == sorted_->end()) {
+    return std::nullopt;
+  }
+  // Последний из равных найденному
+  return std::prev(sorted_->upper_bound({it->first, INT_MAX}))->second;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <utility>
+
+// Индекс чисел одной строки или одного столбца для MATCH и VLOOKUP.
+// Элемент - смещение ячейки от начала строки или столбца и число, которое
+// прочитала бы из неё формула; пустые ячейки, текст и ошибки не индексируются.
+// Хэш для точного поиска и упорядоченный набор для приближённого строятся при
+// первом поиске своего вида, после этого изменение элемента стоит O(log n).
+class LookupIndex {
+ public:
+  // Вид поиска, как третий аргумент MATCH
+  enum class Match : signed char {
+    // Наименьшее число не меньше ключа
+    Descending = -1,
+    Exact = 0,
+    // Наибольшее число не больше ключа
+    Ascending = 1,
+  };
+
+  // По знаку аргумента, как в MATCH
+  static Match ToMatch(double value);
+
+  // nullopt - элемент не индексируется
+  void Set(int offset, std::optional<double> key);
+
+  // Смещение найденного элемента или nullopt. Среди равных чисел точный поиск
+  // находит первое, приближённый - последнее: на отсортированных данных это
+  // совпадает с двоичным поиском MATCH
+  std::optional<int> Find(double key, Match match);
+
+  size_t GetSize() const {
+    return keys_.size();
+  }
+
+ private:
+  std::unordered_map<int, double> keys_;
+  std::optional<std::unordered_map<double, std::set<int>>> exact_;
+  std::optional<std::set<std::pair<double, int>>> sorted_;
+};
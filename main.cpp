@@ -1,12 +1,30 @@
+#include "async_recalc.h"
 #include "common.h"
 #include "cell.h"
 #include "sheet.h"
 #include "formula.h"
+#include "group_by.h"
+#include "profiler.h"
+#include "recalc_scheduler.h"
+#include "scenario.h"
+#include "shared_values.h"
+#include "spreadsheet_ml.h"
 #include "test_runner_p.h"
+#include "tools.h"
+#include "workload.h"
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
 #include <vector>
 #include <memory>
 #include <cassert>
 #include <sstream>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 using namespace std::literals;
 using namespace std;
@@ -25,6 +43,25 @@ inline std::ostream &operator<<(std::ostream &output, Size size) {
 
 namespace {
 
+// Значение ячейки, прочитанное одновременно несколькими потоками. Все потоки
+// должны получить одно значение: читатели делят кэши формул
+CellInterface::Value ConcurrentValue(const SheetInterface &sheet, Position pos, int threads = 4) {
+  std::vector<CellInterface::Value> values(threads);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < threads; ++t) {
+    readers.emplace_back([&sheet, &values, pos, t] {
+      values[t] = sheet.GetCell(pos)->GetValue();
+    });
+  }
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  for (const auto &value : values) {
+    assert(value == values.front());
+  }
+  return values.front();
+}
+
 void TestEmpty() {
   auto sheet = CreateSheet();
   ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
@@ -46,6 +83,24 @@ void TestInvalidPosition() {
   } catch (const InvalidPositionException &) {
   }
 
+  // Позиции без строки или без столбца
+  assert(!Position::FromString("AB").IsValid());
+  assert(!Position::FromString("12").IsValid());
+}
+
+void TestPositionToString() {
+  ASSERT_EQUAL((Position{0, 0}.ToString()), "A1"s);
+  ASSERT_EQUAL((Position{9, 25}.ToString()), "Z10"s);
+  ASSERT_EQUAL((Position{0, 701}.ToString()), "ZZ1"s);
+  ASSERT_EQUAL((Position{0, 702}.ToString()), "AAA1"s);
+  ASSERT_EQUAL((Position{0, 1352}.ToString()), "AZA1"s);
+  ASSERT_EQUAL((Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}.ToString()), "XFD16384"s);
+
+  // Все трёхбуквенные столбцы
+  for (int col = 702; col < Position::MAX_COLS; ++col) {
+    Position pos{col % Position::MAX_ROWS, col};
+    ASSERT_EQUAL(Position::FromString(pos.ToString()), pos);
+  }
 }
 
 void TestSetCellPlainText() {
@@ -370,6 +425,23 @@ void TestSimpleCacheInvalidation() {
     assert(CellCacheStat::invalidate == 0);
     assert(CellCacheStat::hit == 1);
     assert(CellCacheStat::missed == 0);
+
+    CellCacheStat::Reset();
+    assert(std::get<double>(ConcurrentValue(*sheet, "A2"_pos)) == 4);
+    assert(CellCacheStat::hit == 4);
+    assert(CellCacheStat::missed == 0);
+  }
+
+  // Одновременные промахи: каждый поток либо вычисляет значение, либо берёт
+  // опубликованное другим
+  {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "3"s);
+    sheet->SetCell("A2"_pos, "=A1+1"s);
+    CellCacheStat::Reset();
+    assert(std::get<double>(ConcurrentValue(*sheet, "A2"_pos)) == 4);
+    assert(CellCacheStat::missed >= 1);
+    assert(CellCacheStat::hit + CellCacheStat::missed == 4);
   }
 
 
@@ -387,6 +459,12 @@ void TestSimpleCacheInvalidation() {
     sheet->SetCell("A1"_pos, "4"s);
     assert(CellCacheStat::invalidate == 2);
     assert(std::get<double>(sheet->GetCell("C4"_pos)->GetValue()) == 6);
+    assert(std::get<double>(ConcurrentValue(*sheet, "C4"_pos)) == 6);
+    assert(std::get<double>(ConcurrentValue(*sheet, "A2"_pos)) == 5);
+
+    sheet->SetCell("A1"_pos, "5"s);
+    assert(std::get<double>(ConcurrentValue(*sheet, "A2"_pos)) == 6);
+    assert(std::get<double>(ConcurrentValue(*sheet, "C4"_pos)) == 7);
   }
 
 }
@@ -413,18 +491,21 @@ void TestSimpleLinkToEmptyCell() {
     auto sheet = CreateSheet();
     sheet->SetCell("A2"_pos, "=A1+2"s);
     assert(std::get<double>(sheet->GetCell("A2"_pos)->GetValue()) == 2);
+    assert(std::get<double>(ConcurrentValue(*sheet, "A2"_pos)) == 2);
   }
 
   {
     auto sheet = CreateSheet();
     sheet->SetCell("A2"_pos, "=2/A1"s);
     assert(std::get<FormulaError>(sheet->GetCell("A2"_pos)->GetValue()).GetCategory() == FormulaError::Category::Div0);
+    assert(std::get<FormulaError>(ConcurrentValue(*sheet, "A2"_pos)).GetCategory() == FormulaError::Category::Div0);
   }
 
   {
     auto sheet = CreateSheet();
     sheet->SetCell("A2"_pos, "=A1/2"s);
     assert(std::get<double>(sheet->GetCell("A2"_pos)->GetValue()) == 0);
+    assert(std::get<double>(ConcurrentValue(*sheet, "A2"_pos)) == 0);
   }
 
   cerr << "TestSimpleLinkToEmptyCell OK"s << endl;
@@ -438,6 +519,7 @@ void TestSimpleLinkToTextCell() {
     sheet->SetCell("A1"_pos, "hello"s);
     sheet->SetCell("A2"_pos, "=A1+2"s);
     assert(std::get<FormulaError>(sheet->GetCell("A2"_pos)->GetValue()).GetCategory() == FormulaError::Category::Value);
+    assert(std::get<FormulaError>(ConcurrentValue(*sheet, "A2"_pos)).GetCategory() == FormulaError::Category::Value);
   }
 
   cerr << "TestSimpleLinkToTextCell OK"s << endl;
@@ -471,6 +553,8 @@ void TestSimpleErrorPropagation() {
     sheet->SetCell("A1"_pos, "=1/0"s);
     sheet->SetCell("A2"_pos, "=A1"s);
     assert(std::get<FormulaError>(sheet->GetCell("A2"_pos)->GetValue()).GetCategory() == FormulaError::Category::Div0);
+    assert(std::get<FormulaError>(ConcurrentValue(*sheet, "A2"_pos)).GetCategory() == FormulaError::Category::Div0);
+    assert(std::get<FormulaError>(ConcurrentValue(*sheet, "A1"_pos)).GetCategory() == FormulaError::Category::Div0);
   }
 
   // Value
@@ -480,6 +564,7 @@ void TestSimpleErrorPropagation() {
     sheet->SetCell("A2"_pos, "=A1+2"s);
     sheet->SetCell("A3"_pos, "=A2"s);
     assert(std::get<FormulaError>(sheet->GetCell("A3"_pos)->GetValue()).GetCategory() == FormulaError::Category::Value);
+    assert(std::get<FormulaError>(ConcurrentValue(*sheet, "A3"_pos)).GetCategory() == FormulaError::Category::Value);
   }
 
   cerr << "TestSimpleErrorPropagation OK"s << endl;
@@ -493,6 +578,9 @@ void TestSimpleErrorText() {
     std::stringstream ss;
     ss << sheet->GetCell("A1"_pos)->GetValue();
     assert(ss.str() == "#DIV/0!"s);
+    std::stringstream concurrent;
+    concurrent << ConcurrentValue(*sheet, "A1"_pos);
+    assert(concurrent.str() == "#DIV/0!"s);
   }
 
   {
@@ -503,6 +591,9 @@ void TestSimpleErrorText() {
     std::stringstream ss;
     ss << sheet->GetCell("A2"_pos)->GetValue();
     assert(ss.str() == "#VALUE!"s);
+    std::stringstream concurrent;
+    concurrent << ConcurrentValue(*sheet, "A2"_pos);
+    assert(concurrent.str() == "#VALUE!"s);
   }
 
 //  {
@@ -516,13 +607,2042 @@ void TestSimpleErrorText() {
 
 }
 
+void TestRecalcProfiler() {
+  auto sheet = CreateSheet();
+  sheet->SetCell("A1"_pos, "=1+2"s);
+  sheet->SetCell("A2"_pos, "=A1*2"s);
+  sheet->SetCell("A3"_pos, "=A2+A1"s);
+  sheet->SetCell("B1"_pos, "=1/0"s);
+
+  // Без подключённого профилировщика ничего не замеряется
+  RecalcProfiler profiler;
+  assert(std::get<double>(sheet->GetCell("A3"_pos)->GetValue()) == 9);
+  assert(profiler.GetHotCells().empty());
+
+  sheet->SetCell("A1"_pos, "=2+2"s);
+  {
+    auto session = profiler.Attach();
+    assert(RecalcProfiler::IsActive());
+    assert(std::get<double>(sheet->GetCell("A3"_pos)->GetValue()) == 12);
+    assert(std::get<double>(sheet->GetCell("A3"_pos)->GetValue()) == 12);
+    // Ошибки не кэшируются и пересчитываются при каждом чтении
+    sheet->GetCell("B1"_pos)->GetValue();
+    sheet->GetCell("B1"_pos)->GetValue();
+  }
+  assert(!RecalcProfiler::IsActive());
+
+  std::map<Position, RecalcProfiler::CellStat> stats;
+  for (const auto &stat : profiler.GetHotCells()) {
+    stats[stat.pos] = stat;
+  }
+  assert(stats.size() == 4);
+  assert(stats["A1"_pos].evaluations == 1);
+  assert(stats["A1"_pos].reads == 2);
+  assert(stats["A3"_pos].evaluations == 1);
+  assert(stats["A3"_pos].reads == 2);
+  assert(stats["B1"_pos].evaluations == 2);
+  assert(stats["A3"_pos].total >= stats["A3"_pos].self);
+
+  std::ostringstream report;
+  profiler.PrintReport(report);
+  assert(report.str().find("critical path") != std::string::npos);
+
+  std::ostringstream trace;
+  profiler.PrintChromeTrace(trace);
+  assert(trace.str().rfind("{\"traceEvents\":[", 0) == 0);
+  assert(trace.str().find("\"name\":\"A2\"") != std::string::npos);
+
+  // Цепочка A3 -> A2 -> A1 длиннее любой другой
+  profiler.Reset();
+  sheet->SetCell("A1"_pos, "=3+3"s);
+  {
+    auto session = profiler.Attach();
+    sheet->GetCell("A3"_pos)->GetValue();
+  }
+  std::vector<Position> expected = {"A3"_pos, "A2"_pos, "A1"_pos};
+  assert(profiler.GetCriticalPath().cells == expected);
+
+  // Правки во время сеанса замыкают рёбра A1 -> A2 -> A1 в цикл
+  profiler.Reset();
+  sheet->SetCell("A1"_pos, "=4+4"s);
+  {
+    auto session = profiler.Attach();
+    sheet->GetCell("A2"_pos)->GetValue();
+    sheet->SetCell("A2"_pos, "=5"s);
+    sheet->SetCell("A1"_pos, "=A2+1"s);
+    assert(std::get<double>(sheet->GetCell("A1"_pos)->GetValue()) == 6);
+  }
+  auto cyclic = profiler.GetCriticalPath().cells;
+  assert(!cyclic.empty() && cyclic.size() <= 2);
+  assert(std::set<Position>(cyclic.begin(), cyclic.end()).size() == cyclic.size());
+  std::ostringstream cyclic_report;
+  profiler.PrintReport(cyclic_report);
+
+  cerr << "TestRecalcProfiler OK"s << endl;
+}
+
+void TestWorkloadRecordReplay() {
+  std::stringstream trace;
+  {
+    RecordingSheet sheet(CreateSheet(), trace);
+    sheet.SetCell("A1"_pos, "2"s);
+    sheet.SetCell("A2"_pos, "=A1*3"s);
+    sheet.SetCell("B1"_pos, "text\twith\ntabs"s);
+    try {
+      sheet.SetCell("A1"_pos, "=A2"s);
+      assert(false);
+    } catch (const CircularDependencyException &) {
+    }
+    assert(std::get<double>(sheet.GetCell("A2"_pos)->GetValue()) == 6);
+    assert(sheet.GetCell("C3"_pos) == nullptr);
+    sheet.ClearCell("B1"_pos);
+    std::ostringstream out;
+    sheet.PrintValues(out);
+    assert(out.str() == "2\n6\n"s);
+  }
+
+  auto sheet = CreateSheet();
+  auto stats = ReplayTrace(trace, *sheet);
+  assert(stats.mismatches == 0);
+  assert(stats.Summarize(WorkloadOp::SetCell).count == 4);
+  assert(stats.Summarize(WorkloadOp::GetCell).count == 2);
+  assert(stats.Summarize(WorkloadOp::GetValue).count == 1);
+  assert(stats.Summarize(WorkloadOp::ClearCell).count == 1);
+  assert(stats.Summarize(WorkloadOp::PrintValues).count == 1);
+  auto summary = stats.Summarize(WorkloadOp::SetCell);
+  assert(summary.p50 <= summary.p99 && summary.p99 <= summary.max);
+  assert(std::get<double>(sheet->GetCell("A2"_pos)->GetValue()) == 6);
+  assert(sheet->GetCell("B1"_pos) == nullptr);
+
+  std::istringstream corrupted(std::string(TRACE_HEADER) + "\nX 0 0 0 0\n"s);
+  try {
+    ReplayTrace(corrupted, *sheet);
+    assert(false);
+  } catch (const std::invalid_argument &) {
+  }
+
+  cerr << "TestWorkloadRecordReplay OK"s << endl;
+}
+
+void TestWorkloadGenerator() {
+  for (auto shape : {WorkloadShape::Chain, WorkloadShape::FanIn,
+                     WorkloadShape::FanOut, WorkloadShape::RandomDag}) {
+    WorkloadOptions options{shape, 50, 7};
+    std::ostringstream first;
+    std::ostringstream second;
+    for (auto *out : {&first, &second}) {
+      auto sheet = CreateSheet();
+      auto formulas = GenerateWorkload(*sheet, options);
+      assert(!formulas.empty());
+      sheet->PrintTexts(*out);
+    }
+    assert(first.str() == second.str());
+  }
+
+  auto sheet = CreateSheet();
+  auto formulas = GenerateWorkload(*sheet, {WorkloadShape::Chain, 10});
+  assert(formulas.size() == 9);
+  assert(std::get<double>(sheet->GetCell(formulas.back())->GetValue()) == 10);
+
+  cerr << "TestWorkloadGenerator OK"s << endl;
+}
+
+void TestConstantFolding() {
+  auto optimized = [](const std::string &expression) {
+    std::ostringstream out;
+    ParseFormulaAST(expression).PrintOptimized(out);
+    return out.str();
+  };
+
+  assert(optimized("(2+3)*A1/4") == "(/ (* 5 A1) 4)"s);
+  assert(optimized("-(-A1)") == "A1"s);
+  assert(optimized("+-+A1") == "(- A1)"s);
+  assert(optimized("A1*1") == "A1"s);
+  assert(optimized("1*A1") == "A1"s);
+  assert(optimized("A1-0") == "A1"s);
+  assert(optimized("A1+-0") == "A1"s);
+  assert(optimized("1+2*3-4/2") == "5"s);
+  // Упрощения, способные изменить результат, не применяются
+  assert(optimized("A1+0") == "(+ A1 0)"s);
+  assert(optimized("A1/1") == "(/ A1 1)"s);
+  assert(optimized("A1*(1/0)") == "(* A1 (/ 1 0))"s);
+
+  // Выражение формулы печатается в исходном виде
+  assert(ParseFormula("(2+3)*A1/4")->GetExpression() == "(2+3)*A1/4"s);
+  assert(ParseFormula("-(-A1)")->GetExpression() == "--A1"s);
+
+  auto sheet = CreateSheet();
+  sheet->SetCell("A1"_pos, "8"s);
+  sheet->SetCell("B1"_pos, "=(2+3)*A1/4"s);
+  sheet->SetCell("B2"_pos, "=A1*(1/0)"s);
+  sheet->SetCell("B3"_pos, "=-(-C1)"s);
+  sheet->SetCell("B4"_pos, "=-C1+0"s);
+  sheet->SetCell("C2"_pos, "text"s);
+  sheet->SetCell("B5"_pos, "=C2*1"s);
+  assert(std::get<double>(sheet->GetCell("B1"_pos)->GetValue()) == 10);
+  assert(sheet->GetCell("B1"_pos)->GetText() == "=(2+3)*A1/4"s);
+  assert(std::get<FormulaError>(sheet->GetCell("B2"_pos)->GetValue()).GetCategory()
+             == FormulaError::Category::Div0);
+  assert(!std::signbit(std::get<double>(sheet->GetCell("B4"_pos)->GetValue())));
+  assert(std::get<FormulaError>(sheet->GetCell("B5"_pos)->GetValue()).GetCategory()
+             == FormulaError::Category::Value);
+
+  cerr << "TestConstantFolding OK"s << endl;
+}
+
+void TestFormulaInterning() {
+  Sheet sheet;
+  const auto &cache = sheet.GetFormulaCache();
+
+  for (int row = 0; row < 100; ++row) {
+    sheet.SetCell(Position{row, 0}, std::to_string(row));
+    sheet.SetCell(Position{row, 1}, "=1/3"s);
+  }
+  auto stats = cache.GetStats();
+  assert(stats.misses == 1);
+  assert(stats.hits == 99);
+  assert(stats.size == 1);
+
+  // Другая запись того же выражения разбирается, но формула разделяется
+  sheet.SetCell("D1"_pos, "=(1 / 3)"s);
+  sheet.SetCell("D2"_pos, "=(1 / 3)"s);
+  stats = cache.GetStats();
+  assert(stats.misses == 2);
+  assert(stats.hits == 100);
+  assert(stats.size == 1);
+  assert(sheet.GetCell("D2"_pos)->GetText() == "=1/3"s);
+  assert(std::get<double>(sheet.GetCell("D2"_pos)->GetValue()) == 1.0 / 3);
+
+  // У каждой ячейки свой кэш значения
+  sheet.SetCell("C1"_pos, "=A1+A2"s);
+  sheet.SetCell("C2"_pos, "=A1+A2"s);
+  assert(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()) == 1);
+  sheet.SetCell("A2"_pos, "5"s);
+  assert(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()) == 5);
+  assert(std::get<double>(sheet.GetCell("C2"_pos)->GetValue()) == 5);
+
+  // Некорректная формула в кэш не попадает
+  try {
+    sheet.SetCell("E1"_pos, "=1+"s);
+    assert(false);
+  } catch (const FormulaException &) {
+  }
+  assert(cache.GetStats().size == 2);
+
+  // Запись удаляется вместе с последней ячейкой, которая её использует
+  for (int row = 0; row < 100; ++row) {
+    sheet.ClearCell(Position{row, 1});
+  }
+  assert(cache.GetStats().size == 2);
+  sheet.SetCell("D1"_pos, "text"s);
+  sheet.ClearCell("D2"_pos);
+  stats = cache.GetStats();
+  assert(stats.size == 1);
+  assert(stats.evictions == 1);
+
+  // Близкие числа - разные выражения, в том числе после переноса записей при
+  // сдвиге ссылок
+  sheet.SetCell("F1"_pos, "=A1+0.1234567"s);
+  sheet.SetCell("F2"_pos, "=A1+0.1234568"s);
+  assert(cache.GetStats().size == 3);
+  assert(sheet.GetCell("F2"_pos)->GetText() == "=A1+0.1234568"s);
+  assert(std::get<double>(sheet.GetCell("F1"_pos)->GetValue()) == 0.1234567);
+  assert(std::get<double>(sheet.GetCell("F2"_pos)->GetValue()) == 0.1234568);
+  sheet.InsertRows(0);
+  auto hits = cache.GetStats().hits;
+  sheet.SetCell("F10"_pos, "=A2+0.1234568"s);
+  assert(cache.GetStats().hits == hits + 1);
+  assert(cache.GetStats().size == 3);
+  assert(std::get<double>(sheet.GetCell("F2"_pos)->GetValue()) == 0.1234567);
+  assert(std::get<double>(sheet.GetCell("F10"_pos)->GetValue()) == 0.1234568);
+
+  cerr << "TestFormulaInterning OK"s << endl;
+}
+
+void TestParserWarmUp() {
+  WarmUpFormulaParser();
+  WarmUpFormulaParser({"1+"s, "A1*(B2-3)"s});
+  assert(ParseFormula("(1+2)*A1")->GetExpression() == "(1+2)*A1"s);
+
+  cerr << "TestParserWarmUp OK"s << endl;
+}
+
+void TestTryParseFormula() {
+  auto error_offset = [](const std::string &expression) -> std::optional<size_t> {
+    auto result = TryParseFormula(expression);
+    if (auto error = std::get_if<FormulaParseError>(&result)) {
+      assert(!error->message.empty());
+      return error->offset;
+    }
+    return std::nullopt;
+  };
+
+  assert(!error_offset("1+2*A3"s));
+  assert(!error_offset(" ( -1.5e3 ) / .5 "s));
+  assert(error_offset(""s) == 0);
+  assert(error_offset("1+"s) == 2);
+  assert(error_offset("1 2"s) == 2);
+  assert(error_offset("(1+2"s) == 4);
+  assert(error_offset("1+2)"s) == 3);
+  assert(error_offset("a1"s) == 0);
+  // Имя без скобок: парсер ждёт '(' в конце формулы
+  assert(error_offset("A1+B"s) == 4);
+  assert(error_offset("2*ZZZZ1"s) == 2);
+  assert(error_offset("1e999"s) == 0);
+  assert(error_offset("1.+2"s) == 1);
+
+  auto result = TryParseFormula("(1+2)*A1"sv);
+  auto &formula = std::get<std::unique_ptr<FormulaInterface>>(result);
+  assert(formula->GetExpression() == "(1+2)*A1"s);
+  assert(formula->GetReferencedCells() == std::vector<Position>{"A1"_pos});
+
+  std::vector<std::string> expressions;
+  for (int i = 0; i < 1000; ++i) {
+    expressions.push_back(i % 3 == 0 ? "A"s + std::to_string(i + 1) + "+"s : "B1*"s + std::to_string(i));
+  }
+  auto sequential = ValidateFormulas(expressions);
+  auto parallel = ValidateFormulas(expressions, 4);
+  assert(sequential.size() == expressions.size());
+  for (size_t i = 0; i < expressions.size(); ++i) {
+    assert(sequential[i].has_value() == (i % 3 == 0));
+    assert(parallel[i].has_value() == sequential[i].has_value());
+    if (sequential[i]) {
+      assert(sequential[i]->offset == parallel[i]->offset);
+      assert(sequential[i]->offset == expressions[i].size());
+    }
+  }
+
+  auto sheet = CreateSheet();
+  try {
+    sheet->SetCell("A1"_pos, "=1+"s);
+    assert(false);
+  } catch (const FormulaException &) {
+  }
+  try {
+    ParseFormula("(("s);
+    assert(false);
+  } catch (const FormulaException &) {
+  }
+
+  cerr << "TestTryParseFormula OK"s << endl;
+}
+
+// Разбор без исключений с переиспользуемыми лексером и парсером принимает те
+// же формулы, что и разбор с исключениями: каждая конструкция грамматики по
+// отдельности и все последовательности до трёх лексем
+void TestTryParseMatchesParse() {
+  auto antlr_accepts = [](const std::string &expression) {
+    std::istringstream in(expression);
+    try {
+      ParseFormulaAST(in);
+      return true;
+    } catch (const std::exception &) {
+      return false;
+    }
+  };
+  auto check = [&antlr_accepts](const std::string &expression) {
+    auto result = TryParseFormulaAST(expression);
+    if (auto error = std::get_if<FormulaParseError>(&result)) {
+      assert(!error->message.empty() && error->offset <= expression.size());
+    }
+    if (std::holds_alternative<FormulaAST>(result) != antlr_accepts(expression)) {
+      cerr << "TryParseFormulaAST disagrees with ParseFormulaAST on '"s << expression << "'"s << endl;
+      assert(false);
+    }
+  };
+
+  const std::vector<std::string> constructs = {
+      // Parens, UnaryOp, BinaryOp, Comparison
+      "(1)", "((A1))", "-1", "+-+1", "-(A1)", "1+2", "1-2", "1*2", "1/2", "1+2*3-4/5",
+      "1=2", "1<>2", "1<2", "1<=2", "1>2", "1>=2", "1+2<3*4", "1=2=3", "(1<2)+1",
+      // Function
+      "IF(1,2)", "IF(1,2,3)", "AND(1)", "OR(1,2,3)", "AND(1<2,IF(1,2))", "MATCH(1,A1:A3)",
+      "MATCH(1,A1:C1,0)", "VLOOKUP(1,A1:B3,2)", "VLOOKUP(1,A1:B3,2,0)", "TRANSPOSE(A1:B2)",
+      "MMULT(A1:B2,A1:B2)", "IF ( 1 , 2 )", "IF\t(1,2)",
+      // Range, Cell
+      "A1", "XFD16384", "A1:B2", "A1 : B2", "B2:A1", "-A1", "A1+A1:A1",
+      // Literal
+      "0", "007", "1.5", ".5", "1e3", "1E3", "1e+3", "1e-3", ".5e2", "1.5E-2",
+      // WS
+      " 1 ", "\t1\n+\r2",
+      // Ошибки лексера
+      "a1", "1.", "1.e3", "1e", "1e+", "A", "A1:", ":A1", "1$", "1,2", "#1", "'1'",
+      // Ошибки структуры
+      "", " ", "()", "(", ")", "1)", "(1", "1 2", "A1 B1", "1+", "*1", "1**2", "1<", "1<<2",
+      "1=<2", "1><2", "A1:B2:C3", "1:2", "A1:1", "IF", "IF()", "IF(1,)", "IF(,1)", "IF(1",
+      "IF(1,2))", "(1,2)", "IF1(2)", "A1(1)", "1(2)",
+      // Имена, позиции, числа и аргументы функций
+      "IF(1)", "MATCH(1,2)", "MATCH(1,A1:B2)", "TRANSPOSE(A1:B2)+1", "FOO(1)", "ZZZZ1", "A0", "A1:ZZZZ1", "A16385", "XFE1", "1e999", ".1e999",
+  };
+  for (const auto &expression : constructs) {
+    check(expression);
+  }
+
+  // Лексемы каждого правила лексера, в том числе соседние, которые сливаются
+  // в одну лексему или дают ошибку
+  const std::vector<std::string> tokens = {
+      "1", ".5", "2e3", "1.", "A1", "ZZZZ1", "IF", "FOO", "(", ")", ",", ":", "+", "-", "*", "/",
+      "=", "<>", "<", "<=", ">", ">=", " ", "a", "e",
+  };
+  for (const auto &first : tokens) {
+    check(first);
+    for (const auto &second : tokens) {
+      check(first + second);
+      for (const auto &third : tokens) {
+        check(first + second + third);
+      }
+    }
+  }
+
+  cerr << "TestTryParseMatchesParse OK"s << endl;
+}
+
+void TestStaticResolver() {
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "2"s);
+  sheet.SetCell("A2"_pos, "'3"s);
+  sheet.SetCell("A3"_pos, " 4.5"s);
+  sheet.SetCell("A4"_pos, "=A1*10"s);
+  sheet.SetCell("A5"_pos, "text"s);
+  sheet.SetCell("A6"_pos, "=1/0"s);
+  sheet.SetCell("A7"_pos, "9"s);
+  sheet.ClearCell("A7"_pos);
+
+  auto evaluate_both = [&sheet](const std::string &expression) {
+    auto formula = ParseFormula(expression);
+    FormulaInterface::Value fast;
+    try {
+      fast = formula->GetAST().Execute(Sheet::ValueResolver(sheet));
+    } catch (const FormulaError &e) {
+      fast = e;
+    }
+    assert(fast == formula->Evaluate(sheet));
+    return fast;
+  };
+
+  assert(std::get<double>(evaluate_both("A1+A2+A3+A4+A7+A8"s)) == 29.5);
+  assert(std::get<FormulaError>(evaluate_both("A1+A5"s)).GetCategory() == FormulaError::Category::Value);
+  assert(std::get<FormulaError>(evaluate_both("A6*2"s)).GetCategory() == FormulaError::Category::Div0);
+  assert(std::get<FormulaError>(evaluate_both("A1/A7"s)).GetCategory() == FormulaError::Category::Div0);
+
+  // Длинная формула использует стек в куче
+  std::string long_expression = "A1"s;
+  for (int i = 0; i < 40; ++i) {
+    long_expression = "A1+("s + long_expression + ")"s;
+  }
+  assert(std::get<double>(evaluate_both(long_expression)) == 82);
+
+  sheet.SetCell("B1"_pos, "=A4+A2"s);
+  assert(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()) == 23);
+  sheet.SetCell("A1"_pos, "'oops"s);
+  assert(std::get<FormulaError>(sheet.GetCell("B1"_pos)->GetValue()).GetCategory()
+             == FormulaError::Category::Value);
+
+  cerr << "TestStaticResolver OK"s << endl;
+}
+
+void TestInsertDeleteRowsCols() {
+  auto text = [](const Sheet &sheet, Position pos) {
+    return sheet.GetCell(pos)->GetText();
+  };
+  auto number = [](const Sheet &sheet, Position pos) {
+    return std::get<double>(sheet.GetCell(pos)->GetValue());
+  };
+  auto is_ref_error = [](const Sheet &sheet, Position pos) {
+    auto value = sheet.GetCell(pos)->GetValue();
+    return std::holds_alternative<FormulaError>(value)
+        && std::get<FormulaError>(value).GetCategory() == FormulaError::Category::Ref;
+  };
+
+  {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1"s);
+    sheet.SetCell("A2"_pos, "2"s);
+    sheet.SetCell("A3"_pos, "=A1+A2"s);
+    sheet.SetCell("B5"_pos, "=A3*2"s);
+    sheet.SetCell("C1"_pos, "=A2+B1/A2"s);
+    sheet.SetCell("D1"_pos, "=A3*2"s);
+    assert(number(sheet, "B5"_pos) == 6);
+
+    sheet.InsertRows(1);
+    assert(sheet.GetCell("A2"_pos) == nullptr);
+    assert(text(sheet, "A4"_pos) == "=A1+A3");
+    assert(text(sheet, "B6"_pos) == "=A4*2");
+    assert(text(sheet, "C1"_pos) == "=A3+B1/A3");
+    assert(text(sheet, "D1"_pos) == "=A4*2");
+    assert(number(sheet, "B6"_pos) == 6);
+    assert((sheet.GetPrintableSize() == Size{6, 4}));
+
+    // Обратные связи перенесены вместе с ячейками
+    sheet.SetCell("A3"_pos, "10"s);
+    assert(number(sheet, "A4"_pos) == 11);
+    assert(number(sheet, "B6"_pos) == 22);
+    assert(number(sheet, "D1"_pos) == 22);
+    sheet.SetCell("C1"_pos, "=A3"s);
+    assert(number(sheet, "C1"_pos) == 10);
+
+    sheet.InsertCols(0, 2);
+    assert(text(sheet, "C4"_pos) == "=C1+C3");
+    assert(text(sheet, "F1"_pos) == "=C4*2");
+    assert(number(sheet, "F1"_pos) == 22);
+    sheet.DeleteCols(0, 2);
+    assert(text(sheet, "D1"_pos) == "=A4*2");
+
+    sheet.DeleteRows(0);
+    assert(text(sheet, "A3"_pos) == "=#REF!+A2");
+    assert(is_ref_error(sheet, "A3"_pos));
+    assert(is_ref_error(sheet, "B5"_pos));
+    assert(sheet.GetCell("C1"_pos) == nullptr);
+    assert((sheet.GetPrintableSize() == Size{5, 2}));
+
+    // Ячейку с #REF! можно перезаписать, циклы ищутся мимо удалённых ссылок
+    sheet.SetCell("E1"_pos, "=A3+1"s);
+    sheet.SetCell("A3"_pos, "=A2*3"s);
+    assert(number(sheet, "B5"_pos) == 60);
+    assert(number(sheet, "E1"_pos) == 31);
+    bool caught = false;
+    try {
+      sheet.SetCell("A2"_pos, "=E1"s);
+    } catch (const CircularDependencyException &) {
+      caught = true;
+    }
+    assert(caught);
+  }
+
+  {
+    // Разделяемые формулы переписываются один раз и остаются в кэше
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "5"s);
+    sheet.SetCell("A2"_pos, "6"s);
+    sheet.SetCell("B1"_pos, "=A1+A2"s);
+    sheet.SetCell("B2"_pos, "=A1 + A2"s);
+    sheet.SetCell("B3"_pos, "=A2+A3"s);
+    assert(sheet.GetFormulaCache().GetStats().size == 2);
+
+    sheet.InsertRows(0);
+    assert(text(sheet, "B2"_pos) == "=A2+A3");
+    assert(text(sheet, "B3"_pos) == "=A2+A3");
+    assert(text(sheet, "B4"_pos) == "=A3+A4");
+    assert(sheet.GetFormulaCache().GetStats().size == 2);
+    auto hits = sheet.GetFormulaCache().GetStats().hits;
+    sheet.SetCell("C1"_pos, "=A2+A3"s);
+    assert(sheet.GetFormulaCache().GetStats().hits == hits + 1);
+    assert(number(sheet, "C1"_pos) == 11);
+
+    // После удаления выражения могут совпасть
+    sheet.DeleteRows(1, 2);
+    assert(text(sheet, "B2"_pos) == "=#REF!+A2");
+    sheet.SetCell("A2"_pos, "1"s);
+    assert(is_ref_error(sheet, "B2"_pos));
+    assert(is_ref_error(sheet, "C1"_pos));
+  }
+
+  {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=A16384+1"s);
+    sheet.SetCell(Position{Position::MAX_ROWS_ZB - 1, 1}, "x"s);
+    sheet.InsertRows(0);
+    assert(text(sheet, "A2"_pos) == "=#REF!+1");
+    assert(is_ref_error(sheet, "A2"_pos));
+
+    bool caught = false;
+    try {
+      sheet.InsertRows(5);
+    } catch (const TableTooBigException &) {
+      caught = true;
+    }
+    assert(caught);
+    assert(text(sheet, Position{Position::MAX_ROWS_ZB, 1}) == "x");
+
+    caught = false;
+    try {
+      sheet.DeleteCols(Position::MAX_COLS_ZB, 2);
+    } catch (const InvalidPositionException &) {
+      caught = true;
+    }
+    assert(caught);
+  }
+
+  cerr << "TestInsertDeleteRowsCols OK"s << endl;
+}
+
+void TestSheetSnapshot() {
+  auto value = [](const SheetInterface &sheet, Position pos) {
+    return sheet.GetCell(pos)->GetValue();
+  };
+  auto print = [](const SheetInterface &sheet) {
+    std::ostringstream out;
+    sheet.PrintValues(out);
+    return out.str();
+  };
+
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1"s);
+  sheet.SetCell("A2"_pos, "=A1*2"s);
+  sheet.SetCell("B1"_pos, "'=text"s);
+  sheet.SetCell("Z99"_pos, "=A2+B3"s);
+
+  auto first = sheet.Snapshot();
+  assert(first->GetVersion() == sheet.GetVersion());
+  sheet.SetCell("A1"_pos, "5"s);
+  auto second = sheet.Snapshot();
+
+  assert(value(*first, "A2"_pos) == CellInterface::Value(2.0));
+  assert(value(*second, "A2"_pos) == CellInterface::Value(10.0));
+  assert(value(*first, "Z99"_pos) == CellInterface::Value(2.0));
+  assert(value(*second, "Z99"_pos) == CellInterface::Value(10.0));
+  assert(value(*second, "B1"_pos) == CellInterface::Value("=text"s));
+  assert(second->GetCell("B1"_pos)->GetText() == "'=text");
+  assert(second->GetCell("C3"_pos) == nullptr);
+  assert((first->GetPrintableSize() == Size{99, 26}));
+  assert(first->GetVersion() < second->GetVersion());
+
+  // Неизменённые ячейки и их значения разделяются снимками
+  assert(first->GetCell("B1"_pos) == second->GetCell("B1"_pos));
+  assert(first->GetCell("A2"_pos) != second->GetCell("A2"_pos));
+  auto unchanged = sheet.Snapshot();
+  assert(unchanged->GetCell("Z99"_pos) == second->GetCell("Z99"_pos));
+
+  sheet.ClearCell("A1"_pos);
+  assert(value(sheet, "A2"_pos) == CellInterface::Value(0.0));
+  auto cleared = sheet.Snapshot();
+  assert(cleared->GetCell("A1"_pos) == nullptr);
+  assert(value(*cleared, "A2"_pos) == CellInterface::Value(0.0));
+  assert(value(*second, "A2"_pos) == CellInterface::Value(10.0));
+
+  bool caught = false;
+  try {
+    std::const_pointer_cast<SheetSnapshot>(cleared)->SetCell("A1"_pos, "1"s);
+  } catch (const std::logic_error &) {
+    caught = true;
+  }
+  assert(caught);
+
+  // Сдвиг строк не меняет формулы, которые читают снимки
+  sheet.SetCell("A1"_pos, "3"s);
+  auto before_shift = sheet.Snapshot();
+  sheet.InsertRows(0);
+  auto after_shift = sheet.Snapshot();
+  assert(before_shift->GetCell("A2"_pos)->GetText() == "=A1*2");
+  assert(value(*before_shift, "A2"_pos) == CellInterface::Value(6.0));
+  assert(after_shift->GetCell("A3"_pos)->GetText() == "=A2*2");
+  assert(value(*after_shift, "A3"_pos) == CellInterface::Value(6.0));
+  assert(sheet.GetCell("A3"_pos)->GetText() == "=A2*2");
+
+  // Читатели не блокируют изменения листа
+  Sheet large;
+  for (int i = 0; i < 200; ++i) {
+    large.SetCell({i, 0}, std::to_string(i));
+    large.SetCell({i, 1}, "=A"s + std::to_string(i + 1) + "*2"s);
+  }
+  auto pinned = large.Snapshot();
+  auto expected = print(*pinned);
+  std::vector<std::thread> readers;
+  std::atomic<bool> consistent = true;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&pinned, &expected, &consistent, &print] {
+      for (int round = 0; round < 20; ++round) {
+        consistent = consistent && print(*pinned) == expected;
+      }
+    });
+  }
+  for (int i = 0; i < 200; ++i) {
+    large.SetCell({i, 0}, std::to_string(i * 10));
+    if (i % 50 == 0) {
+      large.Snapshot();
+    }
+  }
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  assert(consistent);
+  assert(value(*large.Snapshot(), "B200"_pos) == CellInterface::Value(3980.0));
+
+  cerr << "TestSheetSnapshot OK"s << endl;
+}
+
+
+void TestConcurrentReads() {
+  constexpr int rows = 300;
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1"s);
+  for (int i = 1; i < rows; ++i) {
+    // Цепочка: каждая ячейка зависит от предыдущей и от ячейки первого столбца
+    sheet.SetCell({i, 0}, "=A"s + std::to_string(i) + "+1"s);
+    sheet.SetCell({i, 1}, "=A"s + std::to_string(i + 1) + "*2"s);
+  }
+  sheet.SetCell({rows, 0}, "=1/0"s);
+
+  auto read_all = [&sheet](bool backwards) {
+    std::vector<CellInterface::Value> values(rows * 2);
+    for (int k = 0; k < rows * 2; ++k) {
+      int i = backwards ? rows * 2 - 1 - k : k;
+      if (auto cell = sheet.GetCell({i / 2, i % 2})) {
+        values[i] = cell->GetValue();
+      }
+    }
+    return values;
+  };
+
+  for (int round = 0; round < 3; ++round) {
+    CellCacheStat::Reset();
+    std::vector<std::thread> readers;
+    std::vector<std::vector<CellInterface::Value>> results(8);
+    for (int t = 0; t < 8; ++t) {
+      readers.emplace_back([&, t] {
+        results[t] = read_all(t % 2 == 1);
+        // Ошибки не кэшируются и вычисляются каждый раз
+        assert(std::holds_alternative<FormulaError>(sheet.GetCell({rows, 0})->GetValue()));
+      });
+    }
+    for (auto &reader : readers) {
+      reader.join();
+    }
+
+    for (const auto &values : results) {
+      for (int i = 1; i < rows; ++i) {
+        assert(values[i * 2] == CellInterface::Value(double(i + 1)));
+        assert(values[i * 2 + 1] == CellInterface::Value(double(i + 1) * 2));
+      }
+    }
+    // Каждое значение вычислено хотя бы раз и опубликовано
+    assert(CellCacheStat::missed >= size_t(rows * 2 - 2));
+    CellCacheStat::Reset();
+    read_all(false);
+    assert(CellCacheStat::missed == 0);
+    assert(CellCacheStat::hit == size_t(rows * 2 - 2));
+
+    // Писатель меняет лист, пока читателей нет
+    sheet.SetCell("A1"_pos, "1"s);
+  }
+
+  cerr << "TestConcurrentReads OK"s << endl;
+}
+
+void TestConcurrentWriters() {
+  constexpr int threads = 8;
+  constexpr int band = 40;
+  Sheet sheet;
+  auto row_name = [](int row) {
+    return std::to_string(row + 1);
+  };
+
+  std::vector<std::thread> writers;
+  for (int t = 0; t < threads; ++t) {
+    writers.emplace_back([&, t] {
+      for (int row = t * band; row < (t + 1) * band; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row));
+        sheet.SetCell({row, 1}, "=A"s + row_name(row) + "*2"s);
+        // Ссылка в полосу соседнего потока, возможно ещё пустую
+        if (t > 0) {
+          sheet.SetCell({row, 2}, "=B"s + row_name(row - band) + "+1"s);
+        }
+        sheet.SetCell({row, 3}, "temp"s);
+        sheet.ClearCell({row, 3});
+      }
+    });
+  }
+  for (auto &writer : writers) {
+    writer.join();
+  }
+
+  assert(sheet.GetPrintableSize() == (Size{threads * band, 3}));
+  for (int row = 0; row < threads * band; ++row) {
+    assert(sheet.GetCell({row, 1})->GetValue() == CellInterface::Value(row * 2.0));
+    if (row >= band) {
+      assert(sheet.GetCell({row, 2})->GetValue() == CellInterface::Value((row - band) * 2.0 + 1));
+    }
+    assert(sheet.GetCell({row, 3}) == nullptr);
+  }
+
+  // Встречные ссылки в разных шардах: цикл замечает один из потоков
+  constexpr int pairs = 50;
+  std::atomic<int> cycles = 0;
+  auto link = [&](int column, int other) {
+    for (int i = 0; i < pairs; ++i) {
+      Position pos{i * SheetSnapshot::TILE_SIZE, column};
+      Position target{i * SheetSnapshot::TILE_SIZE, other};
+      try {
+        sheet.SetCell(pos, "="s + target.ToString());
+      } catch (const CircularDependencyException &) {
+        ++cycles;
+      }
+    }
+  };
+  std::thread first(link, 100, 200);
+  std::thread second(link, 200, 100);
+  first.join();
+  second.join();
+  assert(cycles == pairs);
+
+  cerr << "TestConcurrentWriters OK"s << endl;
+}
+
+void TestAsyncRecalculation() {
+  auto value = [](const SheetInterface &sheet, Position pos) {
+    return sheet.GetCell(pos)->GetValue();
+  };
+
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1"s);
+  sheet.SetCell("A2"_pos, "=A1+1"s);
+  AsyncRecalculator recalc(sheet);
+  auto initial = recalc.GetComputed();
+  assert(initial->GetVersion() == sheet.GetVersion());
+  assert(value(*initial, "A2"_pos) == CellInterface::Value(2.0));
+
+  // Цепочка формул пересчитывается в фоне
+  size_t version = 0;
+  for (int row = 2; row < 500; ++row) {
+    version = recalc.SetCell({row, 0}, "=A"s + std::to_string(row) + "+1"s);
+  }
+  auto computed = recalc.WaitForVersion(version);
+  assert(computed->GetVersion() >= version);
+  assert(value(*computed, "A500"_pos) == CellInterface::Value(500.0));
+  // Ранее вычисленный снимок не меняется
+  assert(initial->GetCell("A500"_pos) == nullptr);
+
+  // Без ожидания читается последний вычисленный снимок целиком
+  version = recalc.SetCell("A1"_pos, "100"s);
+  auto last = recalc.GetComputed();
+  auto expected = last->GetVersion() >= version ? 599.0 : 500.0;
+  assert(value(*last, "A500"_pos) == CellInterface::Value(expected));
+  assert(value(*recalc.WaitForVersion(version), "A500"_pos) == CellInterface::Value(599.0));
+
+  version = recalc.ClearCell("A1"_pos);
+  assert(value(*recalc.WaitForVersion(version), "A500"_pos) == CellInterface::Value(499.0));
+
+  try {
+    recalc.SetCell("A1"_pos, "=A500"s);
+    assert(false);
+  } catch (const CircularDependencyException &) {
+  }
+  // Изменения из нескольких потоков
+  std::vector<std::thread> writers;
+  std::vector<size_t> versions(4);
+  for (int t = 0; t < 4; ++t) {
+    writers.emplace_back([&, t] {
+      for (int row = 0; row < 50; ++row) {
+        versions[t] = recalc.SetCell({row, t + 1}, "=A"s + std::to_string(row + 1) + "*2"s);
+      }
+    });
+  }
+  for (auto &writer : writers) {
+    writer.join();
+  }
+  computed = recalc.WaitForVersion(*std::max_element(versions.begin(), versions.end()));
+  assert(value(*computed, "E50"_pos) == CellInterface::Value(98.0));
+
+  // Кэши зависимых формул листа сбрасываются отдельно от изменения
+  auto live_owner = std::make_unique<Sheet>();
+  Sheet &live = *live_owner;
+  live.SetCell("A1"_pos, "=1"s);
+  live.SetCell("A2"_pos, "=A1+1"s);
+  assert(value(live, "A2"_pos) == CellInterface::Value(2.0));
+  live.DeferInvalidation(true);
+  live.SetCell("A1"_pos, "=5"s);
+  assert(value(live, "A2"_pos) == CellInterface::Value(2.0));
+  live.InvalidatePending();
+  assert(value(live, "A2"_pos) == CellInterface::Value(6.0));
+  live.ClearCell("A1"_pos);
+  live.InsertRows(0);
+  assert(value(live, "A3"_pos) == CellInterface::Value(1.0));
+  live.DeferInvalidation(false);
+  {
+    AsyncRecalculator attached(live);
+    attached.SetCell("A2"_pos, "=10"s);
+  }
+  assert(value(live, "A3"_pos) == CellInterface::Value(11.0));
+
+  cerr << "TestAsyncRecalculation OK"s << endl;
+}
+
+void TestRecalcScheduler() {
+  using namespace std::chrono_literals;
+  Sheet sheet;
+  RecalcScheduler scheduler(sheet);
+  scheduler.SetCell("A1"_pos, "1"s);
+  for (int row = 0; row < 200; ++row) {
+    auto name = std::to_string(row + 1);
+    // Столбец B - длинная цепочка, столбец C зависит только от A1
+    scheduler.SetCell({row, 1}, row == 0 ? "=A1"s : "=B"s + std::to_string(row) + "+1"s);
+    scheduler.SetCell({row, 2}, "=A1*"s + name);
+  }
+  while (scheduler.Recalculate(1ms)) {
+  }
+  assert(scheduler.GetPendingCount() == 0);
+
+  // Видимая область вычисляется первой
+  scheduler.SetViewport("C150"_pos, {10, 1});
+  scheduler.SetCell("A1"_pos, "2"s);
+  assert(!scheduler.IsViewportReady());
+  CellCacheStat::Reset();
+  while (!scheduler.IsViewportReady()) {
+    assert(scheduler.Recalculate(0s));
+  }
+  assert(CellCacheStat::missed == 10);
+  assert(scheduler.GetPendingCount() == 390);
+
+  // Изменение посреди пересчёта
+  assert(scheduler.Recalculate(0s));
+  scheduler.SetViewport("B190"_pos, {11, 1});
+  scheduler.SetCell("B1"_pos, "=A1*10"s);
+  CellCacheStat::Reset();
+  size_t slices = 1;
+  while (scheduler.Recalculate(0s)) {
+    ++slices;
+  }
+  assert(slices > 1);
+  // Каждая формула вычисляется не больше одного раза и без рекурсии
+  assert(CellCacheStat::missed <= 389);
+  assert(scheduler.GetPendingCount() == 0);
+  CellCacheStat::Reset();
+  assert(sheet.GetCell("B200"_pos)->GetValue() == CellInterface::Value(219.0));
+  assert(sheet.GetCell("C200"_pos)->GetValue() == CellInterface::Value(400.0));
+  assert(CellCacheStat::missed == 0);
+
+  cerr << "TestRecalcScheduler OK"s << endl;
+}
+
+void TestGetValues() {
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1"s);
+  sheet.SetCell("A2"_pos, "'=text"s);
+  sheet.SetCell("B1"_pos, "=A1/0"s);
+  sheet.SetCell("B2"_pos, "=A2+1"s);
+  sheet.SetCell("C1"_pos, "=A1+10"s);
+  sheet.SetCell("C3"_pos, "=C1*2"s);
+
+  constexpr int rows = 3;
+  constexpr int cols = 3;
+  std::vector<double> numbers(rows * cols, -1);
+  std::vector<ValueTag> tags(rows * cols);
+  std::vector<std::string_view> texts(rows * cols);
+  sheet.GetValues("A1"_pos, {rows, cols}, {numbers.data(), tags.data(), texts.data()});
+
+  auto at = [](int row, int col) {
+    return col * rows + row;
+  };
+  assert(tags[at(0, 0)] == ValueTag::TEXT && texts[at(0, 0)] == "1"sv);
+  assert(tags[at(1, 0)] == ValueTag::TEXT && texts[at(1, 0)] == "=text"sv);
+  assert(tags[at(2, 0)] == ValueTag::EMPTY && numbers[at(2, 0)] == 0);
+  assert(tags[at(0, 1)] == ValueTag::DIV0_ERROR);
+  assert(tags[at(1, 1)] == ValueTag::VALUE_ERROR);
+  assert(tags[at(0, 2)] == ValueTag::NUMBER && numbers[at(0, 2)] == 11);
+  assert(tags[at(2, 2)] == ValueTag::NUMBER && numbers[at(2, 2)] == 22);
+
+  // Длинная цепочка вычисляется без глубокой рекурсии, каждая формула один раз
+  constexpr int chain = 3000;
+  for (int row = 1; row < chain; ++row) {
+    sheet.SetCell({row, 4}, "=E"s + std::to_string(row) + "+1"s);
+  }
+  sheet.SetCell("E1"_pos, "=1"s);
+  numbers.assign(1, 0);
+  tags.assign(1, ValueTag::EMPTY);
+  texts.assign(1, {});
+  CellCacheStat::Reset();
+  sheet.GetValues({chain - 1, 4}, {1, 1}, {numbers.data(), tags.data(), texts.data()});
+  assert(tags[0] == ValueTag::NUMBER && numbers[0] == chain);
+  assert(CellCacheStat::missed == size_t(chain));
+
+  try {
+    sheet.GetValues({Position::MAX_ROWS - 1, 0}, {2, 1}, {numbers.data(), tags.data(), texts.data()});
+    assert(false);
+  } catch (const InvalidPositionException &) {
+  }
+
+  cerr << "TestGetValues OK"s << endl;
+}
+
+void TestSubscriptions() {
+  using namespace std::chrono_literals;
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1"s);
+  sheet.SetCell("B1"_pos, "=A1*2"s);
+  sheet.SetCell("B2"_pos, "=A1/A3"s);
+  sheet.SetCell("C1"_pos, "=B1"s);
+
+  std::vector<std::vector<Position>> calls;
+  auto id = sheet.Subscribe("A1"_pos, {3, 2}, [&calls](const std::vector<Position> &changed) {
+    calls.push_back(changed);
+  });
+  sheet.NotifyChanges();
+  assert(calls.empty());
+
+  // Изменения пакета сообщаются одним списком
+  sheet.SetCell("A1"_pos, "2"s);
+  sheet.SetCell("A1"_pos, "3"s);
+  sheet.SetCell("A3"_pos, "1"s);
+  sheet.NotifyChanges();
+  assert(calls.size() == 1);
+  assert((calls[0] == std::vector{"A1"_pos, "A3"_pos, "B1"_pos, "B2"_pos}));
+
+  // Значение не изменилось; изменения вне области
+  calls.clear();
+  sheet.SetCell("A1"_pos, "3"s);
+  sheet.SetCell("C1"_pos, "=B1+1"s);
+  sheet.SetCell("D5"_pos, "text"s);
+  sheet.NotifyChanges();
+  assert(calls.empty());
+
+  sheet.ClearCell("A3"_pos);
+  sheet.NotifyChanges();
+  assert(calls.size() == 1);
+  assert((calls[0] == std::vector{"A3"_pos, "B2"_pos}));
+  assert(std::get<FormulaError>(sheet.GetCell("B2"_pos)->GetValue()).GetCategory()
+         == FormulaError::Category::Div0);
+
+  // Сдвиг строк: область проверяется целиком
+  calls.clear();
+  sheet.InsertRows(1);
+  sheet.NotifyChanges();
+  assert(calls.size() == 1);
+  assert((calls[0] == std::vector{"B2"_pos, "B3"_pos}));
+
+  // Пересчёт квантами сообщает изменения, когда видимая область готова
+  calls.clear();
+  RecalcScheduler scheduler(sheet);
+  scheduler.SetViewport("A1"_pos, {3, 2});
+  scheduler.SetCell("A1"_pos, "5"s);
+  while (scheduler.Recalculate(0s)) {
+  }
+  assert(calls.size() == 1);
+  assert((calls[0] == std::vector{"A1"_pos, "B1"_pos}));
+
+  calls.clear();
+  sheet.Unsubscribe(id);
+  sheet.SetCell("A1"_pos, "6"s);
+  sheet.NotifyChanges();
+  assert(calls.empty());
+
+  cerr << "TestSubscriptions OK"s << endl;
+}
+
+void TestScenarios() {
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "2"s);
+  sheet.SetCell("A2"_pos, "3"s);
+  sheet.SetCell("A3"_pos, "text"s);
+  sheet.SetCell("B1"_pos, "=A1*A2"s);
+  sheet.SetCell("B2"_pos, "=B1/(A1-1)+B1"s);
+  sheet.SetCell("B3"_pos, "=A3+A1"s);
+  sheet.SetCell("C1"_pos, "=B2-A2+C5"s);
+  sheet.SetCell("C2"_pos, "=B3"s);
+  // Вне зависимостей выхода
+  sheet.SetCell("D1"_pos, "=A1+1"s);
+
+  ScenarioProgram program(sheet, {"A1"_pos, "A2"_pos}, "C1"_pos);
+  assert(program.GetInputCount() == 2);
+  assert(program.GetFormulaCount() == 3);
+
+  // Ответы сверяются с изменением листа; сценариев больше, чем в одном блоке
+  std::vector<double> inputs;
+  for (int i = 0; i < 21; ++i) {
+    inputs.push_back(i % 5 == 0 ? 1 : i * 0.5);
+    inputs.push_back(i - 10);
+  }
+  CellCacheStat::Reset();
+  auto results = program.Evaluate(inputs);
+  assert(CellCacheStat::missed == 0 && CellCacheStat::invalidate == 0);
+  assert(program.Evaluate(inputs, 3) == results);
+
+  Sheet edited;
+  for (auto pos : {"A3"_pos, "B1"_pos, "B2"_pos, "B3"_pos, "C1"_pos}) {
+    edited.SetCell(pos, sheet.GetCell(pos)->GetText());
+  }
+  for (size_t i = 0; i < results.size(); ++i) {
+    edited.SetCell("A1"_pos, std::to_string(inputs[i * 2]));
+    edited.SetCell("A2"_pos, std::to_string(inputs[i * 2 + 1]));
+    auto expected = edited.GetCell("C1"_pos)->GetValue();
+    if (auto error = std::get_if<FormulaError>(&expected)) {
+      assert(error->GetCategory() == FormulaError::Category::Div0);
+      assert(std::get<FormulaError>(results[i]) == *error);
+    } else {
+      assert(std::abs(std::get<double>(results[i]) - std::get<double>(expected)) < 1e-9);
+    }
+  }
+  // Лист не изменился
+  assert(sheet.GetCell("C1"_pos)->GetValue() == CellInterface::Value(9.0));
+
+  // Ошибка ячейки вне входов
+  ScenarioProgram text(sheet, {"A1"_pos}, "C2"_pos);
+  auto text_results = text.Evaluate({1, 2});
+  assert(std::get<FormulaError>(text_results[1]).GetCategory() == FormulaError::Category::Value);
+  // Выход - сам вход
+  assert(ScenarioProgram(sheet, {"A1"_pos}, "A1"_pos).Evaluate({4})[0] == FormulaInterface::Value(4.0));
+
+  try {
+    program.Evaluate({1, 2, 3});
+    assert(false);
+  } catch (const std::invalid_argument &) {
+  }
+  try {
+    ScenarioProgram(sheet, {"A1"_pos, "A1"_pos}, "C1"_pos);
+    assert(false);
+  } catch (const std::invalid_argument &) {
+  }
+
+  cerr << "TestScenarios OK"s << endl;
+}
+
+void TestConditionals() {
+  auto value = [](const Sheet &sheet, Position pos) {
+    return sheet.GetCell(pos)->GetValue();
+  };
+  auto error_message = [](const std::string &expression) {
+    auto result = TryParseFormula(expression);
+    auto error = std::get_if<FormulaParseError>(&result);
+    return error != nullptr ? error->message : ""s;
+  };
+
+  assert(ParseFormula("IF(A1>0,B1,C1)")->GetExpression() == "IF(A1>0,B1,C1)"s);
+  assert(ParseFormula("(A1<B1)+1")->GetExpression() == "(A1<B1)+1"s);
+  assert(ParseFormula("A1<(B1<C1)")->GetExpression() == "A1<(B1<C1)"s);
+  assert(ParseFormula("A1+1>=2*B1")->GetExpression() == "A1+1>=2*B1"s);
+  assert(ParseFormula("AND(A1,OR(B1,C1))")->GetReferencedCells()
+             == (std::vector<Position>{"A1"_pos, "B1"_pos, "C1"_pos}));
+  assert(error_message("SUM(A1)").find("Unknown function") != std::string::npos);
+  assert(error_message("IF(A1)").find("Wrong number of arguments") != std::string::npos);
+  assert(!error_message("1,2").empty());
+  assert(!error_message("IF A1").empty());
+
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1"s);
+  sheet.SetCell("A2"_pos, "2"s);
+  sheet.SetCell("B1"_pos, "=A1<A2"s);
+  sheet.SetCell("B2"_pos, "=(A1=A2)+(A1<>A2)*10+(A2>=2)*100"s);
+  sheet.SetCell("B3"_pos, "=IF(A1>A2,5)"s);
+  sheet.SetCell("B4"_pos, "=IF(A1>0,A2,1/0)"s);
+  sheet.SetCell("B5"_pos, "=AND(A1,A2-2,1/0)+OR(0,A1,1/0)*10"s);
+  sheet.SetCell("B6"_pos, "=IF(1>2,A1,A2)"s);
+  sheet.SetCell("B7"_pos, "=AND(A1,1/0)"s);
+  assert(value(sheet, "B1"_pos) == CellInterface::Value(1.0));
+  assert(value(sheet, "B2"_pos) == CellInterface::Value(110.0));
+  assert(value(sheet, "B3"_pos) == CellInterface::Value(0.0));
+  assert(value(sheet, "B4"_pos) == CellInterface::Value(2.0));
+  assert(value(sheet, "B5"_pos) == CellInterface::Value(10.0));
+  assert(value(sheet, "B6"_pos) == CellInterface::Value(2.0));
+  assert(std::get<FormulaError>(value(sheet, "B7"_pos)).GetCategory()
+             == FormulaError::Category::Div0);
+
+  // Невыбранная ветвь не вычисляется
+  sheet.SetCell("C1"_pos, "=A1+A2"s);
+  sheet.SetCell("C2"_pos, "=A1/0"s);
+  sheet.SetCell("C3"_pos, "=IF(A1>0,C1,C2)"s);
+  CellCacheStat::Reset();
+  assert(value(sheet, "C3"_pos) == CellInterface::Value(3.0));
+  assert(CellCacheStat::missed == 2);
+
+  // Изменение ячейки, которую формула при последнем вычислении не читала,
+  // не сбрасывает её кэш
+  sheet.SetCell("C2"_pos, "=A1/2"s);
+  assert(static_cast<const Cell *>(sheet.GetCell("C3"_pos))->IsCached());
+  sheet.SetCell("A1"_pos, "-1"s);
+  assert(!static_cast<const Cell *>(sheet.GetCell("C3"_pos))->IsCached());
+  assert(value(sheet, "C3"_pos) == CellInterface::Value(-0.5));
+  sheet.SetCell("C1"_pos, "7"s);
+  assert(static_cast<const Cell *>(sheet.GetCell("C3"_pos))->IsCached());
+  sheet.SetCell("C2"_pos, "=A1*4"s);
+  assert(value(sheet, "C3"_pos) == CellInterface::Value(-4.0));
+
+  std::vector<double> numbers(2);
+  std::vector<ValueTag> tags(2);
+  std::vector<std::string_view> texts(2);
+  sheet.GetValues("C3"_pos, {2, 1}, {numbers.data(), tags.data(), texts.data()});
+  assert(tags[0] == ValueTag::NUMBER && numbers[0] == -4);
+
+  // Сценарии с расходящимися условиями сверяются с изменением листа
+  Sheet model;
+  model.SetCell("B1"_pos, "=IF(A1>2,A1*2,IF(A1<-2,1/(A1+3),A1))"s);
+  model.SetCell("B2"_pos, "=OR(A1=0,A1>4)+AND(A1<>1,B1)*10"s);
+  std::vector<double> inputs;
+  for (int i = -8; i < 12; ++i) {
+    inputs.push_back(i * 0.5);
+  }
+  for (auto output : {"B1"_pos, "B2"_pos}) {
+    model.SetCell("A1"_pos, "0"s);
+    auto results = ScenarioProgram(model, {"A1"_pos}, output).Evaluate(inputs);
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      model.SetCell("A1"_pos, std::to_string(inputs[i]));
+      auto expected = value(model, output);
+      if (auto error = std::get_if<FormulaError>(&expected)) {
+        assert(std::get<FormulaError>(results[i]) == *error);
+      } else {
+        assert(std::get<double>(results[i]) == std::get<double>(expected));
+      }
+    }
+  }
+
+  cerr << "TestConditionals OK"s << endl;
+}
+void TestLookups() {
+  auto value = [](const SheetInterface &sheet, Position pos) {
+    return sheet.GetCell(pos)->GetValue();
+  };
+  auto category = [&value](const SheetInterface &sheet, Position pos) {
+    return std::get<FormulaError>(value(sheet, pos)).GetCategory();
+  };
+  auto error_message = [](const std::string &expression) {
+    auto result = TryParseFormula(expression);
+    auto error = std::get_if<FormulaParseError>(&result);
+    return error != nullptr ? error->message : ""s;
+  };
+
+  assert(ParseFormula("MATCH(A1,B1:B10)")->GetExpression() == "MATCH(A1,B1:B10)"s);
+  assert(ParseFormula("VLOOKUP(A1+1, B10:A1 ,2,0)")->GetExpression() == "VLOOKUP(A1+1,A1:B10,2,0)"s);
+  assert(ParseFormula("MATCH(A1,B1:B10)")->GetReferencedCells() == (std::vector<Position>{"A1"_pos}));
+  assert(ParseFormula("VLOOKUP(1,A1:B2,2)+MATCH(1,A1:A2)+MATCH(2,A1:A2)")->GetReferencedRanges()
+             == (std::vector<Range>{{"A1"_pos, "A2"_pos}, {"A1"_pos, "B2"_pos}}));
+  assert(!error_message("MATCH(1,A1:A2)+A1:A2").empty());
+  assert(!error_message("A1:A2>1").empty());
+  assert(!error_message("IF(A1:A2,1)").empty());
+  assert(!error_message("MATCH(A1:A2,A1:A2)").empty());
+  assert(!error_message("MATCH(1,A1)").empty());
+  assert(!error_message("MATCH(1,A1:B2)").empty());
+  assert(!error_message("MATCH(1,A1:A2,0,0)").empty());
+  assert(!error_message("VLOOKUP(1,A1:B2)").empty());
+  assert(!error_message("MATCH(1,A1:A2+1)").empty());
+
+  Sheet sheet;
+  for (int row = 0; row < 6; ++row) {
+    sheet.SetCell({row, 0}, std::to_string(row * 10));
+    sheet.SetCell({row, 1}, "=A" + std::to_string(row + 1) + "*2");
+  }
+  sheet.SetCell("A7"_pos, "text"s);
+  sheet.SetCell("D1"_pos, "=MATCH(30,A1:A7,0)"s);
+  sheet.SetCell("D2"_pos, "=MATCH(35,A1:A7)"s);
+  sheet.SetCell("D3"_pos, "=MATCH(35,A1:A7,-1)"s);
+  sheet.SetCell("D4"_pos, "=MATCH(35,A1:A7,0)"s);
+  sheet.SetCell("D5"_pos, "=VLOOKUP(20,A1:B7,2,0)"s);
+  sheet.SetCell("D6"_pos, "=VLOOKUP(29,A1:B7,2)"s);
+  sheet.SetCell("D7"_pos, "=VLOOKUP(20,A1:B7,3,0)"s);
+  sheet.SetCell("D8"_pos, "=MATCH(20,B1:B7,0)"s);
+  sheet.SetCell("D9"_pos, "=MATCH(-1,A1:A7)"s);
+  sheet.SetCell("D10"_pos, "=MATCH(4,A1:F1,0)"s);
+  assert(value(sheet, "D1"_pos) == CellInterface::Value(4.0));
+  assert(value(sheet, "D2"_pos) == CellInterface::Value(4.0));
+  assert(value(sheet, "D3"_pos) == CellInterface::Value(5.0));
+  assert(category(sheet, "D4"_pos) == FormulaError::Category::NA);
+  assert(value(sheet, "D5"_pos) == CellInterface::Value(40.0));
+  assert(value(sheet, "D6"_pos) == CellInterface::Value(40.0));
+  assert(category(sheet, "D7"_pos) == FormulaError::Category::Ref);
+  assert(value(sheet, "D8"_pos) == CellInterface::Value(2.0));
+  assert(category(sheet, "D9"_pos) == FormulaError::Category::NA);
+  assert(value(sheet, "D10"_pos) == CellInterface::Value(4.0));
+  assert(std::get<FormulaError>(value(sheet, "D4"_pos)).ToString() == "#N/A"s);
+  auto dependents = sheet.GetDependents("A3"_pos);
+  std::vector<Position> expected{"B3"_pos, "D1"_pos, "D2"_pos, "D3"_pos, "D4"_pos,
+                                 "D5"_pos, "D6"_pos, "D7"_pos, "D9"_pos};
+  std::sort(dependents.begin(), dependents.end());
+  std::sort(expected.begin(), expected.end());
+  assert(dependents == expected);
+
+  // Изменения ячеек области доходят до построенных индексов
+  sheet.SetCell("A2"_pos, "35"s);
+  assert(value(sheet, "D4"_pos) == CellInterface::Value(2.0));
+  assert(value(sheet, "D2"_pos) == CellInterface::Value(2.0));
+  sheet.ClearCell("A2"_pos);
+  assert(category(sheet, "D4"_pos) == FormulaError::Category::NA);
+  assert(value(sheet, "D2"_pos) == CellInterface::Value(4.0));
+  sheet.SetCell("A2"_pos, "=A1+10"s);
+  assert(value(sheet, "D8"_pos) == CellInterface::Value(2.0));
+  sheet.SetCell("A1"_pos, "1"s);
+  assert(category(sheet, "D8"_pos) == FormulaError::Category::NA);
+  assert(value(sheet, "D5"_pos) == CellInterface::Value(40.0));
+  sheet.SetCell("A6"_pos, "20"s);
+  sheet.SetCell("B6"_pos, "99"s);
+  assert(value(sheet, "D5"_pos) == CellInterface::Value(40.0));
+  sheet.SetCell("A3"_pos, "=1/0"s);
+  assert(value(sheet, "D5"_pos) == CellInterface::Value(99.0));
+  sheet.SetCell("A3"_pos, "20"s);
+  sheet.SetCell("A6"_pos, "50"s);
+  sheet.SetCell("B6"_pos, "=A6*2"s);
+
+  // Формула не может читать область, которая от неё зависит
+  auto throws_cycle = [&sheet](Position pos, const std::string &text) {
+    try {
+      sheet.SetCell(pos, text);
+    } catch (const CircularDependencyException &) {
+      return true;
+    }
+    return false;
+  };
+  assert(throws_cycle("A4"_pos, "=MATCH(1,A1:A7)"s));
+  assert(throws_cycle("A4"_pos, "=D1"s));
+  assert(throws_cycle("A4"_pos, "=E1"s) == false);
+  assert(throws_cycle("E1"_pos, "=D8"s));
+  sheet.SetCell("A4"_pos, "30"s);
+  sheet.ClearCell("E1"_pos);
+
+  // Вставка и удаление строк растягивают и сжимают области
+  assert(value(sheet, "D1"_pos) == CellInterface::Value(4.0));
+  sheet.InsertRows(1, 2);
+  assert(sheet.GetCell("D1"_pos)->GetText() == "=MATCH(30,A1:A9,0)"s);
+  assert(value(sheet, "D1"_pos) == CellInterface::Value(6.0));
+  sheet.SetCell("A2"_pos, "30"s);
+  assert(value(sheet, "D1"_pos) == CellInterface::Value(2.0));
+  sheet.DeleteRows(1, 2);
+  assert(sheet.GetCell("D1"_pos)->GetText() == "=MATCH(30,A1:A7,0)"s);
+  assert(value(sheet, "D1"_pos) == CellInterface::Value(4.0));
+  sheet.SetCell("H1"_pos, "=MATCH(20,A3:A4)"s);
+  assert(value(sheet, "H1"_pos) == CellInterface::Value(1.0));
+  sheet.DeleteRows(2, 2);
+  assert(sheet.GetCell("H1"_pos)->GetText() == "=MATCH(20,#REF!)"s);
+  assert(category(sheet, "H1"_pos) == FormulaError::Category::Ref);
+  assert(category(sheet, "D1"_pos) == FormulaError::Category::NA);
+
+  Sheet lookups;
+  const int rows = 2000;
+  for (int row = 0; row < rows; ++row) {
+    lookups.SetCell({row, 0}, std::to_string(rows - row));
+    lookups.SetCell({row, 4}, "=VLOOKUP(" + std::to_string(row + 1) + ",A1:C2000,3,0)");
+    lookups.SetCell({row, 2}, std::to_string(row));
+  }
+  auto snapshot = lookups.Snapshot();
+  for (int row = 0; row < rows; ++row) {
+    assert(value(lookups, {row, 4}) == CellInterface::Value(double(rows - row - 1)));
+  }
+  lookups.SetCell("A1"_pos, "0"s);
+  lookups.SetCell("C2000"_pos, "-1"s);
+  assert(category(lookups, {rows - 1, 4}) == FormulaError::Category::NA);
+  assert(value(lookups, "E1"_pos) == CellInterface::Value(-1.0));
+  // Снимок видит значения на момент создания
+  assert(value(*snapshot, {rows - 1, 4}) == CellInterface::Value(0.0));
+  assert(value(*snapshot, "E1"_pos) == CellInterface::Value(double(rows - 1)));
+  auto second = lookups.Snapshot();
+  assert(category(*second, {rows - 1, 4}) == FormulaError::Category::NA);
+  assert(value(*second, "E1"_pos) == CellInterface::Value(-1.0));
+  assert(value(*second, "E2"_pos) == CellInterface::Value(double(rows - 2)));
+
+  // Формулы с общим индексом вычисляются из нескольких потоков
+  lookups.SetCell("A2"_pos, "2000"s);
+  std::vector<std::thread> readers;
+  for (int k = 0; k < 4; ++k) {
+    readers.emplace_back([&lookups, &value, k] {
+      for (int row = k; row < rows; row += 4) {
+        value(lookups, {row, 4});
+      }
+    });
+  }
+  for (auto &reader : readers) {
+    reader.join();
+  }
+  assert(value(lookups, {rows - 1, 4}) == CellInterface::Value(1.0));
+
+  try {
+    ScenarioProgram program(lookups, {"A1"_pos}, "E1"_pos);
+    assert(false);
+  } catch (const std::invalid_argument &) {
+  }
+
+  cerr << "TestLookups OK"s << endl;
+}
+
+
+void TestArrays() {
+  auto value = [](const SheetInterface &sheet, Position pos) {
+    return sheet.GetCell(pos)->GetValue();
+  };
+  auto category = [&value](const SheetInterface &sheet, Position pos) {
+    return std::get<FormulaError>(value(sheet, pos)).GetCategory();
+  };
+  auto error_message = [](const std::string &expression) {
+    auto result = TryParseFormula(expression);
+    auto error = std::get_if<FormulaParseError>(&result);
+    return error != nullptr ? error->message : ""s;
+  };
+
+  assert(ParseFormula("B2:A1 * 2")->GetExpression() == "A1:B2*2"s);
+  assert(ParseFormula("MMULT(A1:B2, C1:D2)")->GetExpression() == "MMULT(A1:B2,C1:D2)"s);
+  assert(ParseFormula("-TRANSPOSE(A1:C1)/(1+A5)")->GetExpression() == "-TRANSPOSE(A1:C1)/(1+A5)"s);
+  assert(ParseFormula("A1:A3*B1:D1")->GetAST().GetArraySize() == (Size{3, 3}));
+  assert(ParseFormula("MMULT(A1:C2,TRANSPOSE(A1:C2))")->GetAST().GetArraySize() == (Size{2, 2}));
+  assert(ParseFormula("TRANSPOSE(A1:C2)+1")->GetReferencedRanges()
+             == (std::vector<Range>{{"A1"_pos, "C2"_pos}}));
+  assert(!ParseFormula("A1*2")->GetAST().IsArray());
+  assert(error_message("A1:B2+A1:C1") == "Array sizes do not match"s);
+  assert(error_message("MMULT(A1:B2,A1:C1)") == "Array sizes do not match"s);
+  assert(!error_message("MMULT(A1:B2)").empty());
+  assert(!error_message("TRANSPOSE(A1:B2,1)").empty());
+  assert(!error_message("IF(A1>0,A1:A2,1)").empty());
+  assert(!error_message("VLOOKUP(1,A1:B2,2)*A1:A2").empty());
+
+  Sheet sheet;
+  sheet.SetCell("A1"_pos, "1"s);
+  sheet.SetCell("B1"_pos, "2"s);
+  sheet.SetCell("A2"_pos, "3"s);
+  sheet.SetCell("B2"_pos, "4"s);
+  sheet.SetCell("C1"_pos, "5"s);
+  sheet.SetCell("D1"_pos, "6"s);
+  sheet.SetCell("C2"_pos, "7"s);
+  sheet.SetCell("D2"_pos, "8"s);
+  sheet.SetCell("H1"_pos, "=F2+1"s);
+  sheet.SetCell("E1"_pos, "=MMULT(A1:B2,C1:D2)"s);
+  assert(value(sheet, "E1"_pos) == CellInterface::Value(19.0));
+  assert(value(sheet, "F1"_pos) == CellInterface::Value(22.0));
+  assert(value(sheet, "E2"_pos) == CellInterface::Value(43.0));
+  assert(value(sheet, "F2"_pos) == CellInterface::Value(50.0));
+  assert(value(sheet, "H1"_pos) == CellInterface::Value(51.0));
+  assert(sheet.GetCell("F2"_pos)->GetText().empty());
+  assert(sheet.GetDependents("E1"_pos).size() == 3);
+  {
+    std::ostringstream out;
+    sheet.PrintValues(out);
+    assert(out.str() == "1\t2\t5\t6\t19\t22\t\t51\n3\t4\t7\t8\t43\t50\t\t\n"s);
+  }
+
+  // Изменение входа пересчитывает массив и читателей его результата
+  sheet.SetCell("A2"_pos, "=A1*3"s);
+  sheet.SetCell("B2"_pos, "5"s);
+  assert(value(sheet, "F2"_pos) == CellInterface::Value(58.0));
+  assert(value(sheet, "H1"_pos) == CellInterface::Value(59.0));
+  sheet.SetCell("C5"_pos, "=A1:A2*10+1"s);
+  sheet.SetCell("A5"_pos, "=TRANSPOSE(C1:D1)"s);
+  assert(value(sheet, "C6"_pos) == CellInterface::Value(31.0));
+  assert(value(sheet, "A6"_pos) == CellInterface::Value(6.0));
+  sheet.ClearCell("C5"_pos);
+  assert(sheet.GetCell("C6"_pos) == nullptr);
+
+  // Занятая область: формула даёт #SPILL!, пока ячейку не очистят
+  sheet.SetCell("F2"_pos, "x"s);
+  assert(category(sheet, "E1"_pos) == FormulaError::Category::Spill);
+  assert(sheet.GetCell("F1"_pos) == nullptr);
+  assert(category(sheet, "H1"_pos) == FormulaError::Category::Value);
+  assert(std::get<FormulaError>(value(sheet, "E1"_pos)).ToString() == "#SPILL!"s);
+  sheet.ClearCell("F2"_pos);
+  assert(value(sheet, "E1"_pos) == CellInterface::Value(19.0));
+  assert(value(sheet, "H1"_pos) == CellInterface::Value(59.0));
+  // Ячейку результата очищает только сама формула
+  sheet.ClearCell("F1"_pos);
+  assert(value(sheet, "F1"_pos) == CellInterface::Value(22.0));
+  sheet.SetCell("J1"_pos, "1"s);
+  sheet.SetCell("I1"_pos, "=TRANSPOSE(A1:A2)"s);
+  assert(category(sheet, "I1"_pos) == FormulaError::Category::Spill);
+  sheet.ClearCell("J1"_pos);
+  assert(value(sheet, "J1"_pos) == CellInterface::Value(3.0));
+  sheet.SetCell("I1"_pos, "=A1:A2/0"s);
+  assert(category(sheet, "I1"_pos) == FormulaError::Category::Div0);
+  assert(category(sheet, "I2"_pos) == FormulaError::Category::Div0);
+  assert(sheet.GetCell("J1"_pos) == nullptr);
+
+  // Результат не может замкнуть цикл
+  try {
+    sheet.SetCell("C1"_pos, "=F1"s);
+    assert(false);
+  } catch (const CircularDependencyException &) {
+  }
+  sheet.SetCell("M5"_pos, "=M2"s);
+  sheet.SetCell("M1"_pos, "=TRANSPOSE(M5:N5)"s);
+  assert(category(sheet, "M1"_pos) == FormulaError::Category::Spill);
+  sheet.ClearCell("M5"_pos);
+  sheet.ClearCell("M1"_pos);
+
+  // Вставка строк переносит формулу и её результат
+  sheet.InsertRows(0, 1);
+  assert(sheet.GetCell("E2"_pos)->GetText() == "=MMULT(A2:B3,C2:D3)"s);
+  assert(value(sheet, "F3"_pos) == CellInterface::Value(58.0));
+  assert(value(sheet, "H2"_pos) == CellInterface::Value(59.0));
+  assert(sheet.GetCell("F4"_pos) == nullptr);
+  sheet.DeleteRows(0, 1);
+  assert(value(sheet, "F2"_pos) == CellInterface::Value(58.0));
+
+  // Снимок видит результат на момент создания
+  auto snapshot = sheet.Snapshot();
+  assert(value(*snapshot, "F2"_pos) == CellInterface::Value(58.0));
+  sheet.SetCell("D2"_pos, "10"s);
+  assert(value(sheet, "F2"_pos) == CellInterface::Value(68.0));
+  assert(value(*snapshot, "F2"_pos) == CellInterface::Value(58.0));
+  auto second = sheet.Snapshot();
+  assert(value(*second, "F2"_pos) == CellInterface::Value(68.0));
+  assert(value(*second, "H1"_pos) == CellInterface::Value(69.0));
+  sheet.SetCell("F2"_pos, "0"s);
+  auto third = sheet.Snapshot();
+  assert(std::get<FormulaError>(value(*third, "E1"_pos)).GetCategory() == FormulaError::Category::Spill);
+  assert(value(*second, "E2"_pos) == CellInterface::Value(50.0));
+  sheet.ClearCell("F2"_pos);
+
+  // Элементы большого результата читаются из нескольких потоков
+  Sheet matrices;
+  const int size = 40;
+  for (int row = 0; row < size; ++row) {
+    for (int col = 0; col < size; ++col) {
+      matrices.SetCell({row, col}, std::to_string(row == col ? 2 : 0));
+      matrices.SetCell({row + size, col}, std::to_string(row * size + col));
+    }
+  }
+  matrices.SetCell({0, size}, "=MMULT(A1:AN40,A41:AN80)"s);
+  std::vector<std::thread> readers;
+  for (int k = 0; k < 4; ++k) {
+    readers.emplace_back([&matrices, &value, k] {
+      for (int row = k; row < size; row += 4) {
+        for (int col = 0; col < size; ++col) {
+          assert(value(matrices, {row, size + col}) == CellInterface::Value(double(2 * (row * size + col))));
+        }
+      }
+    });
+  }
+  for (auto &reader : readers) {
+    reader.join();
+  }
+
+  try {
+    ScenarioProgram program(sheet, {"A1"_pos}, "H1"_pos);
+    assert(false);
+  } catch (const std::invalid_argument &) {
+  }
+
+  cerr << "TestArrays OK"s << endl;
+}
+
+#ifndef _WIN32
+void TestOutOfCore() {
+  const auto path = (std::filesystem::temp_directory_path() / "spreadsheet_test_cold.bin").string();
+  auto print = [](const SheetInterface &sheet) {
+    std::ostringstream out;
+    sheet.PrintValues(out);
+    sheet.PrintTexts(out);
+    return out.str();
+  };
+
+  // Тот же лист без вытеснения для сравнения
+  Sheet expected;
+  {
+    Sheet sheet;
+    const int rows = 200;
+    const int cols = 40;
+    for (auto target : {&sheet, &expected}) {
+      for (int row = 0; row < rows; ++row) {
+        target->SetCell({row, 0}, std::to_string(row));
+        for (int col = 1; col < cols; ++col) {
+          target->SetCell({row, col}, "=" + Position{row, col - 1}.ToString() + "+1");
+        }
+      }
+    }
+    // Несколько плиток из нескольких десятков
+    const size_t limit = 512 * 1024;
+    sheet.EnableOutOfCore(path, limit);
+    auto stats = sheet.GetPagingStats();
+    assert(stats.evicted_tiles > 0);
+    assert(stats.resident_bytes <= limit);
+    assert(std::filesystem::exists(path));
+    for (int row = 0; row < rows; row += 7) {
+      assert(sheet.GetCell({row, cols - 1})->GetValue() == CellInterface::Value(double(row + cols - 1)));
+    }
+    assert(sheet.GetPagingStats().loads > 0);
+    assert(print(sheet) == print(expected));
+
+    // Изменения вытесненных ячеек и их зависимых
+    for (auto target : {&sheet, &expected}) {
+      target->SetCell({0, 0}, "1000"s);
+      target->SetCell({rows - 1, 5}, "=A1*2"s);
+      target->ClearCell({5, 0});
+      target->SetCell({2, cols + 1}, "=TRANSPOSE(A1:A3)"s);
+    }
+    assert(sheet.GetCell({rows - 1, cols - 1})->GetValue() == CellInterface::Value(2000.0 + cols - 6));
+    assert(sheet.GetCell({5, cols - 1})->GetValue() == CellInterface::Value(double(cols - 1)));
+    assert(print(sheet) == print(expected));
+    assert(sheet.GetPagingStats().resident_bytes <= limit + 16 * 1024);
+
+    // Сдвиг и снимок видят вытесненные ячейки
+    for (auto target : {&sheet, &expected}) {
+      target->InsertRows(1, 2);
+      target->DeleteRows(10, 1);
+      target->SetCell({3, cols + 5}, "=A11+1"s);
+      target->DeleteRows(10, 1);
+    }
+    auto snapshot = sheet.Snapshot();
+    sheet.SetCell({0, 0}, "7"s);
+    expected.SetCell({0, 0}, "7"s);
+    assert(print(sheet) == print(expected));
+    assert(print(*snapshot) != print(sheet));
+    assert(print(*expected.Snapshot()) == print(sheet));
+    assert(sheet.GetPagingStats().evictions > stats.evictions);
+
+    // Формула, прочитанная из файла, даёт то же значение
+    const Position exact{1, cols + 8};
+    sheet.SetCell(exact, "=1.23456789*3"s);
+    assert(sheet.GetCell(exact)->GetValue() == CellInterface::Value(1.23456789 * 3));
+    for (int row = 0; row < rows; ++row) {
+      for (int col = 0; col < cols; ++col) {
+        sheet.GetCell({row, col});
+      }
+    }
+    auto loads = sheet.GetPagingStats().loads;
+    auto cell = sheet.GetCell(exact);
+    assert(sheet.GetPagingStats().loads == loads + 1);
+    assert(cell->GetText() == "=1.23456789*3"s);
+    assert(cell->GetValue() == CellInterface::Value(1.23456789 * 3));
+
+    // Сортировка подгружает только блоки области и ссылающихся на неё формул
+    expected.SetCell(exact, "=1.23456789*3"s);
+    loads = sheet.GetPagingStats().loads;
+    for (auto target : {&sheet, &expected}) {
+      target->SortRange({{0, 0}, {31, 2}}, {0}, Sheet::SortOrder::Descending);
+    }
+    assert(sheet.GetPagingStats().loads <= loads + 2);
+    assert(sheet.GetPagingStats().resident_bytes <= limit + 16 * 1024);
+    assert(print(sheet) == print(expected));
+  }
+  assert(!std::filesystem::exists(path));
+
+  cerr << "TestOutOfCore OK"s << endl;
+}
+
+void TestSharedValues() {
+  const auto name = "/spreadsheet_test_values_"s + std::to_string(::getpid());
+  Sheet sheet;
+  sheet.SetCell("B2"_pos, "=1"s);
+  sheet.SetCell("C2"_pos, "=B2*10"s);
+  sheet.SetCell("B3"_pos, "text"s);
+  sheet.SetCell("C3"_pos, "=1/0"s);
+  {
+    SharedValuesWriter writer(sheet, name, "B2"_pos, {3, 2});
+    SharedValuesReader reader(name);
+    assert(reader.GetTopLeft() == "B2"_pos);
+    assert(reader.GetSize() == (Size{3, 2}));
+    auto version = reader.Read([](const SharedValues::Entry *grid) {
+      assert(grid[0].tag == ValueTag::NUMBER && grid[0].number == 1);
+      assert(grid[1].tag == ValueTag::NUMBER && grid[1].number == 10);
+      assert(grid[2].tag == ValueTag::TEXT && grid[2].number == 0);
+      assert(grid[3].tag == ValueTag::DIV0_ERROR);
+      assert(grid[4].tag == ValueTag::EMPTY && grid[5].tag == ValueTag::EMPTY);
+    });
+    assert(version == sheet.GetVersion());
+
+    // Значения обновляются при оповещении подписчиков
+    sheet.SetCell("B2"_pos, "=4"s);
+    sheet.SetCell("B4"_pos, "=C2+1"s);
+    assert(reader.Get("C2"_pos).number == 10);
+    sheet.NotifyChanges();
+    assert(reader.Get("C2"_pos).number == 40);
+    assert(reader.Get("B4"_pos).tag == ValueTag::NUMBER && reader.Get("B4"_pos).number == 41);
+    try {
+      reader.Get("D2"_pos);
+      assert(false);
+    } catch (const InvalidPositionException &) {
+    }
+
+    // Читатель из другого процесса
+    auto child = ::fork();
+    assert(child >= 0);
+    if (child == 0) {
+      SharedValuesReader other(name);
+      ::_exit(other.Get("C2"_pos).number == 40 && other.Get("C3"_pos).tag == ValueTag::DIV0_ERROR ? 0 : 1);
+    }
+    int status = 0;
+    assert(::waitpid(child, &status, 0) == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  // Область удаляется вместе с писателем
+  try {
+    SharedValuesReader reader(name);
+    assert(false);
+  } catch (const std::system_error &) {
+  }
+
+  cerr << "TestSharedValues OK"s << endl;
+}
+#endif
+
+void TestDiff() {
+  // Листы в куче: ThreadSanitizer не путает их мьютексы с мьютексами листов
+  // прежних тестов на том же месте стека
+  auto lhs_owner = std::make_unique<Sheet>();
+  auto rhs_owner = std::make_unique<Sheet>();
+  Sheet &lhs = *lhs_owner;
+  Sheet &rhs = *rhs_owner;
+  assert(lhs.GetContentHash() == rhs.GetContentHash());
+  assert(Sheet::Diff(lhs, rhs).empty());
+
+  // Порядок изменений и запись формулы не влияют на хеш
+  lhs.SetCell("A1"_pos, "1"s);
+  lhs.SetCell("B2"_pos, "=A1+(2*3)"s);
+  lhs.SetCell("Z300"_pos, "far"s);
+  rhs.SetCell("Z300"_pos, "far"s);
+  rhs.SetCell("B2"_pos, "=A1 + 2*3"s);
+  rhs.SetCell("A1"_pos, "1"s);
+  rhs.SetCell("C3"_pos, ""s);
+  assert(lhs.GetContentHash() == rhs.GetContentHash());
+  assert(Sheet::Diff(lhs, rhs).empty());
+
+  // Та же ячейка в другом месте
+  lhs.SetCell("Q10"_pos, "x"s);
+  rhs.SetCell("Q11"_pos, "x"s);
+  assert((Sheet::Diff(lhs, rhs) == std::vector<Position>{"Q10"_pos, "Q11"_pos}));
+  rhs.ClearCell("Q11"_pos);
+  rhs.SetCell("Q10"_pos, "x"s);
+  assert(Sheet::Diff(lhs, rhs).empty());
+
+  const auto hash = lhs.GetContentHash();
+  lhs.SetCell("Z300"_pos, "changed"s);
+  lhs.SetCell("AAA2000"_pos, "=Z300"s);
+  assert((Sheet::Diff(lhs, rhs) == std::vector<Position>{"Z300"_pos, "AAA2000"_pos}));
+  assert((Sheet::Diff(rhs, lhs) == std::vector<Position>{"Z300"_pos, "AAA2000"_pos}));
+  lhs.ClearCell("AAA2000"_pos);
+  lhs.SetCell("Z300"_pos, "far"s);
+  assert(lhs.GetContentHash() == hash);
+
+  // Сдвиг переносит ячейки и переписывает ссылки
+  lhs.InsertRows(1, 3);
+  assert(lhs.GetContentHash() != hash);
+  rhs.InsertRows(1, 3);
+  assert(Sheet::Diff(lhs, rhs).empty());
+  lhs.DeleteRows(0);
+  rhs.SetCell("A1"_pos, "=1/0"s);
+  assert((Sheet::Diff(lhs, rhs) == std::vector<Position>{"A1"_pos, "B4"_pos, "B5"_pos, "Q12"_pos,
+                                                           "Q13"_pos, "Z302"_pos, "Z303"_pos}));
+  assert(lhs.GetCell("B4"_pos)->GetText() == "=#REF!+2*3");
+
+  // Формулы с одинаковым текстом, значения которых различаются через ссылки,
+  // области и результаты формул-массивов
+  auto before_owner = std::make_unique<Sheet>();
+  auto after_owner = std::make_unique<Sheet>();
+  Sheet &before = *before_owner;
+  Sheet &after = *after_owner;
+  for (Sheet *sheet : {&before, &after}) {
+    sheet->SetCell("B1"_pos, "=A1*2"s);
+    sheet->SetCell("C1"_pos, "=B1+1"s);
+    sheet->SetCell("D1"_pos, "=MATCH(3,A1:A3,0)"s);
+    sheet->SetCell("E1"_pos, "=TRANSPOSE(A1:A2)"s);
+    sheet->SetCell("G1"_pos, "=F1"s);
+    sheet->SetCell("H1"_pos, "=5"s);
+  }
+  after.SetCell("A2"_pos, "=3"s);
+  assert((Sheet::Diff(before, after) == std::vector<Position>{"A2"_pos, "D1"_pos, "E1"_pos, "F1"_pos,
+                                                                "G1"_pos}));
+  // Ссылка только в одном из листов
+  after.SetCell("H1"_pos, "=A2"s);
+  assert((Sheet::Diff(after, before) == std::vector<Position>{"A2"_pos, "D1"_pos, "E1"_pos, "F1"_pos,
+                                                                "G1"_pos, "H1"_pos}));
+  after.ClearCell("A2"_pos);
+  after.SetCell("H1"_pos, "=5"s);
+  after.SetCell("A1"_pos, "=2"s);
+  assert((Sheet::Diff(before, after) == std::vector<Position>{"A1"_pos, "B1"_pos, "C1"_pos, "D1"_pos,
+                                                                "E1"_pos, "F1"_pos, "G1"_pos}));
+
+  // Результаты формулы-массива не входят в хеш
+  auto arrays_owner = std::make_unique<Sheet>();
+  auto values_owner = std::make_unique<Sheet>();
+  Sheet &arrays = *arrays_owner;
+  Sheet &values = *values_owner;
+  arrays.SetCell("A1"_pos, "=TRANSPOSE(B1:B3)"s);
+  arrays.SetCell("B1"_pos, "1"s);
+  values.SetCell("B1"_pos, "1"s);
+  assert((Sheet::Diff(arrays, values) == std::vector<Position>{"A1"_pos}));
+
+  cerr << "TestDiff OK"s << endl;
+}
+
+void TestSortRange() {
+  auto owner = std::make_unique<Sheet>();
+  Sheet &sheet = *owner;
+  const std::vector<std::string> keys = {"=3"s, "b"s, "=1"s, ""s, "a"s, "=1/0"s};
+  for (int row = 0; row < 6; ++row) {
+    if (!keys[row].empty()) {
+      sheet.SetCell({row, 0}, keys[row]);
+    }
+    sheet.SetCell({row, 2}, "x"s + std::to_string(row));
+  }
+  sheet.SetCell("B1"_pos, "=A1*10"s);
+  sheet.SetCell("B2"_pos, "=A1+A3"s);
+  sheet.SetCell("D1"_pos, "=A3+0"s);
+  sheet.SetCell("E1"_pos, "=MATCH(3,A1:A6,0)"s);
+  assert(sheet.GetCell("E1"_pos)->GetValue() == CellInterface::Value(1.0));
+  auto snapshot = sheet.Snapshot();
+
+  auto column = [&sheet](int col) {
+    std::vector<std::string> result;
+    for (int row = 0; row < 6; ++row) {
+      auto cell = sheet.GetCell({row, col});
+      result.push_back(cell == nullptr ? ""s : cell->GetText());
+    }
+    return result;
+  };
+
+  // Числа, текст, ошибки, пустые ячейки
+  sheet.SortRange({"A1"_pos, "C6"_pos}, {0});
+  assert((column(0) == std::vector{"=1"s, "=3"s, "a"s, "b"s, "=1/0"s, ""s}));
+  assert((column(2) == std::vector{"x2"s, "x0"s, "x4"s, "x1"s, "x5"s, "x3"s}));
+  // Ссылки идут за ячейками, значения формул прежние
+  assert(sheet.GetCell("B2"_pos)->GetText() == "=A2*10");
+  assert(sheet.GetCell("B4"_pos)->GetText() == "=A2+A1");
+  assert(sheet.GetCell("B2"_pos)->GetValue() == CellInterface::Value(30.0));
+  assert(sheet.GetCell("D1"_pos)->GetText() == "=A1+0");
+  assert(sheet.GetCell("D1"_pos)->GetValue() == CellInterface::Value(1.0));
+  auto dependents = sheet.GetDependents("A2"_pos);
+  std::sort(dependents.begin(), dependents.end());
+  assert((dependents == std::vector<Position>{"B2"_pos, "B4"_pos, "E1"_pos}));
+  // Область формулы прежняя, значение пересчитано
+  assert(sheet.GetCell("E1"_pos)->GetText() == "=MATCH(3,A1:A6,0)");
+  assert(sheet.GetCell("E1"_pos)->GetValue() == CellInterface::Value(2.0));
+  assert(snapshot->GetCell("B2"_pos)->GetText() == "=A1+A3");
+  assert(snapshot->GetCell("E1"_pos)->GetValue() == CellInterface::Value(1.0));
+
+  // Хеш совпадает с листом, заполненным теми же текстами
+  Sheet expected;
+  for (int row = 0; row < 6; ++row) {
+    for (int col = 0; col < 5; ++col) {
+      if (auto cell = sheet.GetCell({row, col}); cell != nullptr && !cell->GetText().empty()) {
+        expected.SetCell({row, col}, cell->GetText());
+      }
+    }
+  }
+  assert(Sheet::Diff(sheet, expected).empty());
+
+  sheet.SortRange({"A1"_pos, "C6"_pos}, {0}, Sheet::SortOrder::Descending);
+  assert((column(0) == std::vector{"=1/0"s, "b"s, "a"s, "=3"s, "=1"s, ""s}));
+  assert(sheet.GetCell("D1"_pos)->GetText() == "=A5+0");
+  assert(sheet.GetCell("E1"_pos)->GetValue() == CellInterface::Value(4.0));
+
+  // Второй ключ упорядочивает равные значения первого, равные строки не
+  // меняют порядок
+  for (int row = 0; row < 6; ++row) {
+    sheet.SetCell({row, 0}, row % 2 == 0 ? "=1"s : "=2"s);
+    sheet.SetCell({row, 1}, row < 3 ? "=5"s : "=4"s);
+  }
+  sheet.SortRange({"A1"_pos, "C6"_pos}, {0, 1});
+  assert((column(2) == std::vector{"x2"s, "x5"s, "x4"s, "x0"s, "x3"s, "x1"s}));
+  sheet.SortRange({"A1"_pos, "C6"_pos}, {1});
+  assert((column(2) == std::vector{"x2"s, "x0"s, "x3"s, "x5"s, "x4"s, "x1"s}));
+
+  // Формула-массив переносится со строкой и выводит результат заново
+  auto arrays_owner = std::make_unique<Sheet>();
+  Sheet &arrays = *arrays_owner;
+  arrays.SetCell("A1"_pos, "=2"s);
+  arrays.SetCell("A2"_pos, "=1"s);
+  arrays.SetCell("B1"_pos, "=TRANSPOSE(A1:A2)"s);
+  arrays.SortRange({"A1"_pos, "C2"_pos}, {0});
+  assert(arrays.GetCell("B1"_pos) == nullptr || arrays.GetCell("B1"_pos)->GetText().empty());
+  assert(arrays.GetCell("B2"_pos)->GetValue() == CellInterface::Value(1.0));
+  assert(arrays.GetCell("C2"_pos)->GetValue() == CellInterface::Value(2.0));
+
+  try {
+    sheet.SortRange({"A1"_pos, "C6"_pos}, {3});
+    assert(false);
+  } catch (const InvalidPositionException &) {
+  }
+
+  cerr << "TestSortRange OK"s << endl;
+}
+
+void TestGroupBy() {
+  auto owner = std::make_unique<Sheet>();
+  Sheet &sheet = *owner;
+  const std::vector<std::pair<std::string, std::string>> rows = {
+      {"=1"s, "=10"s}, {"fruit"s, "=2"s}, {"1"s, "=5"s}, {""s, "=100"s},
+      {"fruit"s, "=1/0"s}, {"=1/0"s, "=7"s}, {"veg"s, "text"s}, {"'=x"s, "3"s},
+  };
+  for (int row = 0; row < static_cast<int>(rows.size()); ++row) {
+    if (!rows[row].first.empty()) {
+      sheet.SetCell({row, 0}, rows[row].first);
+    }
+    sheet.SetCell({row, 1}, rows[row].second);
+  }
+  const Range range{"A1"_pos, "B8"_pos};
+  const std::vector<Aggregation> aggregations = {
+      {1, Aggregate::Sum}, {1, Aggregate::Count}, {1, Aggregate::Min}, {1, Aggregate::Max}, {1, Aggregate::Average},
+  };
+  auto groups = GroupBy(sheet, range, 0, aggregations);
+
+  // Ключи в порядке появления: текст-число совпадает с числом, пустой ключ
+  // пропущен
+  assert(groups.GetGroupCount() == 5);
+  assert((groups.key_tags == std::vector{ValueTag::NUMBER, ValueTag::TEXT, ValueTag::DIV0_ERROR,
+                                         ValueTag::TEXT, ValueTag::TEXT}));
+  assert(groups.key_numbers[0] == 1);
+  assert((groups.key_texts == std::vector{""s, "fruit"s, ""s, "veg"s, "=x"s}));
+  auto value = [&groups](size_t aggregation, size_t group) {
+    const size_t index = aggregation * groups.GetGroupCount() + group;
+    return std::make_pair(groups.tags[index], groups.numbers[index]);
+  };
+  const auto number = [](double value) {
+    return std::make_pair(ValueTag::NUMBER, value);
+  };
+  const auto div0 = std::make_pair(ValueTag::DIV0_ERROR, 0.0);
+  assert(value(0, 0) == number(15) && value(1, 0) == number(2) && value(2, 0) == number(5));
+  assert(value(3, 0) == number(10) && value(4, 0) == number(7.5));
+  // Ошибка значения - во всех агрегатах, кроме Count
+  assert(value(0, 1) == div0 && value(1, 1) == number(1) && value(3, 1) == div0 && value(4, 1) == div0);
+  assert(value(0, 2) == number(7) && value(4, 2) == number(7));
+  // Группа без чисел
+  assert(value(0, 3) == number(0) && value(1, 3) == number(0) && value(2, 3) == number(0));
+  assert(value(4, 3) == div0);
+  assert(value(0, 4) == number(3) && value(4, 4) == number(3));
+
+  WriteGroupBy(sheet, "D1"_pos, groups);
+  auto text = [&sheet](Position pos) {
+    return sheet.GetCell(pos)->GetText();
+  };
+  assert(text("D1"_pos) == "1" && text("E1"_pos) == "15" && text("I1"_pos) == "7.5");
+  assert(text("D2"_pos) == "fruit" && text("E2"_pos) == "#DIV/0!" && text("F2"_pos) == "1");
+  assert(text("D3"_pos) == "#DIV/0!" && text("D5"_pos) == "'=x");
+  assert(sheet.GetCell("D5"_pos)->GetValue() == CellInterface::Value("=x"s));
+  try {
+    WriteGroupBy(sheet, {Position::MAX_ROWS - 2, 0}, groups);
+    assert(false);
+  } catch (const TableTooBigException &) {
+  }
+
+  // Части строк в разных потоках дают тот же результат
+  auto large_owner = std::make_unique<Sheet>();
+  Sheet &large = *large_owner;
+  const int large_rows = 5000;
+  std::vector<double> sums(40);
+  for (int row = 0; row < large_rows; ++row) {
+    const int key = (row * 7919) % 40;
+    large.SetCell({row, 0}, key % 2 == 0 ? "=" + std::to_string(key) : "k" + std::to_string(key));
+    large.SetCell({row, 1}, std::to_string(row % 97));
+    sums[key] += row % 97;
+  }
+  const Range large_range{"A1"_pos, {large_rows - 1, 1}};
+  auto single = GroupBy(large, large_range, 0, {{1, Aggregate::Sum}, {1, Aggregate::Max}});
+  auto parallel = GroupBy(large, large_range, 0, {{1, Aggregate::Sum}, {1, Aggregate::Max}}, 4);
+  assert(single.GetGroupCount() == 40);
+  assert(single.key_tags == parallel.key_tags && single.key_numbers == parallel.key_numbers);
+  assert(single.key_texts == parallel.key_texts && single.numbers == parallel.numbers);
+  for (size_t group = 0; group < single.GetGroupCount(); ++group) {
+    const int key = single.key_tags[group] == ValueTag::NUMBER ? static_cast<int>(single.key_numbers[group])
+                                                               : std::stoi(single.key_texts[group].substr(1));
+    assert(single.numbers[group] == sums[key]);
+  }
+
+  try {
+    GroupBy(sheet, range, 2, aggregations);
+    assert(false);
+  } catch (const InvalidPositionException &) {
+  }
+
+  cerr << "TestGroupBy OK"s << endl;
+}
+
+void TestSpreadsheetML() {
+  // Пачка ячеек: синтаксическая ошибка не меняет лист
+  auto batch_owner = std::make_unique<Sheet>();
+  Sheet &batch = *batch_owner;
+  batch.SetCells({{"A1"_pos, "=B1+1"s}, {"B1"_pos, "=2"s}});
+  assert(batch.GetCell("A1"_pos)->GetValue() == CellInterface::Value(3.0));
+  try {
+    batch.SetCells({{"A1"_pos, "x"s}, {"C1"_pos, "=1+"s}});
+    assert(false);
+  } catch (const FormulaException &) {
+  }
+  assert(batch.GetCell("A1"_pos)->GetText() == "=B1+1");
+  try {
+    batch.SetCells({{"C1"_pos, "=1"s}, {"B1"_pos, "=A1"s}});
+    assert(false);
+  } catch (const CircularDependencyException &) {
+  }
+  assert(batch.GetCell("C1"_pos)->GetText() == "=1" && batch.GetCell("B1"_pos)->GetText() == "=2");
+
+  auto owner = std::make_unique<Sheet>();
+  Sheet &sheet = *owner;
+  sheet.SetCell("A1"_pos, "5"s);
+  sheet.SetCell("B1"_pos, "hello & <world>"s);
+  sheet.SetCell("C1"_pos, "'=escaped"s);
+  sheet.SetCell("A2"_pos, "=A1*2"s);
+  sheet.SetCell("B2"_pos, "=1/0"s);
+  sheet.SetCell("C2"_pos, "=MATCH(5,A1:A2,0)"s);
+  sheet.SetCell("E3"_pos, "=TRANSPOSE(A1:A2)"s);
+  sheet.SetCell("G10"_pos, "x\ty\r\nz \"q\""s);
+  sheet.SetCell("H10"_pos, "'5"s);
+  sheet.SetCell("D1"_pos, "=2.718281828*A1"s);
+
+  std::ostringstream out;
+  WriteSpreadsheetML(sheet, out);
+  const auto xml = out.str();
+  assert(xml.find("<Cell><Data ss:Type=\"Number\">5</Data></Cell>") != std::string::npos);
+  assert(xml.find("<Data ss:Type=\"String\">hello &amp; &lt;world&gt;</Data>") != std::string::npos);
+  assert(xml.find("<Cell ss:Formula=\"=R1C1*2\"><Data ss:Type=\"Number\">10</Data>") != std::string::npos);
+  assert(xml.find("ss:Formula=\"=MATCH(5,R1C1:R2C1,0)\"") != std::string::npos);
+  assert(xml.find("ss:Formula=\"=2.718281828*R1C1\"") != std::string::npos);
+  assert(xml.find("<Data ss:Type=\"Error\">#DIV/0!</Data>") != std::string::npos);
+  assert(xml.find("<Row ss:Index=\"10\">") != std::string::npos);
+  assert(xml.find("<Cell ss:Index=\"7\">") != std::string::npos);
+  // Результат формулы-массива в F3 не записывается
+  assert(xml.find("<Cell ss:Index=\"6\"") == std::string::npos);
+
+  auto imported_owner = std::make_unique<Sheet>();
+  Sheet &imported = *imported_owner;
+  std::istringstream in(xml);
+  assert(ReadSpreadsheetML(in, imported) == 10);
+  assert(Sheet::Diff(sheet, imported).empty());
+  sheet.ForEachCell([&imported](Position pos, const CellInterface &cell) {
+    assert(imported.GetCell(pos)->GetValue() == cell.GetValue());
+  });
+  assert(imported.GetCell("F3"_pos)->GetValue() == CellInterface::Value(10.0));
+  assert(imported.GetCell("C1"_pos)->GetValue() == CellInterface::Value("=escaped"s));
+
+  // Файл в духе Excel: относительные ссылки, пропуски, объединения, формулы,
+  // которых нет в листе
+  std::istringstream excel(R"xml(<?xml version="1.0"?>
+<!-- comment -->
+<Workbook xmlns="urn:schemas-microsoft-com:office:spreadsheet"
+ xmlns:ss="urn:schemas-microsoft-com:office:spreadsheet" xmlns:html="http://www.w3.org/TR/REC-html40">
+ <Styles><Style ss:ID="Default"/></Styles>
+ <Worksheet ss:Name="Data">
+  <Table ss:ExpandedColumnCount="4">
+   <Row>
+    <Cell><Data ss:Type="Number">2</Data></Cell>
+    <Cell ss:MergeAcross="1"><Data ss:Type="String">a &amp; b&#x21;</Data></Cell>
+    <Cell><Data ss:Type='String'><![CDATA[<raw>]]]></Data></Cell>
+   </Row>
+   <Row ss:Span="1"/>
+   <Row>
+    <Cell ss:Formula="=R[-2]C*3"><Data ss:Type="Number">6</Data></Cell>
+    <Cell ss:Formula="=SUM(R1C1:R1C1)"><Data ss:Type="Number">2</Data></Cell>
+    <Cell ss:Index="4" ss:Formula="=Other!R1C1"><Data ss:Type="Number">7</Data></Cell>
+   </Row>
+   <Row ss:Index="6">
+    <Cell><ss:Data ss:Type="String" xmlns="http://www.w3.org/TR/REC-html40"><B>bold</B> text</ss:Data></Cell>
+    <Cell><Data ss:Type="Boolean">1</Data></Cell>
+    <Cell ss:Formula="=C1"><Data ss:Type="Number">0</Data></Cell>
+   </Row>
+  </Table>
+ </Worksheet>
+ <Worksheet ss:Name="Other"><Table><Row><Cell><Data ss:Type="Number">7</Data></Cell></Row></Table></Worksheet>
+</Workbook>
+)xml");
+  auto from_excel_owner = std::make_unique<Sheet>();
+  Sheet &from_excel = *from_excel_owner;
+  assert(ReadSpreadsheetML(excel, from_excel) == 9);
+  auto text = [&from_excel](Position pos) {
+    auto cell = from_excel.GetCell(pos);
+    return cell == nullptr ? ""s : cell->GetText();
+  };
+  assert(text("A1"_pos) == "2" && text("B1"_pos) == "a & b!" && text("C1"_pos).empty());
+  assert(text("D1"_pos) == "<raw>]");
+  assert(text("A4"_pos) == "=A2*3");
+  // Неизвестная функция, другой лист и целый столбец - значения из файла
+  assert(text("B4"_pos) == "2" && text("D4"_pos) == "7" && text("C6"_pos) == "0");
+  assert(text("A6"_pos) == "bold text" && text("B6"_pos) == "1");
+  assert((from_excel.GetPrintableSize() == Size{6, 4}));
+
+  for (auto broken : {"<Workbook><Worksheet><Table><Row><Cell>"s, "<Workbook>&bogus;</Workbook>"s,
+                      "<Workbook><Worksheet><Table><Row ss:Index=\"0\"/>"s}) {
+    auto target_owner = std::make_unique<Sheet>();
+    std::istringstream broken_in(broken);
+    try {
+      ReadSpreadsheetML(broken_in, *target_owner);
+      assert(false);
+    } catch (const std::runtime_error &) {
+    }
+  }
+
+  cerr << "TestSpreadsheetML OK"s << endl;
+}
+
 }  // namespace
 
 
-int main() {
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    return RunTool(argc, argv);
+  }
+
   TestRunner tr;
   RUN_TEST(tr, TestEmpty);
   RUN_TEST(tr, TestInvalidPosition);
+  RUN_TEST(tr, TestPositionToString);
   RUN_TEST(tr, TestSetCellPlainText);
   RUN_TEST(tr, TestClearCell);
   RUN_TEST(tr, TestPrint);
@@ -541,5 +2661,35 @@ int main() {
   TestSimpleErrorPropagation();
   TestSimpleErrorText();
 
+  TestRecalcProfiler();
+  TestWorkloadRecordReplay();
+  TestWorkloadGenerator();
+  TestConstantFolding();
+  TestFormulaInterning();
+  TestParserWarmUp();
+  TestTryParseFormula();
+  TestTryParseMatchesParse();
+  TestStaticResolver();
+  TestInsertDeleteRowsCols();
+  TestSheetSnapshot();
+  TestConcurrentReads();
+  TestConcurrentWriters();
+  TestAsyncRecalculation();
+  TestRecalcScheduler();
+  TestGetValues();
+  TestSubscriptions();
+  TestScenarios();
+  TestConditionals();
+  TestLookups();
+  TestArrays();
+#ifndef _WIN32
+  TestOutOfCore();
+  TestSharedValues();
+#endif
+  TestDiff();
+  TestSortRange();
+  TestGroupBy();
+  TestSpreadsheetML();
+
   return 0;
 }
@@ -0,0 +1,153 @@
+#include "matrix.h"
+
+#include <algorithm>
+#include <cmath>
+
+Matrix::Matrix(Size size, double value)
+    : size_(size), data_(static_cast<size_t>(size.rows) * size.cols, value) {}
+
+Matrix Matrix::Multiply(const Matrix &lhs, const Matrix &rhs) {
+  if (lhs.size_.cols != rhs.size_.rows) {
+    throw FormulaError(FormulaError::Category::Value);
+  }
+  const int rows = lhs.size_.rows;
+  const int inner = lhs.size_.cols;
+  const int cols = rhs.size_.cols;
+  Matrix result({rows, cols});
+
+  // Порядок i-k-j: строка результата накапливается из строк rhs, внутренний
+  // цикл идёт подряд по обеим строкам. Блоки по k и j держат в кэше части
+  // rhs и строки результата, пока по ним проходят все строки блока lhs
+  for (int k0 = 0; k0 < inner; k0 += BLOCK) {
+    const int k1 = std::min(k0 + BLOCK, inner);
+    for (int j0 = 0; j0 < cols; j0 += BLOCK) {
+      const int j1 = std::min(j0 + BLOCK, cols);
+      for (int i = 0; i < rows; ++i) {
+        double *out = &result(i, 0);
+        const double *a = &lhs(i, 0);
+        for (int k = k0; k < k1; ++k) {
+          const double factor = a[k];
+          const double *b = &rhs(k, 0);
+          for (int j = j0; j < j1; ++j) {
+            out[j] += factor * b[j];
+          }
+        }
+      }
+    }
+  }
+  return result;
+}
+
+Matrix Matrix::Transpose() const {
+  Matrix result({size_.cols, size_.rows});
+  // Блоками, чтобы и чтение, и запись оставались в кэше
+  for (int i0 = 0; i0 < size_.rows; i0 += BLOCK) {
+    const int i1 = std::min(i0 + BLOCK, size_.rows);
+    for (int j0 = 0; j0 < size_.cols; j0 += BLOCK) {
+      const int j1 = std::min(j0 + BLOCK, size_.cols);
+      for (int i = i0; i < i1; ++i) {
+        for (int j = j0; j < j1; ++j) {
+          result(j, i) = (*this)(i, j);
+        }
+      }
+    }
+  }
+  return result;
+}
+
+std::optional<Size> Matrix::Broadcast(Size lhs, Size rhs) {
+  auto dimension = [](int a, int b) -> std::optional<int> {
+    if (a == b || b == 1) {
+      return a;
+    }
+    if (a == 1) {
+      return b;
+    }
+    return std::nullopt;
+  };
+  auto rows = dimension(lhs.rows, rhs.rows);
+  auto cols = dimension(lhs.cols, rhs.cols);
+  if (!rows || !cols) {
+    return std::nullopt;
+  }
+  return Size{*rows, *cols};
+}
+
+namespace {
+
+// Одна строка результата: шаг 0 повторяет единственный элемент операнда
+template <typename Func>
+void ApplyRow(double *out, const double *lhs, int lhs_step, const double *rhs, int rhs_step,
+              int count, Func func) {
+  if (lhs_step == 1 && rhs_step == 1) {
+    for (int j = 0; j < count; ++j) {
+      out[j] = func(lhs[j], rhs[j]);
+    }
+  } else if (lhs_step == 1) {
+    const double value = rhs[0];
+    for (int j = 0; j < count; ++j) {
+      out[j] = func(lhs[j], value);
+    }
+  } else if (rhs_step == 1) {
+    const double value = lhs[0];
+    for (int j = 0; j < count; ++j) {
+      out[j] = func(value, rhs[j]);
+    }
+  } else {
+    std::fill_n(out, count, func(lhs[0], rhs[0]));
+  }
+}
+
+}  // namespace
+
+Matrix Matrix::Apply(Op op, const Matrix &lhs, const Matrix &rhs) {
+  auto size = Broadcast(lhs.size_, rhs.size_);
+  if (!size) {
+    throw FormulaError(FormulaError::Category::Value);
+  }
+  Matrix result(*size);
+  const int lhs_step = lhs.size_.cols == 1 ? 0 : 1;
+  const int rhs_step = rhs.size_.cols == 1 ? 0 : 1;
+  auto apply = [&](auto func) {
+    for (int i = 0; i < size->rows; ++i) {
+      ApplyRow(&result(i, 0), &lhs(lhs.size_.rows == 1 ? 0 : i, 0), lhs_step,
+               &rhs(rhs.size_.rows == 1 ? 0 : i, 0), rhs_step, size->cols, func);
+    }
+  };
+
+  switch (op) {
+    case Op::Add:apply([](double a, double b) {
+        return a + b;
+      });
+      break;
+    case Op::Subtract:apply([](double a, double b) {
+        return a - b;
+      });
+      break;
+    case Op::Multiply:apply([](double a, double b) {
+        return a * b;
+      });
+      break;
+    case Op::Divide: {
+      apply([](double a, double b) {
+        return a / b;
+      });
+      // Проверка отдельным проходом не мешает векторизации деления
+      bool finite = true;
+      for (double value : result.data_) {
+        finite &= std::isfinite(value);
+      }
+      if (!finite) {
+        throw FormulaError(FormulaError::Category::Div0);
+      }
+      break;
+    }
+  }
+  return result;
+}
+
+void Matrix::Negate() {
+  for (double &value : data_) {
+    value *= -1;
+  }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "common.h"
+
+#include <optional>
+#include <vector>
+
+// Результат формулы-массива: числа по строкам. Ядра операций написаны так,
+// чтобы внутренние циклы шли подряд по памяти и их векторизовал компилятор.
+// Ошибки вычисления передаются исключением FormulaError, как в FormulaAST
+class Matrix {
+ public:
+  enum class Op : char {
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+  };
+
+  Matrix() = default;
+  explicit Matrix(Size size, double value = 0);
+
+  Size GetSize() const {
+    return size_;
+  }
+
+  const double &operator()(int row, int col) const {
+    return data_[static_cast<size_t>(row) * size_.cols + col];
+  }
+
+  double &operator()(int row, int col) {
+    return data_[static_cast<size_t>(row) * size_.cols + col];
+  }
+
+  const double *GetData() const {
+    return data_.data();
+  }
+
+  double *GetData() {
+    return data_.data();
+  }
+
+  // Произведение матриц, как MMULT. Бросает #VALUE!, если число столбцов
+  // lhs не равно числу строк rhs
+  static Matrix Multiply(const Matrix &lhs, const Matrix &rhs);
+
+  Matrix Transpose() const;
+
+  // Поэлементная операция. Измерение размера 1 растягивается до размера
+  // другого операнда: число, строка и столбец применяются ко всей матрице.
+  // Бросает #VALUE! для несогласованных размеров и #DIV/0! для деления на 0
+  static Matrix Apply(Op op, const Matrix &lhs, const Matrix &rhs);
+
+  void Negate();
+
+  // Размер результата Apply или nullopt, если размеры не согласованы
+  static std::optional<Size> Broadcast(Size lhs, Size rhs);
+
+ private:
+  // Сторона квадратного блока: три блока double помещаются в кэш L1
+  static constexpr int BLOCK = 48;
+
+  Size size_;
+  std::vector<double> data_;
+};
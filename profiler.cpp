@@ -0,0 +1,219 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <stack>
+
+using namespace std::literals;
+
+namespace {
+
+double ToMicroseconds(RecalcProfiler::Clock::duration duration) {
+  return std::chrono::duration<double, std::micro>(duration).count();
+}
+
+std::string CellName(Position pos) {
+  auto name = pos.ToString();
+  return name.empty() ? "?"s : name;
+}
+
+}  // namespace
+
+RecalcProfiler::Session::Session(RecalcProfiler &profiler) : previous_(active_) {
+  active_ = &profiler;
+}
+
+RecalcProfiler::Session::~Session() {
+  active_ = previous_;
+}
+
+RecalcProfiler::CellScope::CellScope(Position pos) : profiler_(active_) {
+  if (profiler_ != nullptr) {
+    profiler_->Enter(pos);
+  }
+}
+
+RecalcProfiler::CellScope::~CellScope() {
+  if (profiler_ != nullptr) {
+    profiler_->Leave(evaluated_);
+  }
+}
+
+RecalcProfiler::RecalcProfiler() : origin_(Clock::now()) {}
+
+void RecalcProfiler::Reset() {
+  origin_ = Clock::now();
+  stack_.clear();
+  stats_.clear();
+  edges_.clear();
+  events_.clear();
+}
+
+void RecalcProfiler::Enter(Position pos) {
+  if (!stack_.empty()) {
+    edges_[stack_.back().pos].insert(pos);
+  }
+  stack_.push_back({pos, Clock::now()});
+}
+
+void RecalcProfiler::Leave(bool evaluated) {
+  auto frame = stack_.back();
+  stack_.pop_back();
+  auto elapsed = Clock::now() - frame.start;
+
+  auto &stat = stats_[frame.pos];
+  stat.pos = frame.pos;
+  ++stat.reads;
+  if (evaluated) {
+    ++stat.evaluations;
+    stat.total += elapsed;
+    stat.self += elapsed - frame.children;
+    events_.push_back({frame.pos, frame.start, elapsed, stack_.size()});
+  }
+
+  if (!stack_.empty()) {
+    stack_.back().children += elapsed;
+  }
+}
+
+std::vector<RecalcProfiler::CellStat> RecalcProfiler::GetHotCells() const {
+  std::vector<CellStat> result;
+  result.reserve(stats_.size());
+  for (const auto &[pos, stat] : stats_) {
+    result.push_back(stat);
+  }
+  std::sort(result.begin(), result.end(), [](const CellStat &lhs, const CellStat &rhs) {
+    if (lhs.self != rhs.self) {
+      return lhs.self > rhs.self;
+    }
+    return lhs.pos < rhs.pos;
+  });
+  return result;
+}
+
+RecalcProfiler::CriticalPath RecalcProfiler::GetCriticalPath() const {
+  // Стоимость цепочки, начинающейся в ячейке, и следующая ячейка цепочки
+  struct Chain {
+    Clock::duration cost{};
+    Position next = Position::NONE;
+  };
+  std::unordered_map<Position, Chain, PositionHasher> chains;
+
+  auto self_cost = [this](Position pos) {
+    auto it = stats_.find(pos);
+    return it == stats_.end() ? Clock::duration{} : it->second.self;
+  };
+
+  // Рёбра копятся за весь сеанс, и правки между вычислениями могут замкнуть
+  // их в цикл. Ячейки на пути обхода не посещаются повторно, а ребро назад к
+  // ним не продолжает цепочку
+  std::unordered_set<Position, PositionHasher> on_path;
+
+  // Обход в глубину без рекурсии: цепочки на больших листах длинные
+  for (const auto &[root, _] : stats_) {
+    if (chains.count(root) > 0) {
+      continue;
+    }
+    std::stack<std::pair<Position, bool>> stack;
+    stack.push({root, false});
+    while (!stack.empty()) {
+      auto [pos, expanded] = stack.top();
+      stack.pop();
+      if (chains.count(pos) > 0) {
+        continue;
+      }
+
+      auto edges = edges_.find(pos);
+      if (!expanded) {
+        if (!on_path.insert(pos).second) {
+          continue;
+        }
+        stack.push({pos, true});
+        if (edges != edges_.end()) {
+          for (auto to : edges->second) {
+            if (chains.count(to) == 0) {
+              stack.push({to, false});
+            }
+          }
+        }
+        continue;
+      }
+
+      Chain chain{self_cost(pos)};
+      if (edges != edges_.end()) {
+        Chain best;
+        for (auto to : edges->second) {
+          auto found = chains.find(to);
+          if (found == chains.end()) {
+            continue;
+          }
+          const auto &candidate = found->second;
+          if (best.next == Position::NONE || candidate.cost > best.cost
+              || (candidate.cost == best.cost && to < best.next)) {
+            best = {candidate.cost, to};
+          }
+        }
+        chain.cost += best.cost;
+        chain.next = best.next;
+      }
+      chains[pos] = chain;
+      on_path.erase(pos);
+    }
+  }
+
+  CriticalPath result;
+  Position start = Position::NONE;
+  for (const auto &[pos, chain] : chains) {
+    if (start == Position::NONE || chain.cost > result.cost
+        || (chain.cost == result.cost && pos < start)) {
+      start = pos;
+      result.cost = chain.cost;
+    }
+  }
+
+  for (auto pos = start; !(pos == Position::NONE); pos = chains.at(pos).next) {
+    result.cells.push_back(pos);
+  }
+  return result;
+}
+
+void RecalcProfiler::PrintReport(std::ostream &out, size_t limit) const {
+  auto hot_cells = GetHotCells();
+  out << "cell\tevaluations\treads\tself_us\ttotal_us\n";
+  out << std::fixed << std::setprecision(3);
+  for (size_t i = 0; i < hot_cells.size() && i < limit; ++i) {
+    const auto &stat = hot_cells[i];
+    out << CellName(stat.pos) << '\t'
+        << stat.evaluations << '\t'
+        << stat.reads << '\t'
+        << ToMicroseconds(stat.self) << '\t'
+        << ToMicroseconds(stat.total) << '\n';
+  }
+
+  auto path = GetCriticalPath();
+  out << "critical path (" << ToMicroseconds(path.cost) << " us):";
+  for (auto pos : path.cells) {
+    out << ' ' << CellName(pos);
+  }
+  out << '\n';
+  out << std::defaultfloat;
+}
+
+void RecalcProfiler::PrintChromeTrace(std::ostream &out) const {
+  out << "{\"traceEvents\":[";
+  out << std::fixed << std::setprecision(3);
+  bool first = true;
+  for (const auto &event : events_) {
+    if (!first) {
+      out << ',';
+    }
+    first = false;
+    out << "{\"name\":\"" << CellName(event.pos) << "\""
+        << ",\"cat\":\"recalc\",\"ph\":\"X\",\"pid\":1,\"tid\":1"
+        << ",\"ts\":" << ToMicroseconds(event.start - origin_)
+        << ",\"dur\":" << ToMicroseconds(event.duration)
+        << ",\"args\":{\"depth\":" << event.depth << "}}";
+  }
+  out << "],\"displayTimeUnit\":\"ns\"}\n";
+  out << std::defaultfloat;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+
+#include <chrono>
+#include <ostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Профилировщик пересчёта ячеек.
+// Включается явно: пока профилировщик не подключён к потоку через Attach(),
+// путь вычисления ничего не замеряет.
+//
+//   RecalcProfiler profiler;
+//   {
+//     auto session = profiler.Attach();
+//     sheet->PrintValues(out);
+//   }
+//   profiler.PrintReport(std::cerr);
+//   profiler.PrintChromeTrace(trace_file);
+class RecalcProfiler {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  struct CellStat {
+    Position pos;
+    // Сколько раз ячейка вычислялась (промахи кэша)
+    size_t evaluations = 0;
+    // Сколько раз значение ячейки запрашивалось
+    size_t reads = 0;
+    // Время вычисления вместе с зависимыми ячейками
+    Clock::duration total{};
+    // Время вычисления без учёта зависимых ячеек
+    Clock::duration self{};
+  };
+
+  struct CriticalPath {
+    // От корня цепочки к листу
+    std::vector<Position> cells;
+    Clock::duration cost{};
+  };
+
+  // Подключает профилировщик к текущему потоку на время жизни объекта
+  class Session {
+   public:
+    explicit Session(RecalcProfiler &profiler);
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
+    ~Session();
+
+   private:
+    RecalcProfiler *previous_;
+  };
+
+  // Замер одного обращения к значению ячейки на пути вычисления
+  class CellScope {
+   public:
+    explicit CellScope(Position pos);
+    CellScope(const CellScope &) = delete;
+    CellScope &operator=(const CellScope &) = delete;
+    ~CellScope();
+
+    // Значение не было взято из кэша и вычислялось
+    void MarkEvaluated() {
+      evaluated_ = true;
+    }
+
+   private:
+    RecalcProfiler *profiler_;
+    bool evaluated_ = false;
+  };
+
+  RecalcProfiler();
+
+  Session Attach() {
+    return Session(*this);
+  }
+
+  static bool IsActive() {
+    return active_ != nullptr;
+  }
+
+  void Reset();
+
+  // Статистика по ячейкам, отсортированная по убыванию собственного времени
+  std::vector<CellStat> GetHotCells() const;
+
+  // Самая дорогая по суммарному собственному времени цепочка зависимостей
+  CriticalPath GetCriticalPath() const;
+
+  void PrintReport(std::ostream &out, size_t limit = 20) const;
+
+  // Формат Chrome trace event (chrome://tracing, Perfetto)
+  void PrintChromeTrace(std::ostream &out) const;
+
+ private:
+  struct Frame {
+    Position pos;
+    Clock::time_point start;
+    Clock::duration children{};
+  };
+
+  struct TraceEvent {
+    Position pos;
+    Clock::time_point start;
+    Clock::duration duration;
+    size_t depth;
+  };
+
+  inline static thread_local RecalcProfiler *active_ = nullptr;
+
+  Clock::time_point origin_;
+  std::vector<Frame> stack_;
+  std::unordered_map<Position, CellStat, PositionHasher> stats_;
+  // Наблюдавшиеся зависимости: ячейка -> ячейки, прочитанные при её вычислении
+  std::unordered_map<Position, std::unordered_set<Position, PositionHasher>, PositionHasher> edges_;
+  std::vector<TraceEvent> events_;
+
+  void Enter(Position pos);
+  void Leave(bool evaluated);
+};
@@ -0,0 +1,144 @@
+#include "recalc_scheduler.h"
+
+#include "cell.h"
+
+RecalcScheduler::RecalcScheduler(Sheet &sheet) : sheet_(sheet) {}
+
+void RecalcScheduler::SetCell(Position pos, std::string text) {
+  sheet_.SetCell(pos, std::move(text));
+  changed_.push_back(pos);
+  Restart();
+}
+
+void RecalcScheduler::ClearCell(Position pos) {
+  sheet_.ClearCell(pos);
+  changed_.push_back(pos);
+  Restart();
+}
+
+void RecalcScheduler::SetViewport(Position top_left, Size size) {
+  viewport_top_left_ = top_left;
+  viewport_size_ = size;
+  Restart();
+}
+
+bool RecalcScheduler::Recalculate(Clock::duration budget) {
+  auto deadline = Clock::now() + budget;
+  bool more;
+  do {
+    more = Step();
+  } while (more && Clock::now() < deadline);
+  if (IsViewportReady()) {
+    sheet_.NotifyChanges();
+  }
+  return more && (!changed_.empty() || !pending_.empty());
+}
+
+bool RecalcScheduler::IsViewportReady() const {
+  if (!changed_.empty()) {
+    return false;
+  }
+  for (int row = 0; row < viewport_size_.rows; ++row) {
+    for (int col = 0; col < viewport_size_.cols; ++col) {
+      if (pending_.count({viewport_top_left_.row + row, viewport_top_left_.col + col}) > 0) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+size_t RecalcScheduler::GetPendingCount() const {
+  return pending_.size();
+}
+
+bool RecalcScheduler::InViewport(Position pos) const {
+  return pos.row >= viewport_top_left_.row
+      && pos.row < viewport_top_left_.row + viewport_size_.rows
+      && pos.col >= viewport_top_left_.col
+      && pos.col < viewport_top_left_.col + viewport_size_.cols;
+}
+
+void RecalcScheduler::Restart() {
+  roots_.clear();
+  roots_ready_ = false;
+  stack_.clear();
+}
+
+bool RecalcScheduler::Step() {
+  if (changed_.empty()) {
+    return Evaluate();
+  }
+
+  // Зависимые находятся до вычислений: иначе формула может быть вычислена
+  // раньше изменённой ячейки, от которой зависит
+  auto pos = changed_.back();
+  changed_.pop_back();
+  if (expanded_.insert(pos).second) {
+    auto cell = sheet_.GetCell(pos);
+    if (cell != nullptr && static_cast<const Cell *>(cell)->IsFormula()) {
+      pending_.insert(pos);
+    }
+    for (auto to : sheet_.GetDependents(pos)) {
+      changed_.push_back(to);
+    }
+  }
+  if (changed_.empty()) {
+    expanded_.clear();
+  }
+  return true;
+}
+
+bool RecalcScheduler::Evaluate() {
+  while (stack_.empty()) {
+    if (pending_.empty()) {
+      return false;
+    }
+    if (!roots_ready_ || roots_.empty()) {
+      // Видимые ячейки в конце: очередь разбирается с конца
+      roots_.clear();
+      for (auto pos : pending_) {
+        if (!InViewport(pos)) {
+          roots_.push_back(pos);
+        }
+      }
+      for (auto pos : pending_) {
+        if (InViewport(pos)) {
+          roots_.push_back(pos);
+        }
+      }
+      roots_ready_ = true;
+    }
+    auto root = roots_.back();
+    roots_.pop_back();
+    if (pending_.count(root) > 0) {
+      stack_.push_back(root);
+    }
+  }
+
+  // Спуск к ещё не вычисленной формуле, все ссылки которой готовы
+  for (;;) {
+    auto pos = stack_.back();
+    auto cell = pending_.count(pos) > 0 ? sheet_.GetCell(pos) : nullptr;
+    if (cell == nullptr) {
+      pending_.erase(pos);
+      stack_.pop_back();
+      return true;
+    }
+
+    bool ready = true;
+    for (auto from : cell->GetReferencedCells()) {
+      if (from.IsValid() && pending_.count(from) > 0) {
+        stack_.push_back(from);
+        ready = false;
+        break;
+      }
+    }
+    if (ready) {
+      cell->GetValue();
+      pending_.erase(pos);
+      stack_.pop_back();
+      return true;
+    }
+  }
+}
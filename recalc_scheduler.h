@@ -0,0 +1,68 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <chrono>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Пересчёт листа квантами ограниченного времени.
+// Изменения проходят через планировщик, который запоминает зависящие от них
+// формулы. Recalculate() вычисляет их по одной, начиная с тех, на которые
+// ссылаются, так что каждая ячейка вычисляется из уже готовых значений без
+// глубокой рекурсии. Сначала вычисляются ячейки видимой области и то, от чего
+// они зависят. Следующий вызов продолжает с места остановки.
+//
+//   RecalcScheduler scheduler(sheet);
+//   scheduler.SetViewport("A1"_pos, {40, 10});
+//   scheduler.SetCell("B2"_pos, "=A1*2");
+//   while (scheduler.Recalculate(std::chrono::milliseconds(8))) {
+//     DrawFrame();
+//   }
+class RecalcScheduler {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit RecalcScheduler(Sheet &sheet);
+
+  // Исключения те же, что у Sheet::SetCell и Sheet::ClearCell
+  void SetCell(Position pos, std::string text);
+  void ClearCell(Position pos);
+
+  // Видимая область: size.rows x size.cols начиная с top_left
+  void SetViewport(Position top_left, Size size);
+
+  // Работает около budget, но хотя бы один шаг. Возвращает true, если
+  // работа осталась. Когда видимая область вычислена, сообщает подписчикам
+  // листа об изменениях (Sheet::NotifyChanges)
+  bool Recalculate(Clock::duration budget);
+
+  // Все формулы видимой области вычислены
+  bool IsViewportReady() const;
+  // Формулы, ожидающие вычисления
+  size_t GetPendingCount() const;
+
+ private:
+  Sheet &sheet_;
+  Position viewport_top_left_{0, 0};
+  Size viewport_size_{0, 0};
+
+  // Изменённые ячейки, зависящие от которых формулы ещё не найдены
+  std::vector<Position> changed_;
+  std::unordered_set<Position, PositionHasher> expanded_;
+  std::unordered_set<Position, PositionHasher> pending_;
+  // Очередь обхода: сначала видимая область; строится заново после изменений
+  std::vector<Position> roots_;
+  bool roots_ready_ = false;
+  // Путь обхода в глубину от ячейки к ещё не вычисленным ссылкам
+  std::vector<Position> stack_;
+
+  bool InViewport(Position pos) const;
+  void Restart();
+  // Один шаг: найти зависимые одной ячейки или вычислить одну формулу.
+  // false - работы нет
+  bool Step();
+  bool Evaluate();
+};
@@ -0,0 +1,344 @@
+#include "scenario.h"
+
+#include "cell.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+using namespace std::literals;
+
+ScenarioProgram::ScenarioProgram(const Sheet &sheet, std::vector<Position> inputs, Position output)
+    : inputs_(std::move(inputs)) {
+  if (inputs_.empty()) {
+    throw std::invalid_argument("Scenario has no inputs"s);
+  }
+
+  std::unordered_map<Position, uint32_t, PositionHasher> slots;
+  auto add_slot = [this, &slots](Position pos, double value, ErrorCode error) {
+    auto slot = static_cast<uint32_t>(values_.size());
+    slots.emplace(pos, slot);
+    values_.push_back(value);
+    errors_.push_back(error);
+    return slot;
+  };
+
+  for (auto pos : inputs_) {
+    sheet.GetCell(pos);
+    if (slots.count(pos) > 0) {
+      throw std::invalid_argument("Duplicate scenario input "s + pos.ToString());
+    }
+    add_slot(pos, 0, 0);
+  }
+  sheet.GetCell(output);
+
+  // Обход в глубину без рекурсии: формула попадает в программу после всех
+  // своих ссылок. Циклов в листе нет, поэтому повторно встреченная ячейка
+  // уже собрана или ещё ждёт своей очереди в стеке
+  struct Frame {
+    Position pos;
+    bool expanded;
+  };
+  std::vector<Frame> stack{{output, false}};
+  while (!stack.empty()) {
+    auto [pos, expanded] = stack.back();
+    if (slots.count(pos) > 0) {
+      stack.pop_back();
+      continue;
+    }
+    auto cell = static_cast<const Cell *>(sheet.GetCell(pos));
+    // Элементы массива не переводятся в команды программы
+    if (cell != nullptr && (cell->IsArray() || cell->IsSpill())) {
+      throw std::invalid_argument("Scenario cell "s + pos.ToString() + " is an array formula result"s);
+    }
+
+    if (cell == nullptr || !cell->IsFormula() || !cell->IsValid()) {
+      // Значение не зависит от входов: вычисляется один раз при сборке
+      stack.pop_back();
+      double value = 0;
+      ErrorCode error = 0;
+      if (cell != nullptr) {
+        try {
+          value = cell->GetNumber();
+        } catch (const FormulaError &e) {
+          error = ToErrorCode(e.GetCategory());
+        }
+      }
+      add_slot(pos, value, error);
+      continue;
+    }
+
+    if (!expanded) {
+      if (!cell->GetReferencedRanges().empty()) {
+        throw std::invalid_argument("Scenario formula "s + pos.ToString() + " reads a range"s);
+      }
+      stack.back().expanded = true;
+      for (auto from : cell->GetReferencedCells()) {
+        if (slots.count(from) == 0) {
+          stack.push_back({from, false});
+        }
+      }
+      continue;
+    }
+
+    stack.pop_back();
+    const auto &ast = cell->GetFormula()->GetAST();
+    // Команды переводятся одна в одну, поэтому адреса переходов сдвигаются на
+    // начало формулы
+    const auto base = static_cast<uint32_t>(program_.size());
+    using Op = ASTImpl::Instruction::Op;
+    for (const auto &instruction : ast.GetProgram()) {
+      auto jump = base + static_cast<uint32_t>(instruction.jump);
+      switch (instruction.op) {
+        case Op::Number:program_.push_back({Instruction::Op::Number, instruction.value});
+          break;
+        case Op::Cell:program_.push_back({Instruction::Op::Load, 0, slots.at(*instruction.cell)});
+          break;
+        case Op::Add:program_.push_back({Instruction::Op::Add});
+          break;
+        case Op::Subtract:program_.push_back({Instruction::Op::Subtract});
+          break;
+        case Op::Multiply:program_.push_back({Instruction::Op::Multiply});
+          break;
+        case Op::Divide:program_.push_back({Instruction::Op::Divide});
+          break;
+        case Op::Negate:program_.push_back({Instruction::Op::Negate});
+          break;
+        case Op::Equal:program_.push_back({Instruction::Op::Equal});
+          break;
+        case Op::NotEqual:program_.push_back({Instruction::Op::NotEqual});
+          break;
+        case Op::Less:program_.push_back({Instruction::Op::Less});
+          break;
+        case Op::LessEqual:program_.push_back({Instruction::Op::LessEqual});
+          break;
+        case Op::Greater:program_.push_back({Instruction::Op::Greater});
+          break;
+        case Op::GreaterEqual:program_.push_back({Instruction::Op::GreaterEqual});
+          break;
+        case Op::Test:program_.push_back({Instruction::Op::Test});
+          break;
+        case Op::JumpIfZero:program_.push_back({Instruction::Op::JumpIfZero, 0, jump});
+          break;
+        case Op::JumpIfNonZero:program_.push_back({Instruction::Op::JumpIfNonZero, 0, jump});
+          break;
+        case Op::Jump:program_.push_back({Instruction::Op::Jump, 0, jump});
+          break;
+        case Op::Match:
+        case Op::VLookup:throw std::logic_error("Lookup outside of range formula"s);
+      }
+    }
+    program_.push_back({Instruction::Op::Store, 0, add_slot(pos, 0, 0)});
+    stack_depth_ = std::max(stack_depth_, ast.GetStackDepth());
+    ++formula_count_;
+  }
+
+  output_slot_ = slots.at(output);
+}
+
+std::vector<FormulaInterface::Value> ScenarioProgram::Evaluate(const std::vector<double> &inputs,
+                                                               size_t threads) const {
+  if (inputs.size() % inputs_.size() != 0) {
+    throw std::invalid_argument("Scenario inputs are incomplete"s);
+  }
+  const size_t count = inputs.size() / inputs_.size();
+  std::vector<FormulaInterface::Value> result(count);
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  // Потоку достаётся целое число блоков
+  const size_t blocks = (count + LANES - 1) / LANES;
+  threads = std::min(threads, std::max<size_t>(1, blocks));
+  if (threads == 1) {
+    EvaluateRange(inputs, 0, count, result);
+    return result;
+  }
+
+  std::vector<std::thread> workers;
+  size_t chunk = (blocks + threads - 1) / threads * LANES;
+  for (size_t begin = 0; begin < count; begin += chunk) {
+    workers.emplace_back([this, &inputs, &result, begin, end = std::min(begin + chunk, count)] {
+      EvaluateRange(inputs, begin, end, result);
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  return result;
+}
+
+ScenarioProgram::ErrorCode ScenarioProgram::ToErrorCode(FormulaError::Category category) {
+  return static_cast<ErrorCode>(static_cast<int>(category) + 1);
+}
+
+void ScenarioProgram::EvaluateRange(const std::vector<double> &inputs, size_t begin, size_t end,
+                                    std::vector<FormulaInterface::Value> &result) const {
+  // Значения ячейки slot для сценариев блока - элементы
+  // [slot * LANES, (slot + 1) * LANES)
+  std::vector<double> values(values_.size() * LANES);
+  std::vector<ErrorCode> errors(errors_.size() * LANES);
+  for (size_t slot = 0; slot < values_.size(); ++slot) {
+    std::fill_n(values.begin() + slot * LANES, LANES, values_[slot]);
+    std::fill_n(errors.begin() + slot * LANES, LANES, errors_[slot]);
+  }
+  std::vector<double> stack(stack_depth_ * LANES);
+
+  const size_t width = inputs_.size();
+  for (size_t block = begin; block < end; block += LANES) {
+    // Неполный блок дополняется копиями последнего сценария
+    const size_t lanes = std::min(LANES, end - block);
+    for (size_t input = 0; input < width; ++input) {
+      for (size_t lane = 0; lane < LANES; ++lane) {
+        values[input * LANES + lane] = inputs[(block + std::min(lane, lanes - 1)) * width + input];
+      }
+    }
+
+    if (!RunBlock<LANES>(0, values.data(), errors.data(), stack.data())) {
+      for (size_t lane = 0; lane < lanes; ++lane) {
+        RunBlock<1>(lane, values.data(), errors.data(), stack.data());
+      }
+    }
+
+    for (size_t lane = 0; lane < lanes; ++lane) {
+      auto code = errors[output_slot_ * LANES + lane];
+      if (code != 0) {
+        result[block + lane] = FormulaError(static_cast<FormulaError::Category>(code - 1));
+      } else {
+        result[block + lane] = values[output_slot_ * LANES + lane];
+      }
+    }
+  }
+}
+
+template <size_t Width>
+bool ScenarioProgram::RunBlock(size_t first, double *values, ErrorCode *errors,
+                               double *stack) const {
+  using Op = Instruction::Op;
+  const ErrorCode div0 = ToErrorCode(FormulaError::Category::Div0);
+
+  // Первая ошибка вычисляемой формулы, как у исключения в FormulaAST::Execute.
+  // Значения сценариев с ошибкой дальше вычисляются, но не используются
+  ErrorCode error[LANES] = {};
+  double *top = stack;
+  auto compare = [&](auto less) {
+    top -= LANES;
+    for (size_t i = 0; i < Width; ++i) {
+      auto lane = first + i;
+      (top - LANES)[lane] = less((top - LANES)[lane], top[lane]) ? 1 : 0;
+    }
+  };
+  // Переход, общий для всех сценариев блока
+  auto branch = [&](bool if_zero, size_t &next, size_t target) {
+    top -= LANES;
+    size_t taken = 0;
+    for (size_t i = 0; i < Width; ++i) {
+      auto lane = first + i;
+      taken += (top[lane] == 0) == if_zero ? 1 : 0;
+    }
+    if (taken == Width) {
+      next = target;
+    }
+    return taken == 0 || taken == Width;
+  };
+
+  for (size_t next = 0; next < program_.size();) {
+    const auto &instruction = program_[next++];
+    switch (instruction.op) {
+      case Op::Number:
+        std::fill_n(top + first, Width, instruction.value);
+        top += LANES;
+        break;
+      case Op::Load: {
+        const double *from = &values[instruction.slot * LANES];
+        const ErrorCode *from_error = &errors[instruction.slot * LANES];
+        for (size_t i = 0; i < Width; ++i) {
+          auto lane = first + i;
+          top[lane] = from[lane];
+          error[lane] = error[lane] != 0 ? error[lane] : from_error[lane];
+        }
+        top += LANES;
+        break;
+      }
+      case Op::Add:
+        top -= LANES;
+        for (size_t i = 0; i < Width; ++i) {
+          (top - LANES)[first + i] += top[first + i];
+        }
+        break;
+      case Op::Subtract:
+        top -= LANES;
+        for (size_t i = 0; i < Width; ++i) {
+          (top - LANES)[first + i] -= top[first + i];
+        }
+        break;
+      case Op::Multiply:
+        top -= LANES;
+        for (size_t i = 0; i < Width; ++i) {
+          (top - LANES)[first + i] *= top[first + i];
+        }
+        break;
+      case Op::Divide:
+        top -= LANES;
+        for (size_t i = 0; i < Width; ++i) {
+          auto lane = first + i;
+          double quotient = (top - LANES)[lane] / top[lane];
+          (top - LANES)[lane] = quotient;
+          ErrorCode divide_error = std::isfinite(quotient) ? 0 : div0;
+          error[lane] = error[lane] != 0 ? error[lane] : divide_error;
+        }
+        break;
+      case Op::Negate:
+        for (size_t i = 0; i < Width; ++i) {
+          (top - LANES)[first + i] *= -1;
+        }
+        break;
+      case Op::Equal:compare(std::equal_to<double>());
+        break;
+      case Op::NotEqual:compare(std::not_equal_to<double>());
+        break;
+      case Op::Less:compare(std::less<double>());
+        break;
+      case Op::LessEqual:compare(std::less_equal<double>());
+        break;
+      case Op::Greater:compare(std::greater<double>());
+        break;
+      case Op::GreaterEqual:compare(std::greater_equal<double>());
+        break;
+      case Op::Test:
+        for (size_t i = 0; i < Width; ++i) {
+          auto lane = first + i;
+          (top - LANES)[lane] = (top - LANES)[lane] != 0 ? 1 : 0;
+        }
+        break;
+      case Op::JumpIfZero:
+        if (!branch(true, next, instruction.slot)) {
+          return false;
+        }
+        break;
+      case Op::JumpIfNonZero:
+        if (!branch(false, next, instruction.slot)) {
+          return false;
+        }
+        break;
+      case Op::Jump:next = instruction.slot;
+        break;
+      case Op::Store: {
+        top -= LANES;
+        double *to = &values[instruction.slot * LANES];
+        ErrorCode *to_error = &errors[instruction.slot * LANES];
+        for (size_t i = 0; i < Width; ++i) {
+          auto lane = first + i;
+          to[lane] = top[lane];
+          to_error[lane] = error[lane];
+          error[lane] = 0;
+        }
+        break;
+      }
+    }
+  }
+  return true;
+}
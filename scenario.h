@@ -0,0 +1,103 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <cstdint>
+#include <vector>
+
+// Пакетное вычисление сценариев "что, если".
+// Конструктор собирает формулы, от которых зависит выходная ячейка, в одну
+// плоскую программу: ссылки заменены номерами ячеек, формулы упорядочены так,
+// что каждая вычисляется после своих ссылок. Входные ячейки программа берёт из
+// вектора сценария, остальные ячейки вне формул - из листа на момент сборки.
+// Лист при вычислении не читается и не изменяется.
+//
+//   ScenarioProgram program(sheet, {"A1"_pos, "A2"_pos}, "D10"_pos);
+//   // Сценарий i задаёт A1 = inputs[2 * i], A2 = inputs[2 * i + 1]
+//   auto results = program.Evaluate(inputs, 0);
+class ScenarioProgram {
+ public:
+  // Бросает InvalidPositionException для некорректной позиции и
+  // std::invalid_argument для повторяющихся входов, формул с областями
+  // (MATCH, VLOOKUP) и формул-массивов с их результатами: поиск и массивы в
+  // программу не переводятся
+  ScenarioProgram(const Sheet &sheet, std::vector<Position> inputs, Position output);
+
+  size_t GetInputCount() const {
+    return inputs_.size();
+  }
+
+  // Число формул в программе
+  size_t GetFormulaCount() const {
+    return formula_count_;
+  }
+
+  // Значение выходной ячейки для каждого сценария - такое, каким его видит
+  // ссылающаяся на неё формула. Входы сценария i занимают элементы
+  // [i * GetInputCount(), (i + 1) * GetInputCount()). threads - число
+  // потоков, 0 - по числу ядер. Бросает std::invalid_argument, если размер
+  // inputs не кратен числу входов
+  std::vector<FormulaInterface::Value> Evaluate(const std::vector<double> &inputs,
+                                                size_t threads = 1) const;
+
+ private:
+  // Сценарии вычисляются блоками: каждая команда выполняется сразу для всех
+  // сценариев блока, и циклы по ним компилятор векторизует. Если условие
+  // IF, AND или OR в сценариях блока расходится, блок вычисляется заново по
+  // одному сценарию
+  static constexpr size_t LANES = 8;
+
+  struct Instruction {
+    enum class Op : char {
+      Number,
+      // Значение ячейки slot
+      Load,
+      Add,
+      Subtract,
+      Multiply,
+      Divide,
+      Negate,
+      Equal,
+      NotEqual,
+      Less,
+      LessEqual,
+      Greater,
+      GreaterEqual,
+      Test,
+      // Переходы к команде slot, как в ASTImpl::Instruction
+      JumpIfZero,
+      JumpIfNonZero,
+      Jump,
+      // Конец формулы: результат и ошибка записываются в ячейку slot
+      Store,
+    };
+
+    Op op;
+    double value = 0;
+    uint32_t slot = 0;
+  };
+
+  // Значение ячейки: 0 - нет ошибки, иначе категория ошибки + 1
+  using ErrorCode = unsigned char;
+
+  std::vector<Position> inputs_;
+  // Начальные значения ячеек; у входов и формул перезаписываются
+  std::vector<double> values_;
+  std::vector<ErrorCode> errors_;
+  std::vector<Instruction> program_;
+  size_t formula_count_ = 0;
+  size_t stack_depth_ = 1;
+  uint32_t output_slot_ = 0;
+
+  static ErrorCode ToErrorCode(FormulaError::Category category);
+
+  // Сценарии [begin, end)
+  void EvaluateRange(const std::vector<double> &inputs, size_t begin, size_t end,
+                     std::vector<FormulaInterface::Value> &result) const;
+  // Выполняет программу для сценариев блока [first, first + Width). false -
+  // условный переход расходится между сценариями
+  template <size_t Width>
+  bool RunBlock(size_t first, double *values, ErrorCode *errors, double *stack) const;
+};
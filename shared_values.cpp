@@ -0,0 +1,237 @@
+#include "shared_values.h"
+
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std::literals;
+
+namespace {
+
+#ifndef _WIN32
+[[noreturn]] void ThrowSystemError(const std::string &what) {
+  throw std::system_error(errno, std::generic_category(), what);
+}
+#endif
+
+// Записи начинаются с границы кэш-линии
+constexpr size_t ENTRIES_OFFSET = 64;
+static_assert(sizeof(SharedValues::Header) <= ENTRIES_OFFSET);
+
+}  // namespace
+
+size_t SharedValues::GetMappingSize(Size size) {
+  return ENTRIES_OFFSET + static_cast<size_t>(size.rows) * size.cols * sizeof(Entry);
+}
+
+#ifndef _WIN32
+
+SharedValuesWriter::SharedValuesWriter(Sheet &sheet, std::string name, Position top_left, Size size)
+    : sheet_(sheet), name_(std::move(name)), top_left_(top_left), size_(size) {
+  if (!top_left.IsValid() || size.rows <= 0 || size.cols <= 0
+      || !Position{top_left.row + size.rows - 1, top_left.col + size.cols - 1}.IsValid()) {
+    throw InvalidPositionException("Shared values area is out of the sheet"s);
+  }
+
+  int fd = ::shm_open(name_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    ThrowSystemError("shm_open "s + name_);
+  }
+  mapping_size_ = SharedValues::GetMappingSize(size);
+  void *mapping = MAP_FAILED;
+  if (::ftruncate(fd, static_cast<off_t>(mapping_size_)) == 0) {
+    mapping = ::mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  auto error = errno;
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    ::shm_unlink(name_.c_str());
+    errno = error;
+    ThrowSystemError("mmap "s + name_);
+  }
+  mapping_ = mapping;
+
+  // Деструктор не вызовется: при ошибке область удаляется здесь
+  try {
+    // Новый объект заполнен нулями: счётчик чётный, записи пустые
+    auto &header = GetHeader();
+    header.top_row = top_left.row;
+    header.top_col = top_left.col;
+    header.rows = size.rows;
+    header.cols = size.cols;
+    Publish();
+    // Читатель, увидевший признак, видит и заголовок
+    std::atomic_thread_fence(std::memory_order_release);
+    header.magic = SharedValues::Header::MAGIC;
+
+    subscription_ = sheet_.Subscribe(top_left, size, [this](const std::vector<Position> &changed) {
+      Write(changed);
+    });
+  } catch (...) {
+    ::munmap(mapping_, mapping_size_);
+    ::shm_unlink(name_.c_str());
+    throw;
+  }
+}
+
+SharedValuesWriter::~SharedValuesWriter() {
+  sheet_.Unsubscribe(subscription_);
+  ::munmap(mapping_, mapping_size_);
+  ::shm_unlink(name_.c_str());
+}
+
+#endif
+
+SharedValues::Header &SharedValuesWriter::GetHeader() const {
+  return *static_cast<SharedValues::Header *>(mapping_);
+}
+
+SharedValues::Entry *SharedValuesWriter::GetEntries() const {
+  return reinterpret_cast<SharedValues::Entry *>(static_cast<char *>(mapping_) + ENTRIES_OFFSET);
+}
+
+void SharedValuesWriter::BeginWrite() {
+  auto &sequence = GetHeader().sequence;
+  sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+void SharedValuesWriter::EndWrite() {
+  auto &header = GetHeader();
+  header.sheet_version = sheet_.GetVersion();
+  header.sequence.store(header.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void SharedValuesWriter::Publish() {
+  // Значения вычисляются до начала записи, чтобы читатели не ждали их
+  std::vector<double> numbers(static_cast<size_t>(size_.rows) * size_.cols);
+  std::vector<ValueTag> tags(numbers.size());
+  std::vector<std::string_view> texts(numbers.size());
+  sheet_.GetValues(top_left_, size_, {numbers.data(), tags.data(), texts.data()});
+
+  BeginWrite();
+  auto entries = GetEntries();
+  for (int row = 0; row < size_.rows; ++row) {
+    for (int col = 0; col < size_.cols; ++col) {
+      const size_t column_index = static_cast<size_t>(col) * size_.rows + row;
+      auto &entry = entries[static_cast<size_t>(row) * size_.cols + col];
+      entry.number = numbers[column_index];
+      entry.tag = tags[column_index];
+    }
+  }
+  EndWrite();
+}
+
+void SharedValuesWriter::Write(const std::vector<Position> &changed) {
+  std::vector<std::pair<double, ValueTag>> values;
+  values.reserve(changed.size());
+  for (auto pos : changed) {
+    double number;
+    ValueTag tag;
+    std::string_view text;
+    sheet_.GetValues(pos, {1, 1}, {&number, &tag, &text});
+    values.emplace_back(number, tag);
+  }
+
+  BeginWrite();
+  auto entries = GetEntries();
+  for (size_t i = 0; i < changed.size(); ++i) {
+    auto &entry = entries[static_cast<size_t>(changed[i].row - top_left_.row) * size_.cols
+        + (changed[i].col - top_left_.col)];
+    entry.number = values[i].first;
+    entry.tag = values[i].second;
+  }
+  EndWrite();
+}
+
+#ifndef _WIN32
+
+SharedValuesReader::SharedValuesReader(const std::string &name) {
+  int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    ThrowSystemError("shm_open "s + name);
+  }
+  struct stat status;
+  void *mapping = MAP_FAILED;
+  if (::fstat(fd, &status) == 0) {
+    mapping = ::mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, fd, 0);
+  }
+  auto error = errno;
+  ::close(fd);
+  if (mapping == MAP_FAILED) {
+    errno = error;
+    ThrowSystemError("mmap "s + name);
+  }
+  mapping_ = mapping;
+  mapping_size_ = static_cast<size_t>(status.st_size);
+
+  const bool valid = mapping_size_ >= sizeof(SharedValues::Header)
+      && GetHeader().magic == SharedValues::Header::MAGIC;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (!valid || mapping_size_ < SharedValues::GetMappingSize(GetSize())) {
+    ::munmap(const_cast<void *>(mapping_), mapping_size_);
+    throw std::runtime_error("Not a shared values area: "s + name);
+  }
+}
+
+SharedValuesReader::~SharedValuesReader() {
+  ::munmap(const_cast<void *>(mapping_), mapping_size_);
+}
+
+#else
+
+// Разделяемой памяти POSIX нет: области недоступны
+SharedValuesWriter::SharedValuesWriter(Sheet &sheet, std::string name, Position top_left, Size size)
+    : sheet_(sheet), name_(std::move(name)), top_left_(top_left), size_(size) {
+  throw std::system_error(std::make_error_code(std::errc::function_not_supported),
+                          "Shared values "s + name_);
+}
+
+SharedValuesWriter::~SharedValuesWriter() = default;
+
+SharedValuesReader::SharedValuesReader(const std::string &name) {
+  throw std::system_error(std::make_error_code(std::errc::function_not_supported),
+                          "Shared values "s + name);
+}
+
+SharedValuesReader::~SharedValuesReader() = default;
+
+#endif
+
+Position SharedValuesReader::GetTopLeft() const {
+  return {GetHeader().top_row, GetHeader().top_col};
+}
+
+Size SharedValuesReader::GetSize() const {
+  return {GetHeader().rows, GetHeader().cols};
+}
+
+SharedValues::Entry SharedValuesReader::Get(Position pos) const {
+  auto top_left = GetTopLeft();
+  auto size = GetSize();
+  if (pos.row < top_left.row || pos.col < top_left.col || pos.row >= top_left.row + size.rows
+      || pos.col >= top_left.col + size.cols) {
+    throw InvalidPositionException("Position is out of the shared values area"s);
+  }
+  const size_t index = static_cast<size_t>(pos.row - top_left.row) * size.cols + (pos.col - top_left.col);
+  SharedValues::Entry result;
+  Read([&result, index](const SharedValues::Entry *grid) {
+    result = grid[index];
+  });
+  return result;
+}
+
+const SharedValues::Header &SharedValuesReader::GetHeader() const {
+  return *static_cast<const SharedValues::Header *>(mapping_);
+}
+
+const SharedValues::Entry *SharedValuesReader::GetEntries() const {
+  return reinterpret_cast<const SharedValues::Entry *>(static_cast<const char *>(mapping_) + ENTRIES_OFFSET);
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "cell.h"
+#include "sheet.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Вычисленные значения области листа в разделяемой памяти POSIX для
+// читателей из других процессов. Область - сетка записей по строкам:
+// число и тег значения, текст не передаётся. Запись защищена seqlock:
+// писатель делает счётчик нечётным на время изменения, читатель читает
+// записи прямо из отображения и повторяет чтение, если счётчик изменился.
+//
+//   SharedValuesWriter writer(sheet, "/sheet-values", {0, 0}, {1000, 26});
+//   sheet.SetCell("A1"_pos, "=B1+1");
+//   sheet.NotifyChanges();  // изменённые значения записываются в область
+//
+//   SharedValuesReader reader("/sheet-values");  // в другом процессе
+//   reader.Read([](const SharedValues::Entry *grid) { ... });
+namespace SharedValues {
+
+struct Entry {
+  // 0, если значение не число
+  double number;
+  ValueTag tag;
+  char padding[7];
+};
+
+struct Header {
+  static constexpr uint64_t MAGIC = 0x5348454554564c31;  // "SHEETVL1"
+
+  uint64_t magic;
+  int32_t top_row;
+  int32_t top_col;
+  int32_t rows;
+  int32_t cols;
+  // Нечётный, пока писатель изменяет записи
+  std::atomic<uint64_t> sequence;
+  // Sheet::GetVersion последней записи
+  uint64_t sheet_version;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+static_assert(sizeof(Entry) == 16);
+
+// Размер отображения области rows x cols
+size_t GetMappingSize(Size size);
+
+}  // namespace SharedValues
+
+// Создаёт область name (имя shm_open) и записывает в неё значения области
+// листа, затем после каждого Sheet::NotifyChanges - изменившиеся значения.
+// Прежняя область с тем же именем заменяется, при разрушении удаляется.
+// Ошибки системных вызовов - исключение std::system_error. Только POSIX: в
+// сборке для Windows конструкторы писателя и читателя бросают
+// std::system_error
+class SharedValuesWriter {
+ public:
+  SharedValuesWriter(Sheet &sheet, std::string name, Position top_left, Size size);
+  SharedValuesWriter(const SharedValuesWriter &) = delete;
+  SharedValuesWriter &operator=(const SharedValuesWriter &) = delete;
+  ~SharedValuesWriter();
+
+  // Записывает всю область заново
+  void Publish();
+
+ private:
+  Sheet &sheet_;
+  std::string name_;
+  Position top_left_;
+  Size size_;
+  void *mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+  size_t subscription_;
+
+  SharedValues::Header &GetHeader() const;
+  SharedValues::Entry *GetEntries() const;
+  // Записи между BeginWrite и EndWrite читатели не видят частично
+  void BeginWrite();
+  void EndWrite();
+  void Write(const std::vector<Position> &changed);
+};
+
+// Отображение области SharedValuesWriter только для чтения
+class SharedValuesReader {
+ public:
+  explicit SharedValuesReader(const std::string &name);
+  SharedValuesReader(const SharedValuesReader &) = delete;
+  SharedValuesReader &operator=(const SharedValuesReader &) = delete;
+  ~SharedValuesReader();
+
+  Position GetTopLeft() const;
+  Size GetSize() const;
+
+  // Вызывает func(grid) с записями области, элемент row * cols + col -
+  // ячейка top_left + {row, col}, без копирования. Если писатель изменил
+  // область во время вызова, func вызывается снова: до возврата она может
+  // видеть несогласованные записи и не должна на них полагаться. Возвращает
+  // версию листа, которую видела последняя func
+  template <typename Func>
+  uint64_t Read(Func func) const {
+    const auto &header = GetHeader();
+    while (true) {
+      auto sequence = header.sequence.load(std::memory_order_acquire);
+      if (sequence % 2 != 0) {
+        continue;
+      }
+      auto version = header.sheet_version;
+      func(GetEntries());
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (header.sequence.load(std::memory_order_relaxed) == sequence) {
+        return version;
+      }
+    }
+  }
+
+  // Согласованная копия одной записи
+  SharedValues::Entry Get(Position pos) const;
+
+ private:
+  const void *mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+
+  const SharedValues::Header &GetHeader() const;
+  const SharedValues::Entry *GetEntries() const;
+};
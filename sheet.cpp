@@ -4,9 +4,15 @@
 #include "common.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <optional>
+#include <set>
+#include <thread>
+#include <utility>
 
 using namespace std::literals;
 
@@ -15,287 +21,2045 @@ Sheet::~Sheet() {}
 void Sheet::SetCell(Position pos, std::string text) {
   validatePosition(pos);
 
-  auto new_cell = std::make_unique<Cell>(*this);
-  new_cell->Set(text);
-  if (new_cell->IsFormula() && new_cell->IsValid()) {
-    if (CycleDetector(pos, *new_cell)) {
-      throw CircularDependencyException("Cycle detected"s);
+  // Формула разбирается без блокировок
+  auto new_cell = std::make_unique<Cell>(*this, pos, &formula_cache_);
+  new_cell->Set(std::move(text));
+  const auto added_hash = HashCell(pos, new_cell.get());
+
+  ShardLocks locks(*this, pos);
+  StoreCell(pos, std::move(new_cell), added_hash, locks);
+  TrimResident();
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+  for (const auto &[pos, text] : cells) {
+    validatePosition(pos);
+  }
+
+  // Все тексты разбираются до изменений: синтаксическая ошибка оставляет
+  // лист прежним
+  std::vector<std::unique_ptr<Cell>> new_cells;
+  std::vector<uint64_t> added_hashes;
+  new_cells.reserve(cells.size());
+  added_hashes.reserve(cells.size());
+  for (auto &[pos, text] : cells) {
+    new_cells.push_back(std::make_unique<Cell>(*this, pos, &formula_cache_));
+    new_cells.back()->Set(std::move(text));
+    added_hashes.push_back(HashCell(pos, new_cells.back().get()));
+  }
+  if (cells.empty()) {
+    return;
+  }
+
+  // Одна монопольная блокировка на всю пачку: проверки не повторяются
+  ShardLocks locks(*this, cells.front().first);
+  if (!locks.IsExclusive()) {
+    locks.RequireExclusive();
+    locks.Expand();
+  }
+  for (size_t i = 0; i < cells.size(); ++i) {
+    StoreCell(cells[i].first, std::move(new_cells[i]), added_hashes[i], locks);
+  }
+  TrimResident();
+}
+
+void Sheet::StoreCell(Position pos, std::unique_ptr<Cell> new_cell, uint64_t added_hash, ShardLocks &locks) {
+  // Результаты формул-массивов занимают ячейки в чужих шардах: изменения с
+  // ними идут при монопольной блокировке
+  bool spills = false;
+  // Проверки и сброс кэшей повторяются, пока все затронутые шарды не
+  // заблокированы. Сброс кэша при неудачной попытке безопасен
+  auto prepare = [&]() -> bool {
+    spills = new_cell->IsArray();
+    if (auto cell = FindCell(pos)) {
+      spills |= cell->IsSpill() || spills_.count(pos) > 0;
+    }
+    if (spills && !locks.IsExclusive()) {
+      locks.RequireExclusive();
+      return false;
+    }
+    if (new_cell->IsFormula() && new_cell->IsValid()) {
+      auto cycle = CycleDetector(pos, *new_cell, &locks);
+      if (!cycle.has_value()) {
+        return false;
+      }
+      if (*cycle) {
+        throw CircularDependencyException("Cycle detected"s);
+      }
     }
+    if (!new_cell->IsValid()) {
+      return true;
+    }
+
+    bool covered = true;
+    if (auto cell = FindCell(pos)) {
+      for (auto const &from : cell->GetReferencedCells()) {
+        if (from.IsValid()) {
+          covered &= locks.Covers(from);
+        }
+      }
+    }
+    for (auto const &from : new_cell->GetReferencedCells()) {
+      covered &= locks.Covers(from);
+    }
+    return InvalidateChanged(pos, locks) && covered;
+  };
+  while (!prepare()) {
+    locks.Expand();
   }
 
-  {
-    if (new_cell->IsValid()) {
-      InvalidateCache(pos);
-      UpdateBackwardLink(pos, new_cell);
+  // Область прежнего результата формулы pos
+  std::optional<Range> freed;
+  if (spills) {
+    auto cell = FindCell(pos);
+    if (cell != nullptr && cell->IsSpill()) {
+      // Значение в области результата занимает её
+      auto anchor = cell->GetSpillAnchor();
+      RemoveSpill(anchor);
+      spills_.at(anchor).blocked = true;
+      FindCell(anchor)->SetSpillBlocked(true);
+      InvalidateCache(anchor);
+      MarkChanged(anchor);
+    } else if (spills_.count(pos) > 0) {
+      RemoveSpill(pos);
+      freed = spills_.at(pos).area;
+      spills_.erase(pos);
     }
+  }
 
-    auto it = storage_.find(pos);
-    if (it == storage_.end()) {
-      storage_.emplace(pos, std::move(new_cell));
-    } else {
-      it->second = std::move(new_cell);
+  if (new_cell->IsValid()) {
+    UpdateBackwardLink(pos, new_cell);
+  }
+
+  const bool is_array = new_cell->IsArray();
+  NoteStored(pos, FindResidentCell(pos), new_cell.get());
+  UpdateContentHash(pos, HashCell(pos, FindResidentCell(pos)), added_hash);
+  auto &storage = ShardAt(pos).storage;
+  auto it = storage.find(pos);
+  if (it == storage.end()) {
+    storage.emplace(pos, std::move(new_cell));
+    afterSet(pos);
+  } else if (it->second == nullptr) {
+    it->second = std::move(new_cell);
+    afterSet(pos);
+  } else {
+    // Ячейка уже учтена в размерах таблицы
+    it->second = std::move(new_cell);
+  }
+  MarkChanged(pos);
+
+  if (is_array) {
+    spills_[pos];
+    PlaceSpill(pos);
+  }
+  if (freed) {
+    RetrySpills(*freed);
+  }
+}
+
+bool Sheet::InvalidateCache(Position pos, ShardLocks *locks, Position changed) {
+  if (locks != nullptr && !locks->Covers(pos)) {
+    return false;
+  }
+
+  // Вытесненная ячейка кэша не хранит
+  if (auto cell = FindResidentCell(pos)) {
+    // Изменённая ссылка была в невыбранной ветви: значение прежнее
+    if (changed.IsValid() && cell->IsIndependentOf(changed)) {
+      return true;
     }
+    cell->InvalidateCache();
+  }
+  if (!subscriptions_.empty()) {
+    ShardAt(pos).value_dirty.insert(pos);
+  }
+  if (has_lookup_indexes_.load(std::memory_order_relaxed)) {
+    MarkLookupChanged(pos);
+  }
 
+  bool complete = true;
+  for (auto const &to: ShardAt(pos).backward_list_manager.GetBackwardList(pos)) {
+    complete = InvalidateCache(to, locks, pos) && complete;
   }
+  // Прочитанные ячейки областей не запоминаются: формула сбрасывается всегда
+  for (auto const &to : GetRangeDependents(pos)) {
+    complete = InvalidateCache(to, locks) && complete;
+  }
+  return complete;
+}
 
-  afterSet(pos);
+bool Sheet::InvalidateChanged(Position pos, ShardLocks &locks) {
+  if (!defer_invalidation_.load(std::memory_order_relaxed)) {
+    return InvalidateCache(pos, &locks);
+  }
+  ShardAt(pos).invalidation_pending.insert(pos);
+  return true;
 }
 
-void Sheet::InvalidateCache(Position pos) {
-  {
-    auto cell = reinterpret_cast<Cell *>(GetCell(pos));
-    if (cell != nullptr) {
-      cell->InvalidateCache();
+void Sheet::DeferInvalidation(bool defer) {
+  defer_invalidation_.store(defer, std::memory_order_relaxed);
+}
+
+void Sheet::InvalidatePending() {
+  for (auto &shard : shards_) {
+    std::unordered_set<Position, PositionHasher> pending;
+    {
+      std::shared_lock structure(structure_mutex_);
+      std::lock_guard guard(shard.mutex);
+      pending.swap(shard.invalidation_pending);
+    }
+    // Каждая ячейка - отдельная операция: изменения листа ждут не дольше,
+    // чем сброс одной цепочки
+    for (auto pos : pending) {
+      ShardLocks locks(*this, pos);
+      while (!InvalidateCache(pos, &locks)) {
+        locks.Expand();
+      }
     }
   }
+}
 
-  for (auto const &to: backward_list_manager_.GetBackwardList(pos)) {
-    InvalidateCache(to);
+void Sheet::FlushPendingInvalidation() {
+  for (auto &shard : shards_) {
+    for (auto pos : shard.invalidation_pending) {
+      InvalidateCache(pos);
+    }
+    shard.invalidation_pending.clear();
   }
 }
 
 void Sheet::UpdateBackwardLink(Position pos, const std::unique_ptr<Cell> &new_cell) {
-  auto cell = GetCell(pos);
+  auto cell = FindCell(pos);
   if (cell != nullptr) {
     // Инвалидировать кеш у зависимых ячеек
 
-    // Удалить обратные ссылки
+    // Удалить обратные ссылки; ссылки на удалённые ячейки (#REF!) не связаны
     for (auto const &from: cell->GetReferencedCells()) {
-      backward_list_manager_.RemoveBackwardLink(pos, from);
+      if (from.IsValid()) {
+        ShardAt(from).backward_list_manager.RemoveBackwardLink(pos, from);
+      }
     }
 
-    // Сохранение обратных ссылок со предыдущей версии ячейки
-    for (auto const from: backward_list_manager_.GetBackwardList(pos)) {
-      backward_list_manager_.AddBackwardLink(pos, from);
-    }
+    // Обратные ссылки на саму ячейку (её зависимые) сохраняются как есть
   }
 
   // Добавить новые обратные ссылки
   for (auto const &from: new_cell->GetReferencedCells()) {
-    backward_list_manager_.AddBackwardLink(pos, from);
+    ShardAt(from).backward_list_manager.AddBackwardLink(pos, from);
+  }
+  if (cell != nullptr) {
+    for (auto const &range : cell->GetReferencedRanges()) {
+      RemoveRangeDependent(range, pos);
+    }
+  }
+  for (auto const &range : new_cell->GetReferencedRanges()) {
+    AddRangeDependent(range, pos);
   }
-
 }
 
-const CellInterface *Sheet::GetCell(Position pos) const {
-  validatePosition(pos);
+void Sheet::AddRangeDependent(const Range &range, Position pos) {
+  // Удалённая область ни от чего не зависит
+  if (!range.IsValid()) {
+    return;
+  }
+  std::lock_guard guard(range_mutex_);
+  range_dependents_[range].insert(pos);
+  has_range_dependents_.store(true, std::memory_order_relaxed);
+}
 
-  auto it = storage_.find(pos);
-  if (it != storage_.end()) {
-    return it->second.get();
+void Sheet::RemoveRangeDependent(const Range &range, Position pos) {
+  if (!range.IsValid()) {
+    return;
+  }
+  std::lock_guard guard(range_mutex_);
+  auto it = range_dependents_.find(range);
+  if (it == range_dependents_.end() || it->second.erase(pos) == 0) {
+    throw std::logic_error("Range dependent does not exist"s);
+  }
+  if (it->second.empty()) {
+    range_dependents_.erase(it);
+    has_range_dependents_.store(!range_dependents_.empty(), std::memory_order_relaxed);
   }
+}
 
-  return nullptr;
+std::vector<Position> Sheet::GetRangeDependents(Position pos) const {
+  if (!has_range_dependents_.load(std::memory_order_relaxed)) {
+    return {};
+  }
+  std::vector<Position> result;
+  std::lock_guard guard(range_mutex_);
+  for (const auto &[range, dependents] : range_dependents_) {
+    if (range.Contains(pos)) {
+      result.insert(result.end(), dependents.begin(), dependents.end());
+    }
+  }
+  return result;
 }
 
-CellInterface *Sheet::GetCell(Position pos) {
-  validatePosition(pos);
+std::vector<Position> Sheet::GetValueDependents(Position pos) const {
+  auto result = ShardAt(pos).backward_list_manager.GetBackwardList(pos);
+  auto range_dependents = GetRangeDependents(pos);
+  result.insert(result.end(), range_dependents.begin(), range_dependents.end());
+  if (auto spill = spills_.find(pos); spill != spills_.end()) {
+    const auto &area = spill->second.area;
+    for (int row = area.first.row; row <= area.last.row; ++row) {
+      for (int col = area.first.col; col <= area.last.col; ++col) {
+        if (Position{row, col} == pos) {
+          continue;
+        }
+        auto dependents = ShardAt({row, col}).backward_list_manager.GetBackwardList({row, col});
+        range_dependents = GetRangeDependents({row, col});
+        result.insert(result.end(), dependents.begin(), dependents.end());
+        result.insert(result.end(), range_dependents.begin(), range_dependents.end());
+      }
+    }
+  }
+  return result;
+}
 
-  auto it = storage_.find(pos);
-  if (it != storage_.end()) {
-    return it->second.get();
+std::optional<int> Sheet::FindInLine(const Range &line, double key, LookupIndex::Match match) const {
+  LineIndex *entry;
+  {
+    std::lock_guard guard(lookup_mutex_);
+    entry = &lookup_indexes_[line];
+    has_lookup_indexes_.store(true, std::memory_order_relaxed);
   }
 
-  return nullptr;
+  // Вычисление формул строки может искать в других индексах, но не в этом:
+  // иначе формула читала бы сама себя
+  std::lock_guard guard(entry->mutex);
+  const bool by_rows = line.first.col == line.last.col;
+  auto at = [&line, by_rows](int offset) {
+    return Position{line.first.row + (by_rows ? offset : 0), line.first.col + (by_rows ? 0 : offset)};
+  };
+  if (!entry->built) {
+    const auto size = line.GetSize();
+    for (int offset = 0; offset < size.rows * size.cols; ++offset) {
+      entry->index.Set(offset, ReadLookupKey(at(offset)));
+    }
+    entry->built = true;
+  } else {
+    for (auto offset : entry->pending) {
+      entry->index.Set(offset, ReadLookupKey(at(offset)));
+    }
+  }
+  entry->pending.clear();
+  return entry->index.Find(key, match);
 }
 
-void Sheet::ClearCell(Position pos) {
-  validatePosition(pos);
+std::optional<double> Sheet::ReadLookupKey(Position pos) const {
+  auto cell = FindCell(pos);
+  if (cell == nullptr) {
+    return std::nullopt;
+  }
+  double number = 0;
+  std::string_view text;
+  switch (cell->ReadValue(number, text)) {
+    case ValueTag::NUMBER:
+      return number;
+    case ValueTag::TEXT:
+      if (ParseCellNumber(text, number)) {
+        return number;
+      }
+      return std::nullopt;
+    default:
+      return std::nullopt;
+  }
+}
 
-  bool found = false;
-  auto it = storage_.find(pos);
-  if (it != storage_.end()) {
-    it->second = nullptr;
-    found = true;
+void Sheet::MarkLookupChanged(Position pos) {
+  std::lock_guard guard(lookup_mutex_);
+  for (auto &[line, entry] : lookup_indexes_) {
+    if (entry.built && line.Contains(pos)) {
+      entry.pending.insert(pos.row - line.first.row + pos.col - line.first.col);
+    }
   }
+}
 
-  if (found) {
-    afterClear(pos);
+Sheet::ShardLocks::ShardLocks(Sheet &sheet, Position pos)
+    : sheet_(sheet), shared_(sheet.structure_mutex_) {
+  // Подгрузка и вытеснение блоков меняют хранилища всех шардов
+  if (sheet.paging_ != nullptr) {
+    attempts_ = PARTIAL_ATTEMPTS;
   }
+  wanted_.set(ShardOf(pos));
+  Expand();
 }
 
-Size Sheet::GetPrintableSize() const {
-  if (storage_.empty()) {
-    return {0, 0};
+bool Sheet::ShardLocks::Covers(Position pos) {
+  if (exclusive_.owns_lock()) {
+    return true;
   }
-  Size size = {0, 0};
-  if (!rows.empty()) {
-    size.rows = rows.rbegin()->first + 1;
+  auto shard = ShardOf(pos);
+  if (held_.test(shard)) {
+    return true;
+  }
+  wanted_.set(shard);
+  return false;
+}
+
+void Sheet::ShardLocks::Expand() {
+  // Все блокировки берутся заново по возрастанию номера шарда, поэтому две
+  // операции не ждут друг друга
+  locks_.clear();
+  // Формулы, читающие большую область, обычно разбросаны по всем шардам:
+  // монопольная блокировка тогда дешевле, чем захват шардов по одному
+  if (++attempts_ > PARTIAL_ATTEMPTS || (held_ | wanted_).count() > SHARD_COUNT / 2) {
+    shared_.unlock();
+    exclusive_ = std::unique_lock(sheet_.structure_mutex_);
+    return;
   }
-  if (!cols.empty()) {
-    size.cols = cols.rbegin()->first + 1;
+  held_ |= wanted_;
+  wanted_.reset();
+  for (size_t shard = 0; shard < SHARD_COUNT; ++shard) {
+    if (held_.test(shard)) {
+      locks_.emplace_back(sheet_.shards_[shard].mutex);
+    }
   }
-  return {size.rows, size.cols};
 }
 
-void Sheet::PrintValues(std::ostream &output) const {
-  auto size = GetPrintableSize();
-  for (int row = 0; row < size.rows; ++row) {
-    for (int col = 0; col < size.cols; ++col) {
-      if (col > 0) {
-        output << "\t";
-      }
-      const auto value = GetCell({row, col});
-      if (value != nullptr) {
-        output << value->GetValue();
+Cell *Sheet::FindCell(Position pos) const {
+  if (paging_ != nullptr) {
+    auto tile = SheetSnapshot::TileOf(pos);
+    auto it = paging_->tiles.find(tile);
+    if (it != paging_->tiles.end()) {
+      if (!it->second.resident) {
+        LoadTile(tile);
       }
+      paging_->lru.splice(paging_->lru.begin(), paging_->lru, it->second.lru);
     }
+  }
+  return FindResidentCell(pos);
+}
 
-    output << "\n";
+Cell *Sheet::FindResidentCell(Position pos) const {
+  const auto &storage = ShardAt(pos).storage;
+  auto it = storage.find(pos);
+  return it == storage.end() ? nullptr : it->second.get();
+}
+
+const CellInterface *Sheet::GetCell(Position pos) const {
+  validatePosition(pos);
+  TrimResident();
+  return FindCell(pos);
+}
+
+CellInterface *Sheet::GetCell(Position pos) {
+  validatePosition(pos);
+  TrimResident();
+  return FindCell(pos);
+}
+
+void Sheet::EnableOutOfCore(std::string path, size_t resident_limit) {
+  std::unique_lock structure(structure_mutex_);
+  if (paging_ != nullptr) {
+    throw std::logic_error("Out-of-core mode is already enabled"s);
   }
+  paging_ = std::make_unique<Paging>(std::move(path), resident_limit);
+  RecountResident();
+  TrimResident();
+}
 
+Sheet::PagingStats Sheet::GetPagingStats() const {
+  if (paging_ == nullptr) {
+    return {};
+  }
+  auto stats = paging_->stats;
+  stats.resident_tiles = paging_->lru.size();
+  stats.file_bytes = paging_->file.GetCapacity();
+  return stats;
 }
 
-void Sheet::PrintTexts(std::ostream &output) const {
-  auto size = GetPrintableSize();
-  for (int row = 0; row < size.rows; ++row) {
-    for (int col = 0; col < size.cols; ++col) {
-      if (col > 0) {
-        output << "\t";
+size_t Sheet::EstimateBytes(const Cell &cell) {
+  // Ячейка, её значение и узел хранилища. Дерево формулы оценивается по
+  // длине текста, хотя одинаковые формулы разделяют одно дерево
+  constexpr size_t CELL_BYTES = sizeof(Cell) + 128;
+  constexpr size_t FORMULA_BYTES_PER_CHAR = 16;
+  auto text = cell.GetText();
+  return CELL_BYTES + text.size() * (cell.IsFormula() ? FORMULA_BYTES_PER_CHAR : 1);
+}
+
+void Sheet::NoteStored(Position pos, const Cell *removed, const Cell *added) {
+  if (paging_ == nullptr) {
+    return;
+  }
+  auto tile = SheetSnapshot::TileOf(pos);
+  auto [it, inserted] = paging_->tiles.try_emplace(tile);
+  auto &state = it->second;
+  if (inserted) {
+    paging_->lru.push_front(tile);
+    state.lru = paging_->lru.begin();
+  }
+  const size_t added_bytes = added == nullptr ? 0 : EstimateBytes(*added);
+  const size_t removed_bytes = removed == nullptr ? 0 : EstimateBytes(*removed);
+  state.bytes = state.bytes + added_bytes - removed_bytes;
+  paging_->stats.resident_bytes = paging_->stats.resident_bytes + added_bytes - removed_bytes;
+}
+
+namespace {
+
+// Запись вытесненной ячейки: строка, столбец, длина текста и текст. Числа в
+// тексте формулы печатаются без потерь, поэтому подгрузка разбирает ту же
+// формулу
+void AppendRecord(std::string &data, Position pos, const std::string &text) {
+  const int32_t header[] = {pos.row, pos.col, static_cast<int32_t>(text.size())};
+  data.append(reinterpret_cast<const char *>(header), sizeof(header));
+  data += text;
+}
+
+}  // namespace
+
+void Sheet::LoadTile(Position tile) const {
+  auto &state = paging_->tiles.at(tile);
+  // Подгрузка восстанавливает те же ячейки: содержимое листа не меняется
+  auto &sheet = const_cast<Sheet &>(*this);
+  auto &storage = ShardAt({tile.row * SheetSnapshot::TILE_SIZE, tile.col * SheetSnapshot::TILE_SIZE}).storage;
+  auto data = paging_->file.Read(state.block);
+  state.bytes = 0;
+  while (!data.empty()) {
+    int32_t header[3];
+    std::memcpy(header, data.data(), sizeof(header));
+    data.remove_prefix(sizeof(header));
+    Position pos{header[0], header[1]};
+    auto cell = std::make_unique<Cell>(sheet, pos, &sheet.formula_cache_);
+    cell->Set(std::string(data.substr(0, header[2])));
+    data.remove_prefix(header[2]);
+    state.bytes += EstimateBytes(*cell);
+    storage.emplace(pos, std::move(cell));
+  }
+  paging_->file.Free(state.block);
+  state.resident = true;
+  paging_->lru.push_front(tile);
+  state.lru = paging_->lru.begin();
+  paging_->stats.resident_bytes += state.bytes;
+  --paging_->stats.evicted_tiles;
+  ++paging_->stats.loads;
+}
+
+void Sheet::EvictTile(Position tile) const {
+  auto it = paging_->tiles.find(tile);
+  auto &state = it->second;
+  auto &storage = ShardAt({tile.row * SheetSnapshot::TILE_SIZE, tile.col * SheetSnapshot::TILE_SIZE}).storage;
+  std::string data;
+  for (int row = tile.row * SheetSnapshot::TILE_SIZE; row < (tile.row + 1) * SheetSnapshot::TILE_SIZE; ++row) {
+    for (int col = tile.col * SheetSnapshot::TILE_SIZE; col < (tile.col + 1) * SheetSnapshot::TILE_SIZE; ++col) {
+      auto cell = storage.find({row, col});
+      if (cell == storage.end()) {
+        continue;
       }
-      const auto value = GetCell({row, col});
-      if (value != nullptr) {
-        output << value->GetText();
+      if (cell->second != nullptr) {
+        AppendRecord(data, {row, col}, cell->second->GetText());
       }
+      storage.erase(cell);
     }
+  }
+  paging_->lru.erase(state.lru);
+  paging_->stats.resident_bytes -= state.bytes;
+  // Пустой блок не пишется в файл
+  if (data.empty()) {
+    paging_->tiles.erase(it);
+    return;
+  }
+  state.block = paging_->file.Write(data);
+  state.resident = false;
+  state.bytes = 0;
+  ++paging_->stats.evicted_tiles;
+  ++paging_->stats.evictions;
+}
 
-    output << "\n";
+bool Sheet::IsPinned(Position tile) const {
+  // Ячейки результата держат указатель на формулу-массив, а формулу с
+  // #REF! нельзя разобрать заново из текста
+  for (int row = tile.row * SheetSnapshot::TILE_SIZE; row < (tile.row + 1) * SheetSnapshot::TILE_SIZE; ++row) {
+    for (int col = tile.col * SheetSnapshot::TILE_SIZE; col < (tile.col + 1) * SheetSnapshot::TILE_SIZE; ++col) {
+      auto cell = FindResidentCell({row, col});
+      if (cell != nullptr && (cell->IsSpill() || cell->IsArray() || !cell->IsValid())) {
+        return true;
+      }
+    }
   }
+  return false;
+}
 
+void Sheet::TrimResident() const {
+  if (paging_ == nullptr) {
+    return;
+  }
+  auto it = paging_->lru.end();
+  while (paging_->stats.resident_bytes > paging_->limit && it != paging_->lru.begin()) {
+    auto victim = std::prev(it);
+    if (IsPinned(*victim)) {
+      it = victim;
+      continue;
+    }
+    EvictTile(*victim);
+  }
 }
 
-void Sheet::afterClear(Position pos) {
-  {
-    auto it = rows.find(pos.row);
-    if (it != rows.end()) {
-      if (it->second > 1) {
-        --it->second;
-      } else {
-        rows.erase(it);
-      }
+void Sheet::LoadAllTiles() {
+  if (paging_ == nullptr) {
+    return;
+  }
+  for (const auto &[tile, state] : paging_->tiles) {
+    if (!state.resident) {
+      LoadTile(tile);
     }
   }
+}
 
-  {
-    auto it = cols.find(pos.col);
-    if (it != cols.end()) {
-      if (it->second > 1) {
-        --it->second;
-      } else {
-        cols.erase(it);
+void Sheet::LoadTiles(const Range &range) const {
+  if (paging_ == nullptr) {
+    return;
+  }
+  auto first = SheetSnapshot::TileOf(range.first);
+  auto last = SheetSnapshot::TileOf(range.last);
+  for (int row = first.row; row <= last.row; ++row) {
+    for (int col = first.col; col <= last.col; ++col) {
+      auto it = paging_->tiles.find({row, col});
+      if (it != paging_->tiles.end() && !it->second.resident) {
+        LoadTile({row, col});
       }
     }
   }
+}
 
+void Sheet::RecountResident() {
+  paging_->tiles.clear();
+  paging_->lru.clear();
+  paging_->stats.resident_bytes = 0;
+  for (const auto &shard : shards_) {
+    for (const auto &[pos, cell] : shard.storage) {
+      if (cell != nullptr) {
+        NoteStored(pos, nullptr, cell.get());
+      }
+    }
+  }
 }
 
-void Sheet::afterSet(Position pos) {
-  {
-    auto it = rows.find(pos.row);
-    if (it == rows.end()) {
-      rows.emplace(pos.row, 1);
-    } else {
-      ++it->second;
+void Sheet::ClearCell(Position pos) {
+  validatePosition(pos);
+
+  ShardLocks locks(*this, pos);
+  auto &storage = ShardAt(pos).storage;
+  // Очищается формула-массив или ячейка, которая занимает область результата
+  bool spills = false;
+  Range freed{pos, pos};
+  for (;;) {
+    // Ячейку результата формулы-массива очищает только сама формула
+    auto cell = FindCell(pos);
+    if (cell == nullptr || cell->IsSpill()) {
+      return;
+    }
+    auto it = storage.find(pos);
+    spills = spills_.count(pos) > 0 || IsSpillBlockedBy(pos);
+    if (spills && !locks.IsExclusive()) {
+      locks.RequireExclusive();
+      locks.Expand();
+      continue;
     }
+    // Обратные ссылки очищаемой формулы снимаются
+    bool covered = true;
+    for (auto const &from : it->second->GetReferencedCells()) {
+      if (from.IsValid()) {
+        covered &= locks.Covers(from);
+      }
+    }
+    // Зависимые формулы теперь читают пустую ячейку
+    if (InvalidateChanged(pos, locks) && covered) {
+      for (auto const &from : it->second->GetReferencedCells()) {
+        if (from.IsValid()) {
+          ShardAt(from).backward_list_manager.RemoveBackwardLink(pos, from);
+        }
+      }
+      for (auto const &range : it->second->GetReferencedRanges()) {
+        RemoveRangeDependent(range, pos);
+      }
+      // Ячейки результата ссылаются на формулу и очищаются раньше неё
+      if (auto spill = spills_.find(pos); spill != spills_.end()) {
+        RemoveSpill(pos);
+        freed = spill->second.area;
+        spills_.erase(spill);
+      }
+      NoteStored(pos, it->second.get(), nullptr);
+      UpdateContentHash(pos, HashCell(pos, it->second.get()), 0);
+      it->second = nullptr;
+      break;
+    }
+    locks.Expand();
   }
 
-  {
-    auto it = cols.find(pos.col);
-    if (it == cols.end()) {
-      cols.emplace(pos.col, 1);
-    } else {
-      ++it->second;
+  afterClear(pos);
+  MarkChanged(pos);
+  if (spills) {
+    RetrySpills(freed);
+  }
+  TrimResident();
+}
+
+void Sheet::InsertRows(int before, int count) {
+  ShiftCells(PositionShift::Axis::Rows, before, count, true);
+}
+
+void Sheet::InsertCols(int before, int count) {
+  ShiftCells(PositionShift::Axis::Cols, before, count, true);
+}
+
+void Sheet::DeleteRows(int first, int count) {
+  ShiftCells(PositionShift::Axis::Rows, first, count, false);
+}
+
+void Sheet::DeleteCols(int first, int count) {
+  ShiftCells(PositionShift::Axis::Cols, first, count, false);
+}
+
+Size Sheet::GetPrintableSize() const {
+  Size size = {0, 0};
+  for (const auto &shard : shards_) {
+    if (!shard.rows.empty()) {
+      size.rows = std::max(size.rows, shard.rows.rbegin()->first + 1);
+    }
+    if (!shard.cols.empty()) {
+      size.cols = std::max(size.cols, shard.cols.rbegin()->first + 1);
     }
   }
+  return size;
+}
 
+std::vector<Position> Sheet::GetDependents(Position pos) const {
+  validatePosition(pos);
+  auto result = ShardAt(pos).backward_list_manager.GetBackwardList(pos);
+  for (auto to : GetRangeDependents(pos)) {
+    if (std::find(result.begin(), result.end(), to) == result.end()) {
+      result.push_back(to);
+    }
+  }
+  return result;
 }
 
-void Sheet::validatePosition(Position pos) {
-  if (pos.row < 0 || pos.col < 0) {
-    std::stringstream ss;
-    ss << pos;
-    throw InvalidPositionException(ss.str());
+void Sheet::GetValues(Position top_left, Size size, const ValueColumns &out) const {
+  if (size.rows <= 0 || size.cols <= 0) {
+    return;
   }
+  TrimResident();
+  validatePosition(top_left);
+  validatePosition({top_left.row + size.rows - 1, top_left.col + size.cols - 1});
 
-  if (pos.row > Position::MAX_ROWS_ZB || pos.col > Position::MAX_COLS_ZB) {
-    std::stringstream ss;
-    ss << pos;
-    throw InvalidPositionException(ss.str());
+  // Ошибки не кэшируются: такие формулы запоминаются, чтобы не вычислять их
+  // повторно при спуске по ссылкам
+  std::unordered_set<Position, PositionHasher> failed;
+  std::vector<Position> stack;
+  size_t index = 0;
+  for (int col = top_left.col; col < top_left.col + size.cols; ++col) {
+    for (int row = top_left.row; row < top_left.row + size.rows; ++row, ++index) {
+      out.numbers[index] = 0;
+      out.texts[index] = {};
+      auto cell = FindCell({row, col});
+      if (cell == nullptr) {
+        out.tags[index] = ValueTag::EMPTY;
+        continue;
+      }
+      if (cell->IsFormula() && !cell->IsCached() && failed.count({row, col}) == 0) {
+        EvaluateDirty({row, col}, stack, failed);
+      }
+      out.tags[index] = cell->ReadValue(out.numbers[index], out.texts[index]);
+    }
   }
 }
 
-bool Sheet::CycleDetector(Position position, const CellInterface &cell) {
-  enum Color {
-    WHITE,
-    GRAY,
-    BLACK
+void Sheet::EvaluateDirty(Position pos, std::vector<Position> &stack,
+                          std::unordered_set<Position, PositionHasher> &failed) const {
+  auto dirty = [this, &failed](Position pos) {
+    auto cell = pos.IsValid() ? FindCell(pos) : nullptr;
+    return cell != nullptr && cell->IsFormula() && !cell->IsCached() && failed.count(pos) == 0;
   };
 
-  std::unordered_map<Position, Color, PositionHasher> visited;
-  std::stack<Position> stack;
-  visited[position] = GRAY;
-  //stack.push(position);
-  auto tmp = cell.GetReferencedCells();
-  std::unordered_set<Position, PositionHasher> uniq(tmp.begin(), tmp.end());
-  for (auto const &to: uniq) {
-    // Либо ссылка на самого себя, либо ошибка формирования ссылок
-    if (position == to) {
-      return true;
+  stack.push_back(pos);
+  while (!stack.empty()) {
+    auto top = stack.back();
+    auto cell = FindCell(top);
+    bool ready = true;
+    // Ссылки из ветвей IF, AND и OR заранее не вычисляются: выбранную ветвь
+    // вычислит сама формула
+    for (auto from : cell->GetFormula()->GetAST().GetUnconditionalCells()) {
+      if (dirty(from)) {
+        stack.push_back(from);
+        ready = false;
+        break;
+      }
+    }
+    if (!ready) {
+      continue;
+    }
+    stack.pop_back();
+    // Саму формулу pos вычислит чтение её значения
+    if (stack.empty()) {
+      break;
+    }
+    double number;
+    std::string_view text;
+    if (cell->ReadValue(number, text) != ValueTag::NUMBER) {
+      failed.insert(top);
     }
-
-    stack.push(to);
-    visited[to] = WHITE;
   }
+}
 
-  while (!stack.empty()) {
-    auto from = stack.top();
-    stack.pop();
-    bool process = true;
-    {
-      auto it = visited.find(from);
-      if (it == visited.end()) {
-        throw std::logic_error("Element out of processed status");
-      }
-
-      // Если пришли в вершину второй раз в цвете GRAY значит все исходящие ребра обработаны
-      if (it->second == GRAY) {
-        visited[from] = Color::BLACK;
-        process = false;
-      }
-    }
-
-    if (process) {
-      visited[from] = Color::GRAY;
-      stack.push(from);
-
-      // Обход связанных вершин
-      auto from_cell = this->GetCell(from);
-      if (from_cell != nullptr) {
-        // Вершина в выражении может встречаться несколько раз
-        // =C3 + B2 / C3
-        tmp = from_cell->GetReferencedCells();
-        uniq = std::unordered_set<Position, PositionHasher>(tmp.begin(), tmp.end());
-        for (auto const to: uniq) {
-          auto it = visited.find(to);
-          if (it != visited.end()) {
-            // BLACK - уже обошли без циклов
-            // WHITE - еще не обходили
-            if (it->second == GRAY) {
-              return true;
-            }
-          }
+bool Sheet::Subscription::Contains(Position pos) const {
+  return pos.row >= top_left.row && pos.row < top_left.row + size.rows
+      && pos.col >= top_left.col && pos.col < top_left.col + size.cols;
+}
 
-          // В первый раз в вершину приходим в начале обхода
-          visited[to] = Color::WHITE;
-          stack.push(to);
+size_t Sheet::Subscribe(Position top_left, Size size, ChangeCallback callback) {
+  validatePosition(top_left);
+  if (size.rows > 0 && size.cols > 0) {
+    validatePosition({top_left.row + size.rows - 1, top_left.col + size.cols - 1});
+  }
 
-        }
+  Subscription subscription{top_left, size, std::move(callback), {}};
+  for (int col = top_left.col; col < top_left.col + size.cols; ++col) {
+    for (int row = top_left.row; row < top_left.row + size.rows; ++row) {
+      auto value = ReadNotifiedValue({row, col});
+      if (value.tag != ValueTag::EMPTY) {
+        subscription.values.emplace(Position{row, col}, std::move(value));
       }
     }
+  }
+  subscriptions_.emplace(next_subscription_, std::move(subscription));
+  return next_subscription_++;
+}
 
+void Sheet::Unsubscribe(size_t id) {
+  subscriptions_.erase(id);
+  if (subscriptions_.empty()) {
+    for (auto &shard : shards_) {
+      shard.value_dirty.clear();
+    }
+    rescan_subscriptions_ = false;
   }
+}
 
-  return false;
+void Sheet::NotifyChanges() {
+  std::vector<Position> dirty;
+  for (auto &shard : shards_) {
+    dirty.insert(dirty.end(), shard.value_dirty.begin(), shard.value_dirty.end());
+    shard.value_dirty.clear();
+  }
+  std::sort(dirty.begin(), dirty.end());
+  const bool rescan = std::exchange(rescan_subscriptions_, false);
+
+  // Обработчики вызываются после проверки всех подписок: они могут менять
+  // лист и подписки
+  std::vector<std::pair<ChangeCallback, std::vector<Position>>> calls;
+  for (auto &[id, subscription] : subscriptions_) {
+    std::vector<Position> changed;
+    auto check = [this, &subscription, &changed](Position pos) {
+      auto value = ReadNotifiedValue(pos);
+      auto it = subscription.values.find(pos);
+      if (it == subscription.values.end()) {
+        if (value.tag == ValueTag::EMPTY) {
+          return;
+        }
+        subscription.values.emplace(pos, std::move(value));
+      } else if (it->second == value) {
+        return;
+      } else if (value.tag == ValueTag::EMPTY) {
+        subscription.values.erase(it);
+      } else {
+        it->second = std::move(value);
+      }
+      changed.push_back(pos);
+    };
+
+    if (rescan) {
+      auto top_left = subscription.top_left;
+      auto size = subscription.size;
+      for (int col = top_left.col; col < top_left.col + size.cols; ++col) {
+        for (int row = top_left.row; row < top_left.row + size.rows; ++row) {
+          check({row, col});
+        }
+      }
+    } else {
+      for (auto pos : dirty) {
+        if (subscription.Contains(pos)) {
+          check(pos);
+        }
+      }
+    }
+    if (!changed.empty()) {
+      calls.emplace_back(subscription.callback, std::move(changed));
+    }
+  }
+
+  for (const auto &[callback, changed] : calls) {
+    callback(changed);
+  }
+}
+
+Sheet::NotifiedValue Sheet::ReadNotifiedValue(Position pos) const {
+  NotifiedValue value{ValueTag::EMPTY, 0, {}};
+  auto cell = FindCell(pos);
+  if (cell == nullptr) {
+    return value;
+  }
+  if (cell->IsFormula() && !cell->IsCached()) {
+    std::unordered_set<Position, PositionHasher> failed;
+    std::vector<Position> stack;
+    EvaluateDirty(pos, stack, failed);
+  }
+  std::string_view text;
+  value.tag = cell->ReadValue(value.number, text);
+  value.text = text;
+  return value;
+}
+
+void Sheet::PrintValues(std::ostream &output) const {
+  auto size = GetPrintableSize();
+  for (int row = 0; row < size.rows; ++row) {
+    for (int col = 0; col < size.cols; ++col) {
+      if (col > 0) {
+        output << "\t";
+      }
+      const auto value = GetCell({row, col});
+      if (value != nullptr) {
+        output << value->GetValue();
+      }
+    }
+
+    output << "\n";
+  }
+
+}
+
+void Sheet::PrintTexts(std::ostream &output) const {
+  auto size = GetPrintableSize();
+  for (int row = 0; row < size.rows; ++row) {
+    for (int col = 0; col < size.cols; ++col) {
+      if (col > 0) {
+        output << "\t";
+      }
+      const auto value = GetCell({row, col});
+      if (value != nullptr) {
+        output << value->GetText();
+      }
+    }
+
+    output << "\n";
+  }
+
+}
+
+void Sheet::ForEachCell(const std::function<void(Position, const CellInterface &)> &func) const {
+  TrimResident();
+  const auto size = GetPrintableSize();
+  const int tile_cols = (size.cols + SheetSnapshot::TILE_SIZE - 1) / SheetSnapshot::TILE_SIZE;
+  std::vector<int> filled;
+  for (int tile_row = 0; tile_row * SheetSnapshot::TILE_SIZE < size.rows; ++tile_row) {
+    filled.clear();
+    for (int tile_col = 0; tile_col < tile_cols; ++tile_col) {
+      const Position tile{tile_row, tile_col};
+      if (tile_col % HASH_AREA_TILES == 0
+          && area_hashes_[HashAreaOf(tile)].load(std::memory_order_relaxed) == 0) {
+        tile_col += HASH_AREA_TILES - 1;
+      } else if (GetTileHash(tile) != 0) {
+        filled.push_back(tile_col);
+      }
+    }
+
+    const int first_row = tile_row * SheetSnapshot::TILE_SIZE;
+    for (int row = first_row; row < std::min(size.rows, first_row + SheetSnapshot::TILE_SIZE); ++row) {
+      for (int tile_col : filled) {
+        for (int col = tile_col * SheetSnapshot::TILE_SIZE; col < (tile_col + 1) * SheetSnapshot::TILE_SIZE;
+             ++col) {
+          auto cell = FindCell({row, col});
+          if (cell != nullptr && !cell->IsSpill() && !cell->GetText().empty()) {
+            func({row, col}, *cell);
+          }
+        }
+      }
+    }
+    TrimResident();
+  }
+}
+
+void Sheet::afterClear(Position pos) {
+  auto &rows = ShardAt(pos).rows;
+  auto &cols = ShardAt(pos).cols;
+  {
+    auto it = rows.find(pos.row);
+    if (it != rows.end()) {
+      if (it->second > 1) {
+        --it->second;
+      } else {
+        rows.erase(it);
+      }
+    }
+  }
+
+  {
+    auto it = cols.find(pos.col);
+    if (it != cols.end()) {
+      if (it->second > 1) {
+        --it->second;
+      } else {
+        cols.erase(it);
+      }
+    }
+  }
+
+}
+
+void Sheet::afterSet(Position pos) {
+  auto &rows = ShardAt(pos).rows;
+  auto &cols = ShardAt(pos).cols;
+  {
+    auto it = rows.find(pos.row);
+    if (it == rows.end()) {
+      rows.emplace(pos.row, 1);
+    } else {
+      ++it->second;
+    }
+  }
+
+  {
+    auto it = cols.find(pos.col);
+    if (it == cols.end()) {
+      cols.emplace(pos.col, 1);
+    } else {
+      ++it->second;
+    }
+  }
+
+}
+
+void Sheet::validatePosition(Position pos) {
+  if (pos.row < 0 || pos.col < 0) {
+    std::stringstream ss;
+    ss << pos;
+    throw InvalidPositionException(ss.str());
+  }
+
+  if (pos.row > Position::MAX_ROWS_ZB || pos.col > Position::MAX_COLS_ZB) {
+    std::stringstream ss;
+    ss << pos;
+    throw InvalidPositionException(ss.str());
+  }
+}
+
+std::optional<bool> Sheet::CycleDetector(Position position, const Cell &cell, ShardLocks *locks,
+                                         const std::vector<Position> &spill) {
+  auto tmp = cell.GetReferencedCells();
+  const std::unordered_set<Position, PositionHasher> referenced(tmp.begin(), tmp.end());
+  const auto ranges = cell.GetReferencedRanges();
+  auto reads = [&referenced, &ranges](Position pos) {
+    return referenced.count(pos) > 0
+        || std::any_of(ranges.begin(), ranges.end(), [pos](const Range &range) {
+          return range.Contains(pos);
+        });
+  };
+  // Ссылка на самого себя или область, в которую формула попадает сама
+  if (reads(position) || std::any_of(spill.begin(), spill.end(), reads)) {
+    return true;
+  }
+  // Прежний результат формулы будет очищен: его зависимые не учитываются
+  auto own_spill = [this, position, has_spill = spills_.count(position) > 0](Position pos) {
+    if (!has_spill) {
+      return false;
+    }
+    auto cell = FindCell(pos);
+    return cell != nullptr && cell->GetSpillAnchor() == position;
+  };
+
+  // Цикл замыкается, если новая формула читает одну из ячеек, которые уже
+  // зависят от position. Обход идёт по обратным ссылкам, поэтому область
+  // проверяется одним сравнением, а не перебором её ячеек
+  std::unordered_set<Position, PositionHasher> visited{position};
+  visited.insert(spill.begin(), spill.end());
+  std::vector<Position> stack{position};
+  stack.insert(stack.end(), spill.begin(), spill.end());
+  bool complete = true;
+  while (!stack.empty()) {
+    auto from = stack.back();
+    stack.pop_back();
+    // Ячейки незаблокированного шарда обходятся при следующей попытке
+    if (locks != nullptr && !locks->Covers(from)) {
+      complete = false;
+      continue;
+    }
+    auto dependents = ShardAt(from).backward_list_manager.GetBackwardList(from);
+    auto range_dependents = GetRangeDependents(from);
+    dependents.insert(dependents.end(), range_dependents.begin(), range_dependents.end());
+    for (auto to : dependents) {
+      if (visited.count(to) > 0 || own_spill(to)) {
+        continue;
+      }
+      if (reads(to)) {
+        return true;
+      }
+      visited.insert(to);
+      stack.push_back(to);
+    }
+  }
+
+  if (!complete) {
+    return std::nullopt;
+  }
+  return false;
+}
+
+void Sheet::PlaceSpill(Position anchor) {
+  auto &spill = spills_.at(anchor);
+  auto cell = FindCell(anchor);
+  const auto size = cell->GetArraySize();
+  const Position last{anchor.row + size.rows - 1, anchor.col + size.cols - 1};
+  spill.area = {anchor, {std::min(last.row, int{Position::MAX_ROWS_ZB}),
+                         std::min(last.col, int{Position::MAX_COLS_ZB})}};
+
+  std::vector<Position> area;
+  bool blocked = !last.IsValid();
+  for (int row = anchor.row; row <= spill.area.last.row && !blocked; ++row) {
+    for (int col = anchor.col; col <= spill.area.last.col && !blocked; ++col) {
+      if (Position pos{row, col}; !(pos == anchor)) {
+        blocked = FindCell(pos) != nullptr;
+        area.push_back(pos);
+      }
+    }
+  }
+  // Результат, который формула читала бы сама через свои зависимые, тоже
+  // занимает область
+  if (!blocked && cell->IsValid()) {
+    blocked = *CycleDetector(anchor, *cell, nullptr, area);
+  }
+
+  if (blocked != spill.blocked || blocked != cell->IsSpillBlocked()) {
+    spill.blocked = blocked;
+    cell->SetSpillBlocked(blocked);
+    InvalidateCache(anchor);
+    MarkChanged(anchor);
+  }
+  if (blocked) {
+    return;
+  }
+  for (auto pos : area) {
+    auto spill_cell = std::make_unique<Cell>(*this, pos, &formula_cache_);
+    spill_cell->SetSpill(*cell, anchor);
+    NoteStored(pos, nullptr, spill_cell.get());
+    ShardAt(pos).storage[pos] = std::move(spill_cell);
+    afterSet(pos);
+    ShardAt(anchor).backward_list_manager.AddBackwardLink(pos, anchor);
+    // Формулы, читавшие пустую ячейку
+    InvalidateCache(pos);
+    MarkChanged(pos);
+  }
+}
+
+void Sheet::RemoveSpill(Position anchor) {
+  const auto &spill = spills_.at(anchor);
+  if (spill.blocked) {
+    return;
+  }
+  for (int row = anchor.row; row <= spill.area.last.row; ++row) {
+    for (int col = anchor.col; col <= spill.area.last.col; ++col) {
+      Position pos{row, col};
+      if (pos == anchor) {
+        continue;
+      }
+      InvalidateCache(pos);
+      ShardAt(anchor).backward_list_manager.RemoveBackwardLink(pos, anchor);
+      NoteStored(pos, FindResidentCell(pos), nullptr);
+      ShardAt(pos).storage.at(pos) = nullptr;
+      afterClear(pos);
+      MarkChanged(pos);
+    }
+  }
+}
+
+bool Sheet::IsSpillBlockedBy(Position pos) const {
+  return std::any_of(spills_.begin(), spills_.end(), [pos](const auto &entry) {
+    return entry.second.blocked && entry.second.area.Contains(pos) && !(entry.first == pos);
+  });
+}
+
+void Sheet::RetrySpills(const Range &freed) {
+  std::vector<Position> anchors;
+  for (const auto &[anchor, spill] : spills_) {
+    if (spill.blocked && spill.area.Intersects(freed)) {
+      anchors.push_back(anchor);
+    }
+  }
+  for (auto anchor : anchors) {
+    PlaceSpill(anchor);
+  }
+}
+
+void Sheet::ShiftCells(PositionShift::Axis axis, int first, int count, bool insert) {
+  const bool by_rows = axis == PositionShift::Axis::Rows;
+  const int limit = by_rows ? Position::MAX_ROWS : Position::MAX_COLS;
+  if (first < 0 || first >= limit || count <= 0 || count > limit - first) {
+    std::stringstream ss;
+    ss << (by_rows ? "rows "s : "columns "s) << first << '+' << count;
+    throw InvalidPositionException(ss.str());
+  }
+
+  std::unique_lock structure(structure_mutex_);
+  FlushPendingInvalidation();
+  auto size = GetPrintableSize();
+  const int last = (by_rows ? size.rows : size.cols) - 1;
+  if (insert && last >= first && last >= limit - count) {
+    throw TableTooBigException("Cells are shifted out of the table"s);
+  }
+
+  const PositionShift shift{axis, first, insert ? count : -count};
+  // Ячейки переносятся между блоками: сдвиг идёт по листу в памяти
+  LoadAllTiles();
+  // Переносится почти всё, следующий снимок строится заново
+  ++version_;
+  snapshot_tiles_.reset();
+  for (auto &shard : shards_) {
+    shard.snapshot_dirty.clear();
+    shard.value_dirty.clear();
+  }
+  rescan_subscriptions_ = !subscriptions_.empty();
+
+  // Результаты формул-массивов выводятся заново после сдвига
+  for (const auto &[anchor, spill] : spills_) {
+    RemoveSpill(anchor);
+  }
+
+  std::vector<Position> affected;
+  // Формулы, ссылки которых переписываются
+  std::unordered_set<Position, PositionHasher> dependents;
+  for (auto &shard : shards_) {
+    for (const auto &[pos, cell] : shard.storage) {
+      if (shift.Affects(pos)) {
+        affected.push_back(pos);
+      }
+    }
+    dependents.merge(shard.backward_list_manager.GetShiftedDependents(shift));
+  }
+  // Формулы, области которых меняют размер, читают другие ячейки
+  std::vector<Position> resized;
+  for (const auto &[range, positions] : range_dependents_) {
+    if (!shift.Affects(range.last)) {
+      continue;
+    }
+    auto moved = shift.Apply(range);
+    const bool same = moved.IsValid()
+        && moved.GetSize().rows == range.GetSize().rows && moved.GetSize().cols == range.GetSize().cols;
+    for (auto pos : positions) {
+      dependents.insert(pos);
+      if (!same) {
+        resized.push_back(pos);
+      }
+    }
+  }
+  lookup_indexes_.clear();
+  has_lookup_indexes_ = false;
+
+  // Перенесённые ячейки и формулы с переписанными ссылками меняют хеши
+  std::unordered_set<Position, PositionHasher> rehashed(affected.begin(), affected.end());
+  rehashed.insert(dependents.begin(), dependents.end());
+  for (auto pos : rehashed) {
+    UpdateContentHash(pos, HashCell(pos, FindCell(pos)), 0);
+  }
+
+  // Связи этих формул и перенесённых формул снимаются и создаются заново
+  auto find_cell = [this](Position pos) {
+    return FindCell(pos);
+  };
+  std::vector<Position> relinked;
+  for (auto pos : dependents) {
+    if (find_cell(pos) != nullptr) {
+      relinked.push_back(pos);
+    }
+  }
+  for (auto pos : affected) {
+    auto cell = find_cell(pos);
+    if (cell != nullptr && cell->IsFormula() && dependents.count(pos) == 0) {
+      relinked.push_back(pos);
+    }
+  }
+  for (auto pos : relinked) {
+    auto cell = find_cell(pos);
+    for (auto const &from : cell->GetReferencedCells()) {
+      if (from.IsValid()) {
+        ShardAt(from).backward_list_manager.RemoveBackwardLink(pos, from);
+      }
+    }
+    for (auto const &range : cell->GetReferencedRanges()) {
+      RemoveRangeDependent(range, pos);
+    }
+  }
+  for (auto &shard : shards_) {
+    shard.backward_list_manager.EraseShifted(shift);
+  }
+
+  // Узлы хранилища переносятся под новыми ключами, возможно в другой шард;
+  // ячейки не копируются
+  std::vector<Storage::node_type> moved;
+  for (auto pos : affected) {
+    auto node = ShardAt(pos).storage.extract(pos);
+    if (node.mapped() == nullptr) {
+      continue;
+    }
+    afterClear(pos);
+    auto to = shift.Apply(pos);
+    if (!to.IsValid()) {
+      continue;
+    }
+    node.key() = to;
+    moved.push_back(std::move(node));
+  }
+  for (auto &node : moved) {
+    afterSet(node.key());
+    ShardAt(node.key()).storage.insert(std::move(node));
+  }
+
+  // Разделяемая формула переписывается один раз
+  std::vector<std::shared_ptr<FormulaInterface>> formulas;
+  std::unordered_set<const FormulaInterface *> seen;
+  for (auto pos : dependents) {
+    auto cell = find_cell(shift.Apply(pos));
+    auto formula = cell == nullptr ? nullptr : cell->GetFormula();
+    if (formula != nullptr && seen.insert(formula.get()).second) {
+      formulas.push_back(std::move(formula));
+    }
+  }
+  // Формулы, которые читают снимки, не меняются: ячейки получают копии
+  auto shifted = formula_cache_.ShiftReferences(formulas, shift, HasSnapshots());
+  std::unordered_map<const FormulaInterface *, std::shared_ptr<FormulaInterface>> copies;
+  for (size_t i = 0; i < formulas.size(); ++i) {
+    if (shifted[i] != formulas[i]) {
+      copies.emplace(formulas[i].get(), std::move(shifted[i]));
+    }
+  }
+  if (!copies.empty()) {
+    for (auto pos : dependents) {
+      auto cell = find_cell(shift.Apply(pos));
+      auto it = cell == nullptr ? copies.end() : copies.find(cell->GetFormula().get());
+      if (it != copies.end()) {
+        cell->ReplaceFormula(it->second);
+      }
+    }
+  }
+
+  for (auto pos : affected) {
+    auto to = shift.Apply(pos);
+    if (auto cell = find_cell(to)) {
+      cell->Relocate(to);
+    }
+  }
+  for (auto pos : relinked) {
+    auto to = shift.Apply(pos);
+    auto cell = find_cell(to);
+    if (cell == nullptr) {
+      continue;
+    }
+    cell->Relocate(to);
+    for (auto const &from : cell->GetReferencedCells()) {
+      if (from.IsValid()) {
+        ShardAt(from).backward_list_manager.AddBackwardLink(to, from);
+      }
+    }
+    for (auto const &range : cell->GetReferencedRanges()) {
+      AddRangeDependent(range, to);
+    }
+  }
+
+  // Значения перенесённых ячеек не меняются, пересчитываются только формулы,
+  // потерявшие ссылки или изменившие области, и зависящие от них
+  for (auto pos : relinked) {
+    auto to = shift.Apply(pos);
+    auto cell = find_cell(to);
+    if (cell != nullptr && !cell->IsValid()) {
+      InvalidateCache(to);
+    }
+  }
+  for (auto pos : resized) {
+    auto to = shift.Apply(pos);
+    if (to.IsValid() && find_cell(to) != nullptr) {
+      InvalidateCache(to);
+    }
+  }
+
+  for (auto pos : rehashed) {
+    auto to = shift.Apply(pos);
+    if (to.IsValid()) {
+      UpdateContentHash(to, 0, HashCell(to, find_cell(to)));
+    }
+  }
+
+  std::map<Position, Spill> spills;
+  for (const auto &[anchor, spill] : spills_) {
+    auto to = shift.Apply(anchor);
+    if (to.IsValid() && find_cell(to) != nullptr) {
+      spills.emplace(to, spill);
+    }
+  }
+  spills_ = std::move(spills);
+  for (const auto &[anchor, spill] : spills_) {
+    PlaceSpill(anchor);
+  }
+
+  if (paging_ != nullptr) {
+    RecountResident();
+    TrimResident();
+  }
+}
+
+namespace {
+
+// Меньшие области сортируются в одном потоке
+constexpr size_t MIN_SORT_CHUNK_ROWS = 4096;
+
+// Класс значения ключа сортировки в порядке возрастания
+int SortClass(ValueTag tag) {
+  switch (tag) {
+    case ValueTag::NUMBER:return 0;
+    case ValueTag::TEXT:return 1;
+    case ValueTag::EMPTY:return 3;
+    default:return 2;
+  }
+}
+
+// Плотные ранги значений столбца: равные значения получают равный ранг.
+// Пустые ячейки получают наибольший ранг и при обратном порядке
+std::vector<uint32_t> RankColumn(const std::vector<double> &numbers, const std::vector<ValueTag> &tags,
+                                 const std::vector<std::string_view> &texts, bool descending) {
+  auto compare = [&](uint32_t lhs, uint32_t rhs) -> int {
+    const int lhs_class = SortClass(tags[lhs]);
+    const int rhs_class = SortClass(tags[rhs]);
+    if (lhs_class != rhs_class) {
+      return lhs_class < rhs_class ? -1 : 1;
+    }
+    switch (lhs_class) {
+      case 0:return numbers[lhs] < numbers[rhs] ? -1 : (numbers[rhs] < numbers[lhs] ? 1 : 0);
+      case 1:return texts[lhs].compare(texts[rhs]);
+      case 2:return tags[lhs] < tags[rhs] ? -1 : (tags[rhs] < tags[lhs] ? 1 : 0);
+      default:return 0;
+    }
+  };
+  std::vector<uint32_t> order(tags.size());
+  for (uint32_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&compare](uint32_t lhs, uint32_t rhs) {
+    return compare(lhs, rhs) < 0;
+  });
+
+  std::vector<uint32_t> ranks(tags.size());
+  uint32_t rank = 0;
+  uint32_t last_filled = 0;
+  for (size_t i = 0; i < order.size(); ++i) {
+    if (i > 0 && compare(order[i - 1], order[i]) != 0) {
+      ++rank;
+    }
+    ranks[order[i]] = rank;
+    if (tags[order[i]] != ValueTag::EMPTY) {
+      last_filled = rank;
+    }
+  }
+  if (descending) {
+    for (size_t i = 0; i < ranks.size(); ++i) {
+      if (tags[i] != ValueTag::EMPTY) {
+        ranks[i] = last_filled - ranks[i];
+      }
+    }
+  }
+  return ranks;
+}
+
+// Плотные ранги пар (старший, младший)
+std::vector<uint32_t> CombineRanks(const std::vector<uint32_t> &major, const std::vector<uint32_t> &minor) {
+  std::vector<uint64_t> packed(major.size());
+  for (size_t i = 0; i < packed.size(); ++i) {
+    packed[i] = (static_cast<uint64_t>(major[i]) << 32) | minor[i];
+  }
+  auto sorted = packed;
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+  std::vector<uint32_t> result(packed.size());
+  for (size_t i = 0; i < packed.size(); ++i) {
+    result[i] = static_cast<uint32_t>(std::lower_bound(sorted.begin(), sorted.end(), packed[i]) - sorted.begin());
+  }
+  return result;
+}
+
+}  // namespace
+
+std::vector<int> Sheet::SortPermutation(const Range &range, const std::vector<int> &key_cols,
+                                        SortOrder order) const {
+  const auto rows = static_cast<size_t>(range.GetSize().rows);
+  std::vector<uint32_t> ranks;
+  std::vector<double> numbers(rows);
+  std::vector<ValueTag> tags(rows);
+  std::vector<std::string_view> texts(rows);
+  for (int col : key_cols) {
+    // Тексты читаются до следующего GetValues: столбец сразу сводится к рангам
+    GetValues({range.first.row, col}, {range.GetSize().rows, 1}, {numbers.data(), tags.data(), texts.data()});
+    auto column = RankColumn(numbers, tags, texts, order == SortOrder::Descending);
+    ranks = ranks.empty() ? std::move(column) : CombineRanks(ranks, column);
+  }
+
+  // Ранг и исходная строка в одном числе: сортировка идёт по плотному массиву
+  // без косвенных обращений, а равные ранги остаются в исходном порядке
+  std::vector<uint64_t> keys(rows);
+  for (size_t i = 0; i < rows; ++i) {
+    keys[i] = (static_cast<uint64_t>(ranks[i]) << 32) | i;
+  }
+  // Большая область сортируется частями в нескольких потоках, отсортированные
+  // части попарно сливаются
+  const size_t threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                          std::max<size_t>(1, rows / MIN_SORT_CHUNK_ROWS));
+  const size_t chunk = (rows + threads - 1) / threads;
+  if (threads == 1) {
+    std::sort(keys.begin(), keys.end());
+  } else {
+    std::vector<std::thread> workers;
+    for (size_t begin = 0; begin < rows; begin += chunk) {
+      workers.emplace_back([&keys, begin, end = std::min(begin + chunk, rows)] {
+        std::sort(keys.begin() + begin, keys.begin() + end);
+      });
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    for (size_t width = chunk; width < rows; width *= 2) {
+      for (size_t begin = 0; begin + width < rows; begin += 2 * width) {
+        std::inplace_merge(keys.begin() + begin, keys.begin() + begin + width,
+                           keys.begin() + std::min(begin + 2 * width, rows));
+      }
+    }
+  }
+  std::vector<int> result(rows);
+  for (size_t i = 0; i < rows; ++i) {
+    result[keys[i] & UINT32_MAX] = static_cast<int>(i);
+  }
+  return result;
+}
+
+void Sheet::SortRange(const Range &range, const std::vector<int> &key_cols, SortOrder order) {
+  if (!range.IsValid()) {
+    throw InvalidPositionException("range "s + range.ToString());
+  }
+  for (int col : key_cols) {
+    if (col < range.first.col || col > range.last.col) {
+      throw InvalidPositionException("sort key column "s + std::to_string(col));
+    }
+  }
+  if (key_cols.empty()) {
+    return;
+  }
+
+  std::unique_lock structure(structure_mutex_);
+  FlushPendingInvalidation();
+  const RowPermutation permutation{range, SortPermutation(range, key_cols, order)};
+  bool reordered = false;
+  for (size_t i = 0; i < permutation.rows.size(); ++i) {
+    reordered |= permutation.rows[i] != static_cast<int>(i);
+  }
+  if (!reordered) {
+    return;
+  }
+
+  // Подгружаются только блоки области: ячейки переносятся между ними
+  LoadTiles(range);
+  ++version_;
+  snapshot_tiles_.reset();
+  for (auto &shard : shards_) {
+    shard.snapshot_dirty.clear();
+    shard.value_dirty.clear();
+  }
+  rescan_subscriptions_ = !subscriptions_.empty();
+  for (const auto &[anchor, spill] : spills_) {
+    RemoveSpill(anchor);
+  }
+
+  // Просматриваются только позиции области и их обратные ссылки. Указатели
+  // на ячейки не меняются при переносе узлов хранилища, поэтому каждая
+  // ячейка ищется в хранилище один раз
+  std::vector<std::pair<Position, Cell *>> affected;
+  std::vector<Position> dependent_positions;
+  std::vector<Position> referenced;
+  for (int row = range.first.row; row <= range.last.row; ++row) {
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+      const Position pos{row, col};
+      auto &shard = ShardAt(pos);
+      if (auto it = shard.storage.find(pos); it != shard.storage.end()) {
+        affected.push_back({pos, it->second.get()});
+      }
+      if (shard.backward_list_manager.AppendDependents(pos, dependent_positions)) {
+        referenced.push_back(pos);
+      }
+    }
+  }
+  std::sort(dependent_positions.begin(), dependent_positions.end());
+  dependent_positions.erase(std::unique(dependent_positions.begin(), dependent_positions.end()),
+                            dependent_positions.end());
+  const int width = range.last.col - range.first.col + 1;
+  auto index_in_range = [&range, width](Position pos) {
+    return static_cast<size_t>(pos.row - range.first.row) * width + pos.col - range.first.col;
+  };
+  std::vector<bool> is_dependent(static_cast<size_t>(permutation.rows.size()) * width);
+  std::vector<std::pair<Position, Cell *>> dependents;
+  dependents.reserve(dependent_positions.size());
+  for (auto pos : dependent_positions) {
+    if (permutation.Affects(pos)) {
+      is_dependent[index_in_range(pos)] = true;
+    }
+    dependents.push_back({pos, FindCell(pos)});
+  }
+  // Оценки памяти переносимых и переписываемых ячеек снимаются до изменений
+  // и добавляются после них уже на новых местах
+  auto note_cells = [this, &affected, &dependents, &permutation](bool added) {
+    if (paging_ == nullptr) {
+      return;
+    }
+    for (auto [pos, cell] : affected) {
+      if (cell != nullptr) {
+        added ? NoteStored(permutation.Apply(pos), nullptr, cell) : NoteStored(pos, cell, nullptr);
+      }
+    }
+    for (auto [pos, cell] : dependents) {
+      if (cell != nullptr && !permutation.Affects(pos)) {
+        added ? NoteStored(pos, nullptr, cell) : NoteStored(pos, cell, nullptr);
+      }
+    }
+  };
+  note_cells(false);
+  // Формулы, читающие область, видят значения в другом порядке
+  std::vector<Position> readers;
+  for (const auto &[reader_range, positions] : range_dependents_) {
+    if (reader_range.Intersects(range)) {
+      readers.insert(readers.end(), positions.begin(), positions.end());
+    }
+  }
+  lookup_indexes_.clear();
+  has_lookup_indexes_ = false;
+
+  // Связи ссылающихся и перенесённых формул снимаются и создаются заново.
+  // Текст ячейки, которая только переносится, не меняется: хеш текста
+  // считается один раз
+  std::vector<std::pair<Position, std::optional<size_t>>> moved_texts;
+  std::vector<std::pair<Position, Cell *>> relinked;
+  moved_texts.reserve(affected.size());
+  for (auto [pos, cell] : dependents) {
+    UpdateContentHash(pos, HashCell(pos, cell), 0);
+    if (cell != nullptr) {
+      relinked.push_back({pos, cell});
+    }
+  }
+  for (auto [pos, cell] : affected) {
+    if (is_dependent[index_in_range(pos)]) {
+      continue;
+    }
+    auto text_hash = HashText(cell);
+    UpdateContentHash(pos, HashPlaced(pos, text_hash), 0);
+    moved_texts.push_back({pos, text_hash});
+    if (cell != nullptr && cell->IsFormula()) {
+      relinked.push_back({pos, cell});
+    }
+  }
+  for (auto [pos, cell] : relinked) {
+    for (auto const &from : cell->GetReferencedCells()) {
+      // Записи ячеек области удаляются целиком
+      if (from.IsValid() && !permutation.Affects(from)) {
+        ShardAt(from).backward_list_manager.RemoveBackwardLink(pos, from);
+      }
+    }
+    for (auto const &reader_range : cell->GetReferencedRanges()) {
+      RemoveRangeDependent(reader_range, pos);
+    }
+  }
+  for (auto pos : referenced) {
+    ShardAt(pos).backward_list_manager.EraseBackwardList(pos);
+  }
+
+  // Узлы хранилища переносятся под новыми ключами; ячейки не копируются
+  std::vector<Storage::node_type> moved;
+  moved.reserve(affected.size());
+  for (auto [pos, cell] : affected) {
+    auto node = ShardAt(pos).storage.extract(pos);
+    if (cell == nullptr) {
+      continue;
+    }
+    afterClear(pos);
+    node.key() = permutation.Apply(pos);
+    moved.push_back(std::move(node));
+  }
+  for (auto &node : moved) {
+    afterSet(node.key());
+    ShardAt(node.key()).storage.insert(std::move(node));
+  }
+
+  std::vector<std::shared_ptr<FormulaInterface>> formulas;
+  std::unordered_set<const FormulaInterface *> seen;
+  for (auto [pos, cell] : dependents) {
+    auto formula = cell == nullptr ? nullptr : cell->GetFormula();
+    if (formula != nullptr && seen.insert(formula.get()).second) {
+      formulas.push_back(std::move(formula));
+    }
+  }
+  auto permuted = formula_cache_.PermuteReferences(formulas, permutation, HasSnapshots());
+  std::unordered_map<const FormulaInterface *, std::shared_ptr<FormulaInterface>> copies;
+  for (size_t i = 0; i < formulas.size(); ++i) {
+    if (permuted[i] != formulas[i]) {
+      copies.emplace(formulas[i].get(), std::move(permuted[i]));
+    }
+  }
+  if (!copies.empty()) {
+    for (auto [pos, cell] : dependents) {
+      auto it = cell == nullptr ? copies.end() : copies.find(cell->GetFormula().get());
+      if (it != copies.end()) {
+        cell->ReplaceFormula(it->second);
+      }
+    }
+  }
+
+  for (auto [pos, cell] : affected) {
+    if (cell != nullptr) {
+      cell->Relocate(permutation.Apply(pos));
+    }
+  }
+  for (auto [pos, cell] : relinked) {
+    auto to = permutation.Apply(pos);
+    if (!permutation.Affects(pos)) {
+      cell->Relocate(to);
+    }
+    for (auto const &from : cell->GetReferencedCells()) {
+      if (from.IsValid()) {
+        ShardAt(from).backward_list_manager.AddBackwardLink(to, from);
+      }
+    }
+    for (auto const &reader_range : cell->GetReferencedRanges()) {
+      AddRangeDependent(reader_range, to);
+    }
+  }
+  for (auto [pos, cell] : dependents) {
+    auto to = permutation.Apply(pos);
+    UpdateContentHash(to, 0, HashCell(to, cell));
+  }
+  for (auto [pos, text_hash] : moved_texts) {
+    auto to = permutation.Apply(pos);
+    UpdateContentHash(to, 0, HashPlaced(to, text_hash));
+  }
+
+  // Значения перенесённых ячеек не меняются: ссылки идут за ними
+  for (auto pos : readers) {
+    auto to = permutation.Apply(pos);
+    if (FindCell(to) != nullptr) {
+      InvalidateCache(to);
+    }
+  }
+
+  std::map<Position, Spill> spills;
+  for (const auto &[anchor, spill] : spills_) {
+    spills.emplace(permutation.Apply(anchor), spill);
+  }
+  spills_ = std::move(spills);
+  for (const auto &[anchor, spill] : spills_) {
+    PlaceSpill(anchor);
+  }
+
+  note_cells(true);
+  TrimResident();
+}
+
+namespace {
+
+// Блок, который держит только лист, можно менять на месте
+template <typename T>
+bool IsExclusive(const std::shared_ptr<T> &ptr) {
+  if (ptr.use_count() != 1) {
+    return false;
+  }
+  // Видеть все чтения снимка, освободившего блок последним
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return true;
+}
+
+}  // namespace
+
+size_t Sheet::GetVersion() const {
+  return version_;
+}
+
+namespace {
+
+// Перемешивание splitmix64: близкие входы дают далёкие хеши
+uint64_t MixHash(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+}  // namespace
+
+uint64_t Sheet::HashCell(Position pos, const Cell *cell) {
+  return HashPlaced(pos, HashText(cell));
+}
+
+std::optional<size_t> Sheet::HashText(const Cell *cell) {
+  if (cell == nullptr || cell->IsSpill()) {
+    return std::nullopt;
+  }
+  auto text = cell->GetText();
+  if (text.empty()) {
+    return std::nullopt;
+  }
+  return std::hash<std::string>{}(text);
+}
+
+uint64_t Sheet::HashPlaced(Position pos, std::optional<size_t> text_hash) {
+  if (!text_hash) {
+    return 0;
+  }
+  // Позиция входит в хеш: сумма различает перестановки ячеек
+  const uint64_t place = (static_cast<uint64_t>(pos.row) << 32) | static_cast<uint32_t>(pos.col);
+  return MixHash(*text_hash + MixHash(place));
+}
+
+size_t Sheet::HashAreaOf(Position tile) {
+  return static_cast<size_t>(tile.row / HASH_AREA_TILES) * HASH_AREA_COLS + tile.col / HASH_AREA_TILES;
+}
+
+void Sheet::UpdateContentHash(Position pos, uint64_t removed, uint64_t added) {
+  if (removed == added) {
+    return;
+  }
+  // Суммы по модулю 2^64 не зависят от порядка изменений
+  const uint64_t delta = added - removed;
+  auto tile = SheetSnapshot::TileOf(pos);
+  auto &tile_hashes = ShardAt(pos).tile_hashes;
+  if ((tile_hashes[tile] += delta) == 0) {
+    tile_hashes.erase(tile);
+  }
+  area_hashes_[HashAreaOf(tile)].fetch_add(delta, std::memory_order_relaxed);
+  content_hash_.fetch_add(delta, std::memory_order_relaxed);
+}
+
+uint64_t Sheet::GetTileHash(Position tile) const {
+  const auto &tile_hashes = ShardAt({tile.row * SheetSnapshot::TILE_SIZE, tile.col * SheetSnapshot::TILE_SIZE})
+      .tile_hashes;
+  auto it = tile_hashes.find(tile);
+  return it == tile_hashes.end() ? 0 : it->second;
+}
+
+uint64_t Sheet::GetContentHash() const {
+  return content_hash_.load(std::memory_order_relaxed);
+}
+
+std::vector<Position> Sheet::Diff(const Sheet &lhs, const Sheet &rhs) {
+  std::vector<Position> result;
+  if (lhs.GetContentHash() == rhs.GetContentHash()) {
+    return result;
+  }
+  auto text = [](const Sheet &sheet, Position pos) {
+    auto cell = sheet.FindCell(pos);
+    return cell == nullptr || cell->IsSpill() ? ""s : cell->GetText();
+  };
+  for (size_t area = 0; area < HASH_AREA_COUNT; ++area) {
+    if (lhs.area_hashes_[area].load(std::memory_order_relaxed)
+        == rhs.area_hashes_[area].load(std::memory_order_relaxed)) {
+      continue;
+    }
+    const int first_row = static_cast<int>(area / HASH_AREA_COLS) * HASH_AREA_TILES;
+    const int first_col = static_cast<int>(area % HASH_AREA_COLS) * HASH_AREA_TILES;
+    for (int tile_row = first_row; tile_row < first_row + HASH_AREA_TILES; ++tile_row) {
+      for (int tile_col = first_col; tile_col < first_col + HASH_AREA_TILES; ++tile_col) {
+        const Position tile{tile_row, tile_col};
+        if (lhs.GetTileHash(tile) == rhs.GetTileHash(tile)) {
+          continue;
+        }
+        for (int row = tile.row * SheetSnapshot::TILE_SIZE; row < (tile.row + 1) * SheetSnapshot::TILE_SIZE;
+             ++row) {
+          for (int col = tile.col * SheetSnapshot::TILE_SIZE;
+               col < (tile.col + 1) * SheetSnapshot::TILE_SIZE; ++col) {
+            if (text(lhs, {row, col}) != text(rhs, {row, col})) {
+              result.push_back({row, col});
+            }
+          }
+        }
+      }
+    }
+  }
+
+  // Зависимые формулы ищутся в обоих листах: ссылка может быть только в одном
+  std::unordered_set<Position, PositionHasher> reported(result.begin(), result.end());
+  for (size_t i = 0; i < result.size(); ++i) {
+    for (const Sheet *sheet : {&lhs, &rhs}) {
+      for (auto to : sheet->GetValueDependents(result[i])) {
+        if (reported.insert(to).second) {
+          result.push_back(to);
+        }
+      }
+    }
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+std::shared_ptr<const SheetSnapshot> Sheet::Snapshot(std::vector<Position> *published) {
+  std::unique_lock structure(structure_mutex_);
+  std::vector<Position> changed;
+  if (snapshot_tiles_ == nullptr) {
+    snapshot_tiles_ = std::make_shared<SheetSnapshot::Tiles>();
+    LoadAllTiles();
+    for (const auto &shard : shards_) {
+      for (const auto &[pos, cell] : shard.storage) {
+        if (cell != nullptr) {
+          changed.push_back(pos);
+        }
+      }
+    }
+  } else {
+    // Изменённые ячейки и все формулы, которые от них зависят
+    std::unordered_set<Position, PositionHasher> dirty;
+    for (auto &shard : shards_) {
+      dirty.merge(shard.snapshot_dirty);
+    }
+    changed.assign(dirty.begin(), dirty.end());
+    for (size_t i = 0; i < changed.size(); ++i) {
+      auto dependents = ShardAt(changed[i]).backward_list_manager.GetBackwardList(changed[i]);
+      auto range_dependents = GetRangeDependents(changed[i]);
+      dependents.insert(dependents.end(), range_dependents.begin(), range_dependents.end());
+      for (auto to : dependents) {
+        if (dirty.insert(to).second) {
+          changed.push_back(to);
+        }
+      }
+    }
+  }
+  for (auto &shard : shards_) {
+    shard.snapshot_dirty.clear();
+  }
+
+  if (!IsExclusive(snapshot_tiles_)) {
+    snapshot_tiles_ = std::make_shared<SheetSnapshot::Tiles>(*snapshot_tiles_);
+  }
+
+  // Версия формулы строится после версий ячеек, на которые она ссылается.
+  // Ячейки области достаточно обойти один раз: формула, которая читает
+  // область, не может быть среди ячеек, от которых область зависит
+  std::unordered_set<Position, PositionHasher> pending(changed.begin(), changed.end());
+  std::set<Range> expanded_ranges;
+  RangeVersions range_versions;
+  std::vector<std::pair<Position, bool>> stack;
+  for (auto root : changed) {
+    stack.push_back({root, false});
+    while (!stack.empty()) {
+      auto [pos, expanded] = stack.back();
+      stack.pop_back();
+      if (pending.count(pos) == 0) {
+        continue;
+      }
+      if (expanded) {
+        pending.erase(pos);
+        PublishVersion(pos, range_versions);
+        if (published != nullptr) {
+          published->push_back(pos);
+        }
+        continue;
+      }
+
+      stack.push_back({pos, true});
+      if (auto cell = FindCell(pos)) {
+        // Ячейка результата читает версию формулы-массива
+        if (auto anchor = cell->GetSpillAnchor(); pending.count(anchor) > 0) {
+          stack.push_back({anchor, false});
+        }
+        for (auto from : cell->GetReferencedCells()) {
+          if (pending.count(from) > 0) {
+            stack.push_back({from, false});
+          }
+        }
+        for (const auto &range : cell->GetReferencedRanges()) {
+          if (!range.IsValid() || !expanded_ranges.insert(range).second) {
+            continue;
+          }
+          for (int row = range.first.row; row <= range.last.row; ++row) {
+            for (int col = range.first.col; col <= range.last.col; ++col) {
+              if (pending.count({row, col}) > 0) {
+                stack.push_back({{row, col}, false});
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  TrimResident();
+  return std::make_shared<SheetSnapshot>(snapshot_tiles_, GetPrintableSize(), version_,
+                                         snapshot_pin_);
+}
+
+void Sheet::PublishVersion(Position pos, RangeVersions &range_versions) {
+  auto &tiles = *snapshot_tiles_;
+
+  std::shared_ptr<const CellVersion> version;
+  auto found = FindCell(pos);
+  if (found != nullptr && found->IsSpill()) {
+    auto anchor = found->GetSpillAnchor();
+    version = std::make_shared<CellVersion>(
+        tiles.at(SheetSnapshot::TileOf(anchor))->cells[SheetSnapshot::IndexInTile(anchor)],
+        pos.row - anchor.row, pos.col - anchor.col);
+  } else if (found != nullptr) {
+    const auto &cell = *found;
+    auto cells = cell.GetReferencedCells();
+    std::vector<std::shared_ptr<const CellVersion>> referenced;
+    referenced.reserve(cells.size());
+    for (auto from : cells) {
+      std::shared_ptr<const CellVersion> referenced_version;
+      auto tile = from.IsValid() ? tiles.find(SheetSnapshot::TileOf(from)) : tiles.end();
+      if (tile != tiles.end()) {
+        referenced_version = tile->second->cells[SheetSnapshot::IndexInTile(from)];
+      }
+      referenced.push_back(std::move(referenced_version));
+    }
+    std::vector<std::shared_ptr<const RangeVersion>> ranges;
+    for (const auto &range : cell.GetReferencedRanges()) {
+      if (!range.IsValid()) {
+        ranges.push_back(nullptr);
+        continue;
+      }
+      auto &range_version = range_versions[range];
+      if (range_version == nullptr) {
+        std::vector<std::shared_ptr<const CellVersion>> range_cells;
+        for (int row = range.first.row; row <= range.last.row; ++row) {
+          for (int col = range.first.col; col <= range.last.col; ++col) {
+            auto tile = tiles.find(SheetSnapshot::TileOf({row, col}));
+            range_cells.push_back(tile == tiles.end() ? nullptr
+                                                      : tile->second->cells[SheetSnapshot::IndexInTile({row, col})]);
+          }
+        }
+        range_version = std::make_shared<RangeVersion>(range, std::move(range_cells));
+      }
+      ranges.push_back(range_version);
+    }
+    version = std::make_shared<CellVersion>(cell.GetText(), cell.GetFormula(), std::move(cells),
+                                            std::move(referenced), std::move(ranges),
+                                            cell.IsSpillBlocked());
+  }
+
+  auto &tile = tiles[SheetSnapshot::TileOf(pos)];
+  if (tile == nullptr) {
+    tile = std::make_shared<SheetSnapshot::Tile>();
+  } else if (!IsExclusive(tile)) {
+    tile = std::make_shared<SheetSnapshot::Tile>(*tile);
+  }
+  tile->cells[SheetSnapshot::IndexInTile(pos)] = std::move(version);
+}
+
+void Sheet::MarkChanged(Position pos) {
+  ++version_;
+  if (snapshot_tiles_ != nullptr) {
+    ShardAt(pos).snapshot_dirty.insert(pos);
+  }
+}
+
+bool Sheet::HasSnapshots() const {
+  return !IsExclusive(snapshot_pin_);
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
@@ -1,13 +1,31 @@
 #pragma once
 
 #include "cell.h"
+#include "cold_storage.h"
 #include "common.h"
+#include "snapshot.h"
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cstdint>
 #include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
 #include <unordered_map>
 #include <map>
 
 //using Row = std::vector<std::unique_ptr<Cell>>;
 
+// SetCell и ClearCell можно вызывать из нескольких потоков одновременно.
+// Ячейки разбиты на шарды по блокам SheetSnapshot::TILE_SIZE x TILE_SIZE, у
+// каждого шарда своя блокировка, хранилище и обратные ссылки на его ячейки.
+// Остальные методы не вызываются одновременно с изменениями листа, кроме
+// Snapshot(), InsertRows() и подобных, которые сами ждут окончания изменений.
+// Результат формулы-массива выводится в область справа и вниз от неё: ячейки
+// области хранят только позицию формулы. Занятая область даёт #SPILL!, пока её
+// не освободят.
 class Sheet : public SheetInterface {
  private:
   class BackwardListManager {
@@ -18,11 +36,50 @@ class Sheet : public SheetInterface {
     }
 
     void RemoveBackwardLink(Position to, Position from) {
-      auto it = backward_list_[from].find(to);
-      if (it == backward_list_[from].end()) {
+      auto list = backward_list_.find(from);
+      if (list == backward_list_.end() || list->second.erase(to) == 0) {
         throw std::logic_error("Deleted backlink does not exists"s);
       }
-      backward_list_[from].erase(it);
+    }
+
+    // Ячейки, ссылающиеся на позиции, которые затрагивает сдвиг или
+    // перестановка строк
+    template <typename Move>
+    std::unordered_set<Position, PositionHasher> GetShiftedDependents(const Move &shift) const {
+      std::unordered_set<Position, PositionHasher> result;
+      for (const auto &[from, list] : backward_list_) {
+        if (shift.Affects(from)) {
+          result.insert(list.begin(), list.end());
+        }
+      }
+      return result;
+    }
+
+    // Дописывает в out ячейки, ссылающиеся на from; false, если таких нет
+    bool AppendDependents(Position from, std::vector<Position> &out) const {
+      auto list = backward_list_.find(from);
+      if (list == backward_list_.end()) {
+        return false;
+      }
+      out.insert(out.end(), list->second.begin(), list->second.end());
+      return true;
+    }
+
+    void EraseBackwardList(Position from) {
+      backward_list_.erase(from);
+    }
+
+    // Удаляет записи затронутых позиций целиком: ссылки из перенесённых
+    // формул создаются заново под новыми позициями
+    template <typename Move>
+    void EraseShifted(const Move &shift) {
+      for (auto it = backward_list_.begin(); it != backward_list_.end();) {
+        if (shift.Affects(it->first)) {
+          it = backward_list_.erase(it);
+        } else {
+          ++it;
+        }
+      }
     }
 
     std::vector<Position> GetBackwardList(Position from) const {
@@ -38,6 +95,29 @@ class Sheet : public SheetInterface {
   };
 
  public:
+  // Резолвер ссылок для FormulaAST::Execute: читает хранилище напрямую, без
+  // виртуальных вызовов и копирования текста ячеек
+  class ValueResolver {
+   public:
+    explicit ValueResolver(const Sheet &sheet) : sheet_(sheet) {
+    }
+
+    double operator()(const Position *pos) const {
+      if (!pos->IsValid()) {
+        throw FormulaError(FormulaError::Category::Ref);
+      }
+      auto cell = sheet_.FindCell(*pos);
+      return cell == nullptr ? 0 : cell->GetNumber();
+    }
+
+    std::optional<int> Match(const Range &line, double key, LookupIndex::Match match) const {
+      return sheet_.FindInLine(line, key, match);
+    }
+
+   private:
+    const Sheet &sheet_;
+  };
+
   ~Sheet();
 
   void SetCell(Position pos, std::string text) override;
@@ -47,22 +127,435 @@ class Sheet : public SheetInterface {
 
   void ClearCell(Position pos) override;
 
+  // Задаёт ячейки по порядку, как SetCell для каждой, но под одной
+  // монопольной блокировкой листа. Тексты разбираются до изменений: при
+  // FormulaException лист не меняется. При CircularDependencyException
+  // ячейки до ошибочной уже заданы
+  void SetCells(std::vector<std::pair<Position, std::string>> cells);
+
+  // Вставляет count пустых строк перед строкой before, сдвигая ячейки и ссылки
+  // на них. Бросает TableTooBigException, если непустые ячейки выйдут за
+  // пределы таблицы; ссылки на вышедшие за пределы пустые ячейки становятся
+  // #REF!
+  void InsertRows(int before, int count = 1);
+  void InsertCols(int before, int count = 1);
+
+  // Удаляет count строк начиная с first. Ссылки на удалённые ячейки
+  // становятся #REF!
+  void DeleteRows(int first, int count = 1);
+  void DeleteCols(int first, int count = 1);
+
+  enum class SortOrder {
+    Ascending,
+    Descending,
+  };
+
+  // Переставляет строки области range по значениям столбцов key_cols, первый
+  // - главный ключ; равные строки сохраняют порядок. По возрастанию числа
+  // идут перед текстом, текст (побайтно) - перед ошибками, по убыванию
+  // наоборот; пустые ячейки в конце при любом порядке. Ячейки переносятся
+  // без пересоздания, ссылки на них следуют за ними, как при вставке строк,
+  // поэтому значения формул не меняются. Просматриваются только ячейки
+  // области и ссылающиеся на них формулы, а не весь лист.
+  // Области в формулах остаются прежними: формулы, читающие range,
+  // пересчитываются. Бросает InvalidPositionException, если область вне
+  // таблицы или столбец ключа вне области
+  void SortRange(const Range &range, const std::vector<int> &key_cols, SortOrder order = SortOrder::Ascending);
+
   Size GetPrintableSize() const override;
 
+  // Формулы, непосредственно ссылающиеся на pos или читающие область с pos
+  std::vector<Position> GetDependents(Position pos) const;
+
+  // Буферы GetValues по столбцам: значение ячейки top_left + {row, col}
+  // записывается в элемент col * size.rows + row каждого буфера
+  struct ValueColumns {
+    // 0, если значение не число
+    double *numbers;
+    ValueTag *tags;
+    // Текст ячейки без экранирования; действителен до изменения ячейки
+    std::string_view *texts;
+  };
+
+  // Читает прямоугольную область без копирования текста и выделения памяти
+  // на ячейку. Невычисленная формула перед чтением вычисляется вместе с
+  // невычисленными ссылками, начиная с листовых, без глубокой рекурсии. Бросает
+  // InvalidPositionException, если область выходит за пределы таблицы
+  void GetValues(Position top_left, Size size, const ValueColumns &out) const;
+
+  // Позиции ячеек, значение которых изменилось
+  using ChangeCallback = std::function<void(const std::vector<Position> &)>;
+
+  // Подписка на изменения значений в области size.rows x size.cols начиная с
+  // top_left. Запоминает текущие значения области, вычисляя её формулы.
+  // Возвращает номер подписки для Unsubscribe
+  size_t Subscribe(Position top_left, Size size, ChangeCallback callback);
+  void Unsubscribe(size_t id);
+
+  // Сообщает подписчикам об изменениях значений после прошлого вызова: каждый
+  // получает не больше одного списка позиций по возрастанию. Проверяются
+  // только ячейки, кэш которых сбрасывался, и их невычисленные формулы
+  // вычисляются. Ячейка, значение которой вернулось к прежнему, не
+  // сообщается. Обработчик может читать и изменять лист
+  void NotifyChanges();
+
+  // Вызывает func для ячеек с текстом по строкам, в строке - по столбцам,
+  // кроме результатов формул-массивов. Просматриваются только блоки
+  // SheetSnapshot::TILE_SIZE x TILE_SIZE с ненулевым хешем содержимого; в
+  // режиме вытеснения лишние блоки вытесняются после каждой полосы блоков.
+  // Лист не должен меняться во время обхода
+  void ForEachCell(const std::function<void(Position, const CellInterface &)> &func) const;
+
   void PrintValues(std::ostream &output) const override;
   void PrintTexts(std::ostream &output) const override;
 
+  const FormulaCache &GetFormulaCache() const {
+    return formula_cache_;
+  }
+
+  // Неизменяемый снимок текущего состояния для чтения из других потоков.
+  // Строит версии только ячеек,
+  // изменённых после предыдущего снимка, и зависящих от них формул; первый
+  // снимок и снимок после вставки или удаления строк строятся по всему листу.
+  // В published добавляются позиции заново построенных версий: ячейка идёт
+  // после всех построенных заново ячеек, на которые она ссылается.
+  std::shared_ptr<const SheetSnapshot> Snapshot(std::vector<Position> *published = nullptr);
+
+  // Счётчик изменений листа
+  size_t GetVersion() const;
+
+  // С defer SetCell и ClearCell не обходят зависимые формулы, а запоминают
+  // изменённую ячейку: кэши зависимых сбрасывает InvalidatePending, например
+  // в фоновом потоке. До этого формулы, прочитанные из самого листа, дают
+  // прежние значения, а подписки и индексы MATCH не видят изменения. Снимки
+  // вычисляют значения заново и от сброса не зависят
+  void DeferInvalidation(bool defer);
+  // Сбрасывает кэши формул, зависящих от запомненных изменений. Можно
+  // вызывать одновременно с SetCell и ClearCell
+  void InvalidatePending();
+
+  // Хеш текстов всех ячеек, кроме результатов формул-массивов. Ведётся
+  // суммой хешей ячеек по блокам снимка и областям 256 x 256 ячеек,
+  // обновляется при каждом изменении. Хеши сравнимы только внутри одного
+  // процесса
+  uint64_t GetContentHash() const;
+
+  // Позиции ячеек, тексты которых различаются, и ячеек, значения которых
+  // могут различаться через них, по возрастанию. Спускается только в области
+  // и блоки с разными хешами. Значения не хешируются и не сравниваются:
+  // формула с одинаковым текстом и результаты формулы-массива попадают в
+  // результат, если в одном из листов они прямо, через области или через
+  // другие формулы зависят от различающейся ячейки, даже если значение
+  // совпало. Листы не должны меняться во время сравнения
+  static std::vector<Position> Diff(const Sheet &lhs, const Sheet &rhs);
+
+  // Режим вытеснения: блоки ячеек SheetSnapshot::TILE_SIZE x TILE_SIZE, к
+  // которым дольше всего не обращались, записываются в файл path, пока оценка
+  // памяти ячеек больше resident_limit байт, и читаются обратно при
+  // обращении. В этом режиме лист читают и изменяют из одного потока, а
+  // указатель из GetCell действителен до следующего вызова методов листа.
+  // Блоки с формулами-массивами, их результатами и формулами с #REF! не
+  // вытесняются. Обратные ссылки, области и снимки остаются в памяти.
+  // Предел не соблюдается внутри операций над всем листом: вставка и
+  // удаление строк и столбцов и первый Snapshot() подгружают все блоки, и
+  // лишние вытесняются только при следующем обращении к листу. SortRange
+  // подгружает только блоки области.
+  // Только POSIX: в сборке для Windows бросает std::system_error
+  void EnableOutOfCore(std::string path, size_t resident_limit);
+
+  struct PagingStats {
+    // Оценка памяти ячеек в памяти
+    size_t resident_bytes = 0;
+    size_t resident_tiles = 0;
+    size_t evicted_tiles = 0;
+    // Блоки, записанные в файл и прочитанные из него
+    size_t evictions = 0;
+    size_t loads = 0;
+    size_t file_bytes = 0;
+  };
+  PagingStats GetPagingStats() const;
+
  private:
-  std::unordered_map<Position, std::unique_ptr<Cell>, PositionHasher> storage_;
-  std::map<int, size_t> cols;
-  std::map<int, size_t> rows;
-  BackwardListManager backward_list_manager_;
+  static constexpr size_t SHARD_COUNT = 64;
+
+  using Storage = std::unordered_map<Position, std::unique_ptr<Cell>, PositionHasher>;
+
+  struct Shard {
+    std::mutex mutex;
+    // В режиме вытеснения блоки подгружаются и при чтении
+    mutable Storage storage;
+    // Ключ - позиция ячейки шарда, на которую ссылаются
+    BackwardListManager backward_list_manager;
+    // Число ячеек шарда в строках и столбцах
+    std::map<int, size_t> cols;
+    std::map<int, size_t> rows;
+    // Ячейки, изменённые после последнего снимка
+    std::unordered_set<Position, PositionHasher> snapshot_dirty;
+    // Изменённые ячейки, кэши зависимых от которых ещё не сброшены
+    std::unordered_set<Position, PositionHasher> invalidation_pending;
+    // Ячейки со сброшенным кэшем после последнего NotifyChanges; ведутся,
+    // пока есть подписки
+    std::unordered_set<Position, PositionHasher> value_dirty;
+    // Хеши непустых блоков снимка шарда
+    std::unordered_map<Position, uint64_t, PositionHasher> tile_hashes;
+  };
+
+  // Значение, о котором подписчик уже знает
+  struct NotifiedValue {
+    ValueTag tag;
+    double number;
+    std::string text;
+
+    bool operator==(const NotifiedValue &rhs) const {
+      return tag == rhs.tag && number == rhs.number && text == rhs.text;
+    }
+  };
+
+  struct Subscription {
+    Position top_left;
+    Size size;
+    ChangeCallback callback;
+    // Непустые ячейки области; отсутствующая ячейка пуста
+    std::unordered_map<Position, NotifiedValue, PositionHasher> values;
+
+    bool Contains(Position pos) const;
+  };
+
+  // Блокировки шардов, нужных одной операции. Операция обходит граф под
+  // блокировками известных ей шардов; встретив незаблокированный шард, она
+  // запоминает его, откатывается и повторяет обход, захватив все нужные
+  // шарды заново по возрастанию номера. Запись в ячейку со ссылками внутри
+  // своего шарда берёт только одну блокировку. Держит structure_mutex_ в
+  // разделяемом режиме.
+  class ShardLocks {
+   public:
+    ShardLocks(Sheet &sheet, Position pos);
+
+    // Шард позиции заблокирован; иначе он понадобится следующей попытке
+    bool Covers(Position pos);
+    // Отпускает блокировки и захватывает их заново вместе с понадобившимися
+    // шардами
+    void Expand();
+
+    bool IsExclusive() const {
+      return exclusive_.owns_lock();
+    }
+
+    // Следующий Expand захватит лист монопольно
+    void RequireExclusive() {
+      attempts_ = PARTIAL_ATTEMPTS;
+    }
+
+   private:
+    // Цепочка ссылок через много шардов открывалась бы по шарду за попытку:
+    // после стольких попыток лист захватывается монопольно
+    static constexpr int PARTIAL_ATTEMPTS = 3;
+
+    Sheet &sheet_;
+    int attempts_ = 0;
+    std::shared_lock<std::shared_mutex> shared_;
+    std::unique_lock<std::shared_mutex> exclusive_;
+    std::bitset<SHARD_COUNT> held_;
+    std::bitset<SHARD_COUNT> wanted_;
+    std::vector<std::unique_lock<std::mutex>> locks_;
+  };
+
+  // Объявлен до shards_: формулы ячеек освобождаются раньше кэша
+  FormulaCache formula_cache_;
+  std::array<Shard, SHARD_COUNT> shards_;
+  // SetCell и ClearCell держат её в разделяемом режиме, операции над всем
+  // листом - монопольно
+  std::shared_mutex structure_mutex_;
+
+  std::atomic<size_t> version_ = 0;
+  std::atomic<bool> defer_invalidation_ = false;
+  // Блоки последнего снимка; nullptr, пока снимки не запрашивались
+  std::shared_ptr<SheetSnapshot::Tiles> snapshot_tiles_;
+  // Копию держит каждый живой снимок
+  std::shared_ptr<const bool> snapshot_pin_ = std::make_shared<const bool>(true);
+
+  std::map<size_t, Subscription> subscriptions_;
+  size_t next_subscription_ = 0;
+  // Ячейки сдвинуты: области подписок проверяются целиком
+  bool rescan_subscriptions_ = false;
+
+  // Формулы, читающие области MATCH и VLOOKUP. Различных областей обычно
+  // немного, поэтому изменённая ячейка сверяется с каждой, а формула
+  // регистрируется один раз, а не в обратных ссылках каждой ячейки области
+  mutable std::mutex range_mutex_;
+  std::map<Range, std::unordered_set<Position, PositionHasher>> range_dependents_;
+  // Проверяется без блокировки, чтобы листы без областей её не брали
+  std::atomic<bool> has_range_dependents_ = false;
+
+  // Индекс строки или столбца, в котором ищут MATCH и VLOOKUP. Строится
+  // при первом поиске; изменённые ячейки перечитываются следующим поиском
+  struct LineIndex {
+    // Поиск в индексе из нескольких потоков
+    std::mutex mutex;
+    LookupIndex index;
+    bool built = false;
+    std::unordered_set<int> pending;
+  };
+  // Изменения листа отмечают ячейки индексов под lookup_mutex_, поиски
+  // берут только блокировку своего индекса: поиски и изменения не идут
+  // одновременно
+  mutable std::mutex lookup_mutex_;
+  mutable std::map<Range, LineIndex> lookup_indexes_;
+  mutable std::atomic<bool> has_lookup_indexes_ = false;
+
+  // Формулы-массивы и области их результатов, в том числе занятые. Меняется
+  // только при монопольной блокировке листа, поэтому читается без своей
+  struct Spill {
+    Range area;
+    bool blocked = false;
+  };
+  std::map<Position, Spill> spills_;
+
+  // Блок ячеек в режиме вытеснения. Блоки без записи ещё не содержали ячеек
+  struct TileState {
+    bool resident = true;
+    size_t bytes = 0;
+    // Положение в Paging::lru, пока блок в памяти
+    std::list<Position>::iterator lru;
+    ColdStorage::Block block;
+  };
+  struct Paging {
+    Paging(std::string path, size_t limit) : file(std::move(path)), limit(limit) {
+    }
+
+    ColdStorage file;
+    size_t limit;
+    std::unordered_map<Position, TileState, PositionHasher> tiles;
+    // Блоки в памяти, недавно использованные - в начале
+    std::list<Position> lru;
+    PagingStats stats;
+  };
+  // nullptr - все ячейки в памяти
+  std::unique_ptr<Paging> paging_;
+
+  static constexpr int HASH_AREA_TILES = 16;
+  static constexpr int HASH_AREA_CELLS = HASH_AREA_TILES * SheetSnapshot::TILE_SIZE;
+  static constexpr int HASH_AREA_COLS = Position::MAX_COLS / HASH_AREA_CELLS;
+  static constexpr size_t HASH_AREA_COUNT = size_t{Position::MAX_ROWS / HASH_AREA_CELLS} * HASH_AREA_COLS;
+  // Суммы хешей ячеек: вклад ячейки добавляется без блокировок
+  std::array<std::atomic<uint64_t>, HASH_AREA_COUNT> area_hashes_{};
+  std::atomic<uint64_t> content_hash_{0};
+
+  static size_t ShardOf(Position pos) {
+    auto tile = SheetSnapshot::TileOf(pos);
+    return static_cast<size_t>(tile.row * 31 + tile.col) % SHARD_COUNT;
+  }
+
+  Shard &ShardAt(Position pos) {
+    return shards_[ShardOf(pos)];
+  }
+
+  const Shard &ShardAt(Position pos) const {
+    return shards_[ShardOf(pos)];
+  }
+
+  // В режиме вытеснения подгружает блок ячейки
+  Cell *FindCell(Position pos) const;
+  // Без подгрузки: вытесненная ячейка не найдена
+  Cell *FindResidentCell(Position pos) const;
+
+  // Оценка памяти ячейки в хранилище
+  static size_t EstimateBytes(const Cell &cell);
+  // Ячейка pos заменена; блок в памяти
+  void NoteStored(Position pos, const Cell *removed, const Cell *added);
+  void LoadTile(Position tile) const;
+  void EvictTile(Position tile) const;
+  bool IsPinned(Position tile) const;
+  // Вытесняет блоки, пока оценка памяти больше предела. Вызывается, когда
+  // указателей на ячейки нет: в начале чтений и в конце изменений листа
+  void TrimResident() const;
+  void LoadAllTiles();
+  // Подгружает вытесненные блоки, пересекающие range
+  void LoadTiles(const Range &range) const;
+  // Пересчитывает оценки всех блоков, когда все они в памяти
+  void RecountResident();
+
+  // 0 для пустой ячейки и результата формулы-массива
+  static uint64_t HashCell(Position pos, const Cell *cell);
+  // HashCell по частям: хеш текста не зависит от позиции и не меняется при
+  // переносе ячейки. nullopt - ячейка не входит в хеш
+  static std::optional<size_t> HashText(const Cell *cell);
+  static uint64_t HashPlaced(Position pos, std::optional<size_t> text_hash);
+  static size_t HashAreaOf(Position tile);
+  // Заменяет вклад ячейки pos в хеши; шард pos заблокирован
+  void UpdateContentHash(Position pos, uint64_t removed, uint64_t added);
+  uint64_t GetTileHash(Position tile) const;
+
+  std::optional<int> FindInLine(const Range &line, double key, LookupIndex::Match match) const;
+  // Число, которое прочитала бы ссылающаяся формула; nullopt для пустой
+  // ячейки, текста и ошибки
+  std::optional<double> ReadLookupKey(Position pos) const;
+  // Ячейка изменилась: индексы, которые её содержат, перечитают её
+  void MarkLookupChanged(Position pos);
+
+  void AddRangeDependent(const Range &range, Position pos);
+  void RemoveRangeDependent(const Range &range, Position pos);
+  // Формулы, читающие области с pos
+  std::vector<Position> GetRangeDependents(Position pos) const;
+  // Формулы, читающие значение pos: по ссылке, через область и через
+  // результат формулы-массива pos
+  std::vector<Position> GetValueDependents(Position pos) const;
+
+  // Вычисляет невычисленные формулы, которые формула pos читает при любом
+  // вычислении, начиная с листовых. failed - формулы с ошибкой, они не
+  // кэшируются
+  void EvaluateDirty(Position pos, std::vector<Position> &stack,
+                     std::unordered_set<Position, PositionHasher> &failed) const;
+
+  // Текущее значение ячейки; невычисленные формулы вычисляются
+  NotifiedValue ReadNotifiedValue(Position pos) const;
 
   void afterClear(Position pos);
   void afterSet(Position pos);
   static void validatePosition(Position pos);
 
-  bool CycleDetector(Position position, const CellInterface &cell);
+  // Формула cell в position создаёт цикл, если читаемая ею ячейка зависит от
+  // position или от ячеек spill, куда будет выведен её результат. Обход идёт
+  // от них по зависимым: у новой ячейки их обычно нет, и проверка не зависит
+  // от размера читаемых областей. Прежний результат формулы position не
+  // учитывается. nullopt - обходу не хватило заблокированных шардов; без
+  // locks лист захвачен монопольно
+  std::optional<bool> CycleDetector(Position position, const Cell &cell, ShardLocks *locks,
+                                    const std::vector<Position> &spill = {});
   void UpdateBackwardLink(Position pos, const std::unique_ptr<Cell> &new_cell);
-  void InvalidateCache(Position pos);
+  // Заменяет ячейку pos разобранной new_cell: проверки и сброс кэшей
+  // повторяются, пока locks не покроют все затронутые шарды
+  void StoreCell(Position pos, std::unique_ptr<Cell> new_cell, uint64_t added_hash, ShardLocks &locks);
+  // false - часть зависимых ячеек в незаблокированных шардах. Без locks лист
+  // захвачен монопольно. changed - ссылка pos, через которую дошёл сброс:
+  // формула, не читавшая её при вычислении кэша, и её зависимые не сбрасываются
+  bool InvalidateCache(Position pos, ShardLocks *locks = nullptr,
+                       Position changed = Position::NONE);
+  // Сбрасывает кэши зависимых от изменённой ячейки pos или, при отложенном
+  // сбросе, запоминает pos. Шард pos заблокирован
+  bool InvalidateChanged(Position pos, ShardLocks &locks);
+  // Сбрасывает отложенное до сдвига ячеек. Лист захвачен монопольно
+  void FlushPendingInvalidation();
+  void MarkChanged(Position pos);
+
+  // Выводит результат формулы-массива anchor в её область или отмечает
+  // формулу занятой. Лист захвачен монопольно
+  void PlaceSpill(Position anchor);
+  // Очищает ячейки результата формулы-массива anchor
+  void RemoveSpill(Position anchor);
+  // Формула-массив, область которой занята ячейкой pos
+  bool IsSpillBlockedBy(Position pos) const;
+  // Повторяет вывод занятых формул-массивов, области которых пересекают
+  // освобождённую область
+  void RetrySpills(const Range &freed);
+
+  bool HasSnapshots() const;
+  // Версии областей разделяются формулами одного вызова Snapshot()
+  using RangeVersions = std::map<Range, std::shared_ptr<const RangeVersion>>;
+  void PublishVersion(Position pos, RangeVersions &ranges);
+  // Ячейки переносятся в хранилище без копирования, ссылки в формулах
+  // переписываются на месте без повторного разбора
+  void ShiftCells(PositionShift::Axis axis, int first, int count, bool insert);
+  // Новые смещения строк range после сортировки по ключам
+  std::vector<int> SortPermutation(const Range &range, const std::vector<int> &key_cols, SortOrder order) const;
 };
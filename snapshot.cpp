@@ -0,0 +1,290 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <sstream>
+
+using namespace std::literals;
+
+// == CellVersion ==
+
+CellVersion::CellVersion(std::string text, std::shared_ptr<const FormulaInterface> formula,
+                         std::vector<Position> cells,
+                         std::vector<std::shared_ptr<const CellVersion>> referenced,
+                         std::vector<std::shared_ptr<const RangeVersion>> ranges,
+                         bool spill_blocked)
+    : text_(std::move(text)),
+      formula_(std::move(formula)),
+      cells_(std::move(cells)),
+      referenced_(std::move(referenced)),
+      ranges_(std::move(ranges)),
+      spill_blocked_(spill_blocked) {
+  if (formula_ != nullptr) {
+    valid_ = std::all_of(cells_.begin(), cells_.end(), [](Position pos) {
+      return pos.IsValid();
+    }) && std::all_of(ranges_.begin(), ranges_.end(), [](const auto &range) {
+      return range != nullptr;
+    });
+    return;
+  }
+
+  std::string_view visible = text_;
+  if (!visible.empty() && visible[0] == ESCAPE_SIGN) {
+    visible.remove_prefix(1);
+  }
+  is_number_ = ParseCellNumber(visible, number_);
+}
+
+CellVersion::CellVersion(std::shared_ptr<const CellVersion> anchor, int row, int col)
+    : anchor_(std::move(anchor)), row_(row), col_(col) {}
+
+void CellVersion::Set(std::string /* text */) {
+  throw std::logic_error("Snapshot is read-only"s);
+}
+
+CellInterface::Value CellVersion::GetValue() const {
+  if (formula_ == nullptr && anchor_ == nullptr) {
+    if (!text_.empty() && text_[0] == ESCAPE_SIGN) {
+      return text_.substr(1);
+    }
+    return text_;
+  }
+
+  auto result = GetValueOrError();
+  if (auto error = std::get_if<FormulaError>(&result)) {
+    return *error;
+  }
+  return std::get<double>(result);
+}
+
+std::string CellVersion::GetText() const {
+  return text_;
+}
+
+std::vector<Position> CellVersion::GetReferencedCells() const {
+  return cells_;
+}
+
+double CellVersion::GetNumber() const {
+  if (formula_ == nullptr && anchor_ == nullptr) {
+    if (!is_number_) {
+      throw FormulaError(FormulaError::Category::Value);
+    }
+    return number_;
+  }
+
+  auto result = GetValueOrError();
+  if (auto error = std::get_if<FormulaError>(&result)) {
+    throw *error;
+  }
+  return std::get<double>(result);
+}
+
+FormulaInterface::Value CellVersion::GetArrayValue(int row, int col) const {
+  std::shared_ptr<const Matrix> array;
+  auto result = Compute(&array);
+  if (std::holds_alternative<FormulaError>(result)) {
+    return result;
+  }
+  if (array == nullptr || row >= array->GetSize().rows || col >= array->GetSize().cols) {
+    throw std::logic_error("Array element is out of the result"s);
+  }
+  return (*array)(row, col);
+}
+
+FormulaInterface::Value CellVersion::GetValueOrError() const {
+  if (anchor_ != nullptr) {
+    return anchor_->GetArrayValue(row_, col_);
+  }
+  return Compute();
+}
+
+FormulaInterface::Value CellVersion::Compute(std::shared_ptr<const Matrix> *array) const {
+  if (state_.load(std::memory_order_acquire) == READY) {
+    if (array != nullptr) {
+      *array = array_;
+    }
+    return value_;
+  }
+
+  FormulaInterface::Value result;
+  std::shared_ptr<const Matrix> matrix;
+  if (!valid_) {
+    result = FormulaError(FormulaError::Category::Ref);
+  } else if (spill_blocked_) {
+    result = FormulaError(FormulaError::Category::Spill);
+  } else if (formula_->GetAST().IsArray()) {
+    try {
+      matrix = std::make_shared<const Matrix>(formula_->GetAST().ExecuteArray(
+          [this](const Position *pos) {
+            return ReadReferenced(*pos);
+          }));
+      result = (*matrix)(0, 0);
+    } catch (const FormulaError &e) {
+      result = e;
+    }
+  } else {
+    try {
+      struct Resolver {
+        const CellVersion &version;
+
+        double operator()(const Position *pos) const {
+          return version.ReadReferenced(*pos);
+        }
+
+        std::optional<int> Match(const Range &line, double key, LookupIndex::Match match) const {
+          return version.Match(line, key, match);
+        }
+      };
+      result = formula_->GetAST().Execute(Resolver{*this});
+    } catch (const FormulaError &e) {
+      result = e;
+    }
+  }
+
+  // Версия неизменяема, поэтому кэшируются и ошибки
+  auto expected = EMPTY;
+  if (state_.compare_exchange_strong(expected, COMPUTING, std::memory_order_acq_rel)) {
+    value_ = result;
+    array_ = matrix;
+    state_.store(READY, std::memory_order_release);
+  }
+  if (array != nullptr) {
+    *array = std::move(matrix);
+  }
+  return result;
+}
+
+double CellVersion::ReadReferenced(Position pos) const {
+  auto it = std::lower_bound(cells_.begin(), cells_.end(), pos);
+  if (it != cells_.end() && *it == pos) {
+    const auto &version = referenced_[it - cells_.begin()];
+    return version == nullptr ? 0.0 : version->GetNumber();
+  }
+  // Ячейка, найденная VLOOKUP
+  for (const auto &range : ranges_) {
+    if (range->GetRange().Contains(pos)) {
+      auto version = range->Find(pos);
+      return version == nullptr ? 0.0 : version->GetNumber();
+    }
+  }
+  throw std::logic_error("Formula reads an unknown cell "s + pos.ToString());
+}
+
+std::optional<int> CellVersion::Match(const Range &line, double key,
+                                      LookupIndex::Match match) const {
+  for (const auto &range : ranges_) {
+    if (range->GetRange().Contains(line.first) && range->GetRange().Contains(line.last)) {
+      return range->Match(line, key, match);
+    }
+  }
+  throw std::logic_error("Formula reads an unknown range "s + line.ToString());
+}
+
+// == RangeVersion ==
+
+RangeVersion::RangeVersion(Range range, std::vector<std::shared_ptr<const CellVersion>> cells)
+    : range_(range), cells_(std::move(cells)) {}
+
+const CellVersion *RangeVersion::Find(Position pos) const {
+  auto cols = range_.GetSize().cols;
+  return cells_[(pos.row - range_.first.row) * cols + pos.col - range_.first.col].get();
+}
+
+std::optional<int> RangeVersion::Match(const Range &line, double key,
+                                       LookupIndex::Match match) const {
+  std::lock_guard guard(mutex_);
+  auto [it, inserted] = indexes_.try_emplace(line);
+  if (inserted) {
+    const bool by_rows = line.first.col == line.last.col;
+    const auto size = line.GetSize();
+    for (int offset = 0; offset < size.rows * size.cols; ++offset) {
+      auto version = Find({line.first.row + (by_rows ? offset : 0),
+                           line.first.col + (by_rows ? 0 : offset)});
+      if (version == nullptr) {
+        continue;
+      }
+      // Число, которое прочитала бы формула; текст и ошибки не индексируются
+      try {
+        it->second.Set(offset, version->GetNumber());
+      } catch (const FormulaError &) {
+      }
+    }
+  }
+  return it->second.Find(key, match);
+}
+
+// == SheetSnapshot ==
+
+Position SheetSnapshot::TileOf(Position pos) {
+  return {pos.row / TILE_SIZE, pos.col / TILE_SIZE};
+}
+
+size_t SheetSnapshot::IndexInTile(Position pos) {
+  return static_cast<size_t>((pos.row % TILE_SIZE) * TILE_SIZE + pos.col % TILE_SIZE);
+}
+
+const CellVersion *SheetSnapshot::Find(const Tiles &tiles, Position pos) {
+  auto it = tiles.find(TileOf(pos));
+  if (it == tiles.end()) {
+    return nullptr;
+  }
+  return it->second->cells[IndexInTile(pos)].get();
+}
+
+SheetSnapshot::SheetSnapshot(std::shared_ptr<const Tiles> tiles, Size size, size_t version,
+                             std::shared_ptr<const void> pin)
+    : tiles_(std::move(tiles)), size_(size), version_(version), pin_(std::move(pin)) {}
+
+void SheetSnapshot::SetCell(Position /* pos */, std::string /* text */) {
+  throw std::logic_error("Snapshot is read-only"s);
+}
+
+void SheetSnapshot::ClearCell(Position /* pos */) {
+  throw std::logic_error("Snapshot is read-only"s);
+}
+
+const CellInterface *SheetSnapshot::GetCell(Position pos) const {
+  if (!pos.IsValid()) {
+    std::stringstream ss;
+    ss << pos;
+    throw InvalidPositionException(ss.str());
+  }
+  return Find(*tiles_, pos);
+}
+
+CellInterface *SheetSnapshot::GetCell(Position pos) {
+  // Версии неизменяемы, изменить ячейку через указатель нельзя
+  return const_cast<CellInterface *>(static_cast<const SheetSnapshot &>(*this).GetCell(pos));
+}
+
+Size SheetSnapshot::GetPrintableSize() const {
+  return size_;
+}
+
+void SheetSnapshot::PrintValues(std::ostream &output) const {
+  for (int row = 0; row < size_.rows; ++row) {
+    for (int col = 0; col < size_.cols; ++col) {
+      if (col > 0) {
+        output << "\t";
+      }
+      if (auto cell = Find(*tiles_, {row, col})) {
+        output << cell->GetValue();
+      }
+    }
+    output << "\n";
+  }
+}
+
+void SheetSnapshot::PrintTexts(std::ostream &output) const {
+  for (int row = 0; row < size_.rows; ++row) {
+    for (int col = 0; col < size_.cols; ++col) {
+      if (col > 0) {
+        output << "\t";
+      }
+      if (auto cell = Find(*tiles_, {row, col})) {
+        output << cell->GetText();
+      }
+    }
+    output << "\n";
+  }
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+#include "formula.h"
+
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+class RangeVersion;
+
+// Версия ячейки в снимке листа. Неизменяема, кроме вычисленного значения,
+// которое разделяют все снимки с этой версией. Формула ссылается прямо на
+// версии ячеек, от которых зависит, поэтому при изменении ячейки лист
+// заменяет и версии всех зависящих от неё формул.
+class CellVersion final : public CellInterface {
+ public:
+  // referenced - версии ячеек cells (nullptr для пустых) в том же порядке,
+  // ranges - версии областей формулы (nullptr для удалённых). spill_blocked -
+  // область результата формулы-массива занята
+  CellVersion(std::string text, std::shared_ptr<const FormulaInterface> formula,
+              std::vector<Position> cells, std::vector<std::shared_ptr<const CellVersion>> referenced,
+              std::vector<std::shared_ptr<const RangeVersion>> ranges = {}, bool spill_blocked = false);
+  // Элемент {row, col} результата формулы-массива anchor
+  CellVersion(std::shared_ptr<const CellVersion> anchor, int row, int col);
+
+  // Версия неизменяема: бросает std::logic_error
+  void Set(std::string text) override;
+
+  Value GetValue() const override;
+  std::string GetText() const override;
+  std::vector<Position> GetReferencedCells() const override;
+
+  // Значение для ссылающейся формулы: ошибка передаётся исключением
+  // FormulaError
+  double GetNumber() const;
+
+  // Элемент результата формулы-массива
+  FormulaInterface::Value GetArrayValue(int row, int col) const;
+
+ private:
+  enum State : char {
+    EMPTY,
+    COMPUTING,
+    READY,
+  };
+
+  std::string text_;
+  std::shared_ptr<const FormulaInterface> formula_;
+  std::vector<Position> cells_;
+  std::vector<std::shared_ptr<const CellVersion>> referenced_;
+  std::vector<std::shared_ptr<const RangeVersion>> ranges_;
+  std::shared_ptr<const CellVersion> anchor_;
+  int row_ = 0;
+  int col_ = 0;
+  bool spill_blocked_ = false;
+  bool valid_ = true;
+  double number_ = 0;
+  bool is_number_ = false;
+
+  // Значение публикует первый вычисливший его поток
+  mutable std::atomic<State> state_{EMPTY};
+  mutable FormulaInterface::Value value_;
+  mutable std::shared_ptr<const Matrix> array_;
+
+  // array - результат формулы-массива, если нужен
+  FormulaInterface::Value Compute(std::shared_ptr<const Matrix> *array = nullptr) const;
+  // Значение ячейки результата или формулы
+  FormulaInterface::Value GetValueOrError() const;
+  double ReadReferenced(Position pos) const;
+  std::optional<int> Match(const Range &line, double key, LookupIndex::Match match) const;
+};
+
+// Версии ячеек области, которую читают MATCH и VLOOKUP. Все формулы снимка с
+// одной областью разделяют её версию и индексы поиска, построенные при первом
+// поиске по строке или столбцу.
+class RangeVersion {
+ public:
+  // cells - версии ячеек области по строкам, nullptr для пустых
+  RangeVersion(Range range, std::vector<std::shared_ptr<const CellVersion>> cells);
+
+  const Range &GetRange() const {
+    return range_;
+  }
+
+  // nullptr - ячейка пуста
+  const CellVersion *Find(Position pos) const;
+
+  // Поиск по строке или столбцу line внутри области, как Sheet::FindInLine
+  std::optional<int> Match(const Range &line, double key, LookupIndex::Match match) const;
+
+ private:
+  Range range_;
+  std::vector<std::shared_ptr<const CellVersion>> cells_;
+
+  // Построение индекса вычисляет формулы области; те могут искать только в
+  // других областях, иначе формула читала бы сама себя
+  mutable std::mutex mutex_;
+  mutable std::map<Range, LookupIndex> indexes_;
+};
+
+// Снимок листа на момент Sheet::Snapshot(), только для чтения.
+// Ячейки хранятся блоками TILE_SIZE x TILE_SIZE, которые снимки разделяют
+// между собой и с листом: лист копирует блок перед изменением, только если его
+// держит снимок. Снимок можно читать из любого числа потоков одновременно с
+// изменением листа.
+class SheetSnapshot : public SheetInterface {
+ public:
+  static constexpr int TILE_SIZE = 16;
+
+  struct Tile {
+    std::array<std::shared_ptr<const CellVersion>, TILE_SIZE * TILE_SIZE> cells;
+  };
+
+  // Ключ - позиция блока: {row / TILE_SIZE, col / TILE_SIZE}
+  using Tiles = std::unordered_map<Position, std::shared_ptr<Tile>, PositionHasher>;
+
+  static Position TileOf(Position pos);
+  static size_t IndexInTile(Position pos);
+  static const CellVersion *Find(const Tiles &tiles, Position pos);
+
+  // pin удерживается, пока жив снимок: так лист узнаёт о читателях
+  SheetSnapshot(std::shared_ptr<const Tiles> tiles, Size size, size_t version,
+                std::shared_ptr<const void> pin);
+
+  // Снимок только для чтения: бросают std::logic_error
+  void SetCell(Position pos, std::string text) override;
+  void ClearCell(Position pos) override;
+
+  const CellInterface *GetCell(Position pos) const override;
+  CellInterface *GetCell(Position pos) override;
+
+  Size GetPrintableSize() const override;
+
+  void PrintValues(std::ostream &output) const override;
+  void PrintTexts(std::ostream &output) const override;
+
+  // Версия листа (Sheet::GetVersion()), на которой сделан снимок
+  size_t GetVersion() const {
+    return version_;
+  }
+
+ private:
+  std::shared_ptr<const Tiles> tiles_;
+  Size size_;
+  size_t version_;
+  std::shared_ptr<const void> pin_;
+};
@@ -0,0 +1,820 @@
+#include "spreadsheet_ml.h"
+
+#include "FormulaAST.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <initializer_list>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+
+// Буфер записи сбрасывается в поток частями такого размера
+constexpr size_t FLUSH_BYTES = size_t{1} << 16;
+// Ячеек в одной пачке Sheet::SetCells
+constexpr size_t BATCH_CELLS = 4096;
+
+bool IsLetter(char ch) {
+  return (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z');
+}
+
+bool IsDigit(char ch) {
+  return ch >= '0' && ch <= '9';
+}
+
+// Символ имени: буква, цифра, подчёркивание или точка
+bool IsNameChar(char ch) {
+  return IsLetter(ch) || IsDigit(ch) || ch == '_' || ch == '.';
+}
+
+// Текст целиком - запись числа, как её понимает ParseCellNumber
+bool IsNumberText(std::string_view text) {
+  size_t digit = !text.empty() && text[0] == '-' ? 1 : 0;
+  if (digit >= text.size() || !(IsDigit(text[digit]) || text[digit] == '.')) {
+    return false;
+  }
+  double number;
+  auto result = std::from_chars(text.data(), text.data() + text.size(), number);
+  return result.ec == std::errc() && result.ptr == text.data() + text.size();
+}
+
+void AppendEscaped(std::string &out, std::string_view text, bool attribute) {
+  for (char ch : text) {
+    switch (ch) {
+      case '&':out += "&amp;"sv;
+        break;
+      case '<':out += "&lt;"sv;
+        break;
+      case '>':out += "&gt;"sv;
+        break;
+      case '"':
+        if (attribute) {
+          out += "&quot;"sv;
+        } else {
+          out += ch;
+        }
+        break;
+      case '\n':
+        if (attribute) {
+          out += "&#10;"sv;
+        } else {
+          out += ch;
+        }
+        break;
+      default:
+        // Перевод каретки и табуляция в атрибуте иначе станут пробелами
+        if (static_cast<unsigned char>(ch) < 0x20 && ch != '\n' && (ch != '\t' || attribute)) {
+          out += "&#"sv;
+          out += std::to_string(static_cast<int>(ch));
+          out += ';';
+        } else {
+          out += ch;
+        }
+        break;
+    }
+  }
+}
+
+// Ссылки A1 выражения формулы в абсолютные ссылки R1C1
+std::string ToR1C1(std::string_view expression) {
+  std::string result;
+  result.reserve(expression.size() + 8);
+  size_t i = 0;
+  while (i < expression.size()) {
+    if (!IsLetter(expression[i]) || (i > 0 && IsNameChar(expression[i - 1]))) {
+      result += expression[i++];
+      continue;
+    }
+    size_t end = i;
+    while (end < expression.size() && IsLetter(expression[end])) {
+      ++end;
+    }
+    size_t letters = end;
+    while (end < expression.size() && IsDigit(expression[end])) {
+      ++end;
+    }
+    auto token = expression.substr(i, end - i);
+    auto pos = end > letters && (end == expression.size() || !IsNameChar(expression[end]))
+        ? Position::FromString(token) : Position::NONE;
+    if (pos.IsValid()) {
+      result += 'R';
+      result += std::to_string(pos.row + 1);
+      result += 'C';
+      result += std::to_string(pos.col + 1);
+    } else {
+      result += token;
+    }
+    i = end;
+  }
+  return result;
+}
+
+// Часть ссылки R1C1 после R или C: 5 - номер, [-2] - смещение от base, без
+// числа - сама base. nullopt - не часть ссылки
+std::optional<int> ParseR1C1Part(std::string_view text, size_t &i, int base) {
+  auto parse = [&text](size_t from, size_t to) -> std::optional<int> {
+    int value = 0;
+    auto result = std::from_chars(text.data() + from, text.data() + to, value);
+    if (result.ec != std::errc() || result.ptr != text.data() + to) {
+      return std::nullopt;
+    }
+    return value;
+  };
+  if (i < text.size() && text[i] == '[') {
+    auto close = text.find(']', i);
+    if (close == std::string_view::npos) {
+      return std::nullopt;
+    }
+    auto offset = parse(i + 1, close);
+    i = close + 1;
+    return offset ? std::optional(base + *offset) : std::nullopt;
+  }
+  size_t end = i;
+  while (end < text.size() && IsDigit(text[end])) {
+    ++end;
+  }
+  if (end == i) {
+    return base;
+  }
+  auto number = parse(i, end);
+  i = end;
+  return number ? std::optional(*number - 1) : std::nullopt;
+}
+
+// Формула со ссылками R1C1 относительно ячейки base в формулу со ссылками
+// A1. nullopt - ссылка вне таблицы или на другой лист
+std::optional<std::string> FromR1C1(std::string_view formula, Position base) {
+  std::string result;
+  result.reserve(formula.size());
+  size_t i = 0;
+  while (i < formula.size()) {
+    const char ch = formula[i];
+    if (ch == '"') {
+      // Строки копируются как есть; кавычка внутри удваивается
+      size_t close = i + 1;
+      while (close < formula.size()) {
+        if (formula[close] == '"') {
+          if (close + 1 < formula.size() && formula[close + 1] == '"') {
+            close += 2;
+            continue;
+          }
+          break;
+        }
+        ++close;
+      }
+      close = std::min(close + 1, formula.size());
+      result += formula.substr(i, close - i);
+      i = close;
+      continue;
+    }
+    if (!IsLetter(ch) || (i > 0 && IsNameChar(formula[i - 1]))) {
+      result += ch;
+      ++i;
+      continue;
+    }
+
+    size_t end = i;
+    Position pos = Position::NONE;
+    if (ch == 'R') {
+      ++end;
+      auto row = ParseR1C1Part(formula, end, base.row);
+      if (row && end < formula.size() && formula[end] == 'C') {
+        ++end;
+        auto col = ParseR1C1Part(formula, end, base.col);
+        if (col && (end == formula.size() || (!IsNameChar(formula[end]) && formula[end] != '('))) {
+          pos = {*row, *col};
+        }
+      }
+    }
+    if (pos == Position::NONE) {
+      end = i;
+      while (end < formula.size() && IsNameChar(formula[end])) {
+        ++end;
+      }
+      if (end < formula.size() && formula[end] == '!') {
+        return std::nullopt;
+      }
+      // Имя вида C5 или R5 - целый столбец или строка; в A1 оно стало бы
+      // ссылкой на ячейку
+      auto name = formula.substr(i, end - i);
+      auto digits = name.find_first_of("0123456789"sv);
+      if (digits != std::string_view::npos && digits > 0
+          && name.find_first_not_of("0123456789"sv, digits) == std::string_view::npos) {
+        return std::nullopt;
+      }
+      result += name;
+      i = end;
+      continue;
+    }
+    if (!pos.IsValid()) {
+      return std::nullopt;
+    }
+    result += pos.ToString();
+    i = end;
+  }
+  return result;
+}
+
+// Потоковый разбор XML: начало и конец элементов и текст между ними.
+// Объявления, комментарии и DOCTYPE пропускаются, CDATA - текст. Имена
+// элементов и атрибутов - без префикса пространства имён
+class XmlReader {
+ public:
+  enum class Token {
+    Start,
+    End,
+    Text,
+    Eof,
+  };
+
+  explicit XmlReader(std::istream &in) : in_(in) {
+  }
+
+  Token Next() {
+    while (true) {
+      if (pending_end_) {
+        pending_end_ = false;
+        return Token::End;
+      }
+      int ch = Peek();
+      if (ch < 0) {
+        return Token::Eof;
+      }
+      if (ch != '<') {
+        ReadText();
+        return Token::Text;
+      }
+      Get();
+      ch = Peek();
+      if (ch == '/') {
+        Get();
+        ReadName(name_);
+        SkipSpaces();
+        Expect('>');
+        return Token::End;
+      }
+      if (ch == '?') {
+        SkipUntil("?>"sv);
+        continue;
+      }
+      if (ch == '!') {
+        Get();
+        if (TryConsume("--"sv)) {
+          SkipUntil("-->"sv);
+          continue;
+        }
+        if (TryConsume("[CDATA["sv)) {
+          text_.clear();
+          ReadUntil("]]>"sv, text_);
+          return Token::Text;
+        }
+        SkipDeclaration();
+        continue;
+      }
+      ReadStartTag();
+      return Token::Start;
+    }
+  }
+
+  const std::string &GetName() const {
+    return name_;
+  }
+
+  const std::string &GetText() const {
+    return text_;
+  }
+
+  const std::string *FindAttribute(std::string_view name) const {
+    for (size_t i = 0; i < attribute_count_; ++i) {
+      if (attributes_[i].first == name) {
+        return &attributes_[i].second;
+      }
+    }
+    return nullptr;
+  }
+
+ private:
+  static constexpr size_t BUFFER_SIZE = size_t{1} << 16;
+
+  std::istream &in_;
+  std::vector<char> buffer_ = std::vector<char>(BUFFER_SIZE);
+  size_t pos_ = 0;
+  size_t end_ = 0;
+  // Смещение начала буфера в потоке
+  size_t offset_ = 0;
+  std::string name_;
+  std::string text_;
+  // Строки атрибутов переиспользуются от элемента к элементу
+  std::vector<std::pair<std::string, std::string>> attributes_;
+  size_t attribute_count_ = 0;
+  // Элемент <a/> даёт Start и затем End
+  bool pending_end_ = false;
+
+  [[noreturn]] void Fail(const std::string &what) const {
+    throw std::runtime_error("SpreadsheetML: "s + what + " at byte "s + std::to_string(offset_ + pos_));
+  }
+
+  bool Fill() {
+    offset_ += end_;
+    pos_ = 0;
+    in_.read(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    end_ = static_cast<size_t>(in_.gcount());
+    return end_ > 0;
+  }
+
+  int Peek() {
+    if (pos_ == end_ && !Fill()) {
+      return -1;
+    }
+    return static_cast<unsigned char>(buffer_[pos_]);
+  }
+
+  int Get() {
+    int ch = Peek();
+    if (ch >= 0) {
+      ++pos_;
+    }
+    return ch;
+  }
+
+  int GetOrFail() {
+    int ch = Get();
+    if (ch < 0) {
+      Fail("unexpected end of file"s);
+    }
+    return ch;
+  }
+
+  void Expect(char expected) {
+    if (GetOrFail() != expected) {
+      Fail("expected '"s + expected + "'"s);
+    }
+  }
+
+  void SkipSpaces() {
+    for (int ch = Peek(); ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r'; ch = Peek()) {
+      Get();
+    }
+  }
+
+  // Дописывает в out текст до разделителя; сам разделитель пропускается
+  void ReadUntil(std::string_view delimiter, std::string &out) {
+    const size_t start = out.size();
+    while (true) {
+      out += static_cast<char>(GetOrFail());
+      if (out.size() - start >= delimiter.size()
+          && std::string_view(out).substr(out.size() - delimiter.size()) == delimiter) {
+        out.resize(out.size() - delimiter.size());
+        return;
+      }
+    }
+  }
+
+  void SkipUntil(std::string_view delimiter) {
+    std::string skipped;
+    ReadUntil(delimiter, skipped);
+  }
+
+  bool TryConsume(std::string_view expected) {
+    for (size_t i = 0; i < expected.size(); ++i) {
+      if (Peek() != expected[i]) {
+        if (i > 0) {
+          Fail("malformed markup"s);
+        }
+        return false;
+      }
+      Get();
+    }
+    return true;
+  }
+
+  // <!DOCTYPE ...> с внутренним подмножеством в квадратных скобках
+  void SkipDeclaration() {
+    int depth = 0;
+    while (true) {
+      const int ch = GetOrFail();
+      if (ch == '[') {
+        ++depth;
+      } else if (ch == ']') {
+        --depth;
+      } else if (ch == '>' && depth <= 0) {
+        return;
+      }
+    }
+  }
+
+  // Имя без префикса: ss:Index - Index
+  void ReadName(std::string &out) {
+    out.clear();
+    for (int ch = Peek(); ch >= 0 && ch != '>' && ch != '/' && ch != '=' && ch != ' ' && ch != '\t'
+        && ch != '\n' && ch != '\r'; ch = Peek()) {
+      Get();
+      if (ch == ':') {
+        out.clear();
+      } else {
+        out += static_cast<char>(ch);
+      }
+    }
+    if (out.empty()) {
+      Fail("expected a name"s);
+    }
+  }
+
+  void AppendUtf8(std::string &out, uint32_t code) {
+    if (code < 0x80) {
+      out += static_cast<char>(code);
+    } else if (code < 0x800) {
+      out += static_cast<char>(0xC0 | (code >> 6));
+      out += static_cast<char>(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+      out += static_cast<char>(0xE0 | (code >> 12));
+      out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+      out += static_cast<char>(0x80 | (code & 0x3F));
+    } else if (code < 0x110000) {
+      out += static_cast<char>(0xF0 | (code >> 18));
+      out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+      out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+      out += static_cast<char>(0x80 | (code & 0x3F));
+    } else {
+      Fail("invalid character reference"s);
+    }
+  }
+
+  // После &
+  void ReadEntity(std::string &out) {
+    char name[12];
+    size_t size = 0;
+    for (int ch = GetOrFail(); ch != ';'; ch = GetOrFail()) {
+      if (size == sizeof(name)) {
+        Fail("malformed entity"s);
+      }
+      name[size++] = static_cast<char>(ch);
+    }
+    std::string_view entity(name, size);
+    if (entity == "lt"sv) {
+      out += '<';
+    } else if (entity == "gt"sv) {
+      out += '>';
+    } else if (entity == "amp"sv) {
+      out += '&';
+    } else if (entity == "quot"sv) {
+      out += '"';
+    } else if (entity == "apos"sv) {
+      out += '\'';
+    } else if (size > 1 && entity[0] == '#') {
+      const bool hex = entity[1] == 'x';
+      uint32_t code = 0;
+      const char *first = entity.data() + (hex ? 2 : 1);
+      auto result = std::from_chars(first, entity.data() + size, code, hex ? 16 : 10);
+      if (result.ec != std::errc() || result.ptr != entity.data() + size || first == result.ptr) {
+        Fail("invalid character reference"s);
+      }
+      AppendUtf8(out, code);
+    } else {
+      Fail("unknown entity &"s + std::string(entity) + ";"s);
+    }
+  }
+
+  void ReadText() {
+    text_.clear();
+    for (int ch = Peek(); ch >= 0 && ch != '<'; ch = Peek()) {
+      // Обычные символы переносятся из буфера целиком
+      size_t plain = pos_;
+      while (plain < end_ && buffer_[plain] != '<' && buffer_[plain] != '&' && buffer_[plain] != '\r') {
+        ++plain;
+      }
+      if (plain > pos_) {
+        text_.append(buffer_.data() + pos_, plain - pos_);
+        pos_ = plain;
+        continue;
+      }
+      Get();
+      if (ch == '&') {
+        ReadEntity(text_);
+      } else if (ch == '\r') {
+        // Конец строки \r\n и \r читается как \n
+        if (Peek() == '\n') {
+          Get();
+        }
+        text_ += '\n';
+      } else {
+        text_ += static_cast<char>(ch);
+      }
+    }
+  }
+
+  void ReadStartTag() {
+    ReadName(name_);
+    attribute_count_ = 0;
+    while (true) {
+      SkipSpaces();
+      const int ch = Peek();
+      if (ch == '/') {
+        Get();
+        Expect('>');
+        pending_end_ = true;
+        return;
+      }
+      if (ch == '>') {
+        Get();
+        return;
+      }
+      if (attribute_count_ == attributes_.size()) {
+        attributes_.emplace_back();
+      }
+      auto &[name, value] = attributes_[attribute_count_++];
+      ReadName(name);
+      SkipSpaces();
+      Expect('=');
+      SkipSpaces();
+      const int quote = GetOrFail();
+      if (quote != '"' && quote != '\'') {
+        Fail("expected a quoted attribute value"s);
+      }
+      value.clear();
+      for (int next = GetOrFail(); next != quote; next = GetOrFail()) {
+        if (next == '&') {
+          ReadEntity(value);
+        } else if (next == '<') {
+          Fail("'<' in attribute value"s);
+        } else {
+          // Переводы строк и табуляция в значении атрибута - пробелы
+          value += next == '\n' || next == '\r' || next == '\t' ? ' ' : static_cast<char>(next);
+        }
+      }
+    }
+  }
+};
+
+// Собирает ячейки первого листа книги и задаёт их пачками
+class Importer {
+ public:
+  explicit Importer(Sheet &sheet) : sheet_(sheet) {
+  }
+
+  size_t Read(std::istream &in) {
+    XmlReader reader(in);
+    // Глубина вложенности: Workbook, Worksheet, Table, Row, Cell, Data
+    std::vector<std::string> path;
+    for (auto token = reader.Next(); token != XmlReader::Token::Eof; token = reader.Next()) {
+      switch (token) {
+        case XmlReader::Token::Start:
+          path.push_back(reader.GetName());
+          OnStart(reader, path);
+          break;
+        case XmlReader::Token::End:
+          if (path.empty()) {
+            throw std::runtime_error("SpreadsheetML: unexpected end tag "s + reader.GetName());
+          }
+          OnEnd(path);
+          path.pop_back();
+          if (done_) {
+            Flush();
+            return count_;
+          }
+          break;
+        case XmlReader::Token::Text:
+          if (in_data_) {
+            data_ += reader.GetText();
+          }
+          break;
+        case XmlReader::Token::Eof:
+          break;
+      }
+    }
+    if (!path.empty()) {
+      throw std::runtime_error("SpreadsheetML: unexpected end of file"s);
+    }
+    Flush();
+    return count_;
+  }
+
+ private:
+  struct Pending {
+    Position pos;
+    std::string text;
+    // Значение из файла для формулы, которую не удалось разобрать
+    std::optional<std::string> fallback;
+  };
+
+  Sheet &sheet_;
+  std::vector<Pending> batch_;
+  size_t count_ = 0;
+  bool done_ = false;
+
+  int row_ = -1;
+  int row_span_ = 0;
+  int col_ = -1;
+  int merge_across_ = 0;
+  std::optional<std::string> formula_;
+  std::string data_type_;
+  std::string data_;
+  bool in_data_ = false;
+
+  static int ReadIndex(const XmlReader &reader, std::string_view name, int otherwise, int min) {
+    auto value = reader.FindAttribute(name);
+    if (value == nullptr) {
+      return otherwise;
+    }
+    int result = 0;
+    auto parsed = std::from_chars(value->data(), value->data() + value->size(), result);
+    if (parsed.ec != std::errc() || parsed.ptr != value->data() + value->size() || result < min) {
+      throw std::runtime_error("SpreadsheetML: invalid "s + std::string(name) + " "s + *value);
+    }
+    return result;
+  }
+
+  static bool Is(const std::vector<std::string> &path, std::initializer_list<std::string_view> expected) {
+    if (path.size() != expected.size()) {
+      return false;
+    }
+    size_t i = 0;
+    for (auto name : expected) {
+      if (path[i++] != name) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void OnStart(const XmlReader &reader, const std::vector<std::string> &path) {
+    if (Is(path, {"Workbook"sv, "Worksheet"sv, "Table"sv, "Row"sv})) {
+      row_ = ReadIndex(reader, "Index"sv, row_ + 2, 1) - 1;
+      row_span_ = ReadIndex(reader, "Span"sv, 0, 0);
+      col_ = -1;
+    } else if (Is(path, {"Workbook"sv, "Worksheet"sv, "Table"sv, "Row"sv, "Cell"sv})) {
+      col_ = ReadIndex(reader, "Index"sv, col_ + 2, 1) - 1;
+      merge_across_ = ReadIndex(reader, "MergeAcross"sv, 0, 0);
+      auto formula = reader.FindAttribute("Formula"sv);
+      formula_ = formula == nullptr ? std::nullopt : std::optional(*formula);
+      data_type_.clear();
+      data_.clear();
+    } else if (Is(path, {"Workbook"sv, "Worksheet"sv, "Table"sv, "Row"sv, "Cell"sv, "Data"sv})) {
+      auto type = reader.FindAttribute("Type"sv);
+      data_type_ = type == nullptr ? ""s : *type;
+      in_data_ = true;
+    }
+  }
+
+  void OnEnd(const std::vector<std::string> &path) {
+    if (Is(path, {"Workbook"sv, "Worksheet"sv})) {
+      // Читается только первый лист книги
+      done_ = true;
+    } else if (Is(path, {"Workbook"sv, "Worksheet"sv, "Table"sv, "Row"sv})) {
+      row_ += row_span_;
+    } else if (Is(path, {"Workbook"sv, "Worksheet"sv, "Table"sv, "Row"sv, "Cell"sv})) {
+      AddCell();
+      col_ += merge_across_;
+    } else if (Is(path, {"Workbook"sv, "Worksheet"sv, "Table"sv, "Row"sv, "Cell"sv, "Data"sv})) {
+      in_data_ = false;
+    }
+  }
+
+  // Текст ячейки по значению из файла. Строка, похожая на формулу или
+  // число, экранируется: после записи она снова станет строкой
+  std::string ValueText() const {
+    if (data_type_ == "String"sv && !data_.empty()
+        && (data_[0] == FORMULA_SIGN || data_[0] == ESCAPE_SIGN || IsNumberText(data_))) {
+      return ESCAPE_SIGN + data_;
+    }
+    return data_;
+  }
+
+  void AddCell() {
+    const Position pos{row_, col_};
+    std::optional<std::string> formula;
+    if (formula_ && formula_->size() > 1 && (*formula_)[0] == FORMULA_SIGN) {
+      formula = FromR1C1(std::string_view(*formula_).substr(1), pos);
+    }
+    if (formula) {
+      batch_.push_back({pos, FORMULA_SIGN + *formula, ValueText()});
+    } else if (!data_.empty()) {
+      batch_.push_back({pos, ValueText(), std::nullopt});
+    } else {
+      return;
+    }
+    if (batch_.size() >= BATCH_CELLS) {
+      Flush();
+    }
+  }
+
+  void Flush() {
+    if (batch_.empty()) {
+      return;
+    }
+    std::vector<std::pair<Position, std::string>> cells;
+    cells.reserve(batch_.size());
+    for (const auto &pending : batch_) {
+      cells.emplace_back(pending.pos, pending.text);
+    }
+    try {
+      sheet_.SetCells(std::move(cells));
+    } catch (const FormulaException &) {
+      // Лист не изменён: ячейки задаются по одной, неразобранные формулы -
+      // своими значениями
+      for (auto &pending : batch_) {
+        try {
+          sheet_.SetCell(pending.pos, pending.text);
+        } catch (const FormulaException &) {
+          if (!pending.fallback || pending.fallback->empty()) {
+            continue;
+          }
+          sheet_.SetCell(pending.pos, std::move(*pending.fallback));
+        }
+        ++count_;
+      }
+      batch_.clear();
+      return;
+    }
+    count_ += batch_.size();
+    batch_.clear();
+  }
+};
+
+}  // namespace
+
+void WriteSpreadsheetML(const Sheet &sheet, std::ostream &out) {
+  std::string buffer;
+  buffer.reserve(FLUSH_BYTES * 2);
+  buffer += "<?xml version=\"1.0\"?>\n"
+            "<?mso-application progid=\"Excel.Sheet\"?>\n"
+            "<Workbook xmlns=\"urn:schemas-microsoft-com:office:spreadsheet\"\n"
+            " xmlns:o=\"urn:schemas-microsoft-com:office:office\"\n"
+            " xmlns:x=\"urn:schemas-microsoft-com:office:excel\"\n"
+            " xmlns:ss=\"urn:schemas-microsoft-com:office:spreadsheet\"\n"
+            " xmlns:html=\"http://www.w3.org/TR/REC-html40\">\n"
+            " <Worksheet ss:Name=\"Sheet1\">\n"
+            "  <Table>\n"sv;
+
+  int row = -1;
+  int col = -1;
+  sheet.ForEachCell([&](Position pos, const CellInterface &cell) {
+    if (pos.row != row) {
+      if (row >= 0) {
+        buffer += "   </Row>\n"sv;
+      }
+      buffer += "   <Row"sv;
+      // Номер пишется только после пропущенных строк, как в Excel
+      if (pos.row != row + 1) {
+        buffer += " ss:Index=\""sv;
+        buffer += std::to_string(pos.row + 1);
+        buffer += '"';
+      }
+      buffer += ">\n"sv;
+      row = pos.row;
+      col = -1;
+    }
+    buffer += "    <Cell"sv;
+    if (pos.col != col + 1) {
+      buffer += " ss:Index=\""sv;
+      buffer += std::to_string(pos.col + 1);
+      buffer += '"';
+    }
+    col = pos.col;
+
+    const auto text = cell.GetText();
+    const bool is_formula = text.size() > 1 && text[0] == FORMULA_SIGN;
+    if (is_formula) {
+      buffer += " ss:Formula=\"="sv;
+      AppendEscaped(buffer, ToR1C1(std::string_view(text).substr(1)), true);
+      buffer += '"';
+    }
+    buffer += "><Data ss:Type=\""sv;
+    const auto value = cell.GetValue();
+    if (auto number = std::get_if<double>(&value)) {
+      buffer += "Number\">"sv;
+      buffer += FormatNumber(*number);
+    } else if (auto error = std::get_if<FormulaError>(&value)) {
+      buffer += "Error\">"sv;
+      buffer += error->ToString();
+    } else {
+      const auto &visible = std::get<std::string>(value);
+      // Текст-число - число, если его не экранировали
+      const bool number = !is_formula && text[0] != ESCAPE_SIGN && IsNumberText(visible);
+      buffer += number ? "Number\">"sv : "String\">"sv;
+      AppendEscaped(buffer, visible, false);
+    }
+    buffer += "</Data></Cell>\n"sv;
+
+    if (buffer.size() >= FLUSH_BYTES) {
+      out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+      buffer.clear();
+    }
+  });
+  if (row >= 0) {
+    buffer += "   </Row>\n"sv;
+  }
+  buffer += "  </Table>\n </Worksheet>\n</Workbook>\n"sv;
+  out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+}
+
+size_t ReadSpreadsheetML(std::istream &in, Sheet &sheet) {
+  return Importer(sheet).Read(in);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "sheet.h"
+
+#include <istream>
+#include <ostream>
+
+// Обмен листом в формате XML Spreadsheet 2003 (SpreadsheetML) без построения
+// дерева документа: память не зависит от размера файла.
+//
+//   std::ofstream out("sheet.xml");
+//   WriteSpreadsheetML(sheet, out);
+//
+//   std::ifstream in("sheet.xml");
+//   ReadSpreadsheetML(in, other);
+//
+// Формулы записываются в атрибут ss:Formula со ссылками вида R1C1 вместе со
+// значением, текст - типом String, текст-число - типом Number, ошибки формул
+// - типом Error. Числа в формулах и значениях записываются кратчайшей
+// записью, которая читается обратно тем же числом. Результаты формул-массивов
+// не записываются: формула выводит их заново после чтения.
+
+// Записывает лист одним листом книги Sheet1 по строкам сверху вниз. Ячейки
+// берутся из хранилища листа через Sheet::ForEachCell
+void WriteSpreadsheetML(const Sheet &sheet, std::ostream &out);
+
+// Читает первый лист книги в sheet поверх его ячеек, пачками через
+// Sheet::SetCells. Формула, которую нельзя перевести в ссылки A1 или
+// разобрать (функции, которых нет в листе, ссылки на другие листы, целые
+// строки и столбцы), заменяется своим значением из файла. Строка, похожая
+// на формулу или число, экранируется ESCAPE_SIGN; данные типов Boolean и
+// DateTime записываются текстом как есть, ошибки - их обозначением.
+// Возвращает число заданных ячеек. Бросает std::runtime_error при ошибке
+// разбора XML, InvalidPositionException для ячейки вне таблицы,
+// CircularDependencyException для циклических формул; ячейки, прочитанные до
+// ошибки, остаются в листе
+size_t ReadSpreadsheetML(std::istream &in, Sheet &sheet);
@@ -1,6 +1,8 @@
 #include "common.h"
 
+#include <algorithm>
 #include <cctype>
+#include <iterator>
 #include <sstream>
 
 const int LETTERS = 26;
@@ -35,31 +37,16 @@ std::string Position::ToString() const {
     return "";
   }
 
-  // Определить разрядность
-  // ZZ - (26*26) + 26
-  static int zz = (LETTERS * LETTERS) + LETTERS;
-
-  std::stringstream ss;
-  // Чтобы математика складывалась
-  if (col > (zz - 1)) {
-    int first = col / (LETTERS * LETTERS);
-    int remains = col - ((LETTERS * LETTERS) * first);
-    int second = remains / LETTERS;
-    int third = remains - (LETTERS * second);
-    ss << static_cast<char>('A' + first - 1)
-       << static_cast<char>('A' + second - 1)
-       << static_cast<char>('A' + third);
-  } else if (col > (LETTERS - 1)) {
-    size_t first = col / LETTERS;
-    size_t second = col % LETTERS;
-    ss << static_cast<char>('A' + first - 1)
-       << static_cast<char>('A' + second);
-  } else {
-    ss << static_cast<char>('A' + col);
+  // Буквы столбца в биективной системе по основанию 26 собираются с конца;
+  // без потока: ссылки печатаются для каждой формулы
+  char letters[MAX_POS_LETTER_COUNT];
+  int length = 0;
+  for (int rest = col + 1; rest > 0; rest = (rest - 1) / LETTERS) {
+    letters[length++] = static_cast<char>('A' + (rest - 1) % LETTERS);
   }
-
-  ss << row + 1;
-  return ss.str();
+  std::string result(std::make_reverse_iterator(letters + length), std::make_reverse_iterator(letters));
+  result += std::to_string(row + 1);
+  return result;
 }
 
 Position Position::FromString(std::string_view str) {
@@ -88,7 +75,8 @@ Position Position::FromString(std::string_view str) {
     }
   }
 
-  if (col_str.size() > MAX_POS_LETTER_COUNT || row_str.size() > MAX_POS_DIGIT_COUNT) {
+  if (col_str.empty() || row_str.empty() || col_str.size() > MAX_POS_LETTER_COUNT
+      || row_str.size() > MAX_POS_DIGIT_COUNT) {
     return Position::NONE;
   }
   int row = std::stoi(row_str) - 1;
@@ -120,6 +108,98 @@ bool Size::operator==(Size rhs) const {
   return rows == rhs.rows && cols == rhs.cols;
 }
 
+// == Range ==
+
+bool Range::operator==(const Range &rhs) const {
+  return first == rhs.first && last == rhs.last;
+}
+
+bool Range::operator<(const Range &rhs) const {
+  if (first == rhs.first) {
+    return last < rhs.last;
+  }
+  return first < rhs.first;
+}
+
+bool Range::IsValid() const {
+  return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+bool Range::Contains(Position pos) const {
+  return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col
+      && pos.col <= last.col;
+}
+
+bool Range::Intersects(const Range &rhs) const {
+  return first.row <= rhs.last.row && rhs.first.row <= last.row && first.col <= rhs.last.col
+      && rhs.first.col <= last.col;
+}
+
+Size Range::GetSize() const {
+  return {last.row - first.row + 1, last.col - first.col + 1};
+}
+
+std::string Range::ToString() const {
+  return first.ToString() + ':' + last.ToString();
+}
+
+// == PositionShift ==
+
+bool PositionShift::Affects(Position pos) const {
+  return pos.IsValid() && (axis == Axis::Rows ? pos.row : pos.col) >= first;
+}
+
+Position PositionShift::Apply(Position pos) const {
+  if (!Affects(pos)) {
+    return pos;
+  }
+
+  int &coordinate = axis == Axis::Rows ? pos.row : pos.col;
+  if (count < 0 && coordinate < first - count) {
+    return Position::NONE;
+  }
+  coordinate += count;
+  return pos.IsValid() ? pos : Position::NONE;
+}
+
+Range PositionShift::Apply(Range range) const {
+  const Range deleted{Position::NONE, Position::NONE};
+  if (!range.IsValid()) {
+    return deleted;
+  }
+  const int limit = axis == Axis::Rows ? Position::MAX_ROWS : Position::MAX_COLS;
+  int &begin = axis == Axis::Rows ? range.first.row : range.first.col;
+  int &end = axis == Axis::Rows ? range.last.row : range.last.col;
+  if (count > 0) {
+    // Вышедшая за пределы таблицы часть отрезается
+    if (begin >= first) {
+      begin += count;
+    }
+    if (end >= first) {
+      end = std::min(end + count, limit - 1);
+    }
+  } else {
+    // Удалённый край переходит на ближайшую уцелевшую строку или столбец
+    const int removed_end = first - count;
+    begin = begin < first ? begin : std::max(begin + count, first);
+    end = end < first ? end : (end < removed_end ? first - 1 : end + count);
+  }
+  return range.IsValid() ? range : deleted;
+}
+
+// == RowPermutation ==
+
+bool RowPermutation::Affects(Position pos) const {
+  return range.Contains(pos);
+}
+
+Position RowPermutation::Apply(Position pos) const {
+  if (!Affects(pos)) {
+    return pos;
+  }
+  return {range.first.row + rows[pos.row - range.first.row], pos.col};
+}
+
 
 // == FormulaError ==
 
@@ -138,6 +218,8 @@ std::string_view FormulaError::ToString() const {
       {Category::Ref, "#REF!"s},
       {Category::Value, "#VALUE!"s},
       {Category::Div0, "#DIV/0!"s},
+      {Category::NA, "#N/A"s},
+      {Category::Spill, "#SPILL!"s},
   };
   return map.at(category_);
 }
@@ -0,0 +1,91 @@
+#include "tools.h"
+
+#include "benchmarks.h"
+#include "workload.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std::literals;
+
+namespace {
+
+int PrintUsage() {
+  std::cerr << "Usage:\n"
+               "  spreadsheet generate <chain|fanin|fanout|dag> <size> [seed]\n"
+               "  spreadsheet replay <trace-file>\n"
+               "  spreadsheet bench [name...]\n";
+  return 2;
+}
+
+int Generate(int argc, char **argv) {
+  if (argc < 4) {
+    return PrintUsage();
+  }
+
+  WorkloadOptions options;
+  std::string shape = argv[2];
+  if (shape == "chain"s) {
+    options.shape = WorkloadShape::Chain;
+  } else if (shape == "fanin"s) {
+    options.shape = WorkloadShape::FanIn;
+  } else if (shape == "fanout"s) {
+    options.shape = WorkloadShape::FanOut;
+  } else if (shape == "dag"s) {
+    options.shape = WorkloadShape::RandomDag;
+  } else {
+    return PrintUsage();
+  }
+  options.size = std::stoi(argv[3]);
+  if (argc > 4) {
+    options.seed = static_cast<unsigned>(std::stoul(argv[4]));
+  }
+
+  RecordingSheet sheet(CreateSheet(), std::cout);
+  auto formulas = GenerateWorkload(sheet, options);
+  for (auto pos : formulas) {
+    sheet.GetCell(pos)->GetValue();
+  }
+  std::ostringstream values;
+  sheet.PrintValues(values);
+  return 0;
+}
+
+int Replay(int argc, char **argv) {
+  if (argc < 3) {
+    return PrintUsage();
+  }
+
+  std::ifstream trace(argv[2], std::ios::binary);
+  if (!trace) {
+    std::cerr << "Unable to open "s << argv[2] << std::endl;
+    return 1;
+  }
+
+  auto sheet = CreateSheet();
+  auto stats = ReplayTrace(trace, *sheet);
+  stats.Print(std::cout);
+  return stats.mismatches == 0 ? 0 : 1;
+}
+
+}  // namespace
+
+int RunTool(int argc, char **argv) {
+  std::string command = argv[1];
+  try {
+    if (command == "generate"s) {
+      return Generate(argc, argv);
+    }
+    if (command == "replay"s) {
+      return Replay(argc, argv);
+    }
+    if (command == "bench"s) {
+      return RunBenchmarks({argv + 2, argv + argc}, std::cout);
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return PrintUsage();
+}
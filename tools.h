@@ -0,0 +1,10 @@
+#pragma once
+
+// Служебные команды исполняемого файла:
+//   spreadsheet generate <chain|fanin|fanout|dag> <size> [seed]
+//     записывает в stdout трассу построения и чтения синтетического листа
+//   spreadsheet replay <trace-file>
+//     воспроизводит трассу на новой таблице и печатает латентности операций
+//   spreadsheet bench [name...]
+//     замеры производительности, см. benchmarks.h
+int RunTool(int argc, char **argv);
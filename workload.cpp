@@ -0,0 +1,376 @@
+#include "workload.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <random>
+#include <sstream>
+
+using namespace std::literals;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+std::chrono::nanoseconds Since(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+}
+
+// Выполняет вызов, замеряя его длительность; исключение пробрасывается дальше
+template <typename Func>
+auto Measure(Func func, std::chrono::nanoseconds &duration, bool &failed) {
+  auto start = Clock::now();
+  try {
+    if constexpr (std::is_void_v<decltype(func())>) {
+      func();
+      duration = Since(start);
+    } else {
+      auto result = func();
+      duration = Since(start);
+      return result;
+    }
+  } catch (...) {
+    duration = Since(start);
+    failed = true;
+    throw;
+  }
+}
+
+const char *OpName(WorkloadOp op) {
+  switch (op) {
+    case WorkloadOp::SetCell:return "SetCell";
+    case WorkloadOp::ClearCell:return "ClearCell";
+    case WorkloadOp::GetCell:return "GetCell";
+    case WorkloadOp::GetValue:return "GetValue";
+    case WorkloadOp::PrintValues:return "PrintValues";
+    case WorkloadOp::PrintTexts:return "PrintTexts";
+  }
+  return "?";
+}
+
+bool IsKnownOp(char op) {
+  switch (static_cast<WorkloadOp>(op)) {
+    case WorkloadOp::SetCell:
+    case WorkloadOp::ClearCell:
+    case WorkloadOp::GetCell:
+    case WorkloadOp::GetValue:
+    case WorkloadOp::PrintValues:
+    case WorkloadOp::PrintTexts:return true;
+  }
+  return false;
+}
+
+}  // namespace
+
+// == RecordingSheet ==
+
+RecordingSheet::RecordingSheet(std::unique_ptr<SheetInterface> sheet, std::ostream &trace)
+    : sheet_(std::move(sheet)), trace_(trace) {
+  trace_ << TRACE_HEADER << '\n';
+}
+
+void RecordingSheet::SetCell(Position pos, std::string text) {
+  std::chrono::nanoseconds duration{};
+  bool failed = false;
+  try {
+    Measure([&] { sheet_->SetCell(pos, text); }, duration, failed);
+  } catch (...) {
+    Record(WorkloadOp::SetCell, pos, duration, failed, &text);
+    throw;
+  }
+  Record(WorkloadOp::SetCell, pos, duration, failed, &text);
+}
+
+const CellInterface *RecordingSheet::GetCell(Position pos) const {
+  std::chrono::nanoseconds duration{};
+  bool failed = false;
+  const CellInterface *cell = nullptr;
+  try {
+    cell = Measure([&] { return static_cast<const SheetInterface &>(*sheet_).GetCell(pos); },
+                   duration, failed);
+  } catch (...) {
+    Record(WorkloadOp::GetCell, pos, duration, failed);
+    throw;
+  }
+  Record(WorkloadOp::GetCell, pos, duration, failed);
+  return Wrap(pos, cell);
+}
+
+CellInterface *RecordingSheet::GetCell(Position pos) {
+  return const_cast<CellInterface *>(static_cast<const RecordingSheet &>(*this).GetCell(pos));
+}
+
+void RecordingSheet::ClearCell(Position pos) {
+  std::chrono::nanoseconds duration{};
+  bool failed = false;
+  try {
+    Measure([&] { sheet_->ClearCell(pos); }, duration, failed);
+  } catch (...) {
+    Record(WorkloadOp::ClearCell, pos, duration, failed);
+    throw;
+  }
+  Record(WorkloadOp::ClearCell, pos, duration, failed);
+}
+
+Size RecordingSheet::GetPrintableSize() const {
+  return sheet_->GetPrintableSize();
+}
+
+void RecordingSheet::PrintValues(std::ostream &output) const {
+  std::chrono::nanoseconds duration{};
+  bool failed = false;
+  Measure([&] { sheet_->PrintValues(output); }, duration, failed);
+  Record(WorkloadOp::PrintValues, {0, 0}, duration, failed);
+}
+
+void RecordingSheet::PrintTexts(std::ostream &output) const {
+  std::chrono::nanoseconds duration{};
+  bool failed = false;
+  Measure([&] { sheet_->PrintTexts(output); }, duration, failed);
+  Record(WorkloadOp::PrintTexts, {0, 0}, duration, failed);
+}
+
+RecordingSheet::RecordingCell *RecordingSheet::Wrap(Position pos, const CellInterface *cell) const {
+  if (cell == nullptr) {
+    return nullptr;
+  }
+  auto &proxy = cells_[pos];
+  if (proxy == nullptr) {
+    proxy = std::make_unique<RecordingCell>(*this, pos);
+  }
+  // Ячейка могла быть пересоздана после предыдущего обращения
+  proxy->Retarget(const_cast<CellInterface *>(cell));
+  return proxy.get();
+}
+
+void RecordingSheet::Record(WorkloadOp op, Position pos, std::chrono::nanoseconds duration,
+                            bool failed, const std::string *text) const {
+  trace_ << static_cast<char>(op) << ' ' << pos.row << ' ' << pos.col << ' '
+         << duration.count() << ' ' << (failed ? 1 : 0);
+  if (text != nullptr) {
+    trace_ << ' ' << text->size() << ' ' << *text;
+  }
+  trace_ << '\n';
+}
+
+void RecordingSheet::RecordingCell::Set(std::string text) {
+  cell_->Set(std::move(text));
+}
+
+CellInterface::Value RecordingSheet::RecordingCell::GetValue() const {
+  std::chrono::nanoseconds duration{};
+  bool failed = false;
+  Value value;
+  try {
+    value = Measure([&] { return cell_->GetValue(); }, duration, failed);
+  } catch (...) {
+    owner_.Record(WorkloadOp::GetValue, pos_, duration, failed);
+    throw;
+  }
+  owner_.Record(WorkloadOp::GetValue, pos_, duration, failed);
+  return value;
+}
+
+std::string RecordingSheet::RecordingCell::GetText() const {
+  return cell_->GetText();
+}
+
+std::vector<Position> RecordingSheet::RecordingCell::GetReferencedCells() const {
+  return cell_->GetReferencedCells();
+}
+
+// == ReplayStats ==
+
+void ReplayStats::Add(WorkloadOp op, std::chrono::nanoseconds duration) {
+  latencies_[op].push_back(duration);
+}
+
+ReplayStats::Summary ReplayStats::Summarize(WorkloadOp op) const {
+  Summary summary;
+  auto it = latencies_.find(op);
+  if (it == latencies_.end() || it->second.empty()) {
+    return summary;
+  }
+
+  auto sorted = it->second;
+  std::sort(sorted.begin(), sorted.end());
+  auto percentile = [&sorted](double p) {
+    auto rank = static_cast<size_t>(p * static_cast<double>(sorted.size()) + 0.999999);
+    return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+  };
+
+  summary.count = sorted.size();
+  summary.p50 = percentile(0.50);
+  summary.p90 = percentile(0.90);
+  summary.p99 = percentile(0.99);
+  summary.max = sorted.back();
+  for (auto duration : sorted) {
+    summary.total += duration;
+  }
+  return summary;
+}
+
+void ReplayStats::Print(std::ostream &out) const {
+  out << "op\tcount\tp50_ns\tp90_ns\tp99_ns\tmax_ns\ttotal_ms\n";
+  for (const auto &[op, _] : latencies_) {
+    auto summary = Summarize(op);
+    out << OpName(op) << '\t' << summary.count << '\t'
+        << summary.p50.count() << '\t' << summary.p90.count() << '\t'
+        << summary.p99.count() << '\t' << summary.max.count() << '\t'
+        << std::fixed << std::setprecision(3)
+        << std::chrono::duration<double, std::milli>(summary.total).count()
+        << std::defaultfloat << '\n';
+  }
+  out << "mismatches\t" << mismatches << '\n';
+}
+
+// == Replay ==
+
+ReplayStats ReplayTrace(std::istream &trace, SheetInterface &sheet) {
+  std::string header;
+  if (!std::getline(trace, header) || header != TRACE_HEADER) {
+    throw std::invalid_argument("Unknown trace format"s);
+  }
+
+  ReplayStats stats;
+  std::ostringstream sink;
+  char op_code = 0;
+  while (trace >> op_code) {
+    Position pos;
+    long long recorded_ns = 0;
+    int recorded_failed = 0;
+    if (!IsKnownOp(op_code)
+        || !(trace >> pos.row >> pos.col >> recorded_ns >> recorded_failed)) {
+      throw std::invalid_argument("Corrupted trace record"s);
+    }
+
+    auto op = static_cast<WorkloadOp>(op_code);
+    std::string text;
+    if (op == WorkloadOp::SetCell) {
+      size_t length = 0;
+      if (!(trace >> length) || trace.get() != ' ') {
+        throw std::invalid_argument("Corrupted trace record"s);
+      }
+      text.resize(length);
+      if (!trace.read(text.data(), static_cast<std::streamsize>(length))) {
+        throw std::invalid_argument("Corrupted trace record"s);
+      }
+    }
+
+    bool failed = false;
+    auto start = Clock::now();
+    try {
+      switch (op) {
+        case WorkloadOp::SetCell:sheet.SetCell(pos, std::move(text));
+          break;
+        case WorkloadOp::ClearCell:sheet.ClearCell(pos);
+          break;
+        case WorkloadOp::GetCell:sheet.GetCell(pos);
+          break;
+        case WorkloadOp::GetValue: {
+          auto cell = static_cast<const SheetInterface &>(sheet).GetCell(pos);
+          if (cell != nullptr) {
+            cell->GetValue();
+          }
+          break;
+        }
+        case WorkloadOp::PrintValues:sink.str({});
+          sheet.PrintValues(sink);
+          break;
+        case WorkloadOp::PrintTexts:sink.str({});
+          sheet.PrintTexts(sink);
+          break;
+      }
+    } catch (const std::exception &) {
+      failed = true;
+    }
+    stats.Add(op, Since(start));
+
+    if (failed != (recorded_failed != 0)) {
+      ++stats.mismatches;
+    }
+  }
+
+  if (!trace.eof()) {
+    throw std::invalid_argument("Corrupted trace record"s);
+  }
+  return stats;
+}
+
+// == Генератор ==
+
+namespace {
+
+// Ячейки данных располагаются начиная со столбца B, A1 отведена под общую
+// ячейку для FanIn/FanOut
+Position DataPosition(int index) {
+  return {index % Position::MAX_ROWS, 1 + index / Position::MAX_ROWS};
+}
+
+}  // namespace
+
+std::vector<Position> GenerateWorkload(SheetInterface &sheet, const WorkloadOptions &options) {
+  const Position hub{0, 0};
+  std::vector<Position> formulas;
+
+  switch (options.shape) {
+    case WorkloadShape::Chain: {
+      sheet.SetCell(DataPosition(0), "1"s);
+      for (int i = 1; i < options.size; ++i) {
+        sheet.SetCell(DataPosition(i), "="s + DataPosition(i - 1).ToString() + "+1"s);
+        formulas.push_back(DataPosition(i));
+      }
+      break;
+    }
+
+    case WorkloadShape::FanIn: {
+      std::string formula = "="s;
+      for (int i = 0; i < options.size; ++i) {
+        sheet.SetCell(DataPosition(i), std::to_string(i));
+        if (i > 0) {
+          formula += '+';
+        }
+        formula += DataPosition(i).ToString();
+      }
+      sheet.SetCell(hub, std::move(formula));
+      formulas.push_back(hub);
+      break;
+    }
+
+    case WorkloadShape::FanOut: {
+      sheet.SetCell(hub, "1"s);
+      for (int i = 0; i < options.size; ++i) {
+        sheet.SetCell(DataPosition(i), "="s + hub.ToString() + "*"s + std::to_string(i + 1));
+        formulas.push_back(DataPosition(i));
+      }
+      break;
+    }
+
+    case WorkloadShape::RandomDag: {
+      std::mt19937 generator(options.seed);
+      // Каждая десятая ячейка в начале листа - исходные данные
+      int inputs = std::max(1, options.size / 10);
+      for (int i = 0; i < options.size; ++i) {
+        if (i < inputs) {
+          sheet.SetCell(DataPosition(i), std::to_string(i + 1));
+          continue;
+        }
+
+        std::uniform_int_distribution<int> refs_count(1, std::max(1, std::min(options.max_refs, i)));
+        std::uniform_int_distribution<int> target(0, i - 1);
+        std::uniform_int_distribution<int> operation(0, 3);
+        std::string formula = "="s;
+        for (int ref = refs_count(generator); ref > 0; --ref) {
+          formula += DataPosition(target(generator)).ToString();
+          if (ref > 1) {
+            formula += "+-*/"[operation(generator)];
+          }
+        }
+        sheet.SetCell(DataPosition(i), std::move(formula));
+        formulas.push_back(DataPosition(i));
+      }
+      break;
+    }
+  }
+
+  return formulas;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+
+#include <chrono>
+#include <istream>
+#include <map>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+// Формат трассы: заголовок TRACE_HEADER, затем по одной операции в строке
+//   <op> <row> <col> <ns> <status>[ <length> <text>]
+// op - одна из WorkloadOp, ns - длительность вызова в наносекундах,
+// status - 0 при успехе или 1, если вызов выбросил исключение.
+// Текст ячейки передаётся только для SetCell и предваряется длиной, поэтому
+// может содержать любые символы.
+inline constexpr std::string_view TRACE_HEADER = "spreadsheet-trace 1"sv;
+
+enum class WorkloadOp : char {
+  SetCell = 'S',
+  ClearCell = 'C',
+  GetCell = 'G',
+  GetValue = 'V',
+  PrintValues = 'P',
+  PrintTexts = 'T',
+};
+
+// Декоратор таблицы, записывающий все обращения к ней в трассу
+class RecordingSheet : public SheetInterface {
+ public:
+  RecordingSheet(std::unique_ptr<SheetInterface> sheet, std::ostream &trace);
+
+  void SetCell(Position pos, std::string text) override;
+
+  const CellInterface *GetCell(Position pos) const override;
+  CellInterface *GetCell(Position pos) override;
+
+  void ClearCell(Position pos) override;
+
+  Size GetPrintableSize() const override;
+
+  void PrintValues(std::ostream &output) const override;
+  void PrintTexts(std::ostream &output) const override;
+
+ private:
+  // Ячейка-посредник: записывает чтения значения
+  class RecordingCell : public CellInterface {
+   public:
+    RecordingCell(const RecordingSheet &owner, Position pos) : owner_(owner), pos_(pos) {
+    }
+
+    void Set(std::string text) override;
+    Value GetValue() const override;
+    std::string GetText() const override;
+    std::vector<Position> GetReferencedCells() const override;
+
+    void Retarget(CellInterface *cell) {
+      cell_ = cell;
+    }
+
+   private:
+    const RecordingSheet &owner_;
+    Position pos_;
+    CellInterface *cell_ = nullptr;
+  };
+
+  std::unique_ptr<SheetInterface> sheet_;
+  std::ostream &trace_;
+  mutable std::unordered_map<Position, std::unique_ptr<RecordingCell>, PositionHasher> cells_;
+
+  RecordingCell *Wrap(Position pos, const CellInterface *cell) const;
+  void Record(WorkloadOp op, Position pos, std::chrono::nanoseconds duration, bool failed,
+              const std::string *text = nullptr) const;
+};
+
+// Латентности операций при воспроизведении трассы
+class ReplayStats {
+ public:
+  struct Summary {
+    size_t count = 0;
+    std::chrono::nanoseconds p50{};
+    std::chrono::nanoseconds p90{};
+    std::chrono::nanoseconds p99{};
+    std::chrono::nanoseconds max{};
+    std::chrono::nanoseconds total{};
+  };
+
+  void Add(WorkloadOp op, std::chrono::nanoseconds duration);
+  Summary Summarize(WorkloadOp op) const;
+
+  // Операции, исход которых (успех или исключение) отличается от записанного
+  size_t mismatches = 0;
+
+  void Print(std::ostream &out) const;
+
+ private:
+  std::map<WorkloadOp, std::vector<std::chrono::nanoseconds>> latencies_;
+};
+
+// Выполняет трассу на переданной таблице (обычно свежей из CreateSheet()).
+// Бросает std::invalid_argument, если трасса повреждена.
+ReplayStats ReplayTrace(std::istream &trace, SheetInterface &sheet);
+
+enum class WorkloadShape {
+  Chain,      // A1 <- A2 <- ... <- An
+  FanIn,      // одна формула ссылается на size ячеек
+  FanOut,     // size формул ссылаются на одну ячейку
+  RandomDag,  // каждая ячейка ссылается на несколько случайных предыдущих
+};
+
+struct WorkloadOptions {
+  WorkloadShape shape = WorkloadShape::Chain;
+  int size = 1000;
+  unsigned seed = 1;
+  // Наибольшее число ссылок в формуле для RandomDag
+  int max_refs = 4;
+};
+
+// Детерминированно заполняет таблицу синтетическим листом заданной формы.
+// Возвращает позиции созданных формул в порядке их задания.
+std::vector<Position> GenerateWorkload(SheetInterface &sheet, const WorkloadOptions &options);